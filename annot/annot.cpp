@@ -35,6 +35,7 @@
 #include <fstream>
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
 
 extern writer_t writer;
 
@@ -43,6 +44,9 @@ extern logger_t logger;
 extern globals global;
 
 
+uint64_t annot_t::stamps = 0;
+
+
 void annot_t::wipe()
 {
   std::set<instance_t *>::iterator ii = all_instances.begin();
@@ -65,6 +69,10 @@ instance_t * annot_t::add( const std::string & id , const interval_t & interval
   all_instances.insert( instance );
   
   interval_events[ instance_idx_t( this , interval , id ) ] = instance; 
+
+  indexed = false;
+
+  stamp = ++stamps;
   
   return instance; 
   
@@ -94,6 +102,10 @@ void annot_t::remove( const std::string & id , const interval_t & interval )
   // clean up idx
   interval_events.erase( key );
 
+  indexed = false;
+
+  stamp = ++stamps;
+
 }
 
 
@@ -1617,91 +1629,117 @@ annot_map_t annot_t::extract( const interval_t & window )
   //
 
   annot_map_t r; 
+
+  // (a window ending at 0 wraps in overlaps(): keep the original scan)
+  
+  if ( window.stop == 0 ) 
+    {
+      annot_map_t::const_iterator ii = interval_events.begin();
+      while ( ii != interval_events.end() )
+	{
+	  const interval_t & a = ii->first.interval;
+	  if ( a.overlaps( window ) ) r[ ii->first ] = ii->second;
+	  else if ( a.is_after( window ) ) break;
+	  ++ii;
+	}
+      return r;
+    }
   
-  // urghhh... need to implement a much better search... 
-  // but for now just use brute force... :-(
+  std::vector<annot_map_t::const_iterator> events;
+
+  query_index( window , &events );
+  
+  // nb. events are in map order
+  for (int i=0;i<events.size();i++)
+    r.insert( r.end() , *events[i] );
   
+  return r;
+
+}
+
+
+//
+// Interval index: events in (start-major) map order, so those that
+// could overlap a window ending at B are the first P (start <= B-1);
+// of these, the implicit tree (node = middle of each range) gives the
+// maximum (stop-1) in each range, so that ranges where nothing ends
+// after the window starts are skipped: O( log n + k ) per query
+//
+
+void annot_t::build_index()
+{
+  
+  const int n = interval_events.size();
+
+  index_events.resize( n );
+  index_start.resize( n );
+  index_last.resize( n );
+  index_maxlast.resize( n );
+  
+  int i = 0;
   annot_map_t::const_iterator ii = interval_events.begin();
   while ( ii != interval_events.end() )
     {
-      const interval_t & a = ii->first.interval;
-      if ( a.overlaps( window ) ) r[ ii->first ] = ii->second;
-      else if ( a.is_after( window ) ) break;
+      index_events[i] = ii;
+      index_start[i] = ii->first.interval.start;
+      index_last[i] = ii->first.interval.stop - 1;  // nb. as in overlaps()
+      ++i;
       ++ii;
     }
   
-  return r;
+  if ( n ) build_index( 0 , n );
+
+  indexed = true;
+}
+
+
+uint64_t annot_t::build_index( const int lo , const int hi )
+{
+  const int mid = lo + ( hi - lo ) / 2;
+  uint64_t m = index_last[ mid ];
+  if ( lo < mid ) 
+    {
+      const uint64_t m1 = build_index( lo , mid );
+      if ( m1 > m ) m = m1;
+    }
+  if ( mid + 1 < hi ) 
+    {
+      const uint64_t m2 = build_index( mid + 1 , hi );
+      if ( m2 > m ) m = m2;
+    }
+  index_maxlast[ mid ] = m;
+  return m;
+}
+
 
+void annot_t::query_index( const interval_t & window , std::vector<annot_map_t::const_iterator> * events ) 
+{
+  
+  if ( ! indexed ) build_index();
+  
+  // candidates: start <= window.stop - 1 
+  const int end = std::lower_bound( index_start.begin() , index_start.end() , window.stop ) - index_start.begin();
+  
+  if ( end ) query_index( window , 0 , index_start.size() , end , events );
+
+}
+
+
+void annot_t::query_index( const interval_t & window , const int lo , const int hi , const int end , 
+			   std::vector<annot_map_t::const_iterator> * events ) const
+{
+  const int mid = lo + ( hi - lo ) / 2;
+
+  // nothing in this range ends on/after the window start
+  if ( index_maxlast[ mid ] < window.start ) return;
+  
+  if ( lo < mid ) query_index( window , lo , mid , end , events );
   
-  // // find first interval just /before/ then step over deciding which
-  // // should fit in
-
-  // interval_evt_map_t::const_iterator ii 
-  //   = interval_events.lower_bound( window );
-
-  // interval_evt_map_t::const_iterator jj = ii; 
-  
-  // // if returns iterator to end(), could still overlap the 
-  // // one or more events at the end, so need to check for this
-  // // special case of looking backwards either way; 
-  
-  // // back
-  // while ( 1 ) 
-  //   {
-
-  //     if ( jj == interval_events.begin() ) break;
-  //     --jj;
-  //     const interval_t & a = jj->first;
-      
-  //     //      std::cout << "extract: considering " << a.start << " - " << a.stop << "\n";
-      
-  //     if ( a.overlaps( window ) ) 
-  // 	{
-  // 	  r[ a ] = jj->second;
-  // 	  //std::cout << " found overlap\n";
-  // 	}
-  //     else if ( a.is_before( window ) )
-  // 	{
-  // 	  // also need to consider intervals that start before 'a' but still span window
-  // 	  // i.e. go back until test interval doesn't overlap 'a'
-  // 	  interval_evt_map_t::const_iterator kk = jj; 
-  // 	  interval_t prev = a;
-  // 	  while ( 1 ) 
-  // 	    {
-  // 	      if ( kk == interval_events.begin() ) break;
-  // 	      --kk;
-  // 	      interval_t b = kk->first;
-  // 	      if ( ! prev.overlaps( b ) ) break; // really all done now
-  // 	      if ( b.overlaps( window ) ) 
-  // 		{ 
-  // 		  r[ b ] = kk->second; 
-  // 		  std::cout << " XXX added an extra!\n"; 		  
-  // 		}
-  // 	      prev = b;
-  // 	    }
-  // 	  break;      
-  // 	}
-  //   }
-
-  // std::cout << "now forward...\n";
-  // // forward
-  // while ( 1 ) 
-  //   {      
-  //     if ( ii == interval_events.end() ) break;
-  //     const interval_t & a = ii->first;
-  //     std::cout << "extract: considering " << a.start << " - " << a.stop << "\n";
-  //     if ( a.overlaps( window ) ) 
-  // 	{
-  // 	  r[ a ] = ii->second;
-  // 	  std::cout << " found overlap\n";
-  // 	}
-      
-  //     else if ( a.is_after( window ) ) break;      
-  //     ++ii;
-  //   }
-  // std::cout << "  done...\n";
-  // return r;
+  if ( mid >= end ) return;
+
+  if ( index_last[ mid ] >= window.start ) events->push_back( index_events[ mid ] );
   
+  if ( mid + 1 < hi && mid + 1 < end ) query_index( window , mid + 1 , hi , end , events );
 }
 
 
@@ -2058,10 +2096,12 @@ void proc_eval( edf_t & edf , param_t & param )
 	  annot_t * annot = edf.timeline.annotations.find( names[a] );
 	  
 	  // get overlapping annotations for this epoch
-	  annot_map_t events = annot->extract( interval );
+	  const std::vector<annot_map_t::const_iterator> & events = edf.timeline.epoch_events( annot )[ e ];
 	  
 	  // store
-	  inputs[ names[a] ] = events;
+	  annot_map_t & input = inputs[ names[a] ];
+	  for (int i=0;i<events.size();i++) 
+	    input.insert( input.end() , *events[i] );
 	}
       
      
@@ -110,6 +110,11 @@ struct annot_t
 
   std::set<instance_t*> all_instances;
 
+  // changes on every add()/remove(), and is unique across all
+  // annotations (i.e. so that derived, cached structures such as
+  // timeline_t::epoch_events() can tell if they are stale)
+
+  uint64_t stamp;
   
 
   //
@@ -121,6 +126,8 @@ struct annot_t
     file = description = "";
     type = globals::A_NULL_T;
     types.clear();
+    indexed = false;
+    stamp = ++stamps;
   }
   
 
@@ -188,9 +195,33 @@ struct annot_t
     description = "";
     types.clear();
     interval_events.clear();
+    indexed = false;
+    stamp = ++stamps;
     wipe();
   }
 
+  //
+  // index of interval_events for overlap queries (built on first use
+  // after any add() or remove(); see extract())
+  //
+  
+  bool indexed;
+
+  static uint64_t stamps;
+  
+  std::vector<annot_map_t::const_iterator> index_events;
+
+  std::vector<uint64_t> index_start, index_last, index_maxlast;
+
+  void build_index();
+
+  uint64_t build_index( const int lo , const int hi );
+  
+  void query_index( const interval_t & window , std::vector<annot_map_t::const_iterator> * events );
+
+  void query_index( const interval_t & window , const int lo , const int hi , const int end , 
+		    std::vector<annot_map_t::const_iterator> * events ) const;
+
 
   // helper functions 
   
@@ -28,6 +28,7 @@
 
 #include "helper/helper.h"
 #include "helper/logger.h"
+#include "helper/threads.h"
 #include "eval.h"
 #include "db/db.h"
 
@@ -313,20 +314,9 @@ annot_t * buckelmuller_artifact_detection( edf_t & edf ,
 	  
 	  if ( edf.header.is_annotation_channel( signals(s) ) ) continue;	  
 	  
-	  slice_t slice( edf , signals(s) , interval );
-	  
-	  std::vector<double> * d = slice.nonconst_pdata();
-
-	  const std::vector<uint64_t> * tp = slice.ptimepoints();
-	  
-	  //
-	  // Mean-centre 30-second window
 	  //
-
-	  MiscMath::centre( d );
-            
-	  //
-	  // Apply PWELCH to this epoch
+	  // Apply PWELCH to this (mean-centred) epoch, reusing any
+	  // spectrum already computed with the same parameters
 	  //
 
 	  // aim to get 10 windows of 4 seconds in 30sec epoch
@@ -334,7 +324,9 @@ annot_t * buckelmuller_artifact_detection( edf_t & edf ,
 	  int noverlap_segments = 10;         
 	  int segment_size_sec = 4;
 	  
-	  PWELCH pwelch( *d , Fs[s] , segment_size_sec , noverlap_segments );
+	  PWELCH pwelch = slice_pwelch( edf , signals(s) , interval , Fs[s] , 
+					segment_size_sec , 0 , noverlap_segments , 
+					WINDOW_TUKEY50 , false , true );
       
 	  // track power bands     
 	  
@@ -501,6 +493,182 @@ annot_t * buckelmuller_artifact_detection( edf_t & edf ,
 
 
 
+//
+// SIGSTATS, per signal 
+//
+
+struct sigstats_job_t : public parallel_job_t 
+{
+
+  sigstats_job_t( edf_t & edf , const signal_list_t & signals , const std::vector<int> & epochs )
+  : edf(edf) , signals(signals) , epochs(epochs) { } 
+  
+  edf_t & edf;
+  const signal_list_t & signals;
+  const std::vector<int> & epochs;
+
+  bool verbose;
+  bool has_threshold;
+  bool turning_rate;
+  double tr_epoch_sec;
+  int tr_d;
+
+  // outputs, indexed by signal
+  std::vector<int> * n;
+  std::vector<double> * rms;
+  std::vector<double> * clipped;
+  std::vector<double> * mean_activity;
+  std::vector<double> * mean_mobility;
+  std::vector<double> * mean_complexity;  
+  std::vector<std::vector<double> > * e_rms;
+  std::vector<std::vector<double> > * e_clp;
+  std::vector<std::vector<double> > * e_act;
+  std::vector<std::vector<double> > * e_mob;
+  std::vector<std::vector<double> > * e_cmp;
+  std::vector<std::vector<double> > * e_epoch;
+  std::vector<std::vector<double> > * e_tr;
+  
+  void run( const int s );
+  
+};
+
+
+void sigstats_job_t::run( const int s )
+{
+
+  //
+  // only consider data tracks
+  //
+  
+  if ( edf.header.is_annotation_channel( signals(s) ) ) return;
+  
+
+  //
+  // output stratifier
+  //
+  
+  writer.level( signals.label(s) , globals::signal_strat );
+
+  //
+  // Get sampling rate
+  //
+  
+  int sr = edf.header.sampling_freq( s );
+  
+  //
+  // for each each epoch 
+  //
+  
+  for (int ei=0; ei<epochs.size(); ei++)
+    {
+      
+      const int epoch = epochs[ei];
+	  
+      interval_t interval = edf.timeline.epoch( epoch );
+      
+      slice_t slice( edf , signals(s) , interval , 1 , false );
+      
+      std::vector<double> * d = slice.nonconst_pdata();
+      
+      //
+      // Mean-centre 30-second window, calculate RMS
+      //
+      
+      MiscMath::centre( d );
+      
+      double x = MiscMath::rms( *d ); 
+      
+      double c = MiscMath::clipped( *d ); 
+      
+      //
+      // Hjorth parameters
+      //
+      
+      double activity = 0 , mobility = 0 , complexity = 0;
+      
+      MiscMath::hjorth( d , &activity , &mobility , &complexity );
+      
+      //
+      // Turning rate
+      //
+      
+      double turning_rate_mean = 0;
+      if ( turning_rate )
+	{
+	  
+	  std::vector<double> subepoch_tr;
+	  
+	  turning_rate_mean = MiscMath::turning_rate( d , sr, tr_epoch_sec , tr_d , &subepoch_tr );
+	  
+	  for (int i=0;i<subepoch_tr.size();i++)
+	    (*e_tr)[s].push_back( subepoch_tr[i] );
+	}
+      
+      //
+      // Verbose output
+      //
+      
+      if ( verbose )
+	{
+	  
+	  writer.epoch( edf.timeline.display_epoch( epoch ) );
+	  
+	  
+	  //
+	  // Report calculated values
+	  //
+	  
+	  writer.value( "CLIP" , c , "Proportion of epoch with clipped signal" );
+	  writer.value( "H1" , activity , "Epoch Hjorth parameter 1: activity (variance)" );
+	  writer.value( "H2" , mobility , "Epoch Hjorth parameter 2: mobility" );
+	  writer.value( "H3" , complexity , "Epoch Hjorth parameter 3: complexity" );
+	  writer.value( "RMS" , x , "Epoch root mean square (RMS)" );
+	  
+	  if ( turning_rate ) 
+	    writer.value( "TR" , turning_rate_mean , "Turning rate mean per epoch" );
+	}
+      
+      
+      //
+      // Tot up for individual-level means
+      //
+      
+      (*rms)[s] += x;
+      (*clipped)[s] += c;
+      
+      (*mean_activity)[s] += activity;
+      (*mean_mobility)[s] += mobility;
+      (*mean_complexity)[s] += complexity;
+      (*n)[s]   += 1;
+      
+      //
+      // Track for thresholding?
+      //
+      
+      if ( has_threshold ) 
+	{
+	  (*e_rms)[s].push_back( x );
+	  (*e_clp)[s].push_back( c );
+	  (*e_act)[s].push_back( activity );
+	  (*e_mob)[s].push_back( mobility );
+	  (*e_cmp)[s].push_back( complexity );
+	  (*e_epoch)[s].push_back( epoch );
+	}
+      
+      
+      //
+      // Next epoch
+      //
+      
+    } 
+  
+  if ( verbose ) 
+    writer.unepoch();
+  
+}
+
+
+
 //
 // SIGSTATS
 //
@@ -625,158 +793,45 @@ void  rms_per_epoch( edf_t & edf , param_t & param )
   
   
   //
-  // For each signal
+  // List of (unmasked) epochs
   //
   
-  for (int s=0;s<ns;s++)
+  std::vector<int> epochs;
+  
+  while ( 1 ) 
     {
-
-      //
-      // only consider data tracks
-      //
-      
-      if ( edf.header.is_annotation_channel( signals(s) ) ) continue;
-      
-
-      //
-      // output stratifier
-      //
-
-      writer.level( signals.label(s) , globals::signal_strat );
-
-      //
-      // reset to first epoch
-      //
-      
-      edf.timeline.first_epoch();
-
-      //
-      // Get sampling rate
-      //
-      
-      int sr = edf.header.sampling_freq( s );
-      
-      //
-      // for each each epoch 
-      //
-      
-      while ( 1 ) 
-	{
-	  
-	  //
-	  // Get next epoch
-	  //
-	  
-	  int epoch = edf.timeline.next_epoch();
-	  
-	  if ( epoch == -1 ) break;
-	  
-	  interval_t interval = edf.timeline.epoch( epoch );
-	  	  
-	  slice_t slice( edf , signals(s) , interval );
-	  
-	  std::vector<double> * d = slice.nonconst_pdata();
-	  
-	  //
-	  // Mean-centre 30-second window, calculate RMS
-	  //
-
-	  MiscMath::centre( d );
-	  
-	  double x = MiscMath::rms( *d ); 
-	  	  
-	  double c = MiscMath::clipped( *d ); 
-	  
-	  //
-	  // Hjorth parameters
-	  //
-
-	  double activity = 0 , mobility = 0 , complexity = 0;
-
-	  MiscMath::hjorth( d , &activity , &mobility , &complexity );
-
-	  //
-	  // Turning rate
-	  //
-	  
-	  double turning_rate_mean = 0;
-	  if ( turning_rate )
-	    {
-
-	      std::vector<double> subepoch_tr;
-	      
-	      turning_rate_mean = MiscMath::turning_rate( d , sr, tr_epoch_sec , tr_d , &subepoch_tr );
-	      
-	      for (int i=0;i<subepoch_tr.size();i++)
-		e_tr[s].push_back( subepoch_tr[i] );
-	    }
-
-	  //
-	  // Verbose output
-	  //
-	  
-	  if ( verbose )
-	    {
-
-	      writer.epoch( edf.timeline.display_epoch( epoch ) );
-
-	     
-	      //
-	      // Report calculated values
-	      //
+      int epoch = edf.timeline.next_epoch();
+      if ( epoch == -1 ) break;
+      epochs.push_back( epoch );
+    }
   
-	      writer.value( "CLIP" , c , "Proportion of epoch with clipped signal" );
-	      writer.value( "H1" , activity , "Epoch Hjorth parameter 1: activity (variance)" );
-	      writer.value( "H2" , mobility , "Epoch Hjorth parameter 2: mobility" );
-	      writer.value( "H3" , complexity , "Epoch Hjorth parameter 3: complexity" );
-	      writer.value( "RMS" , x , "Epoch root mean square (RMS)" );
-	      
-	      if ( turning_rate ) 
-		writer.value( "TR" , turning_rate_mean , "Turning rate mean per epoch" );
-	    }
-
-
-	  //
-	  // Tot up for individual-level means
-	  //
-
-	  rms[s] += x;
-	  clipped[s] += c;
-
-	  mean_activity[s] += activity;
-	  mean_mobility[s] += mobility;
-	  mean_complexity[s] += complexity;
-	  n[s]   += 1;
-
-	  //
-	  // Track for thresholding?
-	  //
+  //
+  // For each signal (in parallel, if threads > 1)
+  //
+  
+  sigstats_job_t job( edf , signals , epochs );
 
-	  if ( has_threshold ) 
-	    {
-	      e_rms[s].push_back( x );
-	      e_clp[s].push_back( c );
-	      e_act[s].push_back( activity );
-	      e_mob[s].push_back( mobility );
-	      e_cmp[s].push_back( complexity );
-	      e_epoch[s].push_back( epoch );
-	    }
-	
-	  
-	  //
-	  // Next epoch
-	  //
+  job.verbose = verbose;
+  job.has_threshold = has_threshold;
+  job.turning_rate = turning_rate;
+  job.tr_epoch_sec = tr_epoch_sec;
+  job.tr_d = tr_d;
 
-	} 
+  job.n = &n;
+  job.rms = &rms;
+  job.clipped = &clipped;
+  job.mean_activity = &mean_activity;
+  job.mean_mobility = &mean_mobility;
+  job.mean_complexity = &mean_complexity;
+  job.e_rms = &e_rms;
+  job.e_clp = &e_clp;
+  job.e_act = &e_act;
+  job.e_mob = &e_mob;
+  job.e_cmp = &e_cmp;
+  job.e_epoch = &e_epoch;
+  job.e_tr = &e_tr;
 
-      if ( verbose ) 
-	writer.unepoch();
-      
-      //
-      // Next signal
-      //
-      
-    } 
+  Helper::parallel_for( ns , job );
 
   if ( verbose ) // did we have any output
     writer.unlevel( globals::signal_strat );
@@ -1020,6 +1075,38 @@ void  rms_per_epoch( edf_t & edf , param_t & param )
 
 
 
+//
+// MSE, per epoch (of one signal)
+//
+
+struct mse_epoch_job_t : public parallel_job_t 
+{
+
+  mse_epoch_job_t( edf_t & edf , const int signal , const std::vector<int> & epochs , 
+		   const std::vector<int> & scale , const int m , const double r )
+  : edf(edf) , signal(signal) , epochs(epochs) , scale(scale) , m(m) , r(r) , mses( epochs.size() ) { } 
+  
+  edf_t & edf;
+  const int signal;
+  const std::vector<int> & epochs;
+  const std::vector<int> & scale;
+  const int m;
+  const double r;
+  
+  // output, indexed by epoch
+  std::vector<std::map<int,double> > mses;
+  
+  void run( const int e )
+  {
+    interval_t interval = edf.timeline.epoch( epochs[e] );
+    slice_t slice( edf , signal , interval );
+    mse_t mse( scale[0] , scale[1] , scale[2] , m , r );
+    mses[e] = mse.calc( *slice.pdata() );
+  }
+  
+};
+
+
 void  mse_per_epoch( edf_t & edf , param_t & param )
 {
   
@@ -1105,40 +1192,34 @@ void  mse_per_epoch( edf_t & edf , param_t & param )
       
       if ( ne == 0 ) return;
       
-
-      //
-      // for each each epoch 
-      //
-
+      std::vector<int> epochs;
+      
       while ( 1 ) 
 	{
-	  
-	  //
-	  // Get next epoch
-	  //
-	  
 	  int epoch = edf.timeline.next_epoch();
-	  
 	  if ( epoch == -1 ) break;
-	  
-	  interval_t interval = edf.timeline.epoch( epoch );
-	  	  
-	  //
-	  // get data
-	  //
+	  epochs.push_back( epoch );
+	}
+      
+      //
+      // MSE for each epoch (in parallel, if threads > 1)
+      //
+      
+      mse_epoch_job_t job( edf , signals(s) , epochs , scale , m , r );
+      
+      Helper::parallel_for( epochs.size() , job );
 
-	  slice_t slice( edf , signals(s) , interval );
-	  
-	  std::vector<double> * d = slice.nonconst_pdata();
+      
+      //
+      // for each each epoch 
+      //
 
+      for (int e=0; e<epochs.size(); e++)
+	{
 	  
-	  //
-	  // Mean-centre 30-second window, calculate RMS
-	  //
-
-	  mse_t mse( scale[0] , scale[1] , scale[2] , m , r );
+	  const int epoch = epochs[e];
 	  
-	  std::map<int,double> mses = mse.calc( *d );
+	  const std::map<int,double> & mses = job.mses[e];
 	  
 	  //
 	  // track
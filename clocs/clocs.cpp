@@ -28,6 +28,7 @@
 
 #include <fstream>
 #include <cmath>
+#include <pthread.h>
 
 
 
@@ -187,38 +188,15 @@ Data::Matrix<double> clocs_t::interelectrode_distance_matrix( const signal_list_
 }
 
 
-bool clocs_t::make_interpolation_matrices( const signal_list_t & good_signals , 
-					   const signal_list_t & bad_signals , 
-					   Data::Matrix<double> * G , 
-					   Data::Matrix<double> * Gi )
+Data::Matrix<double> clocs_t::spline_G( const Data::Matrix<double> & D )
 {
-  
+
   // order of Legendre polynomials
   const int N = 10;
 
-  // smoothing parameter
-  const double smoothing = 1e-5;
-  
-  // other param
-  const int m = 2;  
-    
-  convert_to_unit_sphere();
-  
-  int ns  = good_signals.size();
-  int nsi = bad_signals.size();
-  
-  // get interelectrode distance matrix
-  Data::Matrix<double> D = interelectrode_distance_matrix( good_signals , good_signals );
-  
-//   std::cout << "cosdist\n\n";
-//   std::cout << D.print() << "\n";
-
   // Evaluate Legendre polynomials
   std::vector<Data::Matrix<double> > L = legendre( N , D );
 
-  // given signals in the signal-list, make a matching G matrix  
-  //  const int ns = signals.size();
-  
   // precompute electrode-independent variables
   std::vector<int> twoN1;
   std::vector<double> gdenom;
@@ -228,24 +206,44 @@ bool clocs_t::make_interpolation_matrices( const signal_list_t & good_signals ,
       gdenom.push_back( pow( i*(i+1)  , 2 ) ) ;
     }
 
+  const int n1 = D.dim1();
+  const int n2 = D.dim2();
   
-  // compute G (for all good x all good electrodes)  
-  G->resize( ns , ns , 0 );
+  Data::Matrix<double> G( n1 , n2 );
   
-  // for each pair of good x good electrodes, get element of G
-  for (int i=0;i<ns;i++)
-    for (int j=i;j<ns;j++)
+  // for each pair of electrodes, get element of G
+  for (int i=0;i<n1;i++)
+    for (int j=0;j<n2;j++)
       {
 	double g = 0;
 	for (int n=0;n<N;n++)
 	  {
 	    g += (twoN1[n] * L[n](i,j) ) / gdenom[n];
 	  }
-	(*G)(i,j) = g / ( 4.0 * M_PI );
-	(*G)(j,i) = (*G)(i,j);
+	G(i,j) = g / ( 4.0 * M_PI );
       }
+  
+  return G;
+}
 
-    
+
+bool clocs_t::make_interpolation_matrices( const signal_list_t & good_signals , 
+					   const signal_list_t & bad_signals , 
+					   Data::Matrix<double> * G , 
+					   Data::Matrix<double> * Gi )
+{
+  
+  // smoothing parameter
+  const double smoothing = 1e-5;
+  
+  convert_to_unit_sphere();
+  
+  int ns  = good_signals.size();
+  
+  // compute G (for all good x all good electrodes), from the 
+  // interelectrode distance matrix
+  *G = spline_G( interelectrode_distance_matrix( good_signals , good_signals ) );
+  
   // 
   // Optionally, add smoothing to each diagonal element
   //
@@ -256,29 +254,11 @@ bool clocs_t::make_interpolation_matrices( const signal_list_t & good_signals ,
     }
 
   //
-  // G for the to-be-interpolated electrodes
+  // G for the to-be-interpolated electrodes (bad x good)
   //
 
-  Gi->resize( nsi, ns , 0 );
-  
-  Data::Matrix<double> Di = interelectrode_distance_matrix( bad_signals , good_signals );
+  *Gi = spline_G( interelectrode_distance_matrix( bad_signals , good_signals ) );
   
-  // Evaluate Legendre polynomials
-  std::vector<Data::Matrix<double> > Li = legendre( N , Di );
-
-  // for each bad x good pair, compute element of Gi
-
-  for (int i=0;i<nsi;i++)
-    for (int j=0;j<ns;j++)
-      {
-	double g = 0;
-	for (int n=0;n<N;n++)
-	  {
-	    g += (twoN1[n] * Li[n](i,j) ) / gdenom[n];
-	  }
-	(*Gi)(i,j) = g / ( 4.0 * M_PI );
-      }
-
   // return inverse of G
   bool okay = true;
   Data::Matrix<double> invG = Statistics::inverse( *G , &okay );
@@ -352,3 +332,166 @@ Data::Matrix<double> clocs_t::interpolate( const Data::Matrix<double> & data ,
   
 }
 
+
+
+
+Data::Matrix<double> clocs_t::interpolate( const Data::Matrix<double> & data , 
+					   const std::vector<int> & good_channels , 
+					   const Data::Matrix<double> & W )
+{
+
+  const int nrows = data.dim1();
+  const int nbad  = W.dim1();
+  const int ngood = W.dim2();
+
+  if ( good_channels.size() != ngood ) 
+    Helper::halt( "internal problem in interpolate" );
+
+  // IMPUTED (RxB) = data (RxG) * W' (GxB)
+  
+  Data::Matrix<double> y( nrows , nbad );
+  
+  for (int i=0;i<nbad; i++)
+    for (int k=0;k<ngood;k++)
+      {
+	const double w = W(i,k);
+	const int c = good_channels[k];
+	for (int j=0;j<nrows;j++)
+	  y(j,i) += w * data(j,c);
+      }
+  
+  return y;
+}
+
+
+
+//
+// Montage-level interpolation matrices
+//
+
+static pthread_mutex_t montage_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+clocs_montage_t::clocs_montage_t( const clocs_t & clocs , const signal_list_t & signals )
+{
+  for (int s=0;s<signals.size();s++) 
+    labels.push_back( signals.label(s) );
+  
+  G = clocs_t::spline_G( clocs.interelectrode_distance_matrix( signals ) );
+  
+  bool okay = true;
+  H = Statistics::inverse( G , &okay );
+  if ( ! okay ) Helper::halt( "problem inverting G" );
+}
+
+
+clocs_montage_t * clocs_montage_t::get( clocs_t & clocs , const signal_list_t & signals )
+{
+
+  clocs.convert_to_unit_sphere();
+  
+  // key on labels and locations
+  
+  std::vector<double> xyz;
+  std::vector<std::string> labels;
+  for (int s=0;s<signals.size();s++)
+    {
+      const cart_t c = clocs.cart( signals.label(s) );
+      labels.push_back( signals.label(s) );
+      xyz.push_back( c.x );
+      xyz.push_back( c.y );
+      xyz.push_back( c.z );
+    }
+  
+  typedef std::pair<std::vector<std::string>,std::vector<double> > key_t;
+
+  // nb. montages are kept for the lifetime of the process
+  static std::map<key_t,clocs_montage_t*> montages;
+  
+  pthread_mutex_lock( &montage_mutex );
+  
+  clocs_montage_t * & m = montages[ key_t( labels , xyz ) ];
+  
+  if ( m == NULL ) 
+    m = new clocs_montage_t( clocs , signals );
+  
+  pthread_mutex_unlock( &montage_mutex );
+  
+  return m;
+}
+
+
+const clocs_montage_t::subset_t & clocs_montage_t::subset( const std::vector<bool> & bad )
+{
+
+  const int n = labels.size();
+
+  if ( bad.size() != n ) 
+    Helper::halt( "internal error in clocs_montage_t::subset()" );
+  
+  pthread_mutex_lock( &montage_mutex );
+
+  std::map<std::vector<bool>,subset_t>::iterator ii = subsets.find( bad );
+
+  if ( ii != subsets.end() ) 
+    {
+      pthread_mutex_unlock( &montage_mutex );
+      return ii->second;
+    }
+  
+  subset_t & sub = subsets[ bad ];
+
+  for (int i=0;i<n;i++)
+    {
+      if ( bad[i] ) sub.bad.push_back( i );
+      else sub.good.push_back( i );
+    }
+
+  const int na = sub.good.size();
+  const int nb = sub.bad.size();
+
+  // inv(H_BB)
+  
+  Data::Matrix<double> HBB( nb , nb );
+  for (int i=0;i<nb;i++)
+    for (int j=0;j<nb;j++)
+      HBB(i,j) = H( sub.bad[i] , sub.bad[j] );
+
+  bool okay = true;
+  Data::Matrix<double> Q = nb ? Statistics::inverse( HBB , &okay ) : HBB ;
+  if ( ! okay ) Helper::halt( "problem inverting G" );
+  
+  // W = - inv(H_BB) H_BA
+  
+  sub.W.resize( nb , na );
+  for (int i=0;i<nb;i++)
+    for (int j=0;j<na;j++)
+      {
+	double w = 0;
+	for (int k=0;k<nb;k++)
+	  w -= Q(i,k) * H( sub.bad[k] , sub.good[j] );
+	sub.W(i,j) = w;
+      }
+
+  // inv(G_AA) = H_AA + H_AB W 
+
+  sub.invG.resize( na , na );
+  for (int i=0;i<na;i++)
+    for (int j=0;j<na;j++)
+      {
+	double g = H( sub.good[i] , sub.good[j] );
+	for (int k=0;k<nb;k++)
+	  g += H( sub.good[i] , sub.bad[k] ) * sub.W(k,j);
+	sub.invG(i,j) = g;
+      }
+
+  // G_BA
+  
+  sub.Gi.resize( nb , na );
+  for (int i=0;i<nb;i++)
+    for (int j=0;j<na;j++)
+      sub.Gi(i,j) = G( sub.bad[i] , sub.good[j] );
+  
+  pthread_mutex_unlock( &montage_mutex );
+
+  return sub;
+}
@@ -27,6 +27,7 @@
 #include <cmath>
 #include <map>
 #include <vector>
+#include <string>
 
 #include "stats/statistics.h" 
 
@@ -91,6 +92,14 @@ struct clocs_t {
 				    const Data::Matrix<double> & G , 
 				    const Data::Matrix<double> & Gi );
 
+  // as above, given the combined weights W = Gi * invG (bad x good)
+  Data::Matrix<double> interpolate( const Data::Matrix<double> & data , 
+				    const std::vector<int> & good_channels , 
+				    const Data::Matrix<double> & W );
+
+  // spherical-spline G elements, given a matrix of cosine distances
+  static Data::Matrix<double> spline_G( const Data::Matrix<double> & D );
+
     
   void attach( edf_t * edf_p ) 
   {
@@ -158,4 +167,56 @@ struct clocs_t {
 };
 
 
+
+struct clocs_montage_t {
+
+  //
+  // Spherical-spline interpolation over a fixed set of channels: G
+  // (i.e. the Legendre terms) and H = inv(G) are computed once, for
+  // the full montage.  For any set of bad channels B (good A), the
+  // inverse of G_AA then follows from the Schur complement, 
+  //
+  //   inv(G_AA) = H_AA - H_AB inv(H_BB) H_BA 
+  //
+  // and the interpolation weights from 
+  //
+  //   W = G_BA inv(G_AA) = - inv(H_BB) H_BA
+  //
+  // i.e. only a |B| x |B| inversion per subset (for leave-one-out,
+  // W = -H_bA / H_bb).  Subsets are cached by bad-channel mask, and
+  // montages are shared across individuals with identical locations
+  //
+  
+  struct subset_t { 
+    std::vector<int> good;
+    std::vector<int> bad;
+    Data::Matrix<double> invG;  // good x good
+    Data::Matrix<double> Gi;    // bad x good
+    Data::Matrix<double> W;     // bad x good
+  };
+  
+  // montage for these signals (created on first use); nb. this
+  // converts 'clocs' to the unit sphere, as make_interpolation_matrices()
+  static clocs_montage_t * get( clocs_t & clocs , const signal_list_t & signals );
+
+  // matrices for the channels flagged in 'bad' (in montage order)
+  const subset_t & subset( const std::vector<bool> & bad );
+  
+  int size() const { return labels.size(); } 
+  
+  std::vector<std::string> labels;
+  
+  Data::Matrix<double> G;
+  
+  Data::Matrix<double> H;
+
+ private:
+
+  clocs_montage_t( const clocs_t & clocs , const signal_list_t & signals );
+  
+  std::map<std::vector<bool>,subset_t> subsets;
+  
+};
+
+
 #endif
@@ -25,11 +25,18 @@
 #include <vector>
 #include <cmath>
 #include <complex>
+#include <set>
 
 #include "miscmath/miscmath.h"
 #include "fftw/fftwrap.h"
+#include "helper/threads.h"
 
 std::vector<dcomp> CWT::wavelet( const int fi )
+{
+  return wavelet( fi , time );
+}
+
+std::vector<dcomp> CWT::wavelet( const int fi , const std::vector<double> & time ) const
 {
   
   // based on 'time' variable
@@ -53,27 +60,168 @@ std::vector<dcomp> CWT::wavelet( const int fi )
       w[i] = k 
 	* exp( dcomp( 2 * M_PI * fc[fi] * time[i] , 0 ) * dcomp(0,1) ) 
 	* exp( dcomp(  - (time[i]*time[i]) / fb[fi] , 0 ) );
-      double rw = std::real(w[i]);
-      // double cw = std::imag(w[i]);
-      
-      // std::cout << "wavelet " << " " << sig[fi] << " " << fb[fi] << " " << fc[fi] 
-      // 		<< " " << i << " " << rw  << " " << cw << "\n";
-
     }
   return w;
 }
 
-void CWT::run()
-{
 
+//
+// Power in dB, using the 'baseline correction based on 'all'
+// time-points
+//
+
+static void cwt_decibels( const std::vector<double> & temppower , std::vector<double> * eegpower )
+{
 
-  //
   // Any baseline normalization?
-  //
+  const bool baseline_normalization = true;
+  
+  const int num_pnts = temppower.size();
+
+  if ( baseline_normalization )
+    {
+      double baseline       = 0;
+      int    baseline_n     = 0;
+      int    baseline_start = 0;
+      int    baseline_stop  = num_pnts; // 1 past index
+      
+      for (int i = baseline_start; i < baseline_stop; i++ ) { baseline += temppower[i]; baseline_n++; } 
+      baseline /= (double)baseline_n;
+      
+      // i.e. express as dB over entire night, i.e. 10log10(ratio)
+      for (int i=0; i<num_pnts; i++) (*eegpower)[i] = 10*log10( temppower[i]/baseline );
+    }
+  else
+    {
+      for (int i=0; i<num_pnts; i++) (*eegpower)[i] = 10*log10( temppower[i] );
+    }
+}
+
 
-  bool baseline_normalization = true;
+//
+// Convolve the signal with wavelet 'fi', given the (shared) transform
+// of the zero-padded signal; wavelets are independent, so these may
+// be run in parallel (see Helper::parallel_for())
+//
+
+struct cwt_wavelet_job_t : public parallel_job_t
+{
+
+  cwt_wavelet_job_t( CWT & cwt , const std::map<int,fftw_complex*> & signal_fft ) 
+  : cwt(cwt) , signal_fft(signal_fft) { } 
   
+  CWT & cwt;
+
+  // transform of the signal, for each convolution (FFT) size
+  const std::map<int,fftw_complex*> & signal_fft;
+  
+  void run( const int fi )
+  {
+
+    // Set timeline for this wavelet, then generate the wavelet
+
+    std::vector<double> time = CWT::timeframe( cwt.fc[fi] , cwt.srate );
 
+    std::vector<dcomp> w = cwt.wavelet( fi , time );
+    
+    const int n_wavelet            = time.size();
+    const int n_convolution        = n_wavelet + cwt.n_data - 1;
+    const int n_conv_pow2          = MiscMath::nextpow2( n_convolution );
+    const int half_of_wavelet_size = n_wavelet / 2;
+    
+    const fftw_complex * X = signal_fft.find( n_conv_pow2 )->second;
+    
+    //
+    // FFT of the (zero-padded) wavelet
+    //
+
+    fftw_complex * a = (fftw_complex*) fftw_malloc( sizeof(fftw_complex) * n_conv_pow2 );
+    fftw_complex * b = (fftw_complex*) fftw_malloc( sizeof(fftw_complex) * n_conv_pow2 );
+    if ( a == NULL || b == NULL ) Helper::halt( "CWT failed to allocate memory" );
+    
+    for (int i=0;i<n_wavelet;i++) 
+      {
+	a[i][0] = std::real( w[i] );
+	a[i][1] = std::imag( w[i] );
+      }
+    for (int i=n_wavelet;i<n_conv_pow2;i++) 
+      a[i][0] = a[i][1] = 0;
+    
+    fftw_execute_dft( FFT::plan( n_conv_pow2 , FFT::PLAN_C2C_FORWARD ) , a , b );
+
+    //
+    // Convolution in the frequency domain 
+    //
+
+    for (int i=0;i<n_conv_pow2;i++) 
+      {
+	dcomp y = dcomp( X[i][0] , X[i][1] ) * dcomp( b[i][0] , b[i][1] );
+	b[i][0] = std::real( y );
+	b[i][1] = std::imag( y );
+      }
+
+    //
+    // Inverse FFT back to time-domain
+    //
+
+    fftw_execute_dft( FFT::plan( n_conv_pow2 , FFT::PLAN_C2C_INVERSE ) , b , a );
+
+    //
+    // Normalize and trim: the convolution is in a[] from offset
+    // (half_of_wavelet_size-1), and spans n_data points
+    //
+
+    const double denom = 1.0 / (double)n_conv_pow2;
+    
+    const fftw_complex * eegconv = a + half_of_wavelet_size - 1;
+    
+    const int num_pnts   = cwt.num_pnts;
+    const int num_trials = cwt.num_trials;
+
+    //
+    // extract phase from the convolution
+    //
+
+    std::vector<double> & ph = cwt.ph[fi];
+
+    for (int i=0; i<num_pnts*num_trials; i++)
+      ph[i] = atan2( eegconv[i][1] * denom , eegconv[i][0] * denom );
+    
+    //
+    // Put results back into pnts x trials matrix; take power
+    // abs(X)^2; average over trials to get a pnts-length vector of
+    // average power
+    //
+      
+    std::vector<double> & temppower = cwt.rawpower[fi];
+
+    for (int i=0; i<num_pnts; i++)
+      {
+	double x = 0;
+	for (int t=0; t<num_trials; t++)
+	  {
+	    const fftw_complex & z = eegconv[ i + t*num_pnts ];
+	    x += pow( abs( dcomp( z[0] * denom , z[1] * denom ) ) , 2 ); 
+	  }
+	temppower[i] = num_trials > 1 ? x / (double)num_trials : x ;
+      }
+
+    fftw_free( a );
+    fftw_free( b );
+
+    //
+    // Record in freq x time-point matrix
+    //
+    
+    cwt_decibels( temppower , &cwt.eegpower[fi] );
+    
+  }
+
+};
+
+
+void CWT::run()
+{
   
   //
   // Initialize
@@ -88,129 +236,268 @@ void CWT::run()
     {
       eegpower[i].resize( num_pnts , 0 );
       rawpower[i].resize( num_pnts , 0 );
-      ph[i].resize( num_pnts , 0 );
+      ph[i].resize( num_pnts * num_trials , 0 );
     }
 
-  const double SQRT_PI = sqrt(M_PI);
-
   //
-  // loop through frequencies and compute synchronization
+  // The signal is transformed once for each distinct convolution
+  // size (typically, a single size for all wavelets)
   //
 
+  std::map<int,fftw_complex*> signal_fft;
+
   for (int fi=0;fi<num_frex;fi++)
     {
       
-      // Set timeline for this wavelet, then generate the wavelet
-      
-      set_timeframe( fc[fi] );      
+      const int n_convolution = timeframe( fc[fi] , srate ).size() + n_data - 1;
+      const int n = MiscMath::nextpow2( n_convolution );
 
-      std::vector<dcomp> w = wavelet(fi);
-      
+      if ( signal_fft.find( n ) != signal_fft.end() ) continue;
+
+      // real-to-complex FFT of the zero-padded signal
       
-      //
-      // Initial FFT
-      //
+      double * x = (double*) fftw_malloc( sizeof(double) * n );
+      fftw_complex * X = (fftw_complex*) fftw_malloc( sizeof(fftw_complex) * n );
+      if ( x == NULL || X == NULL ) Helper::halt( "CWT failed to allocate memory" );
       
-      FFT eegfft( n_conv_pow2 , srate );
-      eegfft.apply( *data );
-      std::vector<dcomp> eegfftX = eegfft.transform();
-            
-      //
-      // First FFT
-      //
+      for (int i=0;i<n_data;i++) x[i] = (*data)[i];
+      for (int i=n_data;i<n;i++) x[i] = 0;
       
-      FFT fft1( n_conv_pow2 , 1 , FFT_FORWARD );
-      fft1.apply( w );
-      std::vector<dcomp> wt = fft1.transform();
+      fftw_execute_dft_r2c( FFT::plan( n , FFT::PLAN_R2C ) , x , X );
 
+      fftw_free( x );
 
-      //
-      // Convolution in the frequency domain 
-      //
+      // the upper half by conjugate symmetry
+      for (int i=n/2+1;i<n;i++)
+	{
+	  X[i][0] =   X[n-i][0];
+	  X[i][1] = - X[n-i][1];
+	}
 
-      std::vector<dcomp> y( n_conv_pow2 );
-      for (int i=0;i<eegfftX.size();i++) y[i] = eegfftX[i] * wt[i]; 
-      
-      //
-      // Inverse FFT back to time-domain
-      //
+      signal_fft[ n ] = X;
+    }
 
-      FFT ifft( n_conv_pow2 , 1 , FFT_INVERSE );
-      ifft.apply( y );
-      std::vector<dcomp> eegconv_tmp = ifft.transform();
-      
-      dcomp denom( 1.0/(double)n_conv_pow2 , 0 );
+  //
+  // loop through frequencies and compute synchronization
+  //
 
-      //
-      // Normalize
-      //
+  cwt_wavelet_job_t job( *this , signal_fft );
 
-      for (int i=0;i<n_conv_pow2;i++) eegconv_tmp[i] *= denom;
+  Helper::parallel_for( num_frex , job );
+  
+  std::map<int,fftw_complex*>::iterator ii = signal_fft.begin();
+  while ( ii != signal_fft.end() )
+    {
+      fftw_free( ii->second );
+      ++ii;
+    }
 
-      //
-      // Trim
-      //
+}
 
-      eegconv_tmp.resize( n_convolution );      
-      std::vector<dcomp> eegconv;
-      for (int i=half_of_wavelet_size-1;
-	   i < ( n_convolution - half_of_wavelet_size ); 
-	   i++ ) 
-	eegconv.push_back( eegconv_tmp[i] );
 
-      //
-      // extract phase from the convolution
-      //
 
-      for (int i=0; i<num_pnts*num_trials; i++)
-	{
-	  ph[fi][i] = atan2( eegconv[i].imag() , eegconv[i].real() );
-	}
-      
+//
+// Convolve each trial separately with all wavelets (see run_trials());
+// trials are split into fixed-size blocks (run in parallel), each
+// transformed once per convolution size, with power summed within
+// block; blocks are then added in order, so results do not depend
+// on the number of threads
+//
 
-      //
-      // Put results back into pnts x trials matrix; take power
-      // abs(X)^2; average over trials to get a pnts-length vector of
-      // average power
-      //
-      
-      int cnt = 0;
-      std::vector<double> temppower( num_pnts , 0 );
-      for (int i=0; i<num_pnts; i++)
-	{
-	  double x = 0;
-	  for (int t=0; t<num_trials; t++)
-	    x += pow( abs( eegconv[ cnt + t*num_pnts ] ) , 2 ); 
-	  ++cnt;
-	  temppower[i] = num_trials > 1 ? x / (double)num_trials : x ;
-	}
-      
-      //
-      // Record in freq x time-point matrix; use the 'baseline
-      // correction based on 'all' time-points, i.e. to get dB
-      //
+struct cwt_trials_job_t : public parallel_job_t
+{
+  
+  cwt_trials_job_t( CWT & cwt , const int block_size ) : cwt(cwt) , block_size( block_size ) 
+  {
+    
+    const int num_frex = cwt.num_frex;
+    const int num_trials = cwt.num_trials;
 
-      double baseline       = 0;
-      int    baseline_n     = 0;
-      int    baseline_start = 0;
-      int    baseline_stop  = num_pnts; // 1 past index
-      
-      if ( baseline_normalization )
-	{
+    n_conv_pow2.resize( num_frex );
+    offset.resize( num_frex );
+    wavelet_fft.resize( num_frex );
 
-	  for (int i = baseline_start; i < baseline_stop; i++ ) { baseline += temppower[i]; baseline_n++; } 
-	  baseline /= (double)baseline_n;
-	  
-	  // i.e. express as dB over entire night, i.e. 10log10(ratio)
-	  for (int i=0; i<num_pnts; i++) eegpower[fi][i] = 10*log10( temppower[i]/baseline );
-	}
-      else
+    for (int fi=0;fi<num_frex;fi++)
+      {
+	
+	std::vector<double> time = CWT::timeframe( cwt.fc[fi] , cwt.srate );
+	
+	std::vector<dcomp> w = cwt.wavelet( fi , time );
+	
+	const int n_wavelet = time.size();
+	const int n = MiscMath::nextpow2( n_wavelet + cwt.num_pnts - 1 );
+
+	n_conv_pow2[fi] = n;
+	offset[fi] = n_wavelet / 2 - 1;
+
+	//
+	// FFT of the (zero-padded) wavelet, once for all trials
+	//
+	
+	fftw_complex * a = (fftw_complex*) fftw_malloc( sizeof(fftw_complex) * n );
+	fftw_complex * b = (fftw_complex*) fftw_malloc( sizeof(fftw_complex) * n );
+	if ( a == NULL || b == NULL ) Helper::halt( "CWT failed to allocate memory" );
+
+	for (int i=0;i<n_wavelet;i++) 
+	  {
+	    a[i][0] = std::real( w[i] );
+	    a[i][1] = std::imag( w[i] );
+	  }
+	for (int i=n_wavelet;i<n;i++) 
+	  a[i][0] = a[i][1] = 0;
+	
+	fftw_execute_dft( FFT::plan( n , FFT::PLAN_C2C_FORWARD ) , a , b );
+
+	fftw_free( a );
+	wavelet_fft[fi] = b;	
+      }
+    
+    const int num_blocks = ( num_trials + block_size - 1 ) / block_size;
+    power.resize( num_blocks );
+  }
+
+  ~cwt_trials_job_t()
+  {
+    for (int fi=0;fi<wavelet_fft.size();fi++) fftw_free( wavelet_fft[fi] );
+  }
+  
+  CWT & cwt;
+
+  const int block_size;
+  
+  std::vector<int> n_conv_pow2;
+  std::vector<int> offset;
+  std::vector<fftw_complex*> wavelet_fft;
+  
+  // block x frequency x point
+  std::vector<std::vector<std::vector<double> > > power;
+  
+  void run( const int block )
+  {
+    
+    const int num_frex   = cwt.num_frex;
+    const int num_pnts   = cwt.num_pnts;
+    const int t0 = block * block_size;
+    const int t1 = std::min( t0 + block_size , cwt.num_trials );
+    
+    std::vector<std::vector<double> > & p = power[ block ];
+    p.resize( num_frex );
+    for (int fi=0;fi<num_frex;fi++) p[fi].assign( num_pnts , 0 );
+
+    // typically, a single size for all wavelets
+    std::set<int> sizes( n_conv_pow2.begin() , n_conv_pow2.end() );
+    const int nmax = *sizes.rbegin();
+    
+    double * x       = (double*) fftw_malloc( sizeof(double) * nmax );
+    fftw_complex * X = (fftw_complex*) fftw_malloc( sizeof(fftw_complex) * nmax );
+    fftw_complex * a = (fftw_complex*) fftw_malloc( sizeof(fftw_complex) * nmax );
+    fftw_complex * b = (fftw_complex*) fftw_malloc( sizeof(fftw_complex) * nmax );
+    if ( x == NULL || X == NULL || a == NULL || b == NULL ) 
+      Helper::halt( "CWT failed to allocate memory" );
+    
+    for (int t=t0; t<t1; t++)
+      {
+	
+	const double * d = &(*cwt.data)[ (size_t)t * num_pnts ];
+	
+	std::set<int>::const_iterator nn = sizes.begin();
+	while ( nn != sizes.end() )
+	  {
+	    
+	    const int n = *nn;
+	    
+	    //
+	    // real-to-complex FFT of the zero-padded trial
+	    //
+	    
+	    for (int i=0;i<num_pnts;i++) x[i] = d[i];
+	    for (int i=num_pnts;i<n;i++) x[i] = 0;
+	    
+	    fftw_execute_dft_r2c( FFT::plan( n , FFT::PLAN_R2C ) , x , X );
+	    
+	    for (int i=n/2+1;i<n;i++)
+	      {
+		X[i][0] =   X[n-i][0];
+		X[i][1] = - X[n-i][1];
+	      }
+
+	    const double denom = 1.0 / (double)n;
+
+	    for (int fi=0;fi<num_frex;fi++)
+	      {
+		
+		if ( n_conv_pow2[fi] != n ) continue;
+		
+		//
+		// Convolution in the frequency domain, and back to time-domain
+		//
+		
+		const fftw_complex * B = wavelet_fft[fi];
+		
+		for (int i=0;i<n;i++) 
+		  {
+		    dcomp y = dcomp( X[i][0] , X[i][1] ) * dcomp( B[i][0] , B[i][1] );
+		    b[i][0] = std::real( y );
+		    b[i][1] = std::imag( y );
+		  }
+		
+		fftw_execute_dft( FFT::plan( n , FFT::PLAN_C2C_INVERSE ) , b , a );
+		
+		const fftw_complex * eegconv = a + offset[fi];
+		
+		std::vector<double> & pf = p[fi];
+		
+		for (int i=0; i<num_pnts; i++)
+		  {
+		    const fftw_complex & z = eegconv[i];
+		    pf[i] += pow( abs( dcomp( z[0] * denom , z[1] * denom ) ) , 2 );
+		  }
+	      }
+	    
+	    ++nn;
+	  }
+      }
+    
+    fftw_free( x );
+    fftw_free( X );
+    fftw_free( a );
+    fftw_free( b );
+    
+  }
+  
+};
+
+
+void CWT::run_trials()
+{
+
+  eegpower.resize( num_frex );
+  rawpower.resize( num_frex );
+  ph.clear();
+  for (int i=0;i<num_frex;i++) 
+    {
+      eegpower[i].assign( num_pnts , 0 );
+      rawpower[i].assign( num_pnts , 0 );
+    }
+  
+  cwt_trials_job_t job( *this , 256 );
+
+  Helper::parallel_for( job.power.size() , job );
+  
+  for (int fi=0;fi<num_frex;fi++)
+    {
+      std::vector<double> & temppower = rawpower[fi];
+
+      for (int block=0; block<job.power.size(); block++)
 	{
-	  for (int i=0; i<num_pnts; i++) eegpower[fi][i] = 10*log10( temppower[i] );
+	  const std::vector<double> & p = job.power[block][fi];
+	  for (int i=0; i<num_pnts; i++) temppower[i] += p[i];
 	}
-
-      // save non-dB version too
-      rawpower[fi] = temppower;
+      
+      if ( num_trials > 1 ) 
+	for (int i=0; i<num_pnts; i++) temppower[i] /= (double)num_trials;
+      
+      cwt_decibels( temppower , &eegpower[fi] );
     }
-    
+  
 }
@@ -34,6 +34,10 @@
 void run_cwt();
 
 class CWT {
+
+  // convolution of the signal with a single wavelet (see run())
+  friend struct cwt_wavelet_job_t;
+  friend struct cwt_trials_job_t;
   
  public:
   
@@ -46,10 +50,10 @@ class CWT {
 
   std::vector<double> get_timeframe() const { return time; }  
 
-  void set_timeframe( const double f ) 
+  // time-points for the wavelet with centre frequency 'f'
+  static std::vector<double> timeframe( const double f , const int srate )
   {
-    if ( srate == 0 ) Helper::halt( "srate not set in cwt" );
-    time.clear();
+    std::vector<double> time;
     
     // generates a nice range, based on the frequency of the wavelet
     double T = 50.0 / f;
@@ -60,6 +64,14 @@ class CWT {
       time.push_back(t);    
     if ( time.size() % 2 ) // i.e. if odd, force wavelet to be even
       time.push_back( stop );
+    return time;
+  }
+
+  void set_timeframe( const double f ) 
+  {
+    if ( srate == 0 ) Helper::halt( "srate not set in cwt" );
+
+    time = timeframe( f , srate );
 
     // now set all wavelet-specific factors
     n_wavelet            = time.size();    
@@ -83,6 +95,8 @@ class CWT {
   }
   
   std::vector<dcomp> wavelet(const int);
+
+  std::vector<dcomp> wavelet(const int , const std::vector<double> & t ) const;
   
   void add_wavelet(const double _fc, const int n_cycles ) 
   {
@@ -143,6 +157,13 @@ class CWT {
 
   
   void run();
+
+  // as run(), but each of the 'num_trials' segments (see
+  // set_pnts_trials()) is convolved on its own, i.e. zero-padded
+  // rather than continued by the next trial, with power averaged
+  // over trials; wavelets are transformed once for all trials, and
+  // each trial once for all wavelets (nb. phase is not kept)
+  void run_trials();
   
   double freq(const int fi) const { return fc[fi]; }
   int    points() const { return num_pnts; }
@@ -0,0 +1,544 @@
+
+//    --------------------------------------------------------------------
+//
+//    This file is part of Luna.
+//
+//    LUNA is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    Luna is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with Luna. If not, see <http://www.gnu.org/licenses/>.
+//
+//    Please see LICENSE.txt for more details.
+//
+//    --------------------------------------------------------------------
+
+#include "colstore.h"
+
+#include "helper/helper.h"
+
+#include <cstring>
+
+static const char * colstore_magic = "LUNACOL1";
+
+
+//
+// low-level I/O
+//
+
+static void put( FILE * f , const void * p , const size_t n )
+{
+  if ( fwrite( p , 1 , n , f ) != n ) Helper::halt( "problem writing columnar output" );
+}
+
+static void put_int32( FILE * f , const int32_t x ) { put( f , &x , 4 ); }
+static void put_int64( FILE * f , const int64_t x ) { put( f , &x , 8 ); }
+static void put_uint8( FILE * f , const uint8_t x ) { put( f , &x , 1 ); }
+static void put_double( FILE * f , const double x ) { put( f , &x , 8 ); }
+static void put_string( FILE * f , const std::string & s )
+{
+  put_int32( f , s.size() );
+  if ( s.size() ) put( f , s.data() , s.size() );
+}
+
+static void get( FILE * f , void * p , const size_t n )
+{
+  if ( fread( p , 1 , n , f ) != n ) Helper::halt( "problem reading columnar file" );
+}
+
+static int32_t get_int32( FILE * f ) { int32_t x; get( f , &x , 4 ); return x; }
+static int64_t get_int64( FILE * f ) { int64_t x; get( f , &x , 8 ); return x; }
+static uint8_t get_uint8( FILE * f ) { uint8_t x; get( f , &x , 1 ); return x; }
+static double get_double( FILE * f ) { double x; get( f , &x , 8 ); return x; }
+static std::string get_string( FILE * f )
+{
+  const int32_t n = get_int32( f );
+  if ( n < 0 ) Helper::halt( "problem reading columnar file" );
+  std::string s( n , ' ' );
+  if ( n ) get( f , &s[0] , n );
+  return s;
+}
+
+static void seek( FILE * f , const int64_t offset , const int whence = SEEK_SET )
+{
+#ifdef WINDOWS
+  if ( _fseeki64( f , offset , whence ) ) Helper::halt( "problem reading columnar file" );
+#else
+  if ( fseeko( f , offset , whence ) ) Helper::halt( "problem reading columnar file" );
+#endif
+}
+
+static int64_t tell( FILE * f )
+{
+#ifdef WINDOWS
+  return _ftelli64( f );
+#else
+  return ftello( f );
+#endif
+}
+
+
+
+//
+// Writer
+//
+
+colstore_writer_t::colstore_writer_t( const std::string & filename ) : filename( filename )
+{
+  file = fopen( filename.c_str() , "wb" );
+  if ( file == NULL ) Helper::halt( "could not open " + filename + " for writing" );
+  put( file , colstore_magic , 8 );
+}
+
+colstore_writer_t::~colstore_writer_t()
+{
+  if ( file != NULL ) fclose( file );
+}
+
+
+void colstore_writer_t::write( const value_batch_t & batch )
+{
+
+  //
+  // group rows by column (individual/command/variable/strata), in
+  // order of first appearance
+  //
+
+  typedef std::pair<std::pair<int,int>,std::pair<int,int> > col_key_t;
+
+  std::map<col_key_t,int> cols;
+  std::vector<std::vector<int> > rows;
+
+  const int n = batch.size();
+
+  for (int k=0; k<n; k++)
+    {
+      col_key_t key( std::make_pair( batch.indiv_id[k] , batch.cmd_id[k] ) ,
+		 std::make_pair( batch.var_id[k] , batch.strata_id[k] ) );
+
+      std::map<col_key_t,int>::const_iterator cc = cols.find( key );
+      int c = 0;
+      if ( cc == cols.end() )
+	{
+	  c = rows.size();
+	  cols[ key ] = c;
+	  rows.resize( c + 1 );
+	}
+      else
+	c = cc->second;
+
+      rows[c].push_back( k );
+    }
+
+
+  //
+  // one block per column
+  //
+
+  for (int c=0; c<rows.size(); c++)
+    {
+
+      const std::vector<int> & r = rows[c];
+      const int k0 = r[0];
+      const int nr = r.size();
+
+      colstore_block_t block;
+      block.offset    = tell( file );
+      block.indiv_id  = batch.indiv_id[k0];
+      block.cmd_id    = batch.cmd_id[k0];
+      block.var_id    = batch.var_id[k0];
+      block.strata_id = batch.strata_id[k0];
+      block.n         = nr;
+      blocks.push_back( block );
+
+      bool all_double = true;
+      for (int i=0; i<nr; i++)
+	if ( batch.type[ r[i] ] != value_batch_t::DBL ) { all_double = false; break; }
+
+      put_int32( file , block.indiv_id );
+      put_int32( file , block.cmd_id );
+      put_int32( file , block.var_id );
+      put_int32( file , block.strata_id );
+      put_int32( file , nr );
+      put_uint8( file , all_double ? 0 : 1 );
+
+      std::vector<int32_t> tp( nr );
+      for (int i=0; i<nr; i++) tp[i] = batch.timepoint_id[ r[i] ];
+      put( file , &tp[0] , 4 * nr );
+
+      if ( all_double )
+	{
+	  std::vector<double> d( nr );
+	  for (int i=0; i<nr; i++) d[i] = batch.d[ r[i] ];
+	  put( file , &d[0] , 8 * nr );
+	  continue;
+	}
+
+      std::vector<uint8_t> t( nr );
+      for (int i=0; i<nr; i++) t[i] = batch.type[ r[i] ];
+      put( file , &t[0] , nr );
+
+      for (int i=0; i<nr; i++)
+	{
+	  const int k = r[i];
+	  switch ( batch.type[k] )
+	    {
+	    case value_batch_t::DBL : put_double( file , batch.d[k] ); break;
+	    case value_batch_t::INT : put_int32( file , batch.i[k] ); break;
+	    case value_batch_t::STR : put_string( file , batch.s[ batch.i[k] ] ); break;
+	    default : break;
+	    }
+	}
+    }
+
+}
+
+
+void colstore_writer_t::close( const writer_t & w )
+{
+
+  if ( file == NULL ) return;
+
+  const int64_t footer = tell( file );
+
+  // factors
+  put_int32( file , w.factors.size() );
+  std::map<int,factor_t>::const_iterator ff = w.factors.begin();
+  while ( ff != w.factors.end() )
+    {
+      put_int32( file , ff->first );
+      put_uint8( file , ff->second.is_numeric );
+      put_string( file , ff->second.factor_name );
+      ++ff;
+    }
+
+  // levels
+  put_int32( file , w.levels.size() );
+  std::map<int,level_t>::const_iterator ll = w.levels.begin();
+  while ( ll != w.levels.end() )
+    {
+      put_int32( file , ll->first );
+      put_int32( file , ll->second.factor_id );
+      put_string( file , ll->second.level_name );
+      ++ll;
+    }
+
+  // strata (as level IDs; 0 for the root stratum)
+  put_int32( file , w.strata.size() );
+  std::map<int,strata_t>::const_iterator ss = w.strata.begin();
+  while ( ss != w.strata.end() )
+    {
+      put_int32( file , ss->first );
+      const std::map<factor_t,level_t> & lvls = ss->second.levels;
+      if ( lvls.size() == 0 )
+	{
+	  put_int32( file , 1 );
+	  put_int32( file , 0 );
+	}
+      else
+	{
+	  put_int32( file , lvls.size() );
+	  std::map<factor_t,level_t>::const_iterator kk = lvls.begin();
+	  while ( kk != lvls.end() ) { put_int32( file , kk->second.level_id ); ++kk; }
+	}
+      ++ss;
+    }
+
+  // commands
+  put_int32( file , w.commands.size() );
+  std::map<int,command_t>::const_iterator cc = w.commands.begin();
+  while ( cc != w.commands.end() )
+    {
+      put_int32( file , cc->first );
+      put_int32( file , cc->second.cmd_number );
+      put_string( file , cc->second.cmd_name );
+      put_string( file , cc->second.cmd_parameters );
+      put_string( file , cc->second.timestamp );
+      ++cc;
+    }
+
+  // variables
+  put_int32( file , w.variables.size() );
+  std::map<int,var_t>::const_iterator vv = w.variables.begin();
+  while ( vv != w.variables.end() )
+    {
+      put_int32( file , vv->first );
+      put_string( file , vv->second.cmd_name );
+      put_string( file , vv->second.var_name );
+      put_string( file , vv->second.var_label );
+      ++vv;
+    }
+
+  // individuals
+  put_int32( file , w.individuals.size() );
+  std::map<int,indiv_t>::const_iterator ii = w.individuals.begin();
+  while ( ii != w.individuals.end() )
+    {
+      put_int32( file , ii->first );
+      put_string( file , ii->second.indiv_name );
+      put_string( file , ii->second.file_name );
+      ++ii;
+    }
+
+  // timepoints
+  put_int32( file , w.timepoints.size() );
+  std::map<int,timepoint_t>::const_iterator tt = w.timepoints.begin();
+  while ( tt != w.timepoints.end() )
+    {
+      put_int32( file , tt->first );
+      put_int32( file , tt->second.epoch );
+      put_int64( file , tt->second.start );
+      put_int64( file , tt->second.stop );
+      ++tt;
+    }
+
+  // block index
+  put_int64( file , blocks.size() );
+  for (int b=0; b<blocks.size(); b++)
+    {
+      put_int64( file , blocks[b].offset );
+      put_int32( file , blocks[b].indiv_id );
+      put_int32( file , blocks[b].cmd_id );
+      put_int32( file , blocks[b].var_id );
+      put_int32( file , blocks[b].strata_id );
+      put_int32( file , blocks[b].n );
+    }
+
+  put_int64( file , footer );
+  put( file , colstore_magic , 8 );
+
+  fclose( file );
+  file = NULL;
+
+}
+
+
+
+//
+// Reader
+//
+
+bool colstore_reader_t::is_colstore( const std::string & filename )
+{
+  FILE * f = fopen( filename.c_str() , "rb" );
+  if ( f == NULL ) return false;
+  char m[8];
+  const bool okay = fread( m , 1 , 8 , f ) == 8 && memcmp( m , colstore_magic , 8 ) == 0;
+  fclose( f );
+  return okay;
+}
+
+
+colstore_reader_t::colstore_reader_t( const std::string & filename ) : filename( filename )
+{
+
+  if ( ! is_colstore( filename ) )
+    Helper::halt( filename + " is not a columnar output file" );
+
+  file = fopen( filename.c_str() , "rb" );
+  if ( file == NULL ) Helper::halt( "could not open " + filename );
+
+  // trailer: footer offset and magic
+
+  seek( file , -16 , SEEK_END );
+  const int64_t footer = get_int64( file );
+  char m[8];
+  get( file , m , 8 );
+  if ( memcmp( m , colstore_magic , 8 ) )
+    Helper::halt( filename + " is incomplete (was luna interrupted?)" );
+
+  seek( file , footer );
+
+  // factors
+  int n = get_int32( file );
+  for (int i=0; i<n; i++)
+    {
+      factor_t f;
+      f.factor_id = get_int32( file );
+      f.is_numeric = get_uint8( file );
+      f.factor_name = get_string( file );
+      factors.push_back( f );
+    }
+
+  // levels
+  n = get_int32( file );
+  for (int i=0; i<n; i++)
+    {
+      level_t l;
+      l.level_id = get_int32( file );
+      l.factor_id = get_int32( file );
+      l.level_name = get_string( file );
+      levels.push_back( l );
+    }
+
+  // strata
+  n = get_int32( file );
+  for (int i=0; i<n; i++)
+    {
+      const int id = get_int32( file );
+      const int k = get_int32( file );
+      std::vector<int> & lvls = strata[ id ];
+      for (int j=0; j<k; j++) lvls.push_back( get_int32( file ) );
+    }
+
+  // commands
+  n = get_int32( file );
+  for (int i=0; i<n; i++)
+    {
+      command_t c;
+      c.cmd_id = get_int32( file );
+      c.cmd_number = get_int32( file );
+      c.cmd_name = get_string( file );
+      c.cmd_parameters = get_string( file );
+      c.timestamp = get_string( file );
+      commands.push_back( c );
+    }
+
+  // variables
+  n = get_int32( file );
+  for (int i=0; i<n; i++)
+    {
+      var_t v;
+      v.var_id = get_int32( file );
+      v.cmd_id = -1;
+      v.cmd_name = get_string( file );
+      v.var_name = get_string( file );
+      v.var_label = get_string( file );
+      variables.push_back( v );
+    }
+
+  // individuals
+  n = get_int32( file );
+  for (int i=0; i<n; i++)
+    {
+      indiv_t ind;
+      ind.indiv_id = get_int32( file );
+      ind.indiv_name = get_string( file );
+      ind.file_name = get_string( file );
+      individuals.push_back( ind );
+    }
+
+  // timepoints
+  n = get_int32( file );
+  for (int i=0; i<n; i++)
+    {
+      timepoint_t t;
+      t.timepoint_id = get_int32( file );
+      t.epoch = get_int32( file );
+      t.start = get_int64( file );
+      t.stop = get_int64( file );
+      timepoints.push_back( t );
+    }
+
+  // block index
+  const int64_t nb = get_int64( file );
+  blocks.resize( nb );
+  for (int64_t b=0; b<nb; b++)
+    {
+      blocks[b].offset = get_int64( file );
+      blocks[b].indiv_id = get_int32( file );
+      blocks[b].cmd_id = get_int32( file );
+      blocks[b].var_id = get_int32( file );
+      blocks[b].strata_id = get_int32( file );
+      blocks[b].n = get_int32( file );
+    }
+
+}
+
+
+colstore_reader_t::~colstore_reader_t()
+{
+  if ( file != NULL ) fclose( file );
+}
+
+
+std::vector<int> colstore_reader_t::select( const colstore_filter_t & filter ) const
+{
+
+  std::vector<int> r;
+
+  // which variables and individuals pass?
+
+  std::set<int> vars;
+  for (int v=0; v<variables.size(); v++)
+    if ( filter.vars.size() == 0 || filter.vars.find( variables[v].var_name ) != filter.vars.end() )
+      vars.insert( variables[v].var_id );
+
+  std::set<int> cmds;
+  for (int c=0; c<commands.size(); c++)
+    if ( filter.cmds.size() == 0 || filter.cmds.find( commands[c].cmd_name ) != filter.cmds.end() )
+      cmds.insert( commands[c].cmd_id );
+
+  std::set<int> indivs;
+  for (int i=0; i<individuals.size(); i++)
+    if ( filter.indivs.size() == 0 || filter.indivs.find( individuals[i].indiv_name ) != filter.indivs.end() )
+      indivs.insert( individuals[i].indiv_id );
+
+  for (int b=0; b<blocks.size(); b++)
+    if ( vars.find( blocks[b].var_id ) != vars.end() 
+	 && cmds.find( blocks[b].cmd_id ) != cmds.end() 
+	 && indivs.find( blocks[b].indiv_id ) != indivs.end() )
+      r.push_back( b );
+
+  return r;
+}
+
+
+void colstore_reader_t::read( const int b , packets_t * packets )
+{
+
+  const colstore_block_t & block = blocks[b];
+
+  seek( file , block.offset );
+
+  packet_t packet;
+  packet.indiv_id  = get_int32( file );
+  packet.cmd_id    = get_int32( file );
+  packet.var_id    = get_int32( file );
+  packet.strata_id = get_int32( file );
+
+  const int n = get_int32( file );
+  if ( n != block.n ) Helper::halt( "problem reading block from " + filename );
+
+  const bool all_double = get_uint8( file ) == 0;
+
+  std::vector<int32_t> tp( n );
+  if ( n ) get( file , &tp[0] , 4 * n );
+
+  if ( all_double )
+    {
+      std::vector<double> d( n );
+      if ( n ) get( file , &d[0] , 8 * n );
+      for (int i=0; i<n; i++)
+	{
+	  packet.timepoint_id = tp[i];
+	  packet.value = value_t( d[i] );
+	  packets->push_back( packet );
+	}
+      return;
+    }
+
+  std::vector<uint8_t> t( n );
+  if ( n ) get( file , &t[0] , n );
+
+  for (int i=0; i<n; i++)
+    {
+      packet.timepoint_id = tp[i];
+      switch ( t[i] )
+	{
+	case value_batch_t::DBL : packet.value = value_t( get_double( file ) ); break;
+	case value_batch_t::INT : packet.value = value_t( (int)get_int32( file ) ); break;
+	case value_batch_t::STR : packet.value = value_t( get_string( file ) ); break;
+	default : packet.value = value_t();
+	}
+      packets->push_back( packet );
+    }
+
+}
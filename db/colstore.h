@@ -0,0 +1,144 @@
+
+//    --------------------------------------------------------------------
+//
+//    This file is part of Luna.
+//
+//    LUNA is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    Luna is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with Luna. If not, see <http://www.gnu.org/licenses/>.
+//
+//    Please see LICENSE.txt for more details.
+//
+//    --------------------------------------------------------------------
+
+#ifndef __LUNA_COLSTORE_H__
+#define __LUNA_COLSTORE_H__
+
+#include "db.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <stdint.h>
+
+//
+// Columnar binary output (luna -b file), as an alternative to the
+// SQLite datapoints table.  The file is a sequence of column blocks,
+// each holding all values of one variable, in one stratum, for one
+// individual (from one flush of the writer); a footer then holds the
+// dictionaries (factors, levels, strata, commands, variables,
+// individuals, timepoints) and an index of blocks.  Readers can
+// therefore select blocks from the index alone, and read only those.
+//
+//   "LUNACOL1"
+//   block*       int32 indiv, cmd, var, strata (-1 if none), n
+//                uint8 encoding: 0 all doubles, 1 mixed
+//                int32 timepoint[n] (-1 if none)
+//                0: double[n]
+//                1: uint8 type[n], then each value: double, int32,
+//                   or int32 length + bytes (strings), or nothing (missing)
+//   footer       (see write_footer())
+//   int64        offset of footer
+//   "LUNACOL1"
+//
+// All numbers are written in native byte order.
+//
+
+struct colstore_block_t
+{
+  int64_t offset;
+  int indiv_id;
+  int cmd_id;
+  int var_id;
+  int strata_id;
+  int n;
+};
+
+
+struct colstore_writer_t
+{
+
+  colstore_writer_t( const std::string & filename );
+
+  ~colstore_writer_t();
+
+  // append the values in a batch, as one block per column
+  void write( const value_batch_t & batch );
+
+  // write dictionaries (from the writer's caches) and close
+  void close( const writer_t & w );
+
+  std::string filename;
+
+ private:
+
+  FILE * file;
+
+  std::vector<colstore_block_t> blocks;
+
+};
+
+
+//
+// Selecting blocks: by variable name, command name and individual
+// (an empty set matches all)
+//
+
+struct colstore_filter_t
+{
+  std::set<std::string> vars;
+  std::set<std::string> cmds;
+  std::set<std::string> indivs;
+};
+
+
+struct colstore_reader_t
+{
+
+  colstore_reader_t( const std::string & filename );
+
+  ~colstore_reader_t();
+
+  // does this file have the format above?
+  static bool is_colstore( const std::string & filename );
+
+  // indices of blocks passing the filter (from the index only)
+  std::vector<int> select( const colstore_filter_t & filter ) const;
+
+  // read the values of one block
+  void read( const int b , packets_t * packets );
+
+  // dictionaries
+
+  std::vector<factor_t>    factors;
+  std::vector<level_t>     levels;
+  std::vector<command_t>   commands;
+  std::vector<var_t>       variables;
+  std::vector<indiv_t>     individuals;
+  std::vector<timepoint_t> timepoints;
+
+  // strata_id -> level_ids (0 for the root stratum)
+  std::map<int,std::vector<int> > strata;
+
+  std::vector<colstore_block_t> blocks;
+
+  std::string filename;
+
+ private:
+
+  FILE * file;
+
+};
+
+#endif
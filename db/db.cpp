@@ -20,13 +20,18 @@
 //    --------------------------------------------------------------------
 
 #include "db.h"
+#include "colstore.h"
 
 #include <iostream>
 #include <set>
 #include <utility>
+#include <pthread.h>
 
 extern writer_t writer;
 
+// guards the creation of writer_t handles (which may be made from worker threads)
+static pthread_mutex_t writer_handle_lock = PTHREAD_MUTEX_INITIALIZER;
+
 std::string strata_t::factor_string() const
 {
   if ( levels.size() == 0 ) return ".";
@@ -296,6 +301,7 @@ void StratOutDBase::read_all( writer_t * w )
       indiv_t indiv;
       indiv.indiv_id = sql.get_int( stmt_dump_individuals , 0 );
       indiv.indiv_name = sql.get_text( stmt_dump_individuals , 1 );
+      indiv.file_name = sql.get_text( stmt_dump_individuals , 2 );
       w->individuals[ indiv.indiv_id ] = indiv;
       w->individuals_idmap[ indiv.indiv_name ] = indiv.indiv_id;
     }
@@ -462,6 +468,8 @@ void StratOutDBase::read_all( writer_t * w )
       var.var_label = sql.get_text( stmt_dump_variables , 3 );
 
       std::string command_name = sql.get_text( stmt_dump_variables , 2 );
+      var.cmd_name = command_name;
+      var.cmd_id = -1;
       if ( w->commands_idmap.find( command_name ) != w->commands_idmap.end() ) 
 	var.cmd_id = w->commands_idmap[ command_name ];
 
@@ -474,6 +482,7 @@ void StratOutDBase::read_all( writer_t * w )
 
 bool StratOutDBase::dettach()
 {
+  flush();
   release();
   sql.close();
   return true;
@@ -514,6 +523,10 @@ bool StratOutDBase::init()
   stmt_dump_int_datapoints = sql.prepare( "SELECT * FROM datapoints where indiv_id == :indiv_id AND typeof(value) == \"integer\" ;" );
   stmt_dump_dbl_datapoints = sql.prepare( "SELECT * FROM datapoints where indiv_id == :indiv_id AND typeof(value) == \"real\" ;" );
   stmt_dump_txt_datapoints = sql.prepare( "SELECT * FROM datapoints where indiv_id == :indiv_id AND typeof(value) == \"text\" ;" );
+
+  // all types in one pass, in insertion order (used when merging worker DBs)
+  stmt_dump_indiv_datapoints = sql.prepare( "SELECT indiv_id,cmd_id,variable_id,strata_id,timepoint_id,value,typeof(value) FROM datapoints "
+					    " WHERE indiv_id == :indiv_id ORDER BY rowid ;" );
   
   // queries
   stmt_count_values = sql.prepare( "SELECT count(1) FROM datapoints;" );
@@ -545,6 +558,11 @@ bool StratOutDBase::init()
   stmt_insert_value   = sql.prepare(" INSERT OR REPLACE INTO datapoints ( indiv_id, cmd_id, variable_id, strata_id, timepoint_id, value ) "
 				    " values( :indiv_id, :cmd_id, :variable_id, :strata_id, :timepoint_id, :value ) ; ");  
 
+  std::string q = " INSERT INTO datapoints ( indiv_id, cmd_id, variable_id, strata_id, timepoint_id, value ) values ";
+  for (int r=0; r<batch_insert_rows; r++) q += r ? ", (?,?,?,?,?,?)" : "(?,?,?,?,?,?)";
+  stmt_insert_values  = sql.prepare( q + " ; " );
+
+
   return true;
 }
 
@@ -559,6 +577,7 @@ bool StratOutDBase::release()
   sql.finalise( stmt_insert_variable); 
   sql.finalise( stmt_insert_timepoint);    
   sql.finalise( stmt_insert_value);    
+  sql.finalise( stmt_insert_values);    
 
   sql.finalise( stmt_dump_factors);	      
   sql.finalise( stmt_dump_levels);	      
@@ -571,6 +590,7 @@ bool StratOutDBase::release()
   sql.finalise( stmt_dump_int_datapoints);	      
   sql.finalise( stmt_dump_dbl_datapoints);	      
   sql.finalise( stmt_dump_txt_datapoints);	      
+  sql.finalise( stmt_dump_indiv_datapoints);
 
   sql.finalise( stmt_lookup_value_by_strata);
   sql.finalise( stmt_lookup_value_by_strata_and_timepoint);
@@ -582,6 +602,7 @@ bool StratOutDBase::release()
 bool StratOutDBase::index()
 {
   if ( ! attached() ) return false;
+  flush();
   sql.query( "CREATE INDEX IF NOT EXISTS vIndex ON datapoints(strata_id); " );
   // schema changed, so update prepared queries
   release();
@@ -593,6 +614,7 @@ bool StratOutDBase::index()
 bool StratOutDBase::drop_index()
 {
   if ( ! attached() ) return false;
+  flush();
   sql.query( "DROP INDEX IF EXISTS vIndex;" );
   // schema changed, so update prepared queries
   release();
@@ -630,6 +652,7 @@ var_t     StratOutDBase::insert_variable( const std::string & var_name, const st
   var.var_id = sql.last_insert_rowid();
   var.var_name = var_name;
   var.var_label = var_label;
+  var.cmd_name = cmd_name;
   return var;
 }
 
@@ -799,8 +822,102 @@ bool      StratOutDBase::insert_value( const int indiv_id , const int cmd_id , c
 }
 
 
+void StratOutDBase::queue_value( const int indiv_id , const int cmd_id , const int variable_id , 
+				 const int strata_id , const int timepoint_id, 
+				 const value_t & x )
+{
+  if      ( x.missing ) batch.add( indiv_id , cmd_id , variable_id , strata_id , timepoint_id , value_batch_t::MISSING , 0 , 0 );
+  else if ( x.numeric ) batch.add( indiv_id , cmd_id , variable_id , strata_id , timepoint_id , value_batch_t::DBL , x.d , 0 );
+  else if ( x.integer ) batch.add( indiv_id , cmd_id , variable_id , strata_id , timepoint_id , value_batch_t::INT , 0 , x.i );
+  else 
+    {
+      batch.add( indiv_id , cmd_id , variable_id , strata_id , timepoint_id , value_batch_t::STR , 0 , batch.s.size() );
+      batch.s.push_back( x.s );
+    }
+
+  if ( batch.size() >= batch_max_rows ) flush();
+}
+
+
+void StratOutDBase::bind_value( sqlite3_stmt * stmt , const int p , const int k )
+{
+  // bind row k of the batch to parameters p+1 .. p+6 
+
+  sql.bind_int( stmt , p + 1 , batch.indiv_id[k] );
+  sql.bind_int( stmt , p + 2 , batch.cmd_id[k] );
+  sql.bind_int( stmt , p + 3 , batch.var_id[k] );
+
+  if ( batch.strata_id[k] == -1 ) sql.bind_null( stmt , p + 4 );
+  else sql.bind_int( stmt , p + 4 , batch.strata_id[k] );
+  
+  if ( batch.timepoint_id[k] == -1 ) sql.bind_null( stmt , p + 5 );
+  else sql.bind_int( stmt , p + 5 , batch.timepoint_id[k] );
+  
+  switch ( batch.type[k] ) 
+    {
+    case value_batch_t::DBL     : sql.bind_double( stmt , p + 6 , batch.d[k] ); break;
+    case value_batch_t::INT     : sql.bind_int( stmt , p + 6 , batch.i[k] ); break;
+    case value_batch_t::STR     : sql.bind_text( stmt , p + 6 , batch.s[ batch.i[k] ] ); break;
+    default                     : sql.bind_null( stmt , p + 6 ); 
+    }
+}
+
+
+void StratOutDBase::flush()
+{
+  
+  const int n = batch.size();
+  
+  if ( n == 0 ) return;
+
+  if ( ! attached() ) { batch.clear(); return; }
+
+  if ( colstore ) 
+    {
+      colstore->write( batch );
+      batch.clear();
+      return;
+    }
+
+  // write all queued values in one transaction (i.e. if not already in one)
+  
+  const bool own_transaction = sql.autocommit();
+
+  if ( own_transaction ) sql.begin();
+
+  int k = 0;
+
+  // full multi-row inserts 
+
+  while ( n - k >= batch_insert_rows ) 
+    {
+      for (int r=0; r<batch_insert_rows; r++) 
+	bind_value( stmt_insert_values , 6 * r , k + r );
+      sql.step( stmt_insert_values );
+      sql.reset( stmt_insert_values );
+      k += batch_insert_rows;
+    }
+
+  // and then any remainder, one row at a time
+  
+  while ( k < n ) 
+    {
+      bind_value( stmt_insert_value , 0 , k );
+      sql.step( stmt_insert_value );
+      sql.reset( stmt_insert_value );
+      ++k;
+    }
+  
+  if ( own_transaction ) sql.commit();
+
+  batch.clear();
+  
+}
+
+
 int StratOutDBase::num_values() 
 {
+  flush();
   sql.step( stmt_count_values );
   int n = sql.get_int( stmt_count_values , 0 );
   sql.reset( stmt_count_values );
@@ -810,6 +927,7 @@ int StratOutDBase::num_values()
 
 std::map<int,int> StratOutDBase::count_strata()
 {
+  flush();
   std::map<int,int> ret;
   while ( sql.step( stmt_count_strata ) )
     ret[ sql.get_int( stmt_count_strata , 0 ) ] = sql.get_int(stmt_count_strata , 1 ) ;
@@ -819,6 +937,7 @@ std::map<int,int> StratOutDBase::count_strata()
 
 std::map<int,std::set<int> > StratOutDBase::dump_vars_by_strata()
 {
+  flush();
   std::map<int,std::set<int> > r;
   while ( sql.step( stmt_dump_vars_by_strata ) )
     {
@@ -833,6 +952,7 @@ std::map<int,std::set<int> > StratOutDBase::dump_vars_by_strata()
 
 packets_t StratOutDBase::enumerate( int strata_id )
 {
+  flush();
 
   packets_t packets;
 
@@ -906,6 +1026,7 @@ std::set<int> StratOutDBase::all_matching_cmds( const std::set<std::string> & cm
 
 packets_t StratOutDBase::dump_all() 
 {
+  flush();
   
   packets_t packets;
 
@@ -967,6 +1088,7 @@ packets_t StratOutDBase::dump_all()
 
 packets_t StratOutDBase::dump_indiv( const int indiv_id ) 
 {
+  flush();
   
   packets_t packets;
   
@@ -1027,8 +1149,41 @@ packets_t StratOutDBase::dump_indiv( const int indiv_id )
 }
 
 
+packets_t StratOutDBase::dump_indiv_rows( const int indiv_id ) 
+{
+  flush();
+  
+  packets_t packets;
+  
+  sql.bind_int( stmt_dump_indiv_datapoints , ":indiv_id" , indiv_id );
+  while ( sql.step( stmt_dump_indiv_datapoints ) )
+    {      
+      packet_t packet;
+      packet.indiv_id = sql.get_int( stmt_dump_indiv_datapoints , 0);
+      packet.cmd_id   = sql.get_int( stmt_dump_indiv_datapoints , 1);
+      packet.var_id   = sql.get_int( stmt_dump_indiv_datapoints , 2);
+      bool has_strata = ! sql.is_null( stmt_dump_indiv_datapoints , 3);
+      packet.strata_id = has_strata ? sql.get_int( stmt_dump_indiv_datapoints , 3) : -1;            
+      bool has_tp = ! sql.is_null( stmt_dump_indiv_datapoints , 4); 
+      packet.timepoint_id = has_tp ? sql.get_int( stmt_dump_indiv_datapoints , 4) : -1;
+
+      const std::string type = sql.get_text( stmt_dump_indiv_datapoints , 6 );
+      if      ( type == "integer" ) packet.value = value_t( sql.get_int( stmt_dump_indiv_datapoints , 5) );
+      else if ( type == "real" )    packet.value = value_t( sql.get_double( stmt_dump_indiv_datapoints , 5) );
+      else if ( type == "text" )    packet.value = value_t( sql.get_text( stmt_dump_indiv_datapoints , 5) );
+      else                          packet.value = value_t(); // missing
+      
+      packets.push_back( packet );
+    }
+  sql.reset( stmt_dump_indiv_datapoints );
+  
+  return packets;
+}
+
+
 void StratOutDBase::fetch( int strata_id , int time_mode, packets_t * packets, std::set<int> * indivs_id , std::set<int> * cmds_id , std::set<int> * vars_id )
 {
+  flush();
 
   if ( packets == NULL ) return;
   
@@ -1235,3 +1390,444 @@ retval_t writer_t::dump_to_retval( const std::string & dbname , const std::set<s
   return retval;
 
 }
+
+
+
+void writer_t::replay( const writer_buffer_t & buffer )
+{
+
+  // replay calls buffered by a worker thread, in the order made
+
+  writer_buffer_t::const_iterator ii = buffer.begin();
+  
+  while ( ii != buffer.end() )
+    {
+      
+      switch ( ii->op ) 
+	{
+	case writer_op_t::NUMERIC_FACTOR : numeric_factor( ii->s1 ); break;
+	case writer_op_t::STRING_FACTOR  : string_factor( ii->s1 ); break;
+	case writer_op_t::VAR            : var( ii->s1 , ii->s2 ); break;
+	case writer_op_t::LEVEL          : level( ii->s1 , ii->s2 ); break;
+	case writer_op_t::UNLEVEL        : unlevel( ii->s1 ); break;
+	case writer_op_t::UNLEVEL_ALL    : unlevel(); break;
+	case writer_op_t::EPOCH          : epoch( ii->i ); break;
+	case writer_op_t::INTERVAL       : interval( ii->interval ); break;
+	case writer_op_t::TIMELESS       : timeless(); break;
+	case writer_op_t::VALUE_DBL      : value( ii->s1 , ii->d , ii->s2 ); break;
+	case writer_op_t::VALUE_INT      : value( ii->s1 , ii->i , ii->s2 ); break;
+	case writer_op_t::VALUE_STR      : value( ii->s1 , ii->str , ii->s2 ); break;
+	case writer_op_t::MISSING        : missing_value( ii->s1 , ii->s2 ); break;
+	case writer_op_t::LEVEL_H        : level( level_handle_t( ii->h ) ); break;
+	case writer_op_t::VALUE_DBL_H    : value( var_handle_t( ii->h ) , ii->d ); break;
+	case writer_op_t::VALUE_INT_H    : value( var_handle_t( ii->h ) , ii->i ); break;
+	case writer_op_t::VALUE_STR_H    : value( var_handle_t( ii->h ) , ii->str ); break;
+	case writer_op_t::MISSING_H      : missing_value( var_handle_t( ii->h ) ); break;
+	}
+      
+      ++ii;
+    }
+  
+}
+
+
+
+level_handle_t writer_t::level_handle( const std::string & level_name , const std::string & factor_name )
+{
+  const std::string key = level_name + "." + factor_name;
+  
+  pthread_mutex_lock( &writer_handle_lock );
+  
+  std::map<std::string,int>::const_iterator ii = level_handles_idmap.find( key );
+  
+  int h = -1;
+  if ( ii != level_handles_idmap.end() ) 
+    h = ii->second;
+  else
+    {
+      h = level_handles.size();
+      level_handles.push_back( writer_level_handle_t( level_name , factor_name ) );
+      level_handles_idmap[ key ] = h;
+    }
+  
+  pthread_mutex_unlock( &writer_handle_lock );
+  
+  return level_handle_t( h );
+}
+
+
+var_handle_t writer_t::var_handle( const std::string & var_name , const std::string & var_label )
+{  
+  pthread_mutex_lock( &writer_handle_lock );
+
+  std::map<std::string,int>::const_iterator ii = var_handles_idmap.find( var_name );
+  
+  int h = -1;
+  if ( ii != var_handles_idmap.end() ) 
+    h = ii->second;
+  else
+    {
+      h = var_handles.size();
+      var_handles.push_back( writer_var_handle_t( var_name , var_label ) );
+      var_handles_idmap[ var_name ] = h;
+    }
+
+  // a later label takes precedence over '.'
+  if ( var_label != "." ) var_handles[ h ].var_label = var_label;
+
+  pthread_mutex_unlock( &writer_handle_lock );
+
+  return var_handle_t( h );
+}
+
+
+void writer_t::resolve( writer_level_handle_t & lh )
+{
+  // add factor (as string by default) and level, if needed, as level()
+  
+  if ( factors_idmap.find( lh.factor_name ) == factors_idmap.end() ) 
+    string_factor( lh.factor_name );
+
+  lh.factor = factors[ factors_idmap[ lh.factor_name ] ];
+  
+  std::string level_key = lh.level_name + "." + lh.factor_name ;
+  
+  if ( levels_idmap.find( level_key ) == levels_idmap.end() )
+    {
+      level_t level = db.insert_level( lh.level_name , lh.factor.factor_id );
+      levels_idmap[ level_key ] = level.level_id;
+      levels[ level.level_id ] = level;
+    }
+  
+  lh.level = levels[ levels_idmap[ level_key ] ];
+  lh.level_id = lh.level.level_id;
+}
+
+
+
+void StratOutDBase::colstore_open( const std::string & n )
+{
+  colstore_close( writer );
+  colstore = new colstore_writer_t( n );
+  colstore_filename = n;
+}
+
+
+void StratOutDBase::colstore_close( const writer_t & w )
+{
+  colstore_filename = "";
+  if ( colstore == NULL ) return;
+  flush();
+  colstore->close( w );
+  delete colstore;
+  colstore = NULL;
+}
+
+
+void StratOutDBase::import( colstore_reader_t & reader , const std::vector<int> & blocks )
+{
+
+  // report the source file, not the in-memory DB, as name()
+  colstore_filename = reader.filename;
+
+  begin();
+  
+  //
+  // dictionaries, with their original IDs (replacing the default
+  // factors and root stratum added on attaching)
+  //
+  
+  sql.query( "DELETE FROM factors;" );
+  sql.query( "DELETE FROM levels;" );
+  sql.query( "DELETE FROM strata;" );
+  sql.query( "DELETE FROM commands;" );
+  sql.query( "DELETE FROM variables;" );
+  sql.query( "DELETE FROM individuals;" );
+  sql.query( "DELETE FROM timepoints;" );
+
+  sqlite3_stmt * stmt = sql.prepare( "INSERT INTO factors ( factor_id , factor_name , is_numeric ) values( ? , ? , ? ) ; " );
+  for (int i=0; i<reader.factors.size(); i++)
+    {
+      sql.bind_int( stmt , 1 , reader.factors[i].factor_id );
+      sql.bind_text( stmt , 2 , reader.factors[i].factor_name );
+      sql.bind_int( stmt , 3 , reader.factors[i].is_numeric );
+      sql.step( stmt );
+      sql.reset( stmt );
+    }
+  sql.finalise( stmt );
+
+  stmt = sql.prepare( "INSERT INTO levels ( level_id , factor_id , level_name ) values( ? , ? , ? ) ; " );
+  for (int i=0; i<reader.levels.size(); i++)
+    {
+      sql.bind_int( stmt , 1 , reader.levels[i].level_id );
+      sql.bind_int( stmt , 2 , reader.levels[i].factor_id );
+      sql.bind_text( stmt , 3 , reader.levels[i].level_name );
+      sql.step( stmt );
+      sql.reset( stmt );
+    }
+  sql.finalise( stmt );
+
+  std::map<int,std::vector<int> >::const_iterator ss = reader.strata.begin();
+  while ( ss != reader.strata.end() )
+    {
+      for (int j=0; j<ss->second.size(); j++)
+	{
+	  sql.bind_int( stmt_insert_stratum , ":strata_id" , ss->first );
+	  sql.bind_int( stmt_insert_stratum , ":level_id" , ss->second[j] );
+	  sql.step( stmt_insert_stratum );
+	  sql.reset( stmt_insert_stratum );
+	}
+      ++ss;
+    }
+
+  stmt = sql.prepare( "INSERT INTO commands ( cmd_id , cmd_name , cmd_number , cmd_timestamp , cmd_parameters ) values( ? , ? , ? , ? , ? ) ; " );
+  for (int i=0; i<reader.commands.size(); i++)
+    {
+      sql.bind_int( stmt , 1 , reader.commands[i].cmd_id );
+      sql.bind_text( stmt , 2 , reader.commands[i].cmd_name );
+      sql.bind_int( stmt , 3 , reader.commands[i].cmd_number );
+      sql.bind_text( stmt , 4 , reader.commands[i].timestamp );
+      sql.bind_text( stmt , 5 , reader.commands[i].cmd_parameters );
+      sql.step( stmt );
+      sql.reset( stmt );
+    }
+  sql.finalise( stmt );
+
+  stmt = sql.prepare( "INSERT INTO variables ( variable_id , variable_name , command_name , variable_label ) values( ? , ? , ? , ? ) ; " );
+  for (int i=0; i<reader.variables.size(); i++)
+    {
+      sql.bind_int( stmt , 1 , reader.variables[i].var_id );
+      sql.bind_text( stmt , 2 , reader.variables[i].var_name );
+      sql.bind_text( stmt , 3 , reader.variables[i].cmd_name );
+      sql.bind_text( stmt , 4 , reader.variables[i].var_label );
+      sql.step( stmt );
+      sql.reset( stmt );
+    }
+  sql.finalise( stmt );
+
+  stmt = sql.prepare( "INSERT INTO individuals ( indiv_id , indiv_name , file_name ) values( ? , ? , ? ) ; " );
+  for (int i=0; i<reader.individuals.size(); i++)
+    {
+      sql.bind_int( stmt , 1 , reader.individuals[i].indiv_id );
+      sql.bind_text( stmt , 2 , reader.individuals[i].indiv_name );
+      sql.bind_text( stmt , 3 , reader.individuals[i].file_name );
+      sql.step( stmt );
+      sql.reset( stmt );
+    }
+  sql.finalise( stmt );
+
+  stmt = sql.prepare( "INSERT INTO timepoints ( timepoint_id , epoch , start , stop ) values( ? , ? , ? , ? ) ; " );
+  for (int i=0; i<reader.timepoints.size(); i++)
+    {
+      const timepoint_t & t = reader.timepoints[i];
+      sql.bind_int( stmt , 1 , t.timepoint_id );
+      if ( t.is_epoch() ) sql.bind_int( stmt , 2 , t.epoch ); else sql.bind_null( stmt , 2 );
+      if ( t.is_interval() ) 
+	{
+	  sql.bind_uint64( stmt , 3 , t.start );
+	  sql.bind_uint64( stmt , 4 , t.stop );
+	}
+      else 
+	{
+	  sql.bind_null( stmt , 3 );
+	  sql.bind_null( stmt , 4 );
+	}
+      sql.step( stmt );
+      sql.reset( stmt );
+    }
+  sql.finalise( stmt );
+
+  //
+  // values, for the selected blocks only
+  //
+
+  for (int b=0; b<blocks.size(); b++)
+    {
+      packets_t packets;
+      reader.read( blocks[b] , &packets );
+      for (int k=0; k<packets.size(); k++)
+	{
+	  const packet_t & p = packets[k];
+	  queue_value( p.indiv_id , p.cmd_id , p.var_id , p.strata_id , p.timepoint_id , p.value );
+	}
+    }
+
+  commit();
+
+}
+
+
+bool writer_t::attach_colstore( const std::string & filename )
+{
+  close();
+  attach( ":memory:" );
+  db.colstore_open( filename );
+  return true;
+}
+
+
+bool writer_t::load_colstore( const std::string & filename , const colstore_filter_t * filter )
+{
+  colstore_reader_t reader( filename );
+
+  close();
+  attach( ":memory:" );
+  
+  db.import( reader , filter ? reader.select( *filter ) : std::vector<int>() );
+
+  // and re-read all encodings, as for attach()
+  clear();
+  read_all();
+
+  return true;
+}
+
+
+
+bool writer_t::merge( writer_shard_t & shard , const std::string & indiv_name )
+{
+
+  // copy all values for one individual from a worker's DB, re-coding
+  // commands, variables, strata and timepoints to this writer's IDs
+
+  writer_t & src = shard.src;
+
+  if ( src.individuals_idmap.find( indiv_name ) == src.individuals_idmap.end() ) 
+    return false;
+  
+  const indiv_t & indiv = src.individuals[ src.individuals_idmap[ indiv_name ] ];
+
+  begin();
+
+  id( indiv.indiv_name , indiv.file_name );
+
+  packets_t packets = src.db.dump_indiv_rows( indiv.indiv_id );
+
+  packets_t::const_iterator pp = packets.begin();
+  while ( pp != packets.end() )
+    {
+      db.queue_value( curr_indiv.indiv_id , 
+		      merge_command( shard , pp->cmd_id ) , 
+		      merge_variable( shard , pp->var_id ) , 
+		      pp->strata_id == -1 ? -1 : merge_strata( shard , pp->strata_id ) , 
+		      pp->timepoint_id == -1 ? -1 : merge_timepoint( shard , pp->timepoint_id ) , 
+		      pp->value );
+      ++pp;
+    }
+
+  commit();
+  
+  return true;
+}
+
+
+int writer_t::merge_command( writer_shard_t & shard , const int cmd_id )
+{
+  std::map<int,int>::const_iterator ii = shard.commands.find( cmd_id );
+  if ( ii != shard.commands.end() ) return ii->second;
+
+  const command_t & c = shard.src.commands[ cmd_id ];
+  
+  // as cmd(), but retain the original timestamp
+  std::string command_key = c.cmd_name + "." + Helper::int2str( c.cmd_number );
+  
+  if ( commands_idmap.find( command_key ) == commands_idmap.end() )
+    {
+      command_t command = db.insert_command( c.cmd_name , c.cmd_number , c.timestamp , c.cmd_parameters );
+      commands_idmap[ command_key ] = command.cmd_id;
+      commands[ command.cmd_id ] = command;
+    }
+  
+  return shard.commands[ cmd_id ] = commands_idmap[ command_key ];
+}
+
+
+int writer_t::merge_variable( writer_shard_t & shard , const int var_id )
+{
+  std::map<int,int>::const_iterator ii = shard.variables.find( var_id );
+  if ( ii != shard.variables.end() ) return ii->second;
+  
+  const var_t & v = shard.src.variables[ var_id ];
+
+  std::string var_key = v.cmd_name + ":" + v.var_name;
+
+  if ( variables_idmap.find( var_key ) == variables_idmap.end() )
+    {
+      var_t var = db.insert_variable( v.var_name , v.cmd_name , v.var_label );
+      variables_idmap[ var_key ] = var.var_id;
+      variables[ var.var_id ] = var;
+    }
+
+  return shard.variables[ var_id ] = variables_idmap[ var_key ];
+}
+
+
+int writer_t::merge_strata( writer_shard_t & shard , const int strata_id )
+{
+  std::map<int,int>::const_iterator ii = shard.strata.find( strata_id );
+  if ( ii != shard.strata.end() ) return ii->second;
+  
+  // rebuild this stratum from factor/level names
+  
+  strata_t s;
+
+  const strata_t & src_strata = shard.src.strata[ strata_id ];
+  
+  std::map<factor_t,level_t>::const_iterator ll = src_strata.levels.begin();
+  while ( ll != src_strata.levels.end() )
+    {
+      const std::string & factor_name = ll->first.factor_name;
+      
+      if ( factors_idmap.find( factor_name ) == factors_idmap.end() )
+	{
+	  if ( ll->first.is_numeric ) numeric_factor( factor_name );
+	  else string_factor( factor_name );
+	}
+      
+      const factor_t & factor = factors[ factors_idmap[ factor_name ] ];
+
+      std::string level_key = ll->second.level_name + "." + factor_name ;
+      
+      if ( levels_idmap.find( level_key ) == levels_idmap.end() )
+	{
+	  level_t level = db.insert_level( ll->second.level_name , factor.factor_id );
+	  levels_idmap[ level_key ] = level.level_id;
+	  levels[ level.level_id ] = level;
+	}
+
+      s.insert( levels[ levels_idmap[ level_key ] ] , factor );
+      
+      ++ll;
+    }
+  
+  return shard.strata[ strata_id ] = get_strata_id( s );
+}
+
+
+int writer_t::merge_timepoint( writer_shard_t & shard , const int timepoint_id )
+{
+  std::map<int,int>::const_iterator ii = shard.timepoints.find( timepoint_id );
+  if ( ii != shard.timepoints.end() ) return ii->second;
+  
+  const timepoint_t & t = shard.src.timepoints[ timepoint_id ];
+
+  std::string tp_key = t.is_epoch() ? 
+    Helper::int2str( t.epoch ) + ":" : 
+    ":" + Helper::int2str( t.start ) + "-" + Helper::int2str( t.stop );
+  
+  if ( timepoints_idmap.find( tp_key ) == timepoints_idmap.end() )
+    {
+      timepoint_t timepoint;
+      if ( t.is_epoch() ) 
+	timepoint = db.insert_epoch_timepoint( t.epoch );
+      else
+	{
+	  interval_t interval( t.start , t.stop );
+	  timepoint = db.insert_interval_timepoint( interval );
+	}
+      timepoints_idmap[ tp_key ] = timepoint.timepoint_id;
+      timepoints[ timepoint.timepoint_id ] = timepoint;
+    }
+  
+  return shard.timepoints[ timepoint_id ] = timepoints_idmap[ tp_key ];
+}
@@ -31,6 +31,10 @@
 
 class writer_t;
 extern writer_t writer;
+struct writer_shard_t;
+struct colstore_writer_t;
+struct colstore_reader_t;
+struct colstore_filter_t;
 
 struct value_t;
 struct strata_t;
@@ -285,6 +289,7 @@ struct var_t
   int cmd_id;
   std::string var_name;
   std::string var_label;
+  std::string cmd_name;
   bool operator<( const var_t & rhs ) const 
   { 
     if ( cmd_id == rhs.cmd_id ) return var_id < rhs.var_id; 
@@ -367,6 +372,50 @@ struct packet_t
 
 typedef std::vector<packet_t> packets_t;
 
+
+//
+// Values queued for insertion, stored by column (see StratOutDBase::flush())
+//
+
+struct value_batch_t
+{
+  
+  // value types
+  enum { DBL = 0 , INT = 1 , STR = 2 , MISSING = 3 };
+  
+  int size() const { return indiv_id.size(); } 
+  
+  void clear() 
+  {
+    indiv_id.clear(); cmd_id.clear(); var_id.clear(); strata_id.clear(); timepoint_id.clear();
+    type.clear(); d.clear(); i.clear(); s.clear();
+  }
+  
+  void add( const int indiv , const int cmd , const int var , const int strata , const int timepoint , 
+	    const char t , const double dv , const int iv ) 
+  {
+    indiv_id.push_back( indiv );
+    cmd_id.push_back( cmd );
+    var_id.push_back( var );
+    strata_id.push_back( strata );
+    timepoint_id.push_back( timepoint );
+    type.push_back( t );
+    d.push_back( dv );
+    i.push_back( iv );
+  }
+  
+  std::vector<int> indiv_id;
+  std::vector<int> cmd_id;
+  std::vector<int> var_id;
+  std::vector<int> strata_id;     // -1 for NULL
+  std::vector<int> timepoint_id;  // -1 for NULL
+  std::vector<char> type;
+  std::vector<double> d;
+  std::vector<int> i;             // integer value, or index into s[] for strings
+  std::vector<std::string> s;
+  
+};
+
 //
 // Database with internal cache
 //
@@ -375,7 +424,7 @@ class StratOutDBase {
   
  public:
   
-  StratOutDBase()
+  StratOutDBase() : colstore( NULL )
     {
       
     }
@@ -398,7 +447,7 @@ class StratOutDBase {
   bool attached() { return sql.is_open(); }
   void check_version();
 
-  std::string name() const { return filename; } 
+  std::string name() const { return colstore_filename != "" ? colstore_filename : filename; } 
 
   //
   // Writers
@@ -434,6 +483,9 @@ class StratOutDBase {
   packets_t dump_all();
 
   packets_t dump_indiv( const int indiv_id );
+
+  // all values (incl. missing) for one individual, in insertion order
+  packets_t dump_indiv_rows( const int indiv_id );
   
   std::map<int,std::set<int> > dump_vars_by_strata();
 
@@ -453,8 +505,8 @@ class StratOutDBase {
 
   bool index();
   bool drop_index();
-  void begin() { sql.begin_exclusive(); }
-  void commit() { sql.commit(); }
+  void begin() { flush(); sql.begin_exclusive(); }
+  void commit() { flush(); sql.commit(); }
   
 
   //
@@ -472,6 +524,34 @@ class StratOutDBase {
   command_t insert_command( const std::string & cmd_name , int , const std::string & timedate , const std::string & cmd_param );
   bool      insert_value( const int indiv_id , const int cmd_id , const int variable_id , const int strata_id , const int tp_id , const value_t & x );
 
+  // as insert_value(), but values are queued and written in batches:
+  // anything that reads datapoints, begin(), commit() and dettach() all
+  // flush() the queue first
+  void      queue_value( const int indiv_id , const int cmd_id , const int variable_id , const int strata_id , const int tp_id , const value_t & x );
+  void      queue_value( const int indiv_id , const int cmd_id , const int variable_id , const int strata_id , const int tp_id , const double d )
+  {
+    batch.add( indiv_id , cmd_id , variable_id , strata_id , tp_id , value_batch_t::DBL , d , 0 );
+    if ( batch.size() >= batch_max_rows ) flush();
+  }
+  void      queue_value( const int indiv_id , const int cmd_id , const int variable_id , const int strata_id , const int tp_id , const int i )
+  {
+    batch.add( indiv_id , cmd_id , variable_id , strata_id , tp_id , value_batch_t::INT , 0 , i );
+    if ( batch.size() >= batch_max_rows ) flush();
+  }
+  
+  void      flush();
+
+  //
+  // Columnar output (see colstore.h): if open, flush() writes values
+  // to this file rather than to the datapoints table
+  //
+
+  void      colstore_open( const std::string & filename );
+  void      colstore_close( const writer_t & w );
+
+  // load dictionaries (with their IDs) and the selected blocks from a columnar file
+  void      import( colstore_reader_t & reader , const std::vector<int> & blocks );
+
   // fetchers
 
   
@@ -498,6 +578,7 @@ class StratOutDBase {
   sqlite3_stmt * stmt_insert_variable; 
   sqlite3_stmt * stmt_insert_timepoint;    
   sqlite3_stmt * stmt_insert_value;    
+  sqlite3_stmt * stmt_insert_values; // multi-row, batch_insert_rows at a time
 
   sqlite3_stmt * stmt_dump_factors;	      
   sqlite3_stmt * stmt_dump_levels;	      
@@ -511,6 +592,7 @@ class StratOutDBase {
   sqlite3_stmt * stmt_dump_int_datapoints;
   sqlite3_stmt * stmt_dump_dbl_datapoints;
   sqlite3_stmt * stmt_dump_txt_datapoints;
+  sqlite3_stmt * stmt_dump_indiv_datapoints;
 
   sqlite3_stmt * stmt_count_values;
   sqlite3_stmt * stmt_lookup_value_by_null_strata;
@@ -524,7 +606,24 @@ class StratOutDBase {
   sqlite3_stmt * stmt_match_vars;
   sqlite3_stmt * stmt_match_cmds;
 
+  //
+  // Queued values
+  //
+
+  value_batch_t batch;
+  
+  // flush when this many values are queued
+  static const int batch_max_rows = 8192;
+
+  // rows per multi-row INSERT (6 parameters per row, SQLite's default
+  // limit is 999 parameters per statement)
+  static const int batch_insert_rows = 128;
+
+  void bind_value( sqlite3_stmt * stmt , const int p , const int k );
 
+  colstore_writer_t * colstore;
+  std::string colstore_filename;
+  
 };
 
 
@@ -536,6 +635,74 @@ struct timepoint_t;
 struct value_t;
 struct var_t;
 
+//
+// Buffered writer calls: when a writer_t call is made from a worker
+// thread (see Helper::parallel_for()), it is recorded here instead,
+// and replayed (in a deterministic order) by the main thread
+//
+
+struct writer_op_t
+{
+  enum op_type_t { NUMERIC_FACTOR , STRING_FACTOR , VAR , LEVEL , UNLEVEL , UNLEVEL_ALL , 
+		   EPOCH , INTERVAL , TIMELESS , VALUE_DBL , VALUE_INT , VALUE_STR , MISSING , 
+		   LEVEL_H , VALUE_DBL_H , VALUE_INT_H , VALUE_STR_H , MISSING_H };
+
+  writer_op_t( op_type_t op , const std::string & s1 = "" , const std::string & s2 = "" )
+  : op(op) , s1(s1) , s2(s2) , d(0) , i(0) , h(-1) { } 
+
+  op_type_t op;
+  std::string s1, s2;
+  std::string str;
+  double d;
+  int i;
+  int h; // level or variable handle, for *_H ops
+  interval_t interval;
+};
+
+typedef std::vector<writer_op_t> writer_buffer_t;
+
+
+//
+// Handles for writer_t's fast path: a level (of a factor) or a variable
+// is named once, and thereafter referred to by an integer; handles can
+// be made from worker threads, and are resolved to database IDs on
+// first use
+//
+
+struct level_handle_t 
+{
+  explicit level_handle_t( const int id = -1 ) : id(id) { } 
+  int id;
+};
+
+struct var_handle_t 
+{
+  explicit var_handle_t( const int id = -1 ) : id(id) { } 
+  int id;
+};
+
+struct writer_level_handle_t
+{
+  writer_level_handle_t( const std::string & level_name , const std::string & factor_name ) 
+  : level_name( level_name ) , factor_name( factor_name ) , level_id(-1) { } 
+  std::string level_name;
+  std::string factor_name;
+  int level_id;            // -1 until resolved
+  factor_t factor;
+  level_t level;
+};
+
+struct writer_var_handle_t
+{
+  writer_var_handle_t( const std::string & var_name , const std::string & var_label ) 
+  : var_name( var_name ) , var_label( var_label ) , cmd_id(-1) , var_id(-1) { } 
+  std::string var_name;
+  std::string var_label;
+  int cmd_id;              // command for which var_id was resolved
+  int var_id;             
+};
+
+
 class writer_t 
 {
   
@@ -552,7 +719,7 @@ class writer_t
   // database
   //
 
-  writer_t() { dbless = true; retval = NULL; } 
+  writer_t() { dbless = true; retval = NULL; strata_dirty = true; } 
 
   bool attach( const std::string & filename , bool readonly = false )
   {
@@ -618,9 +785,18 @@ class writer_t
   // open db and send to a retval
   static retval_t dump_to_retval( const std::string & dbname , const std::set<std::string> * = NULL , std::vector<std::string> * ids = NULL );
 
+  // write values to a columnar file (luna -b) rather than to a database; 
+  // encodings are kept in an in-memory database
+  bool attach_colstore( const std::string & filename );
+
+  // read a columnar file into an in-memory database, as if attached: values
+  // only from blocks passing the filter, or none (only encodings) if NULL
+  bool load_colstore( const std::string & filename , const colstore_filter_t * filter );
+
   bool close() 
   { 
     if ( ! attached() ) return false;
+    db.colstore_close( *this );
     clear(); 
     db.dettach();
     return true; 
@@ -638,6 +814,7 @@ class writer_t
   
   bool numeric_factor( const std::string & fac_name )
   {
+    if ( capture ) { capture->push_back( writer_op_t( writer_op_t::NUMERIC_FACTOR , fac_name ) ); return true; }
     if ( factors_idmap.find( fac_name ) == factors_idmap.end() )
       {
 	factor_t factor = db.insert_factor( fac_name , 1 );  // 1 -> numeric factor
@@ -649,6 +826,7 @@ class writer_t
   
   bool string_factor( const std::string & fac_name )
   {
+    if ( capture ) { capture->push_back( writer_op_t( writer_op_t::STRING_FACTOR , fac_name ) ); return true; }
     if ( factors_idmap.find( fac_name ) == factors_idmap.end() )
       {
 	factor_t factor = db.insert_factor( fac_name , 0 ); // 0 -> string factor  
@@ -660,6 +838,7 @@ class writer_t
 
   bool var( const std::string & var_name , const std::string & var_label )
   {
+    if ( capture ) { capture->push_back( writer_op_t( writer_op_t::VAR , var_name , var_label ) ); return true; }
     // use 'command.var' as the unique identifier
     std::string var_key = curr_command.cmd_name + ":" + var_name;
     if ( variables_idmap.find( var_key ) == variables_idmap.end() )
@@ -745,6 +924,7 @@ class writer_t
   
   bool level( const std::string & level_name , const std::string & factor_name )
   {
+    if ( capture ) { capture->push_back( writer_op_t( writer_op_t::LEVEL , level_name , factor_name ) ); return true; }
 
     // add factor (as string by default) if it doesn't already exist
     if ( factors_idmap.find( factor_name ) == factors_idmap.end() ) 
@@ -769,13 +949,14 @@ class writer_t
     level_t level = levels[ levels_idmap[ level_key ] ];
 
     // swap/add to current strata
-    curr_strata.insert( level , factor );
+    set_level( level , factor );
         
     return true;
   }
   
   bool unlevel( const std::string & factor_name )
   {
+    if ( capture ) { capture->push_back( writer_op_t( writer_op_t::UNLEVEL , factor_name ) ); return true; }
     // drop 'factor_name' from current stratification (curr_strata)
 
     // never added / no need to drop
@@ -783,14 +964,17 @@ class writer_t
 
     // drop this level/factor from current strata
     curr_strata.drop( factors_idmap[ factor_name ] );
+    strata_dirty = true;
         
     return true;
   }
   
   bool unlevel() 
   {
+    if ( capture ) { capture->push_back( writer_op_t( writer_op_t::UNLEVEL_ALL ) ); return true; }
     // set curr_strata to 'empty' 
     curr_strata.clear();
+    strata_dirty = true;
     return true;
   }
   
@@ -818,6 +1002,7 @@ class writer_t
   
   bool epoch( const int e )
   {
+    if ( capture ) { capture->push_back( writer_op_t( writer_op_t::EPOCH ) ); capture->back().i = e; return true; }
 
     if ( e == -1 ) 
       {
@@ -849,6 +1034,7 @@ class writer_t
   
   bool interval( const interval_t & interval )
   {
+    if ( capture ) { capture->push_back( writer_op_t( writer_op_t::INTERVAL ) ); capture->back().interval = interval; return true; }
     
     if ( interval.start == 0 && interval.stop == 0 )
       {
@@ -881,6 +1067,7 @@ class writer_t
   
   bool timeless() 
   {
+    if ( capture ) { capture->push_back( writer_op_t( writer_op_t::TIMELESS ) ); return true; }
     unlevel( globals::epoch_strat );
     unlevel( globals::time_strat );    
     // set to timeless
@@ -894,6 +1081,7 @@ class writer_t
 
   bool value( const std::string & var_name , double d , const std::string & desc = "" )
   {    
+    if ( capture ) { capture->push_back( writer_op_t( writer_op_t::VALUE_DBL , var_name , desc ) ); capture->back().d = d; return true; } 
     if ( retval != NULL ) return to_retval( var_name , d );
     else if ( dbless ) return to_stdout( var_name , value_t( d ) ) ;
     if ( desc != "" ) var( var_name , desc );
@@ -902,6 +1090,7 @@ class writer_t
 
   bool value( const std::string & var_name , int i , const std::string & desc = "" ) 
   { 
+    if ( capture ) { capture->push_back( writer_op_t( writer_op_t::VALUE_INT , var_name , desc ) ); capture->back().i = i; return true; } 
     if ( retval != NULL ) return to_retval( var_name , i ); 
     else if ( dbless ) return to_stdout( var_name , value_t( i ) ) ; 
     if ( desc != "" ) var( var_name , desc ); 
@@ -910,6 +1099,7 @@ class writer_t
   
   bool value( const std::string & var_name , const std::string & s , const std::string & desc = "" )
   {
+    if ( capture ) { capture->push_back( writer_op_t( writer_op_t::VALUE_STR , var_name , desc ) ); capture->back().str = s; return true; }
     if ( retval != NULL ) return to_retval( var_name , s );
     if ( dbless ) return to_stdout( var_name , value_t( s ) ); 
     if ( desc != "" ) var( var_name , desc );
@@ -918,6 +1108,7 @@ class writer_t
   
   bool missing_value( const std::string & var_name , const std::string & desc = "" )
   {
+    if ( capture ) { capture->push_back( writer_op_t( writer_op_t::MISSING , var_name , desc ) ); return true; }
     if ( retval != NULL ) return to_retval( var_name ); // missing value 
     if ( dbless ) return to_stdout( var_name , value_t() ); 
     if ( desc != "" ) var( var_name , desc );
@@ -943,21 +1134,86 @@ class writer_t
         variables[ var.var_id ] = var;
       }      
 
-    // check curr_strata is registered; add to DB if not
-    curr_strata.strata_id = get_strata_id( curr_strata );    
-
     // store value    
-    db.insert_value( curr_indiv.indiv_id , 
-		     curr_command.cmd_id , 	
-		     variables_idmap[ var_key ] , 		     
-		     curr_strata.empty() ? -1 : curr_strata.strata_id , 
-		     curr_timepoint.none() ? -1 : curr_timepoint.timepoint_id , 
-		     x );
+    db.queue_value( curr_indiv.indiv_id , 
+		    curr_command.cmd_id , 	
+		    variables_idmap[ var_key ] , 		     
+		    curr_strata_id() , 
+		    curr_timepoint.none() ? -1 : curr_timepoint.timepoint_id , 
+		    x );
     
     return true;
   }
 
 
+  //
+  // Handle-based fast path: as level() and value() above, but
+  // referring to levels and variables by handles (each of which
+  // should be made once, e.g. outside of a loop over epochs and
+  // frequencies)
+  //
+
+  level_handle_t level_handle( const std::string & level_name , const std::string & factor_name );
+
+  level_handle_t level_handle( const int level_name , const std::string & factor_name )
+  { return level_handle( Helper::int2str( level_name ) , factor_name ); }
+  
+  level_handle_t level_handle( const double level_name , const std::string & factor_name )
+  { return level_handle( Helper::dbl2str( level_name ) , factor_name ); }
+
+  // variables are specific to the current command when the value is written
+  var_handle_t var_handle( const std::string & var_name , const std::string & var_label = "." );
+  
+  bool level( const level_handle_t & h )
+  {
+    if ( capture ) { capture->push_back( writer_op_t( writer_op_t::LEVEL_H ) ); capture->back().h = h.id; return true; }
+    writer_level_handle_t & lh = level_handles[ h.id ];
+    if ( lh.level_id == -1 ) resolve( lh );
+    set_level( lh.level , lh.factor );
+    return true;
+  }
+  
+  bool value( const var_handle_t & h , double d )
+  {
+    if ( capture ) { capture->push_back( writer_op_t( writer_op_t::VALUE_DBL_H ) ); capture->back().h = h.id; capture->back().d = d; return true; } 
+    if ( retval != NULL ) return to_retval( var_handles[ h.id ].var_name , d );
+    if ( dbless ) return to_stdout( var_handles[ h.id ].var_name , value_t( d ) );
+    db.queue_value( curr_indiv.indiv_id , curr_command.cmd_id , var_id( h ) , curr_strata_id() , 
+		    curr_timepoint.none() ? -1 : curr_timepoint.timepoint_id , d );
+    return true;
+  }
+
+  bool value( const var_handle_t & h , int i )
+  {
+    if ( capture ) { capture->push_back( writer_op_t( writer_op_t::VALUE_INT_H ) ); capture->back().h = h.id; capture->back().i = i; return true; } 
+    if ( retval != NULL ) return to_retval( var_handles[ h.id ].var_name , i );
+    if ( dbless ) return to_stdout( var_handles[ h.id ].var_name , value_t( i ) );
+    db.queue_value( curr_indiv.indiv_id , curr_command.cmd_id , var_id( h ) , curr_strata_id() , 
+		    curr_timepoint.none() ? -1 : curr_timepoint.timepoint_id , i );
+    return true;
+  }
+
+  bool value( const var_handle_t & h , const std::string & s )
+  {
+    if ( capture ) { capture->push_back( writer_op_t( writer_op_t::VALUE_STR_H ) ); capture->back().h = h.id; capture->back().str = s; return true; } 
+    if ( retval != NULL ) return to_retval( var_handles[ h.id ].var_name , s );
+    if ( dbless ) return to_stdout( var_handles[ h.id ].var_name , value_t( s ) );
+    db.queue_value( curr_indiv.indiv_id , curr_command.cmd_id , var_id( h ) , curr_strata_id() , 
+		    curr_timepoint.none() ? -1 : curr_timepoint.timepoint_id , value_t( s ) );
+    return true;
+  }
+
+  bool missing_value( const var_handle_t & h )
+  {
+    if ( capture ) { capture->push_back( writer_op_t( writer_op_t::MISSING_H ) ); capture->back().h = h.id; return true; } 
+    if ( retval != NULL ) return to_retval( var_handles[ h.id ].var_name );
+    if ( dbless ) return to_stdout( var_handles[ h.id ].var_name , value_t() );
+    db.queue_value( curr_indiv.indiv_id , curr_command.cmd_id , var_id( h ) , curr_strata_id() , 
+		    curr_timepoint.none() ? -1 : curr_timepoint.timepoint_id , value_t() );
+    return true;
+  }
+
+
   bool to_stdout( const std::string & var_name , const value_t & x )  
   {
     std::cout << curr_indiv.indiv_name << "\t"
@@ -1040,6 +1296,22 @@ class writer_t
 
 
   
+  //
+  // buffering of calls made from worker threads
+  //
+
+  static __thread writer_buffer_t * capture;
+  
+  void replay( const writer_buffer_t & buffer );
+
+
+  //
+  // merging of per-worker output databases (luna -j N)
+  //
+
+  bool merge( writer_shard_t & shard , const std::string & indiv_name );
+
+
   //
   // readers
   //
@@ -1086,8 +1358,13 @@ class writer_t
     timepoints.clear();  timepoints_idmap.clear();
     strata.clear();      strata_idmap.clear();
     
+    // handles remain valid, but must be re-resolved against a new DB
+    for (int h=0; h<level_handles.size(); h++) level_handles[h].level_id = -1;
+    for (int h=0; h<var_handles.size(); h++) var_handles[h].cmd_id = var_handles[h].var_id = -1;
+
     curr_indiv.clear();
     curr_strata.clear();
+    strata_dirty = true;
     curr_timepoint.timeless();
     curr_command.clear();
   }
@@ -1118,9 +1395,57 @@ class writer_t
   command_t     curr_command;
   strata_t      curr_strata;
   timepoint_t   curr_timepoint;  
+
+  // strata_id of curr_strata, valid unless strata_dirty
+  bool          strata_dirty;
+
+  int curr_strata_id()
+  {
+    if ( strata_dirty ) 
+      {
+	// check curr_strata is registered; add to DB if not
+	curr_strata.strata_id = get_strata_id( curr_strata );
+	strata_dirty = false;
+      }
+    return curr_strata.empty() ? -1 : curr_strata.strata_id;
+  }
+
+  void set_level( const level_t & level , const factor_t & factor )
+  {
+    // no change to the current strata?
+    std::map<factor_t,level_t>::const_iterator ff = curr_strata.levels.find( factor );
+    if ( ff != curr_strata.levels.end() && ff->second.level_id == level.level_id ) return;
+    curr_strata.insert( level , factor );
+    strata_dirty = true;
+  }
+
+  // handles (indexed by level_handle_t::id and var_handle_t::id)
+  std::vector<writer_level_handle_t> level_handles;
+  std::vector<writer_var_handle_t> var_handles;
+  std::map<std::string,int> level_handles_idmap;
+  std::map<std::string,int> var_handles_idmap;
   
+  void resolve( writer_level_handle_t & );
+
+  int var_id( const var_handle_t & h )
+  {
+    writer_var_handle_t & vh = var_handles[ h.id ];
+    if ( vh.var_id == -1 || vh.cmd_id != curr_command.cmd_id ) 
+      {
+	var( vh.var_name , vh.var_label );
+	vh.var_id = variables_idmap[ curr_command.cmd_name + ":" + vh.var_name ];
+	vh.cmd_id = curr_command.cmd_id;
+      }
+    return vh.var_id;
+  }
  
   
+  // map encodings from a shard to this writer (see merge())
+  int merge_command( writer_shard_t & shard , const int cmd_id );
+  int merge_variable( writer_shard_t & shard , const int var_id );
+  int merge_strata( writer_shard_t & shard , const int strata_id );
+  int merge_timepoint( writer_shard_t & shard , const int timepoint_id );
+
   // helper functions
   std::string timestamp()
     {
@@ -1134,4 +1459,32 @@ class writer_t
 };
 
 
+//
+// A completed output database written by one worker process (luna -j
+// N), attached read-only; the maps track which encodings (commands,
+// variables, strata, timepoints) have already been copied to the
+// primary writer_t, and under which IDs
+//
+
+struct writer_shard_t
+{
+  
+  writer_shard_t( const std::string & filename ) : filename( filename ) 
+  {
+    const bool IS_READONLY = true;
+    src.attach( filename , IS_READONLY );
+  }
+  
+  std::string filename;
+
+  writer_t src;
+
+  std::map<int,int> commands;
+  std::map<int,int> variables;
+  std::map<int,int> strata;
+  std::map<int,int> timepoints;
+  
+};
+
+
 #endif
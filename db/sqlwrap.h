@@ -99,6 +99,9 @@ class SQL {
   void begin_exclusive();
   void commit();
 
+  // true if not inside a BEGIN ... COMMIT
+  bool autocommit() { return sqlite3_get_autocommit( db ); }
+
   uint64_t last_insert_rowid()
     { return sqlite3_last_insert_rowid(db); }
   
@@ -109,6 +112,14 @@ class SQL {
   void bind_blob( sqlite3_stmt * stmt , const std::string index , blob & );
   void bind_null( sqlite3_stmt * stmt , const std::string index );
 
+  // by (1-based) parameter position
+  void bind_int( sqlite3_stmt * stmt , const int index , int value ) { sqlite3_bind_int( stmt , index , value ); } 
+  void bind_uint64( sqlite3_stmt * stmt , const int index , uint64_t value ) { sqlite3_bind_int64( stmt , index , value ); } 
+  void bind_double( sqlite3_stmt * stmt , const int index , double value ) { sqlite3_bind_double( stmt , index , value ); } 
+  void bind_text( sqlite3_stmt * stmt , const int index , const std::string & value ) 
+  { sqlite3_bind_text( stmt , index , value.c_str() , value.size() , SQLITE_TRANSIENT ); } 
+  void bind_null( sqlite3_stmt * stmt , const int index ) { sqlite3_bind_null( stmt , index ); } 
+
   int get_int( sqlite3_stmt *, int );
   uint64_t get_uint64( sqlite3_stmt *, int );
   double get_double( sqlite3_stmt *, int );
@@ -63,12 +63,18 @@ bool globals::assume_pm_starttime;
 std::string globals::current_tag;
 std::string globals::indiv_wildcard;
 bool globals::skip_edf_annots;
+bool globals::edf_mmap;
+bool globals::fftw_measure;
+std::string globals::fftw_wisdom;
+int globals::threads;
+int globals::spectral_cache_mb;
 
 std::set<std::string> globals::excludes;
 
 int globals::sample_list_min;
 int globals::sample_list_max;
 std::string globals::sample_list_id;
+int globals::sample_list_jobs;
 
 std::string globals::edf_timetrack_label;
 int globals::edf_timetrack_size;
@@ -315,6 +321,16 @@ void globals::init_defs()
 
   skip_edf_annots = false;
 
+  edf_mmap = false;
+
+  fftw_measure = false;
+
+  fftw_wisdom = "";
+
+  threads = 1;
+
+  spectral_cache_mb = 256;
+
   current_tag = "";
 
   indiv_wildcard = "^";
@@ -322,6 +338,7 @@ void globals::init_defs()
   sample_list_min = -1;
   sample_list_max = -1;
   sample_list_id = "";
+  sample_list_jobs = 1;
 
   assume_pm_starttime = true;
   
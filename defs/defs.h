@@ -102,6 +102,16 @@ struct globals
   
   static bool skip_edf_annots;
 
+  static bool edf_mmap;
+
+  static bool fftw_measure;
+
+  static std::string fftw_wisdom;
+
+  static int threads;
+
+  static int spectral_cache_mb;
+
   static bool remap_nsrr_annots;
 
   //
@@ -138,6 +148,9 @@ struct globals
   static int sample_list_max;
   static std::string sample_list_id;
 
+  // number of worker processes over the sample-list (luna -j N)
+  static int sample_list_jobs;
+
   // enforce or not the 30-second epoch check
   static bool enforce_epoch_check;
 
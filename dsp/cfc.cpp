@@ -168,7 +168,7 @@ void dsptools::cfc( edf_t & edf , param_t & param )
 	  // Fetch data slice
 	  //
 	  
-	  slice_t slice( edf , signals(s) , interval );
+	  slice_t slice( edf , signals(s) , interval , 1 , false );
 	  
 	  const std::vector<double> * signal = slice.pdata();
 
@@ -40,6 +40,199 @@ extern logger_t logger;
 #include <cmath>
 
 
+//
+// Band-level summaries and (optionally) frequency-bin output for one pair 
+//
+
+static void coherence_output( const coh_t & coh , bool spectrum , double upper_freq , bool norms = true )
+{
+
+  const int sz = coh.frq.size();
+
+  const frequency_band_t bands[] = { SLOW , DELTA , THETA , ALPHA , SIGMA , BETA };
+
+  for (int b=0;b<6;b++)
+    {
+      double c = 0 , n = 0;
+      
+      for (int k=0;k<sz;k++)
+	{
+	  if ( coh.frq[k] >= globals::freq_band[ bands[b] ].first 
+	       && coh.frq[k] < globals::freq_band[ bands[b] ].second ) 
+	    {
+	      c += coh.coh[k];
+	      n++;
+	    }
+	}
+
+      if ( n ) c /= (double)n;
+      
+      writer.level( globals::band( bands[b] ) , globals::band_strat );
+      writer.value( "COH" , c );
+    }
+
+  writer.unlevel( globals::band_strat );
+
+  if ( ! spectrum ) return;
+
+  for (int k=0;k<sz;k++)
+    {
+      if ( upper_freq < 0 || coh.frq[k] <= upper_freq )
+	{
+	  writer.level( coh.frq[k] , globals::freq_strat );
+	  writer.value( "COH" , coh.coh[k] );
+	  writer.value( "CSPEC" , coh.cross_spectrum[k] );
+	  writer.value( "ASPEC1" , coh.auto_spectrum1[k] );
+	  writer.value( "ASPEC2" , coh.auto_spectrum2[k] );
+	  if ( norms ) 
+	    {
+	      writer.value( "CSPEC.N1" , coh.cross_norm1[k] );
+	      writer.value( "CSPEC.N2" , coh.cross_norm2[k] );
+	    }
+	}
+    }
+  
+  writer.unlevel( globals::freq_strat );
+  
+}
+
+
+//
+// All pairs from one cross-spectral matrix (per epoch, or for the whole
+// trace), i.e. each channel is sliced and transformed once, rather than
+// once for every pair it is part of; channels must have the same SR.
+// For the whole trace, only the records spanned by each chunk of
+// segments are sliced at any one time
+//
+
+static void coherence_all_pairs( edf_t & edf , const signal_list_t & signals , 
+				 const std::vector<int> & chs , 
+				 bool epoched , bool show_spectrum , double upper_freq )
+{
+
+  const int nc = chs.size();
+
+  // as for coherence_t in dsptools::coherence()
+  const int Fs = edf.header.sampling_freq( signals( chs[0] ) );
+  const double segment_sec = 5; 
+  const double overlap_sec = 0;
+  const bool average_adj = false;
+  const bool detrend = false;
+
+  std::vector<std::string> labels( nc );
+  for (int c=0;c<nc;c++) labels[c] = signals.label( chs[c] );
+
+  std::vector<slice_t*> slices( nc );
+  std::vector<const std::vector<double>*> d( nc );
+
+  int a = 0 , b = 0;
+
+  //
+  // Whole trace
+  //
+  
+  if ( ! epoched ) 
+    {
+
+      // retained records, in order; all channels have the same number
+      // of samples per record
+      
+      std::vector<int> recs;
+      int r = edf.timeline.first_record();
+      while ( r != -1 ) 
+	{
+	  recs.push_back( r );
+	  r = edf.timeline.next_record( r );
+	}
+      
+      const int nsamp = edf.header.n_samples[ signals( chs[0] ) ];
+      
+      coherence_matrix_t cm( nc , recs.size() * nsamp , Fs , 
+			     segment_sec , overlap_sec , 
+			     WINDOW_HANN , average_adj , detrend );
+      
+      while ( cm.next_chunk( &a , &b ) ) 
+	{
+	  
+	  const int r1 = a / nsamp;
+	  const int r2 = ( b - 1 ) / nsamp;
+	  
+	  interval_t interval( edf.timeline.record2interval( recs[r1] ).start , 
+			       edf.timeline.record2interval( recs[r2] ).stop + 1LLU );
+	  
+	  for (int c=0;c<nc;c++)
+	    {
+	      slices[c] = new slice_t( edf , signals( chs[c] ) , interval , 1 , false );
+	      d[c] = slices[c]->pdata();
+	    }
+	  
+	  cm.accumulate( d , r1 * nsamp );
+	  
+	  for (int c=0;c<nc;c++) delete slices[c];
+	}
+      
+      cm.finalize();
+      
+      for (int k=0;k<cm.npairs();k++)
+	{
+	  writer.level( labels[ cm.first(k) ] + "_x_" + labels[ cm.second(k) ] , "CHS" );
+	  coherence_output( cm.res[k] , true , upper_freq );
+	}
+      
+      writer.unlevel( "CHS" );
+
+      return;
+    }
+
+  
+  //
+  // Epoch-by-epoch
+  //
+
+  edf.timeline.first_epoch();
+
+  while ( 1 ) 
+    {
+      
+      int epoch = edf.timeline.next_epoch();      
+      if ( epoch == -1 ) break;
+      interval_t interval = edf.timeline.epoch( epoch );
+      
+      for (int c=0;c<nc;c++)
+	{
+	  slices[c] = new slice_t( edf , signals( chs[c] ) , interval , 1 , false );
+	  d[c] = slices[c]->pdata();
+	}
+      
+      coherence_matrix_t cm( nc , d[0]->size() , Fs , 
+			     segment_sec , overlap_sec , 
+			     WINDOW_HANN , average_adj , detrend );
+      
+      while ( cm.next_chunk( &a , &b ) )
+	cm.accumulate( d , 0 );
+
+      cm.finalize();
+      
+      for (int c=0;c<nc;c++) delete slices[c];
+      
+      writer.epoch( edf.timeline.display_epoch( epoch ) );
+      
+      for (int k=0;k<cm.npairs();k++)
+	{
+	  writer.level( labels[ cm.first(k) ] + "_x_" + labels[ cm.second(k) ] , "CHS" );
+	  coherence_output( cm.res[k] , show_spectrum , upper_freq );
+	}
+      
+      writer.unlevel( "CHS" );
+      
+    }
+
+  writer.unepoch();
+  
+}
+
+
+
 void dsptools::coherence( edf_t & edf , param_t & param , bool legacy )
 {
   
@@ -84,9 +277,34 @@ void dsptools::coherence( edf_t & edf , param_t & param , bool legacy )
   
 
   //
-  // Ensure similar sampling rates
+  // Default: all pairs from a shared cross-spectral matrix, if all
+  // channels have the same sampling rate
   //
+
+  if ( ! legacy )
+    {
+      std::vector<int> chs;
+      bool same_sr = true;
+      for (int s=0;s<ns;s++)
+	{
+	  if ( edf.header.is_annotation_channel( signals(s) ) ) continue;
+	  if ( chs.size() && edf.header.sampling_freq( signals(s) ) != edf.header.sampling_freq( signals(chs[0]) ) )
+	    same_sr = false;
+	  chs.push_back( s );
+	}
+      
+      if ( same_sr && chs.size() > 1 ) 
+	{
+	  coherence_all_pairs( edf , signals , chs , epoched , show_spectrum , upper_freq );
+	  return;
+	}
+    }
+
   
+  //
+  // Otherwise (legacy, or mixed sampling rates), pair by pair
+  //
+
   for (int i=0;i<ns-1;i++)
     {
       
@@ -100,12 +318,11 @@ void dsptools::coherence( edf_t & edf , param_t & param , bool legacy )
 	  if ( epoched ) 
 	    {
 	      
-	      int epoch = edf.timeline.first_epoch();      
-
 	      const int sr1 = edf.header.sampling_freq( signals(i) );
 	      const int sr2 = edf.header.sampling_freq( signals(j) );	      
 	      if ( sr1 != sr2 ) Helper::halt( "'COH epoch' requires similiar sampling rates (or specify, e.g., sr=200)" );
-
+	      
+	      edf.timeline.first_epoch();      
 	      
 	      // stratify output by SIGNALS
 	      writer.level( signals.label(i) + "_x_" + signals.label(j) , "CHS" );
@@ -117,137 +334,12 @@ void dsptools::coherence( edf_t & edf , param_t & param , bool legacy )
 		  if ( epoch == -1 ) break;
 		  interval_t interval = edf.timeline.epoch( epoch );
 
-// 		  slice_t slice1( edf , signals(i) , interval );
-// 		  slice_t slice2( edf , signals(j) , interval );
-		  
-// 		  const std::vector<double> * d1 = slice1.pdata();
-// 		  const std::vector<double> * d2 = slice2.pdata();
-
 		  coh_t coh = dsptools::coherence( edf , signals(i) , signals(j) , interval , legacy );
 		  
-		  //
-		  // Summarize into bands
-		  //
-
-		  double coh_slow = 0 , 
-		    coh_delta = 0 , 
-		    coh_theta = 0 , 
-		    coh_alpha = 0 , 
-		    coh_sigma = 0 , 
-		    coh_beta = 0; 
-		  
-		  double n_slow = 0 , 
-		    n_delta = 0 , 
-		    n_theta = 0 , 
-		    n_alpha = 0 , 
-		    n_sigma = 0 , 
-		    n_beta = 0; 
-		  
-		  int sz = coh.frq.size();
-
-		  for (int k=0;k<sz;k++)
-		    {
-		      
-		      if ( coh.frq[k] >= globals::freq_band[ SLOW ].first 
-			   && coh.frq[k] < globals::freq_band[ SLOW ].second ) 
-			{			  
-			  coh_slow += coh.coh[k];
-			  n_slow++;
-			}
-
-		      if ( coh.frq[k] >= globals::freq_band[ DELTA ].first 
-			   && coh.frq[k] < globals::freq_band[ DELTA ].second ) 
-			{
-			  coh_delta += coh.coh[k];
-			  n_delta++;
-			}
-		      
-		      if ( coh.frq[k] >= globals::freq_band[ THETA ].first 
-			   && coh.frq[k] < globals::freq_band[ THETA ].second ) 
-			{
-			  coh_theta += coh.coh[k];
-			  n_theta++;
-			}
-
-		      if ( coh.frq[k] >= globals::freq_band[ ALPHA ].first 
-			   && coh.frq[k] < globals::freq_band[ ALPHA ].second ) 
-			{
-			  coh_alpha += coh.coh[k];
-			  n_alpha++;
-			}
-
-		      if ( coh.frq[k] >= globals::freq_band[ SIGMA ].first 
-			   && coh.frq[k] < globals::freq_band[ SIGMA ].second ) 
-			{
-			  coh_sigma += coh.coh[k];
-			  n_sigma++;
-			}
-
-		      if ( coh.frq[k] >= globals::freq_band[ BETA ].first 
-			   && coh.frq[k] < globals::freq_band[ BETA ].second ) 
-			{
-			  coh_beta += coh.coh[k];
-			  n_beta++;
-			}
-		      
-		    }
-		  
-		  if ( n_slow  ) coh_slow /= (double)n_slow;
-		  if ( n_delta ) coh_delta /= (double)n_delta; 
-		  if ( n_theta ) coh_theta /= (double)n_theta;
-		  if ( n_alpha ) coh_alpha /= (double)n_alpha; 
-		  if ( n_sigma ) coh_sigma /= (double)n_sigma;
-		  if ( n_beta ) coh_beta /= (double)n_beta;
-
 		  writer.epoch( edf.timeline.display_epoch( epoch ) );		  				
 
-		  writer.level( globals::band( SLOW ) , globals::band_strat );
-		  writer.value( "COH" , coh_slow );
-
-		  writer.level( globals::band( DELTA ) , globals::band_strat );
-		  writer.value( "COH" , coh_delta );
-
-		  writer.level( globals::band( THETA ) , globals::band_strat );
-		  writer.value( "COH" , coh_theta );
-
-		  writer.level( globals::band( ALPHA ) , globals::band_strat );
-		  writer.value( "COH" , coh_alpha );
-
-		  writer.level( globals::band( SIGMA ) , globals::band_strat );
-		  writer.value( "COH" , coh_sigma );
-
-		  writer.level( globals::band( BETA ) , globals::band_strat );
-		  writer.value( "COH" , coh_beta );
+		  coherence_output( coh , show_spectrum , upper_freq , ! legacy );
 
-		  writer.unlevel( globals::band_strat );
-		  
-
-		  if ( show_spectrum )
-		    {
-		      
-		      for (int k=0;k<sz;k++)
-			{
-			  if ( upper_freq < 0 || coh.frq[k] <= upper_freq )
-			    {
-			      writer.level( coh.frq[k] , globals::freq_strat );			  
-			      writer.value( "COH" , coh.coh[k] );
-			      writer.value( "COH" , coh.coh[k] );
-			      writer.value( "CSPEC" , coh.cross_spectrum[k] );
-			      writer.value( "ASPEC1" , coh.auto_spectrum1[k] );
-			      writer.value( "ASPEC2" , coh.auto_spectrum2[k] );
-			      
-			      if ( ! legacy )
-				{
-				  writer.value( "CSPEC.N1" , coh.cross_norm1[k] );
-				  writer.value( "CSPEC.N2" , coh.cross_norm2[k] );
-				}
-			    }
-			}
-		      
-		      writer.unlevel( globals::freq_strat );
-		      
-		    } // end of epoch-spectrum level output
-		  
 		} // next epoch
 	      
 	      writer.unlevel( "CHS" );
@@ -263,127 +355,10 @@ void dsptools::coherence( edf_t & edf , param_t & param , bool legacy )
 
 	      coh_t coh = coherence( edf , signals(i) , signals(j) , edf.timeline.wholetrace() , legacy  );
 	      
-	      int sz = coh.frq.size();
-	      
 	      writer.level( signals.label(i) + "_x_" + signals.label(j) , "CHS" );
 	      
-	      //
-	      // Band-level summaries
-	      //
+	      coherence_output( coh , true , upper_freq , ! legacy );
 
-	      double coh_slow = 0 , 
-		coh_delta = 0 , 
-		coh_theta = 0 , 
-		coh_alpha = 0 , 
-		coh_sigma = 0 , 
-		coh_beta = 0; 
-		  
-	      double n_slow = 0 , 
-		n_delta = 0 , 
-		n_theta = 0 , 
-		n_alpha = 0 , 
-		n_sigma = 0 , 
-		n_beta = 0; 
-		  
-	      for (int k=0;k<sz;k++)
-		{
-		  
-		  if ( coh.frq[k] >= globals::freq_band[ SLOW ].first 
-		       && coh.frq[k] < globals::freq_band[ SLOW ].second ) 
-		    {			  
-		      coh_slow += coh.coh[k];
-		      n_slow++;
-		    }
-		  
-		  if ( coh.frq[k] >= globals::freq_band[ DELTA ].first 
-		       && coh.frq[k] < globals::freq_band[ DELTA ].second ) 
-		    {
-		      coh_delta += coh.coh[k];
-		      n_delta++;
-		    }
-		  
-		  if ( coh.frq[k] >= globals::freq_band[ THETA ].first 
-		       && coh.frq[k] < globals::freq_band[ THETA ].second ) 
-		    {
-		      coh_theta += coh.coh[k];
-		      n_theta++;
-		    }
-		  
-		  if ( coh.frq[k] >= globals::freq_band[ ALPHA ].first 
-		       && coh.frq[k] < globals::freq_band[ ALPHA ].second ) 
-		    {
-		      coh_alpha += coh.coh[k];
-		      n_alpha++;
-		    }
-		  
-		  if ( coh.frq[k] >= globals::freq_band[ SIGMA ].first 
-		       && coh.frq[k] < globals::freq_band[ SIGMA ].second ) 
-		    {
-		      coh_sigma += coh.coh[k];
-		      n_sigma++;
-		    }
-		  
-		  if ( coh.frq[k] >= globals::freq_band[ BETA ].first 
-		       && coh.frq[k] < globals::freq_band[ BETA ].second ) 
-		    {
-		      coh_beta += coh.coh[k];
-		      n_beta++;
-		    }
-		  
-		}
-	      
-	      if ( n_slow  ) coh_slow /= (double)n_slow;
-	      if ( n_delta ) coh_delta /= (double)n_delta; 
-	      if ( n_theta ) coh_theta /= (double)n_theta;
-	      if ( n_alpha ) coh_alpha /= (double)n_alpha; 
-	      if ( n_sigma ) coh_sigma /= (double)n_sigma;
-	      if ( n_beta ) coh_beta /= (double)n_beta;
-
-	      writer.level( globals::band( SLOW ) , globals::band_strat );
-	      writer.value( "COH" , coh_slow );
-
-	      writer.level( globals::band( DELTA ) , globals::band_strat );
-	      writer.value( "COH" , coh_delta );
-	      
-	      writer.level( globals::band( THETA ) , globals::band_strat );
-	      writer.value( "COH" , coh_theta );
-
-	      writer.level( globals::band( ALPHA ) , globals::band_strat );
-	      writer.value( "COH" , coh_alpha );
-
-	      writer.level( globals::band( SIGMA ) , globals::band_strat );
-	      writer.value( "COH" , coh_sigma );
-
-	      writer.level( globals::band( BETA ) , globals::band_strat );
-	      writer.value( "COH" , coh_beta );
-
-	      writer.unlevel( globals::band_strat );
-		  
-
-	      //
-	      // Frequency-bin level output
-	      //
-
-	      for (int k=0;k<sz;k++)
-		{
-		  if ( upper_freq < 0 || coh.frq[k] <= upper_freq )
-		    {
-		      writer.level( coh.frq[k] , globals::freq_strat );
-		      writer.value( "COH" , coh.coh[k] );
-		      writer.value( "CSPEC" , coh.cross_spectrum[k] );
-		      writer.value( "ASPEC1" , coh.auto_spectrum1[k] );
-		      writer.value( "ASPEC2" , coh.auto_spectrum2[k] );
-
-		      if ( ! legacy )
-			{
-			  writer.value( "CSPEC.N1" , coh.cross_norm1[k] );
-			  writer.value( "CSPEC.N2" , coh.cross_norm2[k] );
-			}
-
-		    }		  
-		}
-
-	      writer.unlevel( globals::freq_strat );
 	      writer.unlevel( "CHS" );
 
 	    }
@@ -602,8 +577,8 @@ coh_t dsptools::coherence( edf_t & edf , const int signal1 , const int signal2 ,
   // extract signals
   //
   
-  slice_t slice1( edf , signal1 , interval );    
-  slice_t slice2( edf , signal2 , interval );    
+  slice_t slice1( edf , signal1 , interval , 1 , false );    
+  slice_t slice2( edf , signal2 , interval , 1 , false );    
   
   const std::vector<double> * d1 = slice1.pdata();
   const std::vector<double> * d2 = slice2.pdata();
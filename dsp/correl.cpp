@@ -139,8 +139,8 @@ void dsptools::correlate_channels( edf_t & edf , param_t & param )
 
 		  interval_t interval = edf.timeline.epoch( epoch );
 
- 		  slice_t slice1( edf , signals(i) , interval );
- 		  slice_t slice2( edf , signals(j) , interval );
+ 		  slice_t slice1( edf , signals(i) , interval , 1 , false );
+ 		  slice_t slice2( edf , signals(j) , interval , 1 , false );
 		  
  		  const std::vector<double> * d1 = slice1.pdata();
  		  const std::vector<double> * d2 = slice2.pdata();
@@ -186,8 +186,8 @@ void dsptools::correlate_channels( edf_t & edf , param_t & param )
 
 	      interval_t interval = edf.timeline.wholetrace();
 	      
-	      slice_t slice1( edf , signals(i) , interval );
-	      slice_t slice2( edf , signals(j) , interval );
+	      slice_t slice1( edf , signals(i) , interval , 1 , false );
+	      slice_t slice2( edf , signals(j) , interval , 1 , false );
 	      
 	      const std::vector<double> * d1 = slice1.pdata();
 	      const std::vector<double> * d2 = slice2.pdata();
@@ -39,17 +39,89 @@
 #include "spline.h"
 
 #include "miscmath/miscmath.h"
+#include "miscmath/crandom.h"
 #include "helper/helper.h"
+#include "helper/logger.h"
+#include "helper/threads.h"
+#include "edf/edf.h"
+#include "edf/slice.h"
+#include "eval.h"
+#include "defs/defs.h"
 
 #include <iostream>
 #include <set>
+#include <cmath>
+#include <stdint.h>
+
+extern logger_t logger;
 
 
 void dsptools::emd_wrapper( edf_t & edf , param_t & param ) 
 {
+
+  signal_list_t signals = edf.header.signal_list( param.requires( "sig" ) );
   
+  const int ns = signals.size();
+
+  // max. number of IMFs, and of sifting iterations per IMF
+  const int max_imf = param.has( "imf" ) ? param.requires_int( "imf" ) : 0 ;
+  const int max_sift = param.has( "sift" ) ? param.requires_int( "sift" ) : 0 ;
+
+  // ensemble EMD: number of members, and noise SD (in units of signal SD)
+  const int ensemble = param.has( "ensemble" ) ? param.requires_int( "ensemble" ) : 1 ;
+  const double noise = param.has( "noise" ) ? param.requires_dbl( "noise" ) : 0.2 ;
+
+  // windowed EMD: window and overlap (seconds)
+  const double win = param.has( "win" ) ? param.requires_dbl( "win" ) : 0 ;
+  const double overlap = param.has( "overlap" ) ? param.requires_dbl( "overlap" ) : 0.2 * win ;
   
+  const bool add_residual = param.has( "residual" );
+
+  std::string tag = param.has( "tag" ) ? "_" + param.value( "tag" ) : "" ; 
+
+  for (int s=0;s<ns;s++)
+    {
+
+      if ( edf.header.is_annotation_channel( signals(s) ) ) 
+	continue;
+      
+      const int Fs = edf.header.sampling_freq( signals(s) );
+      
+      interval_t interval = edf.timeline.wholetrace();
+      
+      slice_t slice( edf , signals(s) , interval , 1 , false );
+
+      const std::vector<double> * d = slice.pdata();
+
+      emd_t emd( Fs );
+      
+      // nb. emd_t stops once more than max_imf IMFs have been extracted
+      if ( max_imf > 0 ) emd.max_imf = max_imf - 1;
+      if ( max_sift > 0 ) emd.max_sift = max_sift;
+      emd.n_iter( ensemble );
+      emd.set_noise_sd( noise );
+      
+      if ( win > 0 ) 
+	emd.decompose( *d , win * Fs , overlap * Fs );
+      else
+	emd.decompose( *d );
 
+      const int k = emd.imf.size();
+      
+      logger << " extracted " << k << " IMFs for " << signals.label(s) ;
+      if ( ensemble > 1 ) logger << " (ensemble of " << ensemble << ")";
+      logger << " --> " << signals.label(s) + tag + "_imf_1" ;
+      if ( k > 1 ) logger << " ... " << signals.label(s) + tag + "_imf_" + Helper::int2str( k );
+      logger << "\n";
+      
+      for (int j=0;j<k;j++)
+	edf.add_signal( signals.label(s) + tag + "_imf_" + Helper::int2str( j+1 ) , Fs , emd.imf[j] );
+
+      if ( add_residual ) 
+	edf.add_signal( signals.label(s) + tag + "_imf_residual" , Fs , emd.residual );
+      
+    }
+  
 }
 
 
@@ -305,7 +377,70 @@ extrema_t::extrema_t( const std::vector<double> & x )
 
 }
 
-std::vector<double> emd_t::sift( const std::vector<double> & x )
+//
+// Extrema, as extrema_t(): consecutive points of change (index1, with
+// direction z1), from which the start/stop of each min and max
+//
+
+static void emd_extrema( emd_workspace_t & ws , const std::vector<double> & x )
+{
+
+  const int n = x.size();
+  
+  ws.index1.clear(); 
+  ws.z1.clear();
+  ws.minindex.clear();
+  ws.maxindex.clear();
+  ws.nmin = ws.nmax = 0;
+  
+  int last_diff = 0;
+  for (int i=0;i<n-1;i++)
+    {
+      if ( x[i] != x[i+1] ) 
+	{
+	  // sign is w.r.t. i, i.e. if i is minimum, then set to -1
+	  const int diff = x[i+1] - x[i] > 0 ? - 1 : +1 ; 
+	  
+	  if ( last_diff != 0 && last_diff != diff ) 
+	    {
+	      int ii = i;
+	      while ( 1 ) 
+		{
+		  --ii;
+		  if ( ii < 0 ) break;
+		  if ( x[ii] != x[i] ) { ++ii; break; } 
+		}
+	      ws.index1.push_back(ii);
+	      ws.z1.push_back(diff);	  
+	    }
+	  
+	  last_diff = diff; 
+	}
+    }
+  
+  // directions alternate, so both seen if at least two
+  const int nextrema = ws.z1.size();
+  if ( nextrema < 2 ) return;
+  
+  // unique, sorted start/stop points (as extrema_t::minindex() and maxindex())
+  for (int j=0;j<nextrema;j++)
+    {
+      const int i1 = ws.index1[j];
+      const int tmpi2 = j < nextrema - 1 ? ws.index1[j+1] - 1 : n - 1 - 1;
+      int i2 = i1;
+      for (int k=i1;k<=tmpi2;k++)
+	if ( x[ k ] == x[ i1 ] ) i2 = k;
+      
+      std::vector<int> & index = ws.z1[j] > 0 ? ws.maxindex : ws.minindex;
+      index.push_back( i1 );
+      if ( i2 != i1 ) index.push_back( i2 );
+      if ( ws.z1[j] > 0 ) ++ws.nmax; else ++ws.nmin;
+    }
+  
+}
+
+
+bool emd_t::sift( emd_workspace_t & ws , const std::vector<double> & x , std::vector<double> & imf ) const
 {
 
   // Extract an IMF from 'x'
@@ -315,46 +450,31 @@ std::vector<double> emd_t::sift( const std::vector<double> & x )
 
   const int n = x.size();
 
-  std::vector<double> h = x;
+  std::vector<double> & h = ws.h;
+  std::vector<double> & h1 = ws.h1;
+  std::vector<double> & m = ws.env;
+  
+  h = x;
+  h1.resize( n );
   
-  //  std::cerr << "sifting ...\n";
   // Begin sifting
   while ( 1 ) 
     {
-
-      //  std::cerr << " siftung " << j << "\n";;
-      
-           
-      //
-      // mean of envelope
-      //
-
-      std::vector<double> m = envelope_mean( h );
       
       //
-      // require at least 'x' extrema: if this wasn't met, we should have an empty matrix here
+      // mean of envelope: require at least 'x' extrema
       //
 
-      if ( m.size() == 0 ) 
-	{ 
-	  break;
-	} 
-
-
-      stop_mode = 2;
+      if ( ! envelope_mean( ws , h , m ) ) 
+	return false;
 
-      std::vector<double> h1 = h;
-      for (int i=0;i<n;i++) h1[i] -= m[i];
+      for (int i=0;i<n;i++) h1[i] = h[i] - m[i];
 
       // return as IMF is more than max sifts
       if ( j >= max_sift ) 
 	{ 
-	  std::cerr << "required " << j << " sifting iterations\n"; 
-
-	  extrema_t fex( h1 );
-	  std::cerr << "H1 nextrema, zc " << fex.nextrema << " " << fex.ncross << " " << ( fex.nextrema == fex.ncross || fex.nextrema == fex.ncross + 1 ? "Y" : "." ) << "\n";
-
-	  return h1; 
+	  imf = h1;
+	  return true;
 	} 
       
       // otherwise, consider other stopping riles
@@ -362,16 +482,11 @@ std::vector<double> emd_t::sift( const std::vector<double> & x )
 	{
 	  double mx = 0;	      
 	  for (int i=0;i<n;i++) if ( fabs(m[i]) > mx ) mx = fabs(m[i]);
-	  //	  std::cout << "tol << " << tol << " " << mx << "\n";
 	  
 	  if ( mx < tol )
 	    {
-	      //	      std::cerr << "required " << j << " sifting iterations\n"; 
-
-	      extrema_t fex( h1 );
-	      std::cerr << "H1 nextrema, zc " << fex.nextrema << " " << fex.ncross << " " << ( fex.nextrema == fex.ncross || fex.nextrema == fex.ncross + 1 ? "Y" : "." ) << "\n";
-
-	      return h1;
+	      imf = h1;
+	      return true;
 	    }
 	}
       else if ( stop_mode == 2 && j >= 2 )
@@ -379,147 +494,363 @@ std::vector<double> emd_t::sift( const std::vector<double> & x )
 	  
 	  double sd = 0;
 	  for (int i=1;i<n-1;i++) 
-	    {
-	      sd +=  ( ( h[i] - h1[i] ) * ( h[i] - h1[i] )  ) / (h[i]*h[i]);
-	      //std::cerr << "cum  " << sd << " " << h[i] << " " << h1[i] << "\n";
-	    }
+	    sd +=  ( ( h[i] - h1[i] ) * ( h[i] - h1[i] )  ) / (h[i]*h[i]);
 	  
-	  //	  std::cerr << "SD= " << sd << " j=" << j << "\n";
-      
 	  // stop?
-	  if ( sd < 0.3 ) 
+	  if ( sd < sd_threshold ) 
 	    {
-	      //std::cerr << "required " << j << " sifting iterations\n"; 
-	      
-	      //
-	      // check extrema and ZC numbers
-	      //
-	      
-	      extrema_t fex( h1 );
-	      std::cerr << "H1 nextrema, zc " << fex.nextrema << " " << fex.ncross << " " << ( fex.nextrema == fex.ncross || fex.nextrema == fex.ncross + 1 ? "Y" : "." ) << "\n";
-	      
-	      
-	      return h1;
+	      imf = h1;
+	      return true;
 	    }
-
+	  
 	}
 	  
       //
-      // continue sifting, store previous 
+      // continue sifting: re-sift results of previous sift
       //
 
-      // set to re-sift results of previous sift
-
-      h = h1;
+      h.swap( h1 );
 
       ++j;
 
     }
 
+  return false;
+}
+
+
+//
+// Ensemble members, in parallel
+//
+
+struct emd_ensemble_job_t : public parallel_job_t 
+{
+  emd_ensemble_job_t( const emd_t & emd , const int n ) 
+  : emd(emd) , x( n ) , res( n ) { } 
   
-  std::vector<double> dummy;
-  return dummy;
+  const emd_t & emd;
+
+  // noisy signals, and their IMFs
+  std::vector<std::vector<double> > x;
+  std::vector<std::vector<std::vector<double> > > res;
   
-}
+  void run( const int i )
+  {
+    emd_workspace_t ws;
+    emd.decompose( ws , x[i] , &res[i] );
+    // done with the input
+    std::vector<double>().swap( x[i] );
+  }
+};
 
-emd_t::emd_t( const std::vector<double> & d , const double Fs ) : Fs(Fs)
+
+//
+// Segments (windowed mode), in parallel
+//
+
+struct emd_segment_job_t : public parallel_job_t 
 {
+  emd_segment_job_t( const emd_t & emd , const int n ) 
+  : emd(emd) , x( n ) , res( n ) { } 
+  
+  const emd_t & emd;
+
+  // segments, and their IMFs
+  std::vector<std::vector<double> > x;
+  std::vector<std::vector<std::vector<double> > > res;
+  
+  void run( const int i )
+  {
+    emd.run( x[i] , &res[i] );
+  }
+};
+
+
+// Gaussian deviate (Box-Muller)
+
+static double emd_rnorm()
+{
+  const double u1 = CRandom::rand();
+  const double u2 = CRandom::rand();
+  return sqrt( -2.0 * log( u1 ) ) * cos( 2.0 * M_PI * u2 );
+}
+
 
-  // defaults
+void emd_t::defaults()
+{
   max_sift = 2000;
   max_imf  = 100;
+  stop_mode = 2;
+  sd_threshold = 0.3;
+  iter = 1;
+  noise_sd = 0.2;
+  tol = 0;
+}
 
-  std::vector<double> working = d;
 
-  // default for tolerance, and stop mode (==1) (from EMD R package)  
-  tol = MiscMath::sdev( d ) * 0.1*0.1;
-  stop_mode = 2;
+emd_t::emd_t( const double Fs ) : Fs(Fs)
+{
+  defaults();
+}
+
+
+emd_t::emd_t( const std::vector<double> & d , const double Fs ) : Fs(Fs)
+{
+  defaults();
+  decompose( d );
+}
+
+
+void emd_t::decompose( emd_workspace_t & ws , const std::vector<double> & x , std::vector<std::vector<double> > * imf ) const
+{
+
+  imf->clear();
+
+  const int n = x.size();
   
-  const  int n = d.size();
+  std::vector<double> & working = ws.r;
+  working = x;
   
-  imf.clear();
-
-  // keep track of IMF
-  int k = 0;
+  std::vector<double> h;
   
-  while ( 1 ) 
+  // nb. as originally, stops once more than max_imf IMFs have been
+  // extracted (i.e. up to max_imf + 1)
+  while ( (int)imf->size() <= max_imf )
     {
       
-      // Get each IMF
-      std::vector<double> h = sift( working );
-      //      std::cerr << " got IMF\n";
-      
-      // not enought extrema on signal/residual: done
-      if ( h.size() == 0 ) { break; } 
+      // Get each IMF: not enough extrema on signal/residual: done
+      if ( ! sift( ws , working , h ) ) break;
       
       // Store
-      imf.push_back( h );
+      imf->push_back( h );
       
       // make residual 
       for (int i=0;i<n;i++)
 	working[i] -= h[i];
+    }
 
-      // next IMF
-      ++k;
-      
-      if ( k > max_imf ) break;
+}
+
+
+void emd_t::run( const std::vector<double> & x , std::vector<std::vector<double> > * imf ) const
+{
+  
+  if ( iter <= 1 ) 
+    {
+      emd_workspace_t ws;
+      decompose( ws , x , imf );
+      return;
     }
 
-  std::cerr << "extracted " << k << " IMF\n";
+  //
+  // Ensemble EMD: average IMFs over 'iter' decompositions of x plus
+  // white noise; members run in blocks of 'threads', with noise drawn
+  // (serially) in member order, so results do not depend on threads
+  //
 
-  // final residual
+  const int n = x.size();
+  
+  const double sd = noise_sd * MiscMath::sdev( x );
+  
+  const int block = globals::threads > 1 ? globals::threads : 1 ;
+  
+  imf->clear();
 
-  residual = d;
+  // members contributing to each IMF (i.e. as members may give
+  // different numbers of IMFs)
+  std::vector<int> cnt;
+  
+  int done = 0;
 
-  for (int i=0;i<n;i++)
+  while ( done < iter ) 
     {
-      for (int j=0;j<k;j++) residual[i] -= imf[j][i];
-
-      if ( 1 ) 
+      
+      const int nb = iter - done < block ? iter - done : block ; 
+      
+      emd_ensemble_job_t job( *this , nb );
+      
+      for (int b=0;b<nb;b++)
 	{
-	  std::cout << i << "\t" << d[i] ;
-	  
-	  for (int j=0;j<k;j++) std::cout << "\t" << imf[j][i];
-	  std::cout << "\t" << residual[i] << "\n";
+	  job.x[b].resize( n );
+	  for (int i=0;i<n;i++) job.x[b][i] = x[i] + sd * emd_rnorm();
+	}
+      
+      Helper::parallel_for( nb , job );
+      
+      for (int b=0;b<nb;b++)
+	{
+	  const std::vector<std::vector<double> > & r = job.res[b];
+	  for (int k=0;k<r.size();k++)
+	    {
+	      if ( k == imf->size() ) 
+		{
+		  imf->push_back( std::vector<double>( n , 0 ) );
+		  cnt.push_back( 0 );
+		}
+	      std::vector<double> & y = (*imf)[k];
+	      for (int i=0;i<n;i++) y[i] += r[k][i];
+	      ++cnt[k];
+	    }
 	}
+      
+      done += nb;
+    }
+
+  for (int k=0;k<imf->size();k++)
+    for (int i=0;i<n;i++) (*imf)[k][i] /= (double)cnt[k];
+  
+}
+
+
+void emd_t::decompose( const std::vector<double> & d )
+{
+  run( d , &imf );
+  set_residual( d );
+}
+
+
+void emd_t::decompose( const std::vector<double> & d , const int win , const int overlap )
+{
+
+  const int n = d.size();
+  
+  if ( win <= 0 || win >= n ) 
+    {
+      decompose( d );
+      return;
     }
+  
+  if ( overlap < 0 || overlap >= win ) 
+    Helper::halt( "EMD overlap must be less than the window size" );
 
+  imf.clear();
+  
+  // segment s covers [ s * step , s * step + win ) (or to the end of the
+  // signal, for the last segment); segments are cross-faded over each
+  // overlap, i.e. weights ramp linearly over the first/last 'overlap'
+  // points of a segment (except at the start/end of the signal), and
+  // each point is the weighted mean over the segments that cover it
 
+  const int step = win - overlap;
   
-  //
-  // Hilbert transform 
-  //
+  int nseg = 1;
+  while ( (int64_t)( nseg - 1 ) * step + win < n ) ++nseg;
+  
+  std::vector<double> wsum( n , 0 );
 
-  // now we have IMF's and residual.  apply HHT
+  // range of the number of IMFs given by (non-empty) segments
+  int min_k = 0 , max_k = 0;
+  
+  // segments in parallel (unless ensemble EMD, where members are already run in parallel)
+  const int block = iter <= 1 && globals::threads > 1 ? globals::threads : 1 ;
+  
+  int done = 0;
 
-  for (int j=0;j<k;j++)   
+  while ( done < nseg ) 
     {
+      
+      const int nb = nseg - done < block ? nseg - done : block ; 
+      
+      emd_segment_job_t job( *this , nb );
+      
+      for (int b=0;b<nb;b++)
+	{
+	  const int a = ( done + b ) * step;
+	  const int e = a + win < n ? a + win : n ;
+	  job.x[b].assign( d.begin() + a , d.begin() + e );
+	}
+      
+      Helper::parallel_for( nb , job );
+      
+      for (int b=0;b<nb;b++)
+	{
+	  const int s = done + b;
+	  const int a = s * step;
+	  const int len = job.x[b].size();
+	  
+	  const std::vector<std::vector<double> > & r = job.res[b];
 
-      hilbert_t hilbert( imf[j] );
+	  const int k = r.size();
+	  if ( k > 0 ) 
+	    {
+	      if ( min_k == 0 || k < min_k ) min_k = k;
+	      if ( k > max_k ) max_k = k;
+	    }
+	  
+	  while ( imf.size() < k ) 
+	    imf.push_back( std::vector<double>( n , 0 ) );
+	  
+	  for (int j=0;j<len;j++)
+	    {
+	      double w = 1;
+	      if ( s != 0 && j < overlap ) 
+		w = ( j + 0.5 ) / (double)overlap;
+	      if ( s != nseg - 1 && j >= len - overlap ) 
+		{
+		  const double w2 = ( len - j - 0.5 ) / (double)overlap;
+		  if ( w2 < w ) w = w2;
+		}
+	      
+	      wsum[ a + j ] += w;
+	      
+	      for (int k1=0;k1<k;k1++)
+		imf[k1][ a + j ] += w * r[k1][j];
+	    }
+	}
       
-      std::vector<double> f = hilbert.instantaneous_frequency( Fs );
-      for (int k=0;k<f.size();k++) std::cout << "IMF " << j << " " << k << " " << f[k] << "\n"; 
+      done += nb;
+    }
+  
+  for (int k=0;k<imf.size();k++)
+    for (int i=0;i<n;i++) imf[k][i] /= wsum[i];
+  
+  //
+  // Segments can give different numbers of IMFs: IMF k is only
+  // comparable across segments up to the smallest number, so any
+  // further (slower) IMFs are summed into the last of these (nb. all
+  // of the above is linear, so this is the same as summing them within
+  // each segment before cross-fading)
+  //
 
+  if ( max_k > min_k ) 
+    {
+      logger << "  segments gave between " << min_k << " and " << max_k 
+	     << " IMFs: IMFs " << min_k + 1 << " to " << max_k 
+	     << " are merged into IMF " << min_k << "\n";
+      
+      std::vector<double> & y = imf[ min_k - 1 ];
+      for (int k=min_k;k<imf.size();k++)
+	for (int i=0;i<n;i++) y[i] += imf[k][i];
+      imf.resize( min_k );
     }
   
+  set_residual( d );
+  
 }
 
 
-std::vector<double> emd_t::envelope_mean( const std::vector<double> & x )
+void emd_t::set_residual( const std::vector<double> & d )
 {
+  const int n = d.size();
+  const int k = imf.size();
+  residual = d;
+  for (int i=0;i<n;i++)
+    for (int j=0;j<k;j++) residual[i] -= imf[j][i];
+}
 
 
+bool emd_t::envelope_mean( emd_workspace_t & ws , const std::vector<double> & x , std::vector<double> & env ) const
+{
+
   // get extrema
-  extrema_t extrema( x );
+  emd_extrema( ws , x );
   
   // check # of extrema (requires at least 2)
   
-  if ( extrema.nextrema <= 2 ) { std::vector<double> dummy; return dummy; } 
+  if ( ws.nmin + ws.nmax <= 2 ) return false;
 
-  std::vector<int> minindex = extrema.minindex();
-  std::vector<int> maxindex = extrema.maxindex();
-  
-  //  std::cerr << "n min/max = " << extrema.nextrema << " " << minindex.size() << " " << maxindex.size() << "\n";
+  const std::vector<int> & minindex = ws.minindex;
+  const std::vector<int> & maxindex = ws.maxindex;
   
   //
   // add a 'periodic' boundary 
@@ -600,15 +931,17 @@ std::vector<double> emd_t::envelope_mean( const std::vector<double> & x )
       else wavefreq2 = d1 + round(1.5 * d2 );
     }
 
-  //    std::cout << "wavefreqs " << wavefreq1 <<" " << wavefreq2 << "\n";
-
   //
   // Set extrema and values for cubic spline
   //
 
-  std::vector<double> e_min_idx, e_max_idx;
-  std::vector<double> e_min_val, e_max_val;
+  std::vector<double> & e_min_idx = ws.e_min_idx;
+  std::vector<double> & e_max_idx = ws.e_max_idx;
+  std::vector<double> & e_min_val = ws.e_min_val;
+  std::vector<double> & e_max_val = ws.e_max_val;
 
+  e_min_idx.clear(); e_max_idx.clear();
+  e_min_val.clear(); e_max_val.clear();
   
   // do we need to add new extrema?
   // i.e. if first/last point has become a new local min/max extrema
@@ -670,13 +1003,13 @@ std::vector<double> emd_t::envelope_mean( const std::vector<double> & x )
   // inner (main signal)
   //
   
-  for (int i=0;i<extrema.nmin;i++ ) 
+  for (int i=0;i<ws.nmin;i++ ) 
     {
       e_min_val.push_back( x[ minindex[ i ] ] );
       e_min_idx.push_back( minindex[ i ] );
     }
 
-  for (int i=0;i<extrema.nmax;i++ ) 
+  for (int i=0;i<ws.nmax;i++ ) 
     {
       e_max_val.push_back( x[ maxindex[ i ] ] );
       e_max_idx.push_back( maxindex[ i ] );
@@ -713,34 +1046,137 @@ std::vector<double> emd_t::envelope_mean( const std::vector<double> & x )
   
 
   //
-  // get upper spline
+  // upper and lower splines, and mean envelope
   // nb. requires the _idx is pre-sorted
   //
 
-  tk::spline sa;
-  sa.set_points( e_max_idx , e_max_val ); 
+  const int n = x.size();
+
+  ws.upper.resize( n );
+  ws.lower.resize( n );
+  env.resize( n );
   
-  tk::spline sb;
-  sb.set_points( e_min_idx , e_min_val ); 
+  ws.spline.interpolate( e_max_idx , e_max_val , n , &(ws.upper[0]) );
+  ws.spline.interpolate( e_min_idx , e_min_val , n , &(ws.lower[0]) );
+  
+  for (int i=0; i<n; i++)
+    env[i] = ( ws.upper[i] + ws.lower[i] ) / 2.0 ; 
+  
+  return true;
+
+}
+
+
+//
+// As tk::spline::set_points() (second derivative 0 at either end), and
+// then operator() at 0..n-1: the band_matrix LU steps are written out
+// for the tridiagonal case, in the same order, so values are the same
+//
+
+void emd_spline_t::interpolate( const std::vector<double> & x , const std::vector<double> & y , const int n , double * f )
+{
+
+  const int k = x.size();
 
+  lower.assign( k , 0 );
+  diag.assign( k , 0 );
+  upper.assign( k , 0 );
+  saved.resize( k );
+  z.resize( k );
+  a.resize( k );
+  b.resize( k );
+  c.resize( k );
+
+  // equations for the parameters b[] (as z, the right hand side, for now)
+  for (int i=1; i<k-1; i++) 
+    {
+      lower[i] = 1.0/3.0*(x[i]-x[i-1]);
+      diag[i]  = 2.0/3.0*(x[i+1]-x[i-1]);
+      upper[i] = 1.0/3.0*(x[i+1]-x[i]);
+      z[i] = (y[i+1]-y[i])/(x[i+1]-x[i]) - (y[i]-y[i-1])/(x[i]-x[i-1]);
+    }
+
+  // boundary conditions: 2*b[0] = 0, 2*b[k-1] = 0 
+  diag[0] = 2.0;
+  upper[0] = 0.0;
+  z[0] = 0.0;
+  diag[k-1] = 2.0;
+  lower[k-1] = 0.0;
+  z[k-1] = 0.0;
+  
+  // LU: normalize each row so that a_ii = 1, then eliminate 
+  for (int i=0; i<k; i++) 
+    {
+      saved[i] = 1.0/diag[i];
+      lower[i] *= saved[i];
+      upper[i] *= saved[i];
+      diag[i] = 1.0;
+    }
+  
+  for (int i=0; i<k-1; i++)
+    {
+      const double t = -lower[i+1]/diag[i];
+      lower[i+1] = -t;
+      diag[i+1] = diag[i+1] + t*upper[i];
+    }
+  
+  // solve Ly = z, then Rb = y
+  for (int i=0; i<k; i++) 
+    {
+      double sum = 0;
+      if ( i > 0 ) sum += lower[i]*z[i-1];
+      z[i] = (z[i]*saved[i]) - sum;
+    }
+
+  for (int i=k-1; i>=0; i--) 
+    {
+      double sum = 0;
+      if ( i < k-1 ) sum += upper[i]*b[i+1];
+      b[i] = ( z[i] - sum ) / diag[i];
+    }
+
+  // parameters a[] and c[] 
+  for (int i=0; i<k-1; i++) 
+    {
+      a[i] = 1.0/3.0*(b[i+1]-b[i])/(x[i+1]-x[i]);
+      c[i] = (y[i+1]-y[i])/(x[i+1]-x[i])
+	- 1.0/3.0*(2.0*b[i]+b[i+1])*(x[i+1]-x[i]);
+    }
   
+  // right extrapolation coefficients (left uses b[0], c[0])
+  const double h = x[k-1]-x[k-2];
+  a[k-1] = 0.0;
+  c[k-1] = 3.0*a[k-2]*h*h+2.0*b[k-2]*h+c[k-2];
+
   //
-  // get mean envelope 
+  // evaluate at 0..n-1: 'p' is the number of knots < t, i.e. as
+  // std::lower_bound(), and only moves forward
   //
-
-  const int n = x.size();
   
-  std::vector<double> env( n );
+  int p = 0;
+  
   for (int i=0; i<n; i++)
-      env[i] = ( sa( i ) + sb( i ) ) / 2.0 ; 
+    {
+      const double t = i;
+      
+      while ( p < k && x[p] < t ) ++p;
+      
+      const int idx = p - 1 > 0 ? p - 1 : 0 ;
+      
+      const double hh = t - x[idx];
+      
+      if ( t < x[0] ) 
+	f[i] = (b[0]*hh + c[0])*hh + y[0];
+      else if ( t > x[k-1] ) 
+	f[i] = (b[k-1]*hh + c[k-1])*hh + y[k-1];
+      else
+	f[i] = ((a[idx]*hh + b[idx])*hh + c[idx])*hh + y[idx];
+    }
   
-  return env;
-
 }
 
 
 
-
 void test_emd( ) 
 {
 
@@ -20,7 +20,6 @@
 //
 //    --------------------------------------------------------------------
 
-
 #ifndef __EMD_H__
 #define __EMD_H__
 
@@ -59,11 +58,58 @@ struct extrema_t {
 };
 
 
+//
+// Natural cubic spline through knots (x,y), evaluated at 0..n-1: gives
+// the same values as tk::spline (default boundaries), but solves the
+// tridiagonal system directly, in storage kept across calls
+//
+
+struct emd_spline_t 
+{
+  void interpolate( const std::vector<double> & x , const std::vector<double> & y , const int n , double * f );
+  
+ private:
+  std::vector<double> lower, diag, upper, saved, z, a, b, c;
+};
+
+
+//
+// Sifting buffers, reused over all iterations and IMFs of a decomposition
+//
+
+struct emd_workspace_t 
+{
+  // working signal (residual), current and next sift, envelopes
+  std::vector<double> r, h, h1, env, upper, lower;
+
+  // extrema (as extrema_t: minindex(), maxindex(), nmin, nmax)
+  std::vector<int> index1, z1;
+  std::vector<int> minindex, maxindex;
+  int nmin, nmax;
+
+  // spline knots
+  std::vector<double> e_min_idx, e_max_idx, e_min_val, e_max_val;
+  
+  emd_spline_t spline;
+};
+
+
 struct emd_t
 {
   
-  // Empirical mode decomposition
+  // Empirical mode decomposition (with default options)
   emd_t( const std::vector<double> & d , double );
+
+  // ... or set options, then call decompose()
+  emd_t( double );
+
+  void decompose( const std::vector<double> & d );
+  
+  // windowed: decompose overlapping segments of 'win' samples and 
+  // cross-fade the IMFs over each overlap, so that sifting only ever 
+  // works on 'win' samples; IMFs beyond the smallest number given by 
+  // any segment are summed into the last common IMF
+  void decompose( const std::vector<double> & d , const int win , const int overlap );
   
   // ensemble EMD
   int n_iter() const { return iter; } 
@@ -78,20 +124,32 @@ struct emd_t
   int max_sift;
   int max_imf;
   
-  std::vector<double> sift( const std::vector<double> & ); 
-  std::vector<double> envelope_mean( const std::vector<double> & ); 
+  // extract one IMF from x (false if too few extrema)
+  bool sift( emd_workspace_t & , const std::vector<double> & x , std::vector<double> & imf ) const; 
+
+  // mean of upper and lower envelopes of x (false if too few extrema)
+  bool envelope_mean( emd_workspace_t & , const std::vector<double> & x , std::vector<double> & env ) const; 
+  
+  // single decomposition of x (iter ignored)
+  void decompose( emd_workspace_t & , const std::vector<double> & x , std::vector<std::vector<double> > * imf ) const;
+  
+  // single or ensemble decomposition of x
+  void run( const std::vector<double> & x , std::vector<std::vector<double> > * imf ) const;
   
   std::vector<std::vector<double> > imf;
   std::vector<double> residual;
   
-  extrema_t extrema( const std::vector<double> & ) ;
-  
   int iter;              // number of iterations (>1 implies ensemble EMD)
   
   double sd_threshold;   // determine when to stop sifting
   
-  double noise_sd;
+  double noise_sd;       // ensemble EMD: added noise (in units of signal SD)
+  
+ private:
   
+  void defaults();
+
+  void set_residual( const std::vector<double> & d );
   
 };
 
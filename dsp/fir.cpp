@@ -26,12 +26,16 @@
 #include "helper/helper.h"
 #include "helper/logger.h"
 #include "fftw/fftwrap.h"
+#include "helper/threads.h"
 #include "db/db.h"
 #include "eval.h"
 
 #include "edf/slice.h"
 #include "edf/edf.h"
 
+#include <map>
+#include <pthread.h>
+
 extern logger_t logger;
 
 extern writer_t writer;
@@ -52,6 +56,34 @@ fir_impl_t::fir_impl_t( const std::vector<double> & coefs_ )
   for (int i=0;i<del;i++)
     checksum += fabs( coefs[i] - coefs[ coefs.size() - 1 - i ] );
   if ( checksum > 1e-8 ) Helper::halt( "problem in filter" );
+
+  //
+  // For longer filters, cache the spectrum used by block_filter(); each
+  // block of nfft points gives nfft - L + 1 new outputs
+  //
+  
+  nfft = 0;
+
+  if ( length >= block_min_taps ) 
+    {
+      nfft = MiscMath::nextpow2( 8 * length );
+      if ( nfft < 1024 ) nfft = 1024;
+      
+      double * h = (double*) fftw_malloc( sizeof(double) * nfft );
+      fftw_complex * out = (fftw_complex*) fftw_malloc( sizeof(fftw_complex) * ( nfft/2 + 1 ) );
+      if ( h == NULL || out == NULL ) Helper::halt( "FIR failed to allocate memory" );
+      
+      for (int i=0;i<length;i++) h[i] = coefs[i];
+      for (int i=length;i<nfft;i++) h[i] = 0;
+      
+      fftw_execute_dft_r2c( FFT::plan( nfft , FFT::PLAN_R2C ) , h , out );
+
+      H.resize( nfft/2 + 1 );
+      for (int i=0;i<=nfft/2;i++) H[i] = std::complex<double>( out[i][0] , out[i][1] );
+      
+      fftw_free( h );
+      fftw_free( out );
+    }
   
 }
 
@@ -219,6 +251,57 @@ std::vector<double> dsptools::design_highpass_fir( double ripple , double tw , d
 std::vector<double> dsptools::apply_fir( const std::vector<double> & x , int fs, fir_t::filterType ftype , double ripple , double tw , double f1, double f2 )
 {
 
+  const fir_impl_t * fir_impl = shared_fir( ftype , ripple , tw , fs , f1 , f2 );
+  
+  //
+  // Apply FIR 
+  //
+  
+  const int n = x.size();
+
+  std::vector<double> r( n );
+
+  if ( n ) fir_impl->filter( &x[0] , n , &r[0] );
+
+  return r;
+
+}
+
+
+//
+// Shared FIR cache: e.g. SPINDLES, SW, POL and HILBERT filter many
+// signals (or the same signal many times) with the same few designs;
+// entries are never released
+//
+
+static pthread_mutex_t fir_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static std::map<std::vector<double>,fir_impl_t*> fir_cache;
+
+const fir_impl_t * dsptools::shared_fir( fir_t::filterType ftype , double ripple , double tw , double fs , double f1, double f2 )
+{
+  
+  if ( ftype == fir_t::LOW_PASS || ftype == fir_t::HIGH_PASS ) f2 = 0;
+  
+  std::vector<double> key( 6 );
+  key[0] = ftype;
+  key[1] = ripple;
+  key[2] = tw;
+  key[3] = fs;
+  key[4] = f1;
+  key[5] = f2;
+  
+  pthread_mutex_lock( &fir_cache_lock );
+
+  std::map<std::vector<double>,fir_impl_t*>::const_iterator ii = fir_cache.find( key );
+  
+  if ( ii != fir_cache.end() ) 
+    {
+      const fir_impl_t * f = ii->second;
+      pthread_mutex_unlock( &fir_cache_lock );
+      return f;
+    }
+
   std::vector<double> fc;
   
   if ( ftype == fir_t::BAND_PASS ) 
@@ -229,15 +312,14 @@ std::vector<double> dsptools::apply_fir( const std::vector<double> & x , int fs,
     fc = design_lowpass_fir( ripple , tw , fs , f1 );
   else if ( ftype == fir_t::HIGH_PASS )
     fc = design_highpass_fir( ripple , tw , fs , f1 );
+
+  fir_impl_t * f = new fir_impl_t( fc );
   
-  //
-  // Apply FIR 
-  //
-  
-  fir_impl_t fir_impl ( fc );
-  
-  return fir_impl.filter( &x );  
+  fir_cache[ key ] = f;
 
+  pthread_mutex_unlock( &fir_cache_lock );
+  
+  return f;
 }
 
 void dsptools::apply_fir( edf_t & edf , param_t & param )
@@ -293,9 +375,13 @@ void dsptools::apply_fir( edf_t & edf , param_t & param )
   const int ns = signals.size();
 
   //
-  // Process each signal
+  // Process signals, together for all with the same sampling rate
+  // (i.e. the same filter), in order of first appearance
   //
 
+  std::vector<int> rates;
+  std::map<int,std::vector<int> > rate2sigs;
+  
   for (int s=0; s<ns; s++)
     {
 
@@ -304,77 +390,121 @@ void dsptools::apply_fir( edf_t & edf , param_t & param )
       //
       
       if ( edf.header.is_annotation_channel(s) ) continue;
-      
-      apply_fir( edf , signals(s) , ftype , ripple, tw , f1 , f2 );
+
+      const int fs = edf.header.sampling_freq( signals(s) );
+      if ( rate2sigs.find( fs ) == rate2sigs.end() ) rates.push_back( fs );
+      rate2sigs[ fs ].push_back( signals(s) );
       
     }
 
+  for (int r=0; r<rates.size(); r++)
+    apply_fir( edf , rate2sigs[ rates[r] ] , ftype , ripple, tw , f1 , f2 );
+
 }
 
 void dsptools::apply_fir( edf_t & edf , int s , fir_t::filterType ftype , double ripple , double tw , double f1, double f2 )
+{
+  std::vector<int> sigs( 1 , s );
+  apply_fir( edf , sigs , ftype , ripple , tw , f1 , f2 );
+}
+
+
+void dsptools::apply_fir( edf_t & edf , const std::vector<int> & sigs , fir_t::filterType ftype , double ripple , double tw , double f1, double f2 )
 {
       
+  // all signals are expected to have the same sampling rate
   
-  interval_t interval = edf.timeline.wholetrace();
-  
-  //
-  // Filter data
-  //
-  
-  logger << " filtering channel " << edf.header.label[ s ] << ", ";
+  const int ns = sigs.size();
 
-  //
-  // Pull entire signals out
-  //
+  if ( ns == 0 ) return;
   
-  slice_t slice( edf , s , interval );
+  interval_t interval = edf.timeline.wholetrace();
   
-  const std::vector<double> * d = slice.pdata();
-      
-  int fs = edf.header.sampling_freq( s );
-      
+  int fs = edf.header.sampling_freq( sigs[0] );
+
+  for (int i=1;i<ns;i++)
+    if ( edf.header.sampling_freq( sigs[i] ) != fs ) 
+      Helper::halt( "internal error in apply_fir(), mixed sampling rates" );
+
   //
   // Design FIR
   // 
 
   std::vector<double> fc;
-      
+  std::string label;
+  
   if ( ftype == fir_t::BAND_PASS ) 
     {
       fc = design_bandpass_fir( ripple , tw , fs , f1, f2 );    
-      logger << "bandpass FIR order " << fc.size() << "\n";
+      label = "bandpass";
     }
   else if ( ftype == fir_t::BAND_STOP )
     {
       fc = design_bandstop_fir( ripple , tw , fs , f1, f2 );
-      logger << "bandstop FIR order " << fc.size() << "\n";
+      label = "bandstop";
     }
   else if ( ftype == fir_t::LOW_PASS )
     {
       fc = design_lowpass_fir( ripple , tw , fs , f1 );
-      logger << "lowpass FIR order " << fc.size() << "\n";
+      label = "lowpass";
     }
   else if ( ftype == fir_t::HIGH_PASS )
     {
       fc = design_highpass_fir( ripple , tw , fs , f1 );
-      logger << "highpass FIR order " << fc.size() << "\n";
+      label = "highpass";
     }
   
   //int filter_order = num_taps == -1 ? 3 * ( Fs[s] / lwr ) : num_taps ; 
   
   //
-  // Apply FIR 
+  // The FIR (and its block spectrum) is set up once for this rate, and
+  // channels are then filtered in batches of up to threads=N: each batch
+  // is sliced, filtered and placed back before the next is sliced
   //
   
   fir_impl_t fir_impl ( fc );
+
+  const int batch_size = globals::threads > 1 ? globals::threads : 1 ;
   
-  std::vector<double> filtered = fir_impl.filter( d );
-  
-  //
-  // Place back
-  //
-  
-  edf.update_signal( s , &filtered );
+  for (int s0=0; s0<ns; s0+=batch_size)
+    {
+      
+      const int nb = s0 + batch_size < ns ? batch_size : ns - s0 ;
+
+      //
+      // Pull entire signals out
+      //
+      
+      std::vector<slice_t*> slices( nb );
+      std::vector<const std::vector<double>*> d( nb );
+      
+      for (int i=0;i<nb;i++)
+	{
+	  logger << " filtering channel " << edf.header.label[ sigs[s0+i] ] << ", "
+		 << label << " FIR order " << fc.size() << "\n";
+	  
+	  slices[i] = new slice_t( edf , sigs[s0+i] , interval , 1 , false );
+	  d[i] = slices[i]->pdata();
+	}
+      
+      //
+      // Apply FIR 
+      //
+      
+      std::vector<std::vector<double> > filtered = fir_impl.filter( d );
+      
+      //
+      // Place back
+      //
+      
+      for (int i=0;i<nb;i++)
+	{
+	  delete slices[i];
+	  edf.update_signal( sigs[s0+i] , &filtered[i] );
+	  std::vector<double>().swap( filtered[i] );
+	}
+      
+    }
   
 }
 
@@ -791,28 +921,170 @@ std::vector<double> fir_impl_t::filter( const std::vector<double> * x )
 {
   
   if ( length % 2 == 0 ) Helper::halt("fir_impl_t requries odd # of coeffs");
+
+  if ( length >= block_min_taps ) 
+    return block_filter( x );
   
+  return direct_filter( x );
+
+}
+
+
+void fir_impl_t::filter( const double * x , const int n , double * r ) const
+{
+  
+  if ( length % 2 == 0 ) Helper::halt("fir_impl_t requries odd # of coeffs");
+
+  if ( length >= block_min_taps ) 
+    block_filter( x , n , r );
+  else
+    direct_filter( x , n , r );
+
+}
+
+
+std::vector<double> fir_impl_t::direct_filter( const std::vector<double> * x ) const
+{
   const int n = x->size();
+  std::vector<double> r( n ) ;
+  if ( n ) direct_filter( &(*x)[0] , n , &r[0] );
+  return r;
+}
+
+
+void fir_impl_t::direct_filter( const double * p , const int n , double * r ) const
+{
+
+  // as getOutputSample(), output j is sum_i coefs[i] * x[ j + delay - i ], 
+  // with x[] zero outside of 0 .. n-1
   
   const int delay_idx = (length-1)/2;
   
+  for (int j=0;j<n;j++)
+    {
+      const int m = j + delay_idx;
+
+      // taps overlapping the signal
+      const int i0 = m >= n ? m - n + 1 : 0 ; 
+      const int i1 = m < length - 1 ? m : length - 1 ; 
+      
+      double result = 0.0;
+      for (int i=i0; i<=i1; i++) 
+	result += coefs[i] * p[ m - i ];
+
+      r[j] = result;
+    }
+  
+}
+
+
+std::vector<double> fir_impl_t::block_filter( const std::vector<double> * x ) const
+{
+  const int n = x->size();
   std::vector<double> r( n ) ;
+  if ( n ) block_filter( &(*x)[0] , n , &r[0] );
+  return r;
+}
+
+
+void fir_impl_t::block_filter( const double * x , const int n , double * r ) const
+{
+  
+  const int delay_idx = (length-1)/2;
   
-  const double * p = &(*x)[0];
+  // new (valid) outputs per block
+  const int step = nfft - ( length - 1 );
   
-  // burn in
-  for (int i=0;i<delay_idx;i++) 
-    getOutputSample( *(p++) );
+  const int nc = nfft/2 + 1;
+
+  double * seg = (double*) fftw_malloc( sizeof(double) * nfft );
+  fftw_complex * X = (fftw_complex*) fftw_malloc( sizeof(fftw_complex) * nc );
+  if ( seg == NULL || X == NULL ) Helper::halt( "FIR failed to allocate memory" );
+
+  fftw_plan fwd = FFT::plan( nfft , FFT::PLAN_R2C );
+  fftw_plan inv = FFT::plan( nfft , FFT::PLAN_C2R );
+  
+  const double denom = 1.0 / (double)nfft;
+  
+  //
+  // Overlap-save: output j is the full convolution at j + delay; each
+  // block takes the L-1 preceding input points plus 'step' new ones, and
+  // the first L-1 (circularly wrapped) outputs are discarded
+  //
+
+  for (int m0 = delay_idx ; m0 < n + delay_idx ; m0 += step )
+    {
+
+      const int s0 = m0 - ( length - 1 );
+      
+      for (int i=0;i<nfft;i++) 
+	{
+	  const int k = s0 + i;
+	  seg[i] = k >= 0 && k < n ? x[k] : 0 ; 
+	}
+      
+      fftw_execute_dft_r2c( fwd , seg , X );
+      
+      for (int i=0;i<nc;i++)
+	{
+	  const double a = X[i][0] , b = X[i][1];
+	  const double c = H[i].real() , d = H[i].imag();
+	  X[i][0] = a * c - b * d;
+	  X[i][1] = a * d + b * c;
+	}
+      
+      fftw_execute_dft_c2r( inv , X , seg );
+      
+      const int j0 = m0 - delay_idx;
+      const int nj = j0 + step < n ? step : n - j0 ;
+      
+      for (int i=0;i<nj;i++)
+	r[ j0 + i ] = seg[ length - 1 + i ] * denom;
+    }
   
-  // process
-  int j = 0;
-  for (int i=delay_idx;i<n;i++) 
-    r[j++] = getOutputSample( *(p++) );
+  fftw_free( seg );
+  fftw_free( X );
   
-  // zero-pad end of signal
-  for (int i=0;i<delay_idx;i++) 
-    r[j++] = getOutputSample( 0 );
+}
+
+
+//
+// Filter several signals with the same FIR, e.g. all channels at a given
+// sampling rate; signals are independent, so are run in parallel
+// (if threads=N is set)
+//
+
+struct fir_filter_job_t : public parallel_job_t 
+{
+
+  fir_filter_job_t( const fir_impl_t & fir , 
+		    const std::vector<const std::vector<double>*> & x , 
+		    std::vector<std::vector<double> > & r ) 
+  : fir(fir) , x(x) , r(r) { } 
+
+  const fir_impl_t & fir;
+  const std::vector<const std::vector<double>*> & x;
+  std::vector<std::vector<double> > & r;
+
+  void run( const int i )
+  {
+    r[i] = fir.length >= fir_impl_t::block_min_taps ? fir.block_filter( x[i] ) : fir.direct_filter( x[i] );
+  }
+
+};
+
+
+std::vector<std::vector<double> > fir_impl_t::filter( const std::vector<const std::vector<double>*> & x )
+{
+
+  if ( length % 2 == 0 ) Helper::halt("fir_impl_t requries odd # of coeffs");
   
+  std::vector<std::vector<double> > r( x.size() );
+
+  fir_filter_job_t job( *this , x , r );
+
+  Helper::parallel_for( x.size() , job );
+
   return r;
   
 }
@@ -44,9 +44,33 @@ struct fir_impl_t {
   
   fir_impl_t( const std::vector<double> & coefs_ ); 
   
+  // zero-phase filtering (output aligned with input): uses the block
+  // FFT form for longer filters, otherwise the direct form
   std::vector<double> filter( const std::vector<double> * x );
 
+  // as above, for several signals (e.g. channels) at once
+  std::vector<std::vector<double> > filter( const std::vector<const std::vector<double>*> & x );
+
+  // as above, writing n outputs to r (which must not overlap x)
+  void filter( const double * x , const int n , double * r ) const;
+  
+  // direct form, O(n.L)
+  std::vector<double> direct_filter( const std::vector<double> * x ) const;
+  void direct_filter( const double * x , const int n , double * r ) const;
+
+  // overlap-save, in fixed-size blocks against the cached filter spectrum
+  std::vector<double> block_filter( const std::vector<double> * x ) const;
+  void block_filter( const double * x , const int n , double * r ) const;
+  
+  // single FFT of the whole (zero-padded) signal
   std::vector<double> fft_filter( const std::vector<double> * x );
+
+  // filters with at least this many taps use block_filter()
+  static const int block_min_taps = 64;
+  
+  // block FFT size, and the filter's (real-to-complex) spectrum
+  int nfft;
+  std::vector<std::complex<double> > H;
   
   double getOutputSample(double inputSample) 
   {
@@ -128,7 +152,12 @@ namespace dsptools
   
   void apply_fir( edf_t & edf , param_t & param );
   void apply_fir( edf_t & edf , int s , fir_t::filterType , double ripple , double tw , double f1, double f2 );
+  void apply_fir( edf_t & edf , const std::vector<int> & s , fir_t::filterType , double ripple , double tw , double f1, double f2 );
   std::vector<double> apply_fir( const std::vector<double> & , int fs , fir_t::filterType ftype , double ripple , double tw , double f1, double f2 );
+
+  // designed once per (type, ripple, tw, fs, f1, f2), and shared
+  // (nb. f2 is ignored for low/high-pass filters)
+  const fir_impl_t * shared_fir( fir_t::filterType ftype , double ripple , double tw , double fs , double f1, double f2 );
   
 }
 
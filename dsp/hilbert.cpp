@@ -26,75 +26,256 @@
 #include "miscmath/miscmath.h"
 #include "dsp/fir.h"
 #include "defs/defs.h"
+#include "helper/threads.h"
 
 #include <iostream>
 #include <cmath>
 
 
+hilbert_bank_t::hilbert_bank_t( const int n , const double fs ) 
+  : n(n) , fs(fs) , fir(NULL)
+{
+}
 
 
-hilbert_t::hilbert_t( const std::vector<double> & d ) : input(d)
+hilbert_bank_t::hilbert_bank_t( const int n , const int sr , double lwr , double upr , double ripple , double tw ) 
+  : n(n) , fs(sr)
 {
-  // this mode assumes we've already BPF the input
-  proc();
+  fir = dsptools::shared_fir( fir_t::BAND_PASS , ripple , tw , sr , lwr , upr );
 }
 
 
-hilbert_t::hilbert_t( const std::vector<double> & d , const int sr , double lwr , double upr , double ripple , double tw )
+void hilbert_bank_t::apply( const double * x , 
+			    double * filtered , 
+			    double * ph , 
+			    double * mag , 
+			    double * ifrq ) const
 {
-  // include band-pass filter
-  input = dsptools::apply_fir( d , sr , fir_t::BAND_PASS , ripple , tw , lwr , upr );
   
-  proc();
+  if ( n == 0 ) return;
+
+  if ( ifrq != NULL && fs <= 0 ) 
+    Helper::halt( "internal error in hilbert(), no sample rate for instantaneous frequency" );
+
+  // 1) band-pass filter (if needed)
+  
+  std::vector<double> tmp;
+
+  const double * y = x;
+  
+  if ( fir != NULL ) 
+    {
+      if ( filtered == NULL ) 
+	{
+	  tmp.resize( n );
+	  filtered = &tmp[0];
+	}
+      fir->filter( x , n , filtered );
+      y = filtered;
+    }
+  else if ( filtered != NULL ) 
+    {
+      for (int i=0;i<n;i++) filtered[i] = x[i];
+    }
+
+  // 2) take (real-to-complex) FFT, in aligned buffers as the shared
+  // plans expect
+  
+  const int nc = n/2 + 1;
+
+  double * r = (double*) fftw_malloc( sizeof(double) * n );
+  fftw_complex * f = (fftw_complex*) fftw_malloc( sizeof(fftw_complex) * nc );
+  if ( r == NULL || f == NULL ) Helper::halt( "hilbert() failed to allocate memory" );
+  
+  for (int i=0;i<n;i++) r[i] = y[i];
+
+  fftw_execute_dft_r2c( FFT::plan( n , FFT::PLAN_R2C ) , r , f );
+  
+  // 3) the analytic signal is y + i.H(y), where H(y) is the inverse
+  // of -i.F for positive frequencies (and zero for DC, and Nyquist
+  // if n is even); i.e. rotating the positive frequencies
+
+  const int pos_idx = floor(n/2.0) + ( n % 2 ) - 1;
+  
+  f[0][0] = f[0][1] = 0;
+
+  for (int i = 1 ; i <= pos_idx ; i++ ) 
+    {
+      const double a = f[i][0];
+      f[i][0] = f[i][1];
+      f[i][1] = -a;
+    }
+
+  for (int i = pos_idx + 1 ; i < nc ; i++ ) f[i][0] = f[i][1] = 0;
+  
+  // 4) inverse (complex-to-real) FFT of the rotated coefficients 
+  
+  fftw_execute_dft_c2r( FFT::plan( n , FFT::PLAN_C2R ) , f , r );
+  
+  // 5) phase, magnitude
+
+  // (instantaneous frequency needs the phase)
+
+  std::vector<double> ptmp;
+
+  if ( ph == NULL && ifrq != NULL ) 
+    {
+      ptmp.resize( n );
+      ph = &ptmp[0];
+    }
+  
+  const double denom = 1.0 / (double)n;
+
+  for (int i=0;i<n;i++)
+    {
+      const double a = y[i];
+      const double b = r[i] * denom;
+      if ( ph ) ph[i] = atan2( b , a );
+      if ( mag ) mag[i] = sqrt( a*a + b*b );     
+    }
+
+  fftw_free( r );
+  fftw_free( f );
+
+  // 6) instantaneous frequency
+
+  if ( ifrq != NULL ) 
+    instantaneous_frequency( ph , n , fs , ifrq );
+  
 }
-      
-void hilbert_t::proc()
+
+
+struct hilbert_job_t : public parallel_job_t 
 {
+  
+  hilbert_job_t( const hilbert_bank_t & bank , 
+		 const std::vector<const double*> & x , 
+		 const std::vector<double*> & filtered , 
+		 const std::vector<double*> & ph , 
+		 const std::vector<double*> & mag , 
+		 const std::vector<double*> & ifrq ) 
+  : bank(bank) , x(x) , filtered(filtered) , ph(ph) , mag(mag) , ifrq(ifrq) { } 
+
+  const hilbert_bank_t & bank;
+  const std::vector<const double*> & x;
+  const std::vector<double*> & filtered;
+  const std::vector<double*> & ph;
+  const std::vector<double*> & mag;
+  const std::vector<double*> & ifrq;
+
+  void run( const int i )
+  {
+    bank.apply( x[i] , 
+		filtered.size() ? filtered[i] : NULL , 
+		ph.size() ? ph[i] : NULL , 
+		mag.size() ? mag[i] : NULL , 
+		ifrq.size() ? ifrq[i] : NULL );
+  }
+  
+};
 
-  int n = input.size();
+
+void hilbert_bank_t::apply( const std::vector<const double*> & x , 
+			    const std::vector<double*> & filtered , 
+			    const std::vector<double*> & ph , 
+			    const std::vector<double*> & mag , 
+			    const std::vector<double*> & ifrq ) const
+{
   
-  // 1) take FFT
-  FFT fft( n , 1 , FFT_FORWARD );
-  fft.apply( input );
-  std::vector<dcomp> f = fft.transform();
-  if ( f.size() != n ) Helper::halt( "internal error in hilbert()" );
+  const int nc = x.size();
 
-  // 2) Adjusted postive/negative frequencies
+  if ( ( filtered.size() && filtered.size() != nc ) || 
+       ( ph.size() && ph.size() != nc ) || 
+       ( mag.size() && mag.size() != nc ) || 
+       ( ifrq.size() && ifrq.size() != nc ) ) 
+    Helper::halt( "internal error in hilbert(), mismatched output buffers" );
   
-  int pos_idx = floor(n/2.0) + ( n % 2 ) - 1;
-  int neg_idx = ceil(n/2.0) + ( ! ( n % 2 ) );
+  hilbert_job_t job( *this , x , filtered , ph , mag , ifrq );
+
+  Helper::parallel_for( nc , job );
   
-  for (int i = 1 ; i <= pos_idx ; i++ ) f[i] *= 2;
-  for (int i = neg_idx ; i < n ; i++ ) f[i] = 0;
+}
+
 
-  // equivalent to rotating Fourier coefficients by computing the
-  // iAsin(2pft) component, i.e., the phase quadrature) positive
-  // frequencies are rotated counter-clockwise; negative frequencies
-  // are rotated clockwise)
+void hilbert_bank_t::instantaneous_frequency( const double * ph , const int n , const double fs , double * f )
+{
 
-  // f(posF) = f(posF) + -1i*complexf(posF);
-  // f(negF) = f(negF) +  1i*complexf(negF);
+  // unwrap the phase (as MATLAB's unwrap(), see
+  // http://homepages.cae.wisc.edu/~brodskye/mr/phaseunwrap/unwrap.c)
+  // and take the first difference, in a single pass 
   
+  if ( n < 2 ) return;
+
+  // default tol in matlab
+  const double cutoff = M_PI;   
+
+  double cumsum = 0;
+
+  double prev = ph[0];
+
+  for (int j = 0; j < n-1; j++)
+    {
+
+      // incremental phase variation 
+      // MATLAB: dp = diff(p, 1, 1);
+      const double dp = ph[j+1] - ph[j];
+      
+      // equivalent phase variation in [-pi, pi]
+      // MATLAB: dps = mod(dp+dp,2*pi) - pi;
+      double dps = (dp+M_PI) - floor((dp+M_PI) / (2*M_PI))*(2*M_PI) - M_PI;
   
-  // 3) Inverse FFT of the rotated coefficients 
-  FFT ifft( n , 1 , FFT_INVERSE );
-  ifft.apply( f );
-  std::vector<dcomp> ht = ifft.scaled_transform();
+      // preserve variation sign for +pi vs. -pi
+      // MATLAB: dps(dps==pi & dp>0,:) = pi;
+      if ((dps == -M_PI) && (dp > 0))
+	dps = M_PI;
+
+      // incremental phase correction
+      // MATLAB: dp_corr = dps - dp;
+      double dp_corr = dps - dp;
+      
+      // Ignore correction when incremental variation is smaller than cutoff
+      // MATLAB: dp_corr(abs(dp)<cutoff,:) = 0;
+      if (fabs(dp) < cutoff)
+	dp_corr = 0;
+
+      // Integrate corrections and add to P to produce smoothed phase values
+      // MATLAB: p(2:m,:) = p(2:m,:) + cumsum(dp_corr,1);
+      cumsum += dp_corr;
+      
+      const double curr = ph[j+1] + cumsum;
+      
+      f[j] = fs / ( 2.0 * M_PI ) * ( curr - prev ) ;
+
+      prev = curr;
+    }
   
-  if ( ht.size() != n ) Helper::halt( "problem in hilbert()" );
+}
+
+
+hilbert_t::hilbert_t( const std::vector<double> & d )
+{
+  // this mode assumes we've already BPF the input
+  proc( hilbert_bank_t( d.size() ) , d );
+}
+
 
-  // 4) Store phase, magnitude
+hilbert_t::hilbert_t( const std::vector<double> & d , const int sr , double lwr , double upr , double ripple , double tw )
+{
+  // include band-pass filter
+  proc( hilbert_bank_t( d.size() , sr , lwr , upr , ripple , tw ) , d );
+}
+      
+void hilbert_t::proc( const hilbert_bank_t & bank , const std::vector<double> & d )
+{
 
+  const int n = d.size();
+  
+  input.resize( n );
   ph.resize( n );
   mag.resize( n );
 
-  for(int i=0;i<n;i++)
-    {
-      double a = std::real( ht[i] ) ;
-      double b = std::imag( ht[i] ) ;
-      ph[i] = atan2( b , a );
-      mag[i] = sqrt( a*a + b*b );     
-    }
+  if ( n ) bank.apply( &d[0] , &input[0] , &ph[0] , &mag[0] );
+  
 }
 
 const std::vector<double> * hilbert_t::phase() const
@@ -115,15 +296,10 @@ const std::vector<double> * hilbert_t::signal() const
 
 std::vector<double> hilbert_t::instantaneous_frequency( double Fs ) const
 {
-  std::vector<double> angles = ph; 
-  unwrap( &angles );
-
-  const int nm1 = angles.size() - 1;
-  std::vector<double> f( nm1 );
-  for (int i=0;i<nm1;i++)
-    f[i] = Fs / ( 2.0 * M_PI ) * ( angles[i+1] - angles[i] ) ;
+  const int n = ph.size();
+  std::vector<double> f( n > 1 ? n - 1 : 0 );
+  if ( n > 1 ) hilbert_bank_t::instantaneous_frequency( &ph[0] , n , Fs , &f[0] );
   return f;
-        
 }
 
 double hilbert_t::phase_events( const std::vector<int> & e , 
@@ -184,61 +360,3 @@ double hilbert_t::phase_events( const std::vector<int> & e ,
 
   return itpc;
 }
-
-
-
-
-
-void hilbert_t::unwrap( std::vector<double> * p ) const 
-{
-  
-  // http://homepages.cae.wisc.edu/~brodskye/mr/phaseunwrap/unwrap.c
-
-  const int n = p->size();
-  
-  std::vector<double> dp( n );
-  std::vector<double> dps( n );
-  std::vector<double> dp_corr( n );
-  std::vector<double> cumsum( n );
-
-  // default tol in matlab
-  double cutoff = M_PI;   
-  
-  // incremental phase variation 
-  // MATLAB: dp = diff(p, 1, 1);
-  for (int j = 0; j < n-1; j++)
-    dp[j] = (*p)[j+1] - (*p)[j];
-  
-  // equivalent phase variation in [-pi, pi]
-  // MATLAB: dps = mod(dp+dp,2*pi) - pi;
-  for (int j = 0; j < n-1; j++)
-    dps[j] = (dp[j]+M_PI) - floor((dp[j]+M_PI) / (2*M_PI))*(2*M_PI) - M_PI;
-  
-  // preserve variation sign for +pi vs. -pi
-  // MATLAB: dps(dps==pi & dp>0,:) = pi;
-  for (int j = 0; j < n-1; j++)
-    if ((dps[j] == -M_PI) && (dp[j] > 0))
-      dps[j] = M_PI;
-
-  // incremental phase correction
-  // MATLAB: dp_corr = dps - dp;
-  for (int j = 0; j < n-1; j++)
-    dp_corr[j] = dps[j] - dp[j];
-      
-  // Ignore correction when incremental variation is smaller than cutoff
-  // MATLAB: dp_corr(abs(dp)<cutoff,:) = 0;
-  for (int j = 0; j < n-1; j++)
-    if (fabs(dp[j]) < cutoff)
-      dp_corr[j] = 0;
-
-  // Find cumulative sum of deltas
-  // MATLAB: cumsum = cumsum(dp_corr, 1);
-  cumsum[0] = dp_corr[0];
-  for (int j = 1; j < n-1; j++)
-    cumsum[j] = cumsum[j-1] + dp_corr[j];
-
-  // Integrate corrections and add to P to produce smoothed phase values
-  // MATLAB: p(2:m,:) = p(2:m,:) + cumsum(dp_corr,1);
-  for (int j = 1; j < n; j++)
-    (*p)[j] += cumsum[j-1];
-}
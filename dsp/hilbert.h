@@ -26,8 +26,59 @@
 
 struct edf_t;
 struct param_t;
+struct fir_impl_t;
 
 #include <vector>
+#include <cstddef>
+
+
+//
+// Batched (filter-)Hilbert transform for several signals of the same
+// length n (e.g. channels at one sampling rate): optional band-pass
+// filtering with a shared FIR (designed once per fs, band, ripple and
+// tw), then the analytic signal by a real-to-complex FFT and a
+// complex-to-real inverse of the quadrature (-i.sign(f)) component,
+// with the shared FFTW plans.  Outputs go to caller-provided buffers
+// of n points (n-1 for instantaneous frequency); any can be NULL
+//
+
+struct hilbert_bank_t
+{
+  
+  // Hilbert transform only (signals already filtered); fs is needed
+  // only for instantaneous frequencies
+  hilbert_bank_t( const int n , const double fs = 0 );
+
+  // filter-Hilbert
+  hilbert_bank_t( const int n , const int sr , double lwr , double upr , double ripple , double tw );
+  
+  // one signal
+  void apply( const double * x , 
+	      double * filtered , 
+	      double * ph , 
+	      double * mag , 
+	      double * ifrq = NULL ) const;
+  
+  // several signals, in parallel (threads=N); each output is either
+  // empty (not wanted) or has one (possibly NULL) pointer per signal
+  void apply( const std::vector<const double*> & x , 
+	      const std::vector<double*> & filtered , 
+	      const std::vector<double*> & ph , 
+	      const std::vector<double*> & mag , 
+	      const std::vector<double*> & ifrq ) const;
+  
+  // n-1 instantaneous frequencies from n (wrapped) phases
+  static void instantaneous_frequency( const double * ph , const int n , const double fs , double * f );
+
+  int n;
+
+  double fs;
+  
+  // NULL if no filtering
+  const fir_impl_t * fir;
+
+};
+
 
 struct hilbert_t
 {
@@ -53,8 +104,7 @@ struct hilbert_t
   
 private:
 
-  void proc();
-  void unwrap(std::vector<double> * ) const;
+  void proc( const hilbert_bank_t & bank , const std::vector<double> & d );
 
   std::vector<double> input;
   std::vector<double> ph;
@@ -81,51 +81,21 @@ void dsptools::leave_one_out( edf_t & edf , param_t & param )
   // for each channel, assume it is bad, and calculate G and Gi based on all other channels
   //
   
-  std::vector<Data::Matrix<double> > invG;
-  std::vector<Data::Matrix<double> > Gi;
-  std::vector<std::vector<int> > good_channels;
+  // the montage evaluates G once for all channels; each leave-one-out
+  // set of weights then follows from a downdate of its inverse
+  
+  clocs_montage_t * montage = clocs_montage_t::get( clocs , signals );
+  
+  std::vector<const clocs_montage_t::subset_t*> subsets;
   
   if ( ! globals::silent ) 
     logger << " generating leave-one-out G matrices for " << signals.size() << " signals\n";
   
   for (int s=0;s<ns;s++)
     {
-
-      signal_list_t good_signals;
-      signal_list_t bad_signals;
-      
-      // generate 'good channel' list (i.e. all other than 's'
-      std::vector<int> gc;
-      for (int s2=0;s2<ns;s2++) 
-	{
-	  if ( s != s2 ) 
-	    {
-	      gc.push_back( s2 );
-	      good_signals.add( signals(s2) , signals.label(s2) );
-	    }
-	  else
-	    {
-	      bad_signals.add( signals(s2) , signals.label(s2) );
-	    }
-	}
-      
-      //
-      // make matrices
-      //
-
-      Data::Matrix<double> _invG;
-      Data::Matrix<double> _Gi;
-      
-      clocs.make_interpolation_matrices( good_signals , bad_signals , &_invG , &_Gi );
-      
-      //
-      // save all
-      //
-
-      invG.push_back( _invG );
-      Gi.push_back( _Gi );
-      good_channels.push_back( gc );      
-      
+      std::vector<bool> bad( ns , false );
+      bad[s] = true;
+      subsets.push_back( &montage->subset( bad ) );
     }
   
 
@@ -160,12 +130,10 @@ void dsptools::leave_one_out( edf_t & edf , param_t & param )
       
       for (int s=0;s<ns;s++)
 	{
-	  Data::Matrix<double> & _invG = invG[s];
-	  Data::Matrix<double> & _Gi = Gi[s];
-	  std::vector<int> & _good_channels = good_channels[s];
-
+	  const clocs_montage_t::subset_t & subset = *subsets[s];
+	  
 	  // interpolate
-	  Data::Matrix<double> I = clocs.interpolate( D , _good_channels , _invG, _Gi );
+	  Data::Matrix<double> I = clocs.interpolate( D , subset.good , subset.W );
 	  
 	  // calculate error 
 // 	  logger << "X " << s << "\t" 
@@ -29,8 +29,10 @@
 #include "edf/edf.h"
 #include "edf/slice.h"
 #include "db/db.h"
+#include "helper/threads.h"
 
 #include <cmath>
+#include <algorithm>
 
 
 
@@ -146,8 +148,8 @@ void dsptools::compute_mi( edf_t & edf , param_t & param )
 	  	  
 	  interval_t interval = edf.timeline.wholetrace();
 	  
-	  slice_t slice1( edf , signals(i) , interval );
-	  slice_t slice2( edf , signals(j) , interval );
+	  slice_t slice1( edf , signals(i) , interval , 1 , false );
+	  slice_t slice2( edf , signals(j) , interval , 1 , false );
 	  
 	  const std::vector<double> * d1 = slice1.pdata();
 	  const std::vector<double> * d2 = slice2.pdata();
@@ -224,8 +226,8 @@ void dsptools::compute_mi( edf_t & edf , param_t & param )
 		  // Get data
 		  //
 
- 		  slice_t slice1( edf , signals(i) , interval );
- 		  slice_t slice2( edf , signals(j) , interval );
+ 		  slice_t slice1( edf , signals(i) , interval , 1 , false );
+ 		  slice_t slice2( edf , signals(j) , interval , 1 , false );
 		  
  		  const std::vector<double> * d1 = slice1.pdata();
 		  const std::vector<double> * d2 = slice2.pdata();
@@ -458,52 +460,123 @@ void mi_t::bin_data()
 }
 
 
+//
+// Permutation: each replicate circularly shifts b relative to a.  Shifts
+// are drawn up front, in replicate order, so results depend only on the
+// seed (not on the number of threads); blocks of replicates are then run
+// in parallel, each re-using one flat (nbins x nbins) buffer of joint
+// counts, with p.log2(p) terms looked up by count
+//
+
+static const int mi_block_reps = 32;
+
+struct mi_permute_job_t : public parallel_job_t
+{
+
+  mi_permute_job_t( const mi_t & mi , 
+		    const std::vector<int> & shifts , 
+		    const std::vector<int> & rowa , 
+		    const std::vector<double> & plogp , 
+		    std::vector<double> & stats )
+  : mi(mi) , shifts(shifts) , rowa(rowa) , plogp(plogp) , stats(stats) { } 
+  
+  const mi_t & mi;
+
+  const std::vector<int> & shifts;
+
+  // bina[i] * nbins, i.e. row offsets into the joint counts
+  const std::vector<int> & rowa;
+
+  // p.log2(p) for p = count / n
+  const std::vector<double> & plogp;
+
+  std::vector<double> & stats;
+  
+  void run( const int blk )
+  {
+
+    const int n = mi.n;
+    const int nb2 = mi.nbins * mi.nbins;
+
+    const int * ra = &(rowa[0]);
+    const int * b  = &(mi.binb[0]);
+
+    std::vector<int> pab( nb2 );
+
+    const int r1 = blk * mi_block_reps;
+    const int nrep = shifts.size();
+    const int r2 = r1 + mi_block_reps < nrep ? r1 + mi_block_reps : nrep;
+    
+    for (int r=r1;r<r2;r++)
+      {
+
+	std::fill( pab.begin() , pab.end() , 0 );
+	
+	// count all, i.e. a[i] with b[i+shift], wrapping around
+	const int shift = shifts[r];
+	const int m = n - shift;
+	
+	for (int i=0;i<m;i++) ++pab[ ra[i] + b[i+shift] ];
+	for (int i=m;i<n;i++) ++pab[ ra[i] + b[i-m] ];
+
+	// shannonize, calc
+	double pjointinf = 0;
+	for (int k=0;k<nb2;k++)
+	  pjointinf -= plogp[ pab[k] ];
+	
+	stats[r] = mi.infa + mi.infb - pjointinf;
+      }
+  }
+
+};
+
+
 void mi_t::permute( const int nrep , double * pemp , double * pz )
 {
-  double r = 0;
-  std::vector<double> stats;
 
+  // determine random shifts
+  std::vector<int> shifts( nrep );
   for (int p=0;p<nrep;p++)
+    shifts[p] = CRandom::rand( n );
+  
+  // row offsets, and marginal counts
+  std::vector<int> rowa( n );
+  std::vector<int> cnta( nbins , 0 );
+  std::vector<int> cntb( nbins , 0 );
+  for (int i=0;i<n;i++)
     {
-      //      std::cerr << ".";
+      rowa[i] = bina[i] * nbins;
+      ++cnta[ bina[i] ];
+      ++cntb[ binb[i] ];
+    }
 
-      // determine random shift
-      int shift = CRandom::rand( n );      
-      
-      // joint distrib.
-      std::vector<std::vector<double> > pab( nbins );
-      for (int j=0;j<nbins;j++) pab[j].resize( nbins , 0 );
-      
-      // count all
-      for (int i=0;i<n;i++) 
-	{
-	  int permi = i + shift;
-	  if (  permi >= n ) permi -= n;
-	  
-	  //	  std::cout << "permi " << i <<" " << permi << " " << n << "\n";
-	  ++pab[ bina[i] ][ binb[permi] ];
-	}
-      
-      // init
-      double pjointinf = 0;
-      
-      // shannonize, calc
-      for (int j=0;j<nbins;j++)
-	for (int k=0;k<nbins;k++)
-	  {
-	    pab[j][k] /= (double)n;
-	    pjointinf -= pab[j][k] * log2( pab[j][k] + eps );
-	  }
-      
-      
-      double stat = infa + infb - pjointinf;
-      
-      if ( stat >= mutinf ) ++r;
-      
-      stats.push_back( stat );
-      
+  // a joint count cannot exceed either marginal count
+  int maxa = 0 , maxb = 0;
+  for (int j=0;j<nbins;j++)
+    {
+      if ( cnta[j] > maxa ) maxa = cnta[j];
+      if ( cntb[j] > maxb ) maxb = cntb[j];
+    }
+  const int maxc = maxa < maxb ? maxa : maxb ; 
+
+  std::vector<double> plogp( maxc + 1 );
+  for (int c=0;c<=maxc;c++)
+    {
+      double p = c / (double)n;
+      plogp[c] = p * log2( p + eps );
     }
   
+  // replicates
+  std::vector<double> stats( nrep );
+
+  mi_permute_job_t job( *this , shifts , rowa , plogp , stats );
+
+  Helper::parallel_for( ( nrep + mi_block_reps - 1 ) / mi_block_reps , job );
+
+  double r = 0;
+  for (int p=0;p<nrep;p++)
+    if ( stats[p] >= mutinf ) ++r;
+  
   *pemp = ( r+1.0 ) / ( nrep+1.0 ); 
 
   double null_mean = MiscMath::mean( stats );
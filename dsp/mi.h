@@ -31,6 +31,9 @@ struct param_t;
 struct mi_t
 {
 
+  // replicates for permute()
+  friend struct mi_permute_job_t;
+
   mi_t() { } 
 
   mi_t( const std::vector<double> & a , const std::vector<double> & b );
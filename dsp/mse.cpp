@@ -24,6 +24,7 @@
 #include "mse.h"
 
 #include "miscmath/miscmath.h"
+#include "helper/threads.h"
 
   
 #include <iostream>
@@ -55,6 +56,173 @@ _______________________________________________________________________________
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <algorithm>
+#include <stdint.h>
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#define MSE_SIMD_X86
+#include <immintrin.h>
+#endif
+
+
+//
+// Template matching for sample entropy: of the first n-m templates
+// (of length m+1) in y, count pairs that match on their first m
+// points (B) and on all m+1 points (A), where points match if
+// |y[i]-y[j]| < r (or <= r, if not strict).  Templates are sorted on
+// their first point, so that only pairs already within r on that point
+// are compared; as each comparison is the same as in the all-pairs
+// loops below, so are the counts.
+//
+
+#ifdef MSE_SIMD_X86
+
+__attribute__((target("avx2")))
+static void mse_window_avx2( const double * cols , const int np , const int m , 
+			     const int p , const int hi , const double r , const bool strict , 
+			     int64_t * A , int64_t * B )
+{
+  const __m256d vr = _mm256_set1_pd( r );
+  const __m256d sign = _mm256_set1_pd( -0.0 );
+  const __m256d all = _mm256_castsi256_pd( _mm256_set1_epi64x( -1 ) );
+  int64_t a = 0 , b = 0;
+  int q = p + 1;
+  for ( ; q + 4 <= hi ; q += 4 )
+    {
+      __m256d mb = all;
+      for (int k=1;k<=m;k++)
+	{
+	  const double * c = cols + (int64_t)k * np;
+	  const __m256d d = _mm256_andnot_pd( sign , _mm256_sub_pd( _mm256_loadu_pd( c + q ) , _mm256_set1_pd( c[p] ) ) );
+	  const __m256d match = strict ? _mm256_cmp_pd( d , vr , _CMP_LT_OQ ) : _mm256_cmp_pd( d , vr , _CMP_LE_OQ );
+	  if ( k == m ) 
+	    {
+	      b += __builtin_popcount( _mm256_movemask_pd( mb ) );
+	      mb = _mm256_and_pd( mb , match );
+	    }
+	  else
+	    mb = _mm256_and_pd( mb , match );
+	}
+      a += __builtin_popcount( _mm256_movemask_pd( mb ) );
+    }
+
+  for ( ; q < hi ; q++ )
+    {
+      int k = 1;
+      for ( ; k <= m ; k++ )
+	{
+	  const double * c = cols + (int64_t)k * np;
+	  const double d = fabs( c[q] - c[p] );
+	  if ( ! ( strict ? d < r : d <= r ) ) break;
+	}
+      if ( k >= m ) ++b;
+      if ( k > m ) ++a;
+    }
+
+  *A += a;
+  *B += b;
+}
+
+#endif
+
+static void mse_window( const double * cols , const int np , const int m , 
+			const int p , const int hi , const double r , const bool strict , 
+			int64_t * A , int64_t * B )
+{
+#ifdef MSE_SIMD_X86
+  static const bool avx2 = __builtin_cpu_supports( "avx2" );
+  if ( avx2 ) { mse_window_avx2( cols , np , m , p , hi , r , strict , A , B ); return; }
+#endif
+  int64_t a = 0 , b = 0;
+  for (int q = p + 1 ; q < hi ; q++ )
+    {
+      int k = 1;
+      for ( ; k <= m ; k++ )
+	{
+	  const double * c = cols + (int64_t)k * np;
+	  const double d = fabs( c[q] - c[p] );
+	  if ( ! ( strict ? d < r : d <= r ) ) break;
+	}
+      if ( k >= m ) ++b;
+      if ( k > m ) ++a;
+    }
+  *A += a;
+  *B += b;
+}
+
+
+static void mse_count_matches( const std::vector<double> & y , const int m , const double r , const bool strict , 
+			       double * A , double * B )
+{
+  
+  *A = *B = 0;
+
+  const int nt = (int)y.size() - m;
+  
+  if ( m < 1 || nt < 2 ) return;
+  
+  // sort templates on first point (NaNs never match, so drop them)
+  std::vector<std::pair<double,int> > order;
+  order.reserve( nt );
+  for (int i=0;i<nt;i++) 
+    if ( y[i] == y[i] ) order.push_back( std::make_pair( y[i] , i ) );
+  std::sort( order.begin() , order.end() );
+  
+  // points k = 0..m of each template, contiguous per k, in sorted order
+  const int np = order.size();
+  std::vector<double> cols( (int64_t)( m + 1 ) * np );
+  for (int k=0;k<=m;k++)
+    for (int p=0;p<np;p++) 
+      cols[ (int64_t)k * np + p ] = y[ order[p].second + k ];
+
+  const double * c0 = &(cols[0]);
+  
+  int64_t a = 0 , b = 0;
+
+  // [p+1,hi) are the templates within r of template p on the first
+  // point: as |c0[q]-c0[p]| only grows with q (and shrinks with p), hi
+  // only moves forward
+  
+  int hi = 0;
+  
+  for (int p=0;p<np;p++)
+    {
+      if ( hi < p + 1 ) hi = p + 1;
+      while ( hi < np ) 
+	{
+	  const double d = fabs( c0[hi] - c0[p] );
+	  if ( ! ( strict ? d < r : d <= r ) ) break;
+	  ++hi;
+	}
+      mse_window( c0 , np , m , p , hi , r , strict , &a , &b );
+    }
+
+  *A = a;
+  *B = b;
+}
+
+
+//
+// Scales (coarse-graining + SampEn) in parallel
+//
+
+struct mse_scale_job_t : public parallel_job_t 
+{
+  mse_scale_job_t( mse_t & mse , const std::vector<double> & zd , const std::vector<int> & scales ) 
+  : mse(mse) , zd(zd) , scales(scales) , res( scales.size() ) { } 
+  
+  mse_t & mse;
+  const std::vector<double> & zd;
+  const std::vector<int> & scales;
+  std::vector<double> res;
+  
+  void run( const int i )
+  {
+    std::vector<double> y = mse.coarse_graining( zd , scales[i] );
+    res[i] = mse.sampen( y , mse.pattern_length() , mse.tolerance() );
+  }
+};
+
 
 
 std::map<int,double> mse_t::calc( const std::vector<double> & d )
@@ -71,18 +239,16 @@ std::map<int,double> mse_t::calc( const std::vector<double> & d )
   //double sdev = SD( zd );
     
   // Iterate over each scale j
+  std::vector<int> scales;
   for (int j = 1; j <= scale_max; j += scale_step)
-    {      
-      
-      std::vector<double> y = coarse_graining( zd , j ) ;
-      
-      // faster version (from mse.c)
-      //retval[j] = sample_entropy( y , 1.0 );
-      
-      // old version (slower)
-      retval[j] = sampen( y , m , r );
-      
-    }
+    scales.push_back( j );
+  
+  mse_scale_job_t job( *this , zd , scales );
+
+  Helper::parallel_for( scales.size() , job );
+
+  for (int i=0;i<scales.size();i++)
+    retval[ scales[i] ] = job.res[i];
   
   return retval;
 
@@ -131,33 +297,25 @@ double mse_t::sample_entropy( const std::vector<double> & y , double sd )
   // m    pattern length parameter  (typically 2)
   // r    pattern match (SD units, i.e. typically SD == 1 ) (typically 0.15)
   
-  std::vector<int> cont( m+2 , 0 );  
+  // pairs i < l (of the first n-m templates) matching on the first m
+  // points (cont[m]) and on all m+1 points (cont[m+1]), where points
+  // match if within r_new (inclusive)
   
-  const int nlin_j = y.size() - m; 
-   
   double r_new = r * sd;
 
-  for (int i = 0; i < nlin_j; ++i) 
-    {
-      for (int l = i+1; l < nlin_j; ++l) 
- 	{ /*self-matches are not counted*/
- 	  int k = 0;
- 	  while (k < m && fabs(y[i+k] - y[l+k]) <= r_new)
- 	    cont[++k]++;
- 	  if (k == m && fabs(y[i+m] - y[l+m]) <= r_new)
- 	    cont[m+1]++;
- 	} 
-    }     
+  double cont_m = 0 , cont_m1 = 0;
   
+  mse_count_matches( y , m , r_new , false , &cont_m1 , &cont_m );
+
   //    for (i = 1; i <= m; i++)
   //      if (cont[i] == 0 || cont[i-1] == 0)
   //        SE[j][i] = -log((double)1/((nlin_j)*(nlin_j-1)));
   //      else
   //        SE[j][i] = -log((double)cont[i+1]/cont[i]);
   
-  if ( cont[m+1] == 0 || cont[m] == 0 ) return -1;
+  if ( cont_m1 == 0 || cont_m == 0 ) return -1;
 
-  return -log( cont[m+1]/(double)cont[m] );
+  return -log( cont_m1 / cont_m );
 
   //   std::cout << "v2 = " << cont[m+1] << " / " << cont[m] << " " << -log( cont[m+1]/(double)cont[m] ) <<"\n";
 }
@@ -166,79 +324,23 @@ double mse_t::sample_entropy( const std::vector<double> & y , double sd )
 
 // sampen() calculates an estimate of sample entropy 
 
-double mse_t::sampen( const std::vector<double> y , int M , double r )
+double mse_t::sampen( const std::vector<double> & y , int M , double r )
 {
   
-  const int n = y.size();
-    
-  ++M;
-  
-  std::vector<long> run( n );
-  std::vector<long> lastrun( n );
-  std::vector<double> A(M);
-  std::vector<double> B(M);
-  std::vector<double> p(M);
+  // As the original (all-pairs) sampen(): A[M] is the number of pairs
+  // of templates of length M+1 that match (|y[i]-y[j]| < r at each
+  // point), and B[M-1] the number of pairs of length-M templates,
+  // excluding the template at the very end, i.e. both over the first
+  // n-M templates; SampEn is -log( A[M] / B[M-1] )
 
-  /* start running */
-  for (int i = 0; i < n - 1; i++) 
-    {
-      int nj = n - i - 1;
-      double y1 = y[i];
-      for (int jj = 0; jj < nj; jj++) 
-	{
-	  int j = jj + i + 1;
-	  if (((y[j] - y1) < r) && ((y1 - y[j]) < r)) 
-	    {
-	      run[jj] = lastrun[jj] + 1;
-	      int M1 = M < run[jj] ? M : run[jj];
-	      for (int mi = 0; mi < M1; mi++) 
-		{
-		  A[mi]++;
-		  if (j < n - 1)
-		    B[mi]++;
-		}
-	    }
-	  else
-	    run[jj] = 0;
-	}/* for jj */
-      for (int j = 0; j < nj; j++)
-	lastrun[j] = run[j];
-    }/* for i */
+  double A = 0 , B = 0;
   
-  int N = (long) (n * (n - 1) / 2);
-  p[0] = A[0] / N;
-  //  printf("SampEn(0,%g,%d) = %lf\n", r, n, -log(p[0]));
-
-  if ( false || 1 ) 
-    {
-      
-      for (int mi = 1; mi < M; mi++) 
-	{
-	  p[mi] = A[mi] / B[mi - 1];
-	  if (p[mi] == 0)
-	    {
-	      //	std::cout << "sampEn " << m << " " << r << " " << n << " " << "NA" << "\n";
-	      //std::cerr << "sampEn ... no matches!\n";
-	      //printf("No matches! SampEn((%d,%g,%d) = Inf!\n", m, r, n);
-	    }
-	  else
-	    {
-	      //std::cout << "sampEn " << mi << " " << r << " " << n << " " << -log(p[mi]) << "\n";
-	      //      printf("SampEn(%d,%g,%d) = %lf\n", m, r, n, 
-	    }
-	}
-    }
-
-  const int mi = m;
-  p[mi] = A[mi] / B[mi-1];
-
-  //  std::cout << "final A/B " << A[mi] << " " << B[mi-1] << " (" << A[mi-1] << ") " << -log(p[mi]) << "\n";
-
-  // return SE for m=2 
-
+  mse_count_matches( y , M , r , true , &A , &B );
+  
+  const double p = A / B;
 
-  if (p[mi] == 0) return -1;
-  return -log(p[mi]);
+  if ( p == 0 ) return -1;
+  return -log( p );
 
 }
 
@@ -37,7 +37,7 @@ struct mse_t
 
   double SD( const std::vector<double> & x );
   
-  double sampen( const std::vector<double> y , int M , double r );
+  double sampen( const std::vector<double> & y , int M , double r );
 
   // MSE
   
@@ -54,6 +54,10 @@ struct mse_t
     {   }
   
   std::map<int,double> calc( const std::vector<double> & d );
+
+  int pattern_length() const { return m; } 
+
+  double tolerance() const { return r; } 
   
 private:
 
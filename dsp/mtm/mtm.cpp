@@ -107,7 +107,7 @@ void mtm::wrapper( edf_t & edf , param_t & param )
 	  // Get data
 	  //
 	  
-	  slice_t slice( edf , signals(s) , interval );
+	  slice_t slice( edf , signals(s) , interval , 1 , false );
 	  
 	  const std::vector<double> * d = slice.pdata();	   
 	  
@@ -237,7 +237,7 @@ void mtm::wrapper( edf_t & edf , param_t & param )
 	  
 	  interval_t interval = edf.timeline.epoch( epoch );
  
-	  slice_t slice( edf , signals(s) , interval );
+	  slice_t slice( edf , signals(s) , interval , 1 , false );
 	  
 	  const std::vector<double> * d = slice.pdata();	   
 	  
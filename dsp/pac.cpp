@@ -30,6 +30,7 @@
 #include "edf/slice.h"
 #include "db/db.h"
 #include "helper/helper.h"
+#include "helper/threads.h"
 
 #include <iostream>
 
@@ -70,6 +71,10 @@ void dsptools::pac( edf_t & edf , param_t & param )
 
   // using epochs or not?
   bool epoched = param.has( "epoch" );
+
+  // optionally, decimate phase/amplitude series, and/or hold them as floats
+  const int decimation = param.has( "dec" ) ? param.requires_int( "dec" ) : 1 ;
+  const bool single_precision = param.has( "float" );
   
   // for each signal
   for (int s=0;s<ns;s++)
@@ -119,7 +124,7 @@ void dsptools::pac( edf_t & edf , param_t & param )
 	  // Fetch data slice
 	  //
 	  
-	  slice_t slice( edf , signals(s) , interval );
+	  slice_t slice( edf , signals(s) , interval , 1 , false );
 	  
 	  const std::vector<double> * signal = slice.pdata();
 
@@ -129,6 +134,9 @@ void dsptools::pac( edf_t & edf , param_t & param )
 	  //
 	  
 	  pac_t pac( signal , f4p , f4a , srate , nreps );
+
+	  pac.decimation = decimation;
+	  pac.single_precision = single_precision;
 	  
 	  bool okay = pac.calc();
 	  
@@ -173,135 +181,215 @@ void dsptools::pac( edf_t & edf , param_t & param )
 }
 
 
-bool pac_t::calc() 
+//
+// pac_t::calc() : each phase series (as exp(i.phase)) and each amplitude
+// envelope is computed once, as a 'bank' of na + nb wavelet transforms;
+// all comodulogram cells are then computed from the bank, in parallel.
+// Permutation offsets are drawn up front, in cell order, so results
+// are the same as a serial loop over cells
+//
+
+// for wavelets, for high temporal resolution, set a relatively 
+// small number of cycles
+static const int pac_n_cycles = 7;
+
+template<typename T>
+struct pac_bank_t
 {
-  
-  for (int fa=0;fa<frq4phase.size();fa++)
-    for (int fb=0;fb<frq4pow.size();fb++)
-      {	
-	
-	// for wavelets, for high temporal resolution, set a relatively 
-	// small number of cycles
-	
-	//	const int n_cycles = 4;
-	const int n_cycles = 7;
-	
-	//
-	// wavelet for phase
-	//
-
-	CWT phase_cwt;	
-	phase_cwt.set_sampling_rate( srate );  
-	phase_cwt.add_wavelet( frq4phase[fa] , n_cycles );  
-	phase_cwt.load( data );
-	phase_cwt.run();
-	
-	//
-	// wavelet for power
-	//
-	
-	CWT pow_cwt;	
-	pow_cwt.set_sampling_rate( srate );  
-	pow_cwt.add_wavelet( frq4pow[fb] , n_cycles );  
-	pow_cwt.load( data );
-	pow_cwt.run();
-	
-	//
-	// Extract
-	//
+  // exp(i.phase), for each frq4phase
+  std::vector<std::vector<std::complex<T> > > y;
 
-	std::vector<double> angle = phase_cwt.phase(0);
-	std::vector<double> pwr   = pow_cwt.results(0); // get 'raw' power back
-	
-	const int n = angle.size();
+  // 'raw' power, for each frq4pow
+  std::vector<std::vector<T> > x;  
+};
 
-	// std::cout << "sizes = " << angle.size() << " " << pwr.size() << "\n";
-	// for (int i = 0 ; i < angle.size() ; i++ ) 
-	//   std::cout << "PDET\t" << i << "\t"
-	// 	    << angle[i] << "\t"
-	// 	    << pwr[i] << "\n";
-	
-	// Note:   pwr is different compared to example
-	// Note:   angle is offset by 1 compared to example
-	
-	// Note: various differences:  time resolution selected, in examples of using different N versus nextPow2 for convolution size, etc
-	// In broad terms, things line up
 
-	//
-	// Precalculate x and exp(y) 
-	//
+template<typename T>
+struct pac_bank_job_t : public parallel_job_t
+{
+  
+  pac_bank_job_t( const pac_t & pac , pac_bank_t<T> & bank ) 
+  : pac(pac) , bank(bank) { } 
+
+  const pac_t & pac;
+  pac_bank_t<T> & bank;
 
-	std::vector<std::complex<double> > x(n);
- 
-	std::vector<std::complex<double> > y(n);
+  void run( const int i )
+  {
 
-	for (int i=0;i<n;i++)
+    // phase wavelets first, then amplitude
+    const bool phase = i < pac.na;
+    
+    CWT cwt;	
+    cwt.set_sampling_rate( pac.srate );  
+    cwt.add_wavelet( phase ? pac.frq4phase[i] : pac.frq4pow[ i - pac.na ] , pac_n_cycles );  
+    cwt.load( pac.data );
+    cwt.run();
+
+    if ( phase )
+      {
+	std::vector<double> angle = cwt.phase(0);
+	std::vector<std::complex<T> > & y = bank.y[i];
+	const int n = angle.size();
+	y.reserve( ( n + pac.decimation - 1 ) / pac.decimation );
+	for (int j=0;j<n;j+=pac.decimation)
 	  {
-	    x[i] = std::complex<double>( pwr[i] , 0 );
-	    y[i] = exp( std::complex<double>( 0 , angle[i] ) );
+	    std::complex<double> e = exp( std::complex<double>( 0 , angle[j] ) );
+	    y.push_back( std::complex<T>( std::real( e ) , std::imag( e ) ) );
 	  }
+      }
+    else
+      {
+	const std::vector<double> & pwr = cwt.results(0);
+	std::vector<T> & x = bank.x[ i - pac.na ];
+	const int n = pwr.size();
+	x.reserve( ( n + pac.decimation - 1 ) / pac.decimation );
+	for (int j=0;j<n;j+=pac.decimation)
+	  x.push_back( pwr[j] );
+      }
+  }
+  
+};
+
+
+template<typename T>
+struct pac_cell_job_t : public parallel_job_t
+{
+
+  pac_cell_job_t( pac_t & pac , const pac_bank_t<T> & bank , const std::vector<int> & offsets )
+  : pac(pac) , bank(bank) , offsets(offsets) { }
+
+  pac_t & pac;
+  const pac_bank_t<T> & bank;
+
+  // nreps permuted start positions, for each cell
+  const std::vector<int> & offsets;
+  
+  void run( const int c )
+  {
+
+    const int fa = c / pac.nb;
+    const int fb = c % pac.nb;
+    
+    const std::vector<std::complex<T> > & y = bank.y[fa];
+    const std::vector<T> & x = bank.x[fb];
+
+    const int n = y.size();
+
+    //
+    // Calculate PAC
+    //
+    
+    // obsPAC = abs(mean(pwr.*exp(1i*phase)));
+    
+    dcomp sm = 0;
+    
+    for (int i=0; i<n; i++)
+      sm += (double)x[i] * dcomp( y[i].real() , y[i].imag() );
+    
+    double obs = abs( sm / (double)n );
+    
+    //
+    // Permute
+    // 
+    
+    const int nreps = pac.nreps;
+    
+    std::vector<double> ppac( nreps , 0 ); // permuted PACs
+    double p = 1;
+    
+    for (int r=0; r<nreps ; r++ ) 
+      {
 	
-	//
-	// Calculate PAC
-	//
-	
-	// obsPAC = abs(mean(pwr.*exp(1i*phase)));
+	int pp = offsets[ c * nreps + r ];
 	
 	dcomp sm = 0;
 	
 	for (int i=0; i<n; i++)
-	  sm += x[i] * y[i] ;
-	
-	double pac = abs( sm / (double)n );
-	
-	//
-	// Permute
-	// 
-	
-	std::vector<double> ppac( nreps , 0 ); // permuted PACs
-	double p = 1;
-	
-	for (int r=0; r<nreps ; r++ ) 
 	  {
-
-	    // from 0..n, select a random time-point (from within 10-90% of signal)
-
-	    int pp = n * 0.1 + CRandom::rand( int( n * 0.8 ) );
-	    
-	    dcomp sm = 0;
-	
-	    for (int i=0; i<n; i++)
-	      {
-
-		sm += x[pp] * y[i] ;
-		
-		// advance permuted position, 
-		++pp;
-
-		// wrapping around when needed
-		if ( pp == n ) pp = 0;
-	      }
 	    
-	    ppac[r] = abs( sm / (double)n );
+	    sm += (double)x[pp] * dcomp( y[i].real() , y[i].imag() );
 	    
-	    if ( ppac[r] >= pac ) ++p;
+	    // advance permuted position, 
+	    ++pp;
 	    
+	    // wrapping around when needed
+	    if ( pp == n ) pp = 0;
 	  }
 	
-	p /= (double)(nreps+1);
+	ppac[r] = abs( sm / (double)n );
 	
-	//
-	// Z-transform observed PAC
-	//
-
-	double pacmean = MiscMath::mean( ppac );
-	double pacsd   = MiscMath::sdev( ppac );
-	double pacZ    = ( pac - pacmean ) / pacsd;
+	if ( ppac[r] >= obs ) ++p;
 	
-	// store
-	z[fa][fb] = pacZ;
-	pval[fa][fb] = p;
       }
+    
+    p /= (double)(nreps+1);
+    
+    //
+    // Z-transform observed PAC
+    //
+    
+    double pacmean = MiscMath::mean( ppac );
+    double pacsd   = MiscMath::sdev( ppac );
+    double pacZ    = ( obs - pacmean ) / pacsd;
+    
+    // store
+    pac.z[fa][fb] = pacZ;
+    pac.pval[fa][fb] = p;
+  }
+
+};
+
+
+template<typename T>
+static void pac_calc( pac_t & pac )
+{
+
+  //
+  // Phase and amplitude bank
+  //
+
+  pac_bank_t<T> bank;
+  bank.y.resize( pac.na );
+  bank.x.resize( pac.nb );
+
+  pac_bank_job_t<T> bank_job( pac , bank );
+  Helper::parallel_for( pac.na + pac.nb , bank_job );
+
+  const int n = bank.y[0].size();
+
+  //
+  // Permutation offsets, for each cell: from 0..n, select a random
+  // time-point (from within 10-90% of signal)
+  //
+
+  const int ncells = pac.na * pac.nb;
+
+  std::vector<int> offsets( ncells * pac.nreps );
+  for (int i=0;i<offsets.size();i++)
+    offsets[i] = n * 0.1 + CRandom::rand( int( n * 0.8 ) );
+  
+  //
+  // Comodulogram
+  //
+
+  pac_cell_job_t<T> cell_job( pac , bank , offsets );
+  Helper::parallel_for( ncells , cell_job );
+  
+}
+
+
+bool pac_t::calc() 
+{
+
+  if ( na == 0 || nb == 0 ) return true;
+
+  if ( decimation < 1 ) Helper::halt( "PAC decimation must be 1 or more" );
+  
+  if ( single_precision ) 
+    pac_calc<float>( *this );
+  else
+    pac_calc<double>( *this );
   
   return true;
   
@@ -47,6 +47,8 @@ struct pac_t
     na = nb = 1;
     srate = sr;
     nreps = nr;
+    decimation = 1;
+    single_precision = false;
     size();
   }
   
@@ -63,6 +65,8 @@ struct pac_t
     data = d;
     srate = sr;
     nreps = nr;
+    decimation = 1;
+    single_precision = false;
     size();
   }
 
@@ -119,6 +123,11 @@ struct pac_t
   int srate;
   int na,nb;
   int nreps;
+
+  // optionally, decimate the phase and amplitude series (after the
+  // wavelet transform) and/or store them as single-precision floats
+  int decimation;
+  bool single_precision;
 };
 
 
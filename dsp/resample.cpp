@@ -105,7 +105,7 @@ void dsptools::resample_channel( edf_t & edf , const int s , const int nsr )
   
   interval_t interval = edf.timeline.wholetrace();
 
-  slice_t slice( edf , s , interval );
+  slice_t slice( edf , s , interval , 1 , false );
   
   
   const std::vector<double> * d = slice.pdata();
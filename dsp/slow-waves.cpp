@@ -177,7 +177,8 @@ slow_waves_t::slow_waves_t( edf_t & edf , const param_t & param )
   // Other stuff?
   //
 
-  // time_locked_spectral_analysis( edf , d, Fs );
+  if ( param.has( "tl-spectral" ) ) 
+    time_locked_spectral_analysis( d , sr );
 
 
   //
@@ -803,6 +804,53 @@ int slow_waves_t::getbin( double x , const std::vector<double> & th , int last_b
   return nb-1;
 }
 
+void event_locked_t::gather( const std::vector<double> & sig , const std::vector<int> & centres , const bool keep )
+{
+
+  const int n0 = n;
+  
+  n += centres.size();
+
+  if ( keep ) x.resize( (size_t)n * np , 0 );
+
+  const int sz = sig.size();
+  
+  for (int i=0;i<centres.size();i++)
+    {
+
+      double * w = keep ? &x[ (size_t)( n0 + i ) * np ] : NULL ;
+      
+      const int lower = centres[i] - nleft ; 
+
+      // only the part of the window within the signal
+      const int p0 = lower < 0 ? - lower : 0 ;
+      const int p1 = lower + np > sz ? sz - lower : np ;
+      
+      for (int pos = p0 ; pos < p1 ; pos++ )
+	{
+	  const double v = sig[ lower + pos ];
+	  means.add( pos , v );
+	  if ( keep ) w[pos] = v;
+	}
+    }
+  
+}
+
+
+std::vector<int> slow_waves_t::centres( const int position ) const
+{
+  std::vector<int> c( sw.size() );
+  for (int i=0;i<sw.size();i++)
+    {
+      if      ( position == -1 ) c[i] = sw[i].down_peak_sp;
+      else if ( position == 0 ) c[i] = sw[i].interval.start;
+      else if ( position == +1 ) c[i] = sw[i].up_peak_sp;
+      else Helper::halt("internal error in slow_waves_t::centres()" );
+    }
+  return c;
+}
+
+
 std::vector<double> slow_waves_t::phase_locked_averaging( const std::vector<double> * sig , int nbins , const std::vector<bool> * subset )
 {
 
@@ -812,8 +860,7 @@ std::vector<double> slow_waves_t::phase_locked_averaging( const std::vector<doub
       return sigmean;
     }
 
-  std::vector<double> sigmean( nbins , 0 );
-  std::vector<int> sigcnt( nbins , 0 );
+  running_means_t sigmean( nbins );
 
   // phase is 0..360 degrees, with 0 as pos-2-neg crossing
   
@@ -841,8 +888,7 @@ std::vector<double> slow_waves_t::phase_locked_averaging( const std::vector<doub
 	    {
 	      int b = getbin( phase[p] , th , last_bin , nbins );
 	      last_bin = b;
-	      sigmean[b] += (*sig)[p];
-	      ++sigcnt[b];	 
+	      sigmean.add( b , (*sig)[p] );
 	    }
 	}
 
@@ -850,9 +896,7 @@ std::vector<double> slow_waves_t::phase_locked_averaging( const std::vector<doub
     }
 
   // get mean
-  for (int j=0;j<sigmean.size();j++) sigmean[j] /= (double)sigcnt[j];
-
-  return sigmean;
+  return sigmean.means();
 }
 
 
@@ -868,71 +912,15 @@ std::vector<double> slow_waves_t::time_locked_averaging( const std::vector<doubl
     return sigmean;
   }
   
-  // position
-  //   0 onset 
-  //  -1 negative peak (default)
-  //  +1 positive peak
-  
-  // around each slow wave peak, average up to sr*left points before
-  // and sr*right points after
+  // around each slow wave peak (or onset, see centres()), average up
+  // to sr*left points before and sr*right points after; the windows
+  // themselves are not needed, only their means
 
-  int nleft  = sr*left;
-  int nright = sr*right;
-  int np = nleft + 1 + nright;
- 
-  std::vector<double> sigmean( np , 0 );  
-  std::vector<double> sigcnt( np , 0 );
-
-    
-  for (int i=0;i<sw.size();i++)
-    {
-      
-      // interval in sample-points, plus window
-      // centered around down-peak of each SW
-      // by default, but can be onset or 
-      // positive peak
-
-      int centre;
-      if      ( position == -1 ) centre = sw[i].down_peak_sp;
-      else if ( position == 0 ) centre = sw[i].interval.start;
-      else if ( position == +1 ) centre = sw[i].up_peak_sp;
-      else Helper::halt("internal error in slow_waves_t::time_locked_averaging()" );
-      
-      // shuffle?
-      if ( 0 ) 
-	{
-	  int offset = CRandom::rand( 3 - 6 * sr );
-	  centre += offset;
-	  logger << "offset = " << offset << "\n";
-	}
-
-      
-      int lower = centre - nleft ; 
-      int upper = centre + nright ;
-      int pos = 0;
-      
-      for (int j = lower ; j <= upper ; j++ )
-	{
-	  if ( j < 0 ) { ++pos; continue; }
-	  if ( j >= sig->size() ) { ++pos; continue; }
-	  if ( pos >= np ) Helper::halt("internal error in slow_waves_t");
-	  // track means
-	  sigmean[pos] += (*sig)[j];	  
-	  sigcnt[pos]++;
-	  ++pos;
-	  
-	  //	  std::cout << "pos " << pos << " " << np << " " << centre << " " << nleft << " " << nright << " " << lower << " " << upper << "\n";
-	}
-      
-      // next slow wave
-    }      
+  event_locked_t windows( sr*left , sr*right );
   
-  // get means
-    
-  for (int j=0;j<np;j++)
-    sigmean[j] /= (double)sigcnt[j];
-  
-  return sigmean;
+  windows.gather( *sig , centres( position ) , false );
+
+  return windows.means.means();
   
 }
 
@@ -941,12 +929,12 @@ std::vector<double> slow_waves_t::time_locked_averaging( const std::vector<doubl
 // Seed on SW, consider spindle/wavelet power
 //
 
-void slow_waves_t::time_locked_spectral_analysis( edf_t & edf , const std::vector<double> * sig , double sr, double window_sec )
+void slow_waves_t::time_locked_spectral_analysis( const std::vector<double> * sig , double sr, double window_sec )
 {
 
-  logger << " time-locked analysis of slow waves\n";
-
   if ( sw.size() == 0 ) return;
+
+  logger << " time-locked analysis of " << sw.size() << " slow waves\n";
   
   // window in sample-points
   int window_sp = sr * window_sec ;
@@ -959,10 +947,29 @@ void slow_waves_t::time_locked_spectral_analysis( edf_t & edf , const std::vecto
   int npoints_total = npoints + padding_sp * 2;
   const int start = padding_sp ;  // i.e. for output, start reading npoints from 'start' rather than '0' 
   
-  // means
-  std::vector<double> sigmean( npoints , 0 );
-  std::vector<double> phmean( npoints , 0 );
-  std::vector<double> sigcnt( npoints , 0 );
+  // centered around down-peak of each SW
+  std::vector<int> c = centres( -1 );
+  
+  //
+  // Means of signal and phase (analysis window only)
+  //
+
+  event_locked_t sigwin( window_sp , window_sp );
+  sigwin.gather( *sig , c , false );
+  
+  event_locked_t phwin( window_sp , window_sp );
+  phwin.gather( phase , c , false );
+  
+  //
+  // All (padded) analysis windows, as one SW x sample-point matrix;
+  // these may be zero-padded but will always be this fixed size
+  //
+  
+  event_locked_t x( total_window_sp , total_window_sp );
+  x.gather( *sig , c );
+  
+  if ( x.points() != npoints_total ) 
+    Helper::halt( "internal error in SW/CWT"  );
   
   // FFTs
   // const double fmin = 5;
@@ -973,142 +980,63 @@ void slow_waves_t::time_locked_spectral_analysis( edf_t & edf , const std::vecto
   const double fmax = 14;
   const double finc = 1;
 
-  std::vector<std::vector<double> > freq( npoints );
-  
-  // for each slow wave  
-  for (int i=0;i<sw.size();i++)
-    {
-      
-      logger << " considering slow wave " << i+1 << " of " << sw.size() << "\n";
-      //    logger << " npoints = " << npoints_total << "\n";
-      
-      // analysis window may be zero-padded but will always be this fixed size
-      std::vector<double> x( npoints_total , 0 );
-      
-      // interval in sample-points, plus window
-      // centered around down-peak of each SW
-      int centre = sw[i].down_peak_sp;
-      int lower = centre - total_window_sp ; 
-      int upper = centre + total_window_sp ; 
-      int pos = 0;
-      
-      for (int j = lower ; j <= upper ; j++ )
-	{
-	  if ( j < 0 ) { ++pos; continue; }
-	  if ( j >= sig->size() ) { ++pos; continue; }
-	  x[pos] = (*sig)[j];
-	  ++pos;		  
-	}
-      
-      //
-      // Means (analysis window only)
-      //
-      
-      lower = centre - window_sp ; 
-      upper = centre + window_sp ;      
-      pos = 0;
-      for (int j = lower ; j <= upper ; j++ )
-	{
-	  if ( j < 0 ) { ++pos; continue; }
-	  if ( j >= sig->size() ) { ++pos; continue; } 
-	  if ( pos >= npoints) Helper::halt("Internal error SW");	  
-	  // track means
-	  sigmean[pos] += (*sig)[j];
-	  phmean[pos] += phase[j];
-	  sigcnt[pos]++;
-	  ++pos;
-	}
-      
-      
-      //
-      // Run CWT 
-      //
-      
-      CWT cwt;      
-      cwt.set_sampling_rate( sr );
-      int num_cycles = 7;
-      
-      for (double f=fmin;f<=fmax; f+= finc)
-	cwt.add_wavelet( f , num_cycles );  // f( Fc , number of cycles )       
-      
-      cwt.load( &x );      
-      cwt.run();
-
-      int np = cwt.points();
-      int nf = cwt.freqs();      
-      
-      if ( np != npoints_total ) 
-	Helper::halt( "internal error in SW/CWT"  );
-
-      for (int fi=0;fi<nf;fi++)
-	{
-	  
-	  // note, only extract analysis window, not padding
-	  for (int ti=0;ti<npoints; ti++)	    
-	    {
-	      //std::cout << "\t" << cwt.raw_result(fi,start + ti);
-	      freq[ti].push_back( cwt.raw_result(fi,start + ti) );
-	      
-	      //std::cout << "\t" << cwt.result(fi,ti);
-	      //std::cout << "\t" << cwt.raw_result(fi,ti);
-	    }
-	   
-	  std::cout << "\n";
-	}
-
-      // next slow wave
-    }      
-
-
   //
-  // get means
+  // Run CWT, on all windows at once: each wavelet is transformed
+  // once, and power averaged over slow waves
   //
   
-  logger << sigcnt.size() << " " << sigmean.size() << " " << npoints << " " << npoints_total << "\n";
-  for (int j=0;j<npoints;j++)
-    {
-      sigmean[j] /= (double)sigcnt[j];
-      phmean[j] /= (double)sigcnt[j];
-      for (int k=0;k<freq[j].size();k++) freq[j][k] /= (double)sigcnt[j]; 
-    }
+  CWT cwt;      
+  cwt.set_sampling_rate( sr );
+  int num_cycles = 7;
   
+  for (double f=fmin;f<=fmax; f+= finc)
+    cwt.add_wavelet( f , num_cycles );  // f( Fc , number of cycles )       
   
+  cwt.load( &x.x );      
+  cwt.set_pnts_trials( npoints_total , x.events() );
+  cwt.run_trials();
   
   //
-  // Display
+  // get means
   //
+
+  std::vector<double> sigmean = sigwin.means.means();
+  std::vector<double> phmean = phwin.means.means();
+  
+  
+  //
+  // Output, by sample-point relative to the negative peak (and by
+  // frequency for CWT power)
+  //
+
+  writer.var( "SIGMEAN" , "Slow wave time-locked signal mean" );
+  writer.var( "PHMEAN" , "Slow wave time-locked phase mean" );
+  writer.var( "CWT" , "Slow wave time-locked mean wavelet power" );
+  
+  for (int j=0;j<npoints;j++) 
+    {
+      writer.level( j - window_sp , "SP" );
+      writer.value( "SIGMEAN" , sigmean[j] );
+      writer.value( "PHMEAN" , phmean[j] );
+    }
+  writer.unlevel( "SP" );
   
-  std::cout << "SW\t"
-	    << edf.id << "\t"
-	    << "[" << globals::current_tag << "]\t"
-	    << "<name>" << "\t"
-	    << "SIGMEAN";
-  for (int j=0;j<npoints;j++) std::cout << "\t" << sigmean[j];
-  std::cout << "\n";
-  
-  std::cout << "SW\t"
-	    << edf.id << "\t"
-	    << "[" << globals::current_tag << "]\t"
-	    << "<name>" << "\t"
-	    << "PHMEAN";
-  for (int j=0;j<npoints;j++) std::cout << "\t" << phmean[j];
-  std::cout << "\n";
-      
-  double f = fmin;
   int fi = 0;
   for (double f=fmin;f<=fmax; f+= finc)
     {
-      std::cout << "SW\t"
-		<< edf.id << "\t"
-		<< "[" << globals::current_tag << "]\t"
-		<< "<name>" << "\t"
-		<< "CWT" << "\t"
-		<< f;
-      for (int j=0;j<npoints;j++) std::cout << "\t" << freq[j][fi];
-      std::cout << "\n";
+      writer.level( f , globals::freq_strat );
+      
+      // note, only extract analysis window, not padding
+      for (int j=0;j<npoints;j++) 
+	{
+	  writer.level( j - window_sp , "SP" );
+	  writer.value( "CWT" , cwt.raw_result( fi , start + j ) );
+	}
+      writer.unlevel( "SP" );
       
       fi++;
     }
+  writer.unlevel( globals::freq_strat );
 
   
   //
@@ -94,6 +94,65 @@ struct slow_wave_t
 
 };
 
+
+//
+// Streaming means, i.e. sums and counts for each of 'n' positions
+// (sample-points, or phase bins), accumulated one value at a time
+//
+
+struct running_means_t
+{
+  
+  running_means_t( const int n = 0 ) : sum( n , 0 ) , cnt( n , 0 ) { } 
+
+  void add( const int j , const double x ) { sum[j] += x; ++cnt[j]; } 
+  
+  std::vector<double> means() const 
+  {
+    std::vector<double> m( sum.size() );
+    for (int j=0;j<sum.size();j++) m[j] = sum[j] / cnt[j];
+    return m;
+  }
+  
+  std::vector<double> sum;
+  std::vector<double> cnt;
+  
+};
+
+
+//
+// Event-locked windows: for a set of events (e.g. slow-wave negative
+// peaks), the fixed-size windows of 'nleft' points before and
+// 'nright' points after each gathered into one contiguous event x
+// sample-point matrix (row-major, i.e. as CWT::set_pnts_trials()
+// expects, zero outside the signal); means over events of points
+// within the signal are accumulated as windows are gathered
+//
+
+struct event_locked_t
+{
+
+  event_locked_t( const int nleft , const int nright ) 
+  : nleft(nleft) , nright(nright) , np( nleft + 1 + nright ) , n(0) , means( nleft + 1 + nright ) { } 
+
+  // windows around each of 'centres'; if ! keep, only the means are tracked
+  void gather( const std::vector<double> & sig , const std::vector<int> & centres , const bool keep = true );
+  
+  int events() const { return n; }
+  int points() const { return np; }
+  
+  const double * window( const int i ) const { return &x[ i * np ]; } 
+
+  int nleft, nright, np, n;
+  
+  // n x np
+  std::vector<double> x;
+
+  running_means_t means;
+  
+};
+
+
 struct slow_waves_t
 {
 
@@ -170,8 +229,14 @@ struct slow_waves_t
   
   void phase_slow_waves();
   
-  void time_locked_spectral_analysis( edf_t & edf , const std::vector<double> * sig , double sr, double window_sec = 1.5  ); 
+  void time_locked_spectral_analysis( const std::vector<double> * sig , double sr, double window_sec = 1.5  ); 
+
 
+  // centres of all slow waves, as sample-points
+  //   0 onset 
+  //  -1 negative peak (default)
+  //  +1 positive peak
+  std::vector<int> centres( const int position = -1 ) const;
 
   // time-locked and phase-locked averaging
   
@@ -55,7 +55,7 @@ void dsptools::norm_1overf( edf_t & edf , param_t & param )
 
       interval_t interval = edf.timeline.wholetrace();
       
-      slice_t slice( edf , signals(s) , interval );    
+      slice_t slice( edf , signals(s) , interval , 1 , false );    
 
       const std::vector<double> * sig  = slice.pdata();
 
@@ -56,7 +56,7 @@ void dsptools::tv( edf_t & edf , param_t & param )
       
       interval_t interval = edf.timeline.wholetrace();
       
-      slice_t slice1( edf , signals(s) , interval );    
+      slice_t slice1( edf , signals(s) , interval , 1 , false );    
 
       const std::vector<double> * d = slice1.pdata();
       
@@ -55,7 +55,7 @@ void dsptools::cwt( edf_t & edf , param_t & param )
       
       interval_t interval = edf.timeline.wholetrace();
       
-      slice_t slice( edf , signals(s) , interval );
+      slice_t slice( edf , signals(s) , interval , 1 , false );
 
       const std::vector<double> * d = slice.pdata();
       
@@ -102,51 +102,125 @@ void dsptools::hilbert( edf_t & edf , param_t & param )
   
   std::string tag = param.has( "tag" ) ? "_" + param.value( "tag" ) : "" ; 
 
-  for (int s=0;s<ns;s++)
+  interval_t interval = edf.timeline.wholetrace();
+  
+  //
+  // Channels are taken in batches (of up to threads=N consecutive
+  // channels at the same sampling rate) that share one filter-Hilbert
+  // bank and are transformed together; each batch is added to the EDF
+  // and freed before the next is sliced
+  //
+
+  const int batch_size = globals::threads > 1 ? globals::threads : 1 ;
+
+  int s0 = 0;
+
+  while ( 1 ) 
     {
 
-      if ( edf.header.is_annotation_channel( signals(s) ) ) 
-	continue;
+      while ( s0 < ns && edf.header.is_annotation_channel( signals(s0) ) ) 
+	++s0;
       
-      const int Fs = edf.header.sampling_freq( signals(s) );
+      if ( s0 == ns ) break;
       
-      interval_t interval = edf.timeline.wholetrace();
-      
-      slice_t slice( edf , signals(s) , interval );
+      const int Fs = edf.header.sampling_freq( signals(s0) );
 
-      const std::vector<double> * d = slice.pdata();
+      std::vector<int> sigs;
       
-      std::vector<double> mag , phase, ifrq;
-      
-      run_hilbert( *d , Fs , frqs[0] , frqs[1] , ripple , tw , &mag , return_phase ? &phase : NULL , return_ifrq ? &ifrq : NULL );
-            
-      std::string new_mag_label = signals.label(s) + tag + "_hilbert_"   + Helper::dbl2str(frqs[0]) + "_" + Helper::dbl2str( frqs[1] ) + "_mag";
-      std::string new_phase_label = signals.label(s) + tag + "_hilbert_" + Helper::dbl2str(frqs[0]) + "_" + Helper::dbl2str( frqs[1] ) + "_phase";
-      std::string new_ifrq_label = signals.label(s) + tag + "_hilbert_"  + Helper::dbl2str(frqs[0]) + "_" + Helper::dbl2str( frqs[1] ) + "_ifrq";
+      int s = s0;
+      while ( s < ns && (int)sigs.size() < batch_size ) 
+	{
+	  if ( ! edf.header.is_annotation_channel( signals(s) ) ) 
+	    {
+	      if ( edf.header.sampling_freq( signals(s) ) != Fs ) break;
+	      sigs.push_back( s );
+	    }
+	  ++s;
+	}
+
+      s0 = s;
       
-      logger << " Hilbert transform for " << signals.label(s) << " --> " << new_mag_label ;      
+      const int nc = sigs.size();
 
-      if ( return_phase ) 
-	logger << ", " << new_phase_label ;
+      std::vector<std::vector<double> > mag( nc ) , phase( nc ) , ifrq( nc );
 
-      if ( return_ifrq ) 
-	logger << ", " << new_ifrq_label ;
+      std::vector<slice_t*> slices( nc );
+      std::vector<const double*> x( nc );
+      std::vector<double*> pmag( nc ) , pphase , pifrq ;
+      if ( return_phase ) pphase.resize( nc );
+      if ( return_ifrq ) pifrq.resize( nc );
 
-      logger << "\n";
+      int n = 0;
 
-      edf.add_signal( new_mag_label , Fs , mag );
+      for (int i=0;i<nc;i++)
+	{
+	  slices[i] = new slice_t( edf , signals( sigs[i] ) , interval , 1 , false );
+	  
+	  const std::vector<double> * d = slices[i]->pdata();
+	  
+	  n = d->size();
+	  
+	  // nb. ifrq has n-1 estimates (i.e. based on the derivative of the
+	  // phase): add 0 to the end as a null marker, so it can be placed
+	  // back in the EDF
+
+	  mag[i].resize( n );
+	  if ( return_phase ) phase[i].resize( n );
+	  if ( return_ifrq ) ifrq[i].resize( n , 0 );
+	  
+	  x[i] = n ? &(*d)[0] : NULL;
+	  pmag[i] = n ? &mag[i][0] : NULL;
+	  if ( return_phase ) pphase[i] = n ? &phase[i][0] : NULL;
+	  if ( return_ifrq ) pifrq[i] = n ? &ifrq[i][0] : NULL;
+	}
+
+      // nb. passes tw/ripple in the same order as run_hilbert()
+      if ( n ) 
+	{
+	  hilbert_bank_t bank( n , Fs , frqs[0] , frqs[1] , tw , ripple );
+	  bank.apply( x , std::vector<double*>() , pphase , pmag , pifrq );
+	}
       
-      if ( return_phase ) 
-	edf.add_signal( new_phase_label , Fs , phase );
+      for (int i=0;i<nc;i++) delete slices[i];
       
-      if ( return_ifrq ) 
+      //
+      // Add new signals (in the original channel order)
+      //
+      
+      for (int i=0;i<nc;i++)
 	{
-	  // this returns n-1 estimates, i.e. based on the derivative of the phase
-	  // add 0 to the end as a null marker, so it can be placed back in the EDF
-	  ifrq.push_back(0);
-	  edf.add_signal( new_ifrq_label , Fs , ifrq );
+	  
+	  const int s = sigs[i];
+	  
+	  std::string new_mag_label = signals.label(s) + tag + "_hilbert_"   + Helper::dbl2str(frqs[0]) + "_" + Helper::dbl2str( frqs[1] ) + "_mag";
+	  std::string new_phase_label = signals.label(s) + tag + "_hilbert_" + Helper::dbl2str(frqs[0]) + "_" + Helper::dbl2str( frqs[1] ) + "_phase";
+	  std::string new_ifrq_label = signals.label(s) + tag + "_hilbert_"  + Helper::dbl2str(frqs[0]) + "_" + Helper::dbl2str( frqs[1] ) + "_ifrq";
+	  
+	  logger << " Hilbert transform for " << signals.label(s) << " --> " << new_mag_label ;      
+	  
+	  if ( return_phase ) 
+	    logger << ", " << new_phase_label ;
+	  
+	  if ( return_ifrq ) 
+	    logger << ", " << new_ifrq_label ;
+	  
+	  logger << "\n";
+	  
+	  edf.add_signal( new_mag_label , Fs , mag[i] );
+	  
+	  if ( return_phase ) 
+	    edf.add_signal( new_phase_label , Fs , phase[i] );
+	  
+	  if ( return_ifrq ) 
+	    edf.add_signal( new_ifrq_label , Fs , ifrq[i] );
+	  
+	  // release as we go
+	  std::vector<double>().swap( mag[i] );
+	  std::vector<double>().swap( phase[i] );
+	  std::vector<double>().swap( ifrq[i] );
 	}
-    }  
+      
+    }
 
 }
 
@@ -182,15 +256,22 @@ void dsptools::run_hilbert( const std::vector<double> & data , const int Fs ,
 			    std::vector<double> * ifrq )
 {
 
-  hilbert_t hilbert( data , Fs , flwr , fupr , tw , ripple );
-  
-  *mag = *(hilbert.magnitude());
+  const int n = data.size();
 
-  if ( phase != NULL )
-    *phase = *(hilbert.phase());
+  hilbert_bank_t bank( n , Fs , flwr , fupr , tw , ripple );
+  
+  mag->resize( n );
+  
+  if ( phase != NULL ) phase->resize( n );
+  
+  if ( ifrq != NULL ) ifrq->resize( n > 1 ? n - 1 : 0 );
+  
+  if ( n == 0 ) return;
 
-  if ( ifrq != NULL )   
-      *ifrq = hilbert.instantaneous_frequency( Fs );    
+  bank.apply( &data[0] , NULL , 
+	      phase != NULL ? &(*phase)[0] : NULL , 
+	      &(*mag)[0] , 
+	      ifrq != NULL && n > 1 ? &(*ifrq)[0] : NULL );
 }
 
 
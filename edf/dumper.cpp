@@ -280,16 +280,14 @@ void edf_t::data_dumper( const std::string & signal_labels , const param_t & par
 	      
 	      annot_t * annot = timeline.annotations( annots[a] );
 	      
-	      annot_map_t events = annot->extract( interval );
+	      const std::vector<annot_map_t::const_iterator> & events = timeline.epoch_events( annot )[ epoch ];
 	      
 	      // collapse
 	      
-	      annot_map_t::const_iterator ii = events.begin();
-	      while ( ii != events.end() )
+	      for (int i=0;i<events.size();i++)
 		{	      
 
-		  const instance_idx_t & instance_idx = ii->first;
-		  const instance_t * instance = ii->second;
+		  const instance_t * instance = events[i]->second;
 		  
 		  instance_table_t::const_iterator jj = instance->data.begin();
 		  while ( jj != instance->data.end() )
@@ -300,7 +298,6 @@ void edf_t::data_dumper( const std::string & signal_labels , const param_t & par
 			atxt[ jj->first ].insert( jj->second->text_value() );
 		      ++jj;
 		    }
-		  ++ii;
 		}
 	    }
 	  
@@ -526,15 +523,14 @@ void edf_t::data_epoch_dumper( param_t & param , std::set<std::string> * selecte
 	  
 	  annot_t * annot = timeline.annotations( annots[a] );
 	  
-	  annot_map_t events = annot->extract( interval );
+	  const std::vector<annot_map_t::const_iterator> & events = timeline.epoch_events( annot )[ epoch ];
 	  
 	  // collapse
 	  
-	  annot_map_t::const_iterator ii = events.begin();
-	  while ( ii != events.end() )
+	  for (int i=0;i<events.size();i++)
 	    {	 
 	      
-	      const instance_idx_t & instance_idx = ii->first;
+	      annot_map_t::const_iterator ii = events[i];
 	      const instance_t * instance = ii->second;
 
 	      instance_table_t::const_iterator jj = instance->data.begin();
@@ -557,7 +553,6 @@ void edf_t::data_epoch_dumper( param_t & param , std::set<std::string> * selecte
 
 		  ++jj;
 		}
-	      ++ii;
 	    }
 	}
       
@@ -872,13 +867,9 @@ void edf_t::epoch_matrix_dumper( param_t & param )
 		  if ( aa->second == 1 ) 
 		    {
 		      
-		      interval_t interval = timeline.epoch( epoch );
-		      
 		      annot_t * annot = timeline.annotations( aa->first );
 		      
-		      annot_map_t events = annot->extract( interval );
-		      
-		      bool has_annot = events.size() ;
+		      bool has_annot = timeline.epoch_events( annot )[ epoch ].size() ;
 		      
 		      OUT << "\t" << ( has_annot ? 1 : 0 ) ;
 		    }
@@ -35,6 +35,18 @@
 
 #include <iostream>
 #include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#ifndef WINDOWS
+#include <sys/mman.h>
+#endif
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#define EDF_SIMD_X86
+#include <immintrin.h>
+#endif
 
 extern writer_t writer;
 extern logger_t logger;
@@ -140,6 +152,62 @@ inline int16_t edf_record_t::phys2dig( double d , double bv , double offset )
 }
 
 
+//
+// Bulk digital --> physical conversion: as dig2phys(), i.e. giving
+// identical values, but vectorized where the CPU supports it
+//
+
+#ifdef EDF_SIMD_X86
+
+__attribute__((target("avx2")))
+static void dig2phys_avx2( const int16_t * d , const int n , const double bv , const double offset , double * out )
+{
+  const __m256d vbv = _mm256_set1_pd( bv );
+  const __m256d vos = _mm256_set1_pd( offset );
+  int i = 0;
+  for ( ; i + 8 <= n ; i += 8 )
+    {
+      const __m256i x = _mm256_cvtepi16_epi32( _mm_loadu_si128( (const __m128i*)( d + i ) ) );
+      const __m256d lo = _mm256_cvtepi32_pd( _mm256_castsi256_si128( x ) );
+      const __m256d hi = _mm256_cvtepi32_pd( _mm256_extracti128_si256( x , 1 ) );
+      _mm256_storeu_pd( out + i     , _mm256_mul_pd( vbv , _mm256_add_pd( vos , lo ) ) );
+      _mm256_storeu_pd( out + i + 4 , _mm256_mul_pd( vbv , _mm256_add_pd( vos , hi ) ) );
+    }
+  for ( ; i < n ; i++ ) out[i] = bv * ( offset + d[i] );
+}
+
+__attribute__((target("sse2")))
+static void dig2phys_sse2( const int16_t * d , const int n , const double bv , const double offset , double * out )
+{
+  const __m128d vbv = _mm_set1_pd( bv );
+  const __m128d vos = _mm_set1_pd( offset );
+  int i = 0;
+  for ( ; i + 4 <= n ; i += 4 )
+    {
+      // sign-extend 4 x int16 to 4 x int32
+      const __m128i x16 = _mm_loadl_epi64( (const __m128i*)( d + i ) );
+      const __m128i x = _mm_srai_epi32( _mm_unpacklo_epi16( x16 , x16 ) , 16 );
+      const __m128d lo = _mm_cvtepi32_pd( x );
+      const __m128d hi = _mm_cvtepi32_pd( _mm_shuffle_epi32( x , _MM_SHUFFLE( 1 , 0 , 3 , 2 ) ) );
+      _mm_storeu_pd( out + i     , _mm_mul_pd( vbv , _mm_add_pd( vos , lo ) ) );
+      _mm_storeu_pd( out + i + 2 , _mm_mul_pd( vbv , _mm_add_pd( vos , hi ) ) );
+    }
+  for ( ; i < n ; i++ ) out[i] = bv * ( offset + d[i] );
+}
+
+#endif
+
+void edf_record_t::dig2phys( const int16_t * d , const int n , const double bv , const double offset , double * out )
+{
+#ifdef EDF_SIMD_X86
+  static const int simd = __builtin_cpu_supports( "avx2" ) ? 2 : __builtin_cpu_supports( "sse2" ) ? 1 : 0 ;
+  if ( simd == 2 ) { dig2phys_avx2( d , n , bv , offset , out ); return; } 
+  if ( simd == 1 ) { dig2phys_sse2( d , n , bv , offset , out ); return; }
+#endif
+  for (int i=0;i<n;i++) out[i] = bv * ( offset + d[i] );
+}
+
+
 inline int16_t edf_record_t::tc2dec( char a , char b )
 {        
   union 
@@ -653,36 +721,49 @@ std::set<int> edf_header_t::read( FILE * file , const std::set<std::string> * in
 
 
 
-bool edf_record_t::read( FILE * file , int r )
+bool edf_record_t::read( FILE * file )
 {
   
-  // bound checking on 'r' already done, via edf_t::read_record();
+  // bound checking on 'rec' already done, via edf_t::read_record();
   
   // skip if already loaded?
-  if ( edf->loaded( r ) ) return false;
-  
-  // determine offset into EDF
-  long int offset = edf->header_size + (long int)(edf->record_size) * r;
-  
-  // find the appropriate record
-  fseek( file , offset , SEEK_SET );
+  if ( edf->loaded( rec ) ) return false;
+
+  // ensure space in the sample store
+  edf->ensure_store();
   
+  // if memory-mapped, read directly from the mapped file; otherwise, 
   // allocate space in the buffer for a single record, and read from file
-  byte_t * p = new byte_t[ edf->record_size ];
-  byte_t * p0 = p;
 
-  // and read it
-  size_t rdsz = fread( p , 1, edf->record_size , edf->file );
+  const bool mapped = edf->mapped();
+
+  byte_t * p0 = mapped ? NULL : new byte_t[ edf->record_size ];
+
+  const byte_t * p = mapped ? edf->record_view( rec ) : p0;
+
+  if ( ! mapped )
+    {
+      // determine offset into EDF
+      long int offset = edf->header_size + (long int)(edf->record_size) * rec;
+      
+      // find the appropriate record
+      fseek( file , offset , SEEK_SET );
+
+      // and read it
+      size_t rdsz = fread( p0 , 1, edf->record_size , edf->file );
+    }
 
 
   // which signals/channels do we actually want to read?
   // header : 0..(ns-1)
   // from record data : 0..(ns_all-1), from which we pick the 'ns' entries is 'channels'
-  // data[] is already created for 'ns' signals
+  // the store already has slots for 'ns' signals
   
   // for convenience, use name 'channels' below
   std::set<int> & channels = edf->inp_signals_n;
-    
+
+  edf_store_t & store = edf->store;
+  
   int s = 0;
   
   for (int s0=0; s0<edf->header.ns_all; s0++)
@@ -712,50 +793,26 @@ bool edf_record_t::read( FILE * file , int r )
       // s0 : actual signal in EDF
       // s  : where this signal will land in edf_t
       //
+
+      int16_t * data = store.record( s , rec );
       
       if ( ! annotation ) 
 	{
 	  
-	  for (int j=0; j < nsamples ; j++)
-	    {
+	  // nb. the in-memory record size can differ from the EDF, if
+	  // the signal has since been resampled (and will be replaced)
+
+	  const int n = nsamples < store.width[s] ? nsamples : store.width[s];
 	  
-	      //int d = tc2dec( **p ,  *((*p)+1)  ); 
-	      int16_t d = tc2dec( *p ,  *(p+1)  ); 
-	      
-	      // advance pointer
-	      p += 2;
-	      
-	      // store digital data-point
-	      data[s][j] = d;
-	      
-	      // physically-scaled data-point	  
-	      if ( false )
-		if ( d < edf->header.orig_digital_min[s] || d > edf->header.orig_digital_max[s] ) 
-		  {	
-		    
-		  std::cout << "OUT-OF-BOUNDS" << "\t"
-			    << edf->id << "\t"
-			    << "[" << globals::current_tag << "]\t"
-			    << edf->header.label[s] << "\t"
-			    << "digt: " << d << "\t"
-			    << edf->header.orig_digital_min[s] << " .. " 
-			    << edf->header.orig_digital_max[s] << "\t"
-			    << "phys: " << edf->header.bitvalue[s] * ( edf->header.offset[s] + d ) << "\t"
-			    << edf->header.orig_physical_min[s] << " .. " 
-			    << edf->header.orig_physical_max[s] << "\n"; 
-
-		  if (  d < edf->header.orig_digital_min[s] ) 
-		    d = edf->header.orig_digital_min[s];
-		  else 
-		    d = edf->header.orig_digital_max[s];
-		  
-		  }
-	      
-	      // concert to physical scale
-	      //pdata[s][j] = edf->header.bitvalue[s] * ( edf->header.offset[s] + d );
-	      //pdata[s][j] = dig2phys( d , s ) ;
-	      
-	    }
+	  if ( edf_t::endian == edf_t::MACHINE_LITTLE_ENDIAN ) 
+	    memcpy( data , p , 2 * n );
+	  else
+	    for (int j=0; j < n ; j++)
+	      data[j] = tc2dec( p[2*j] , p[2*j+1] ); 
+	  
+	  // advance pointer
+	  p += 2 * nsamples;
+
 	}
       else // read as a ANNOTATION
 	{
@@ -763,16 +820,12 @@ bool edf_record_t::read( FILE * file , int r )
 	  // Note, because for a normal signal, each sample takes 2 bytes,
 	  // here we read twice the number of datapoints
 	  
-	  for (int j=0; j < 2 * nsamples; j++)
-	    {
-	      
-	      // store digital data-point
-	      data[s][j] = *p;
-	      
-	      // advance pointer
-	      p++;
-	      
-	    }	  
+	  const int n = 2 * nsamples < store.width[s] ? 2 * nsamples : store.width[s];
+
+	  for (int j=0; j < n; j++)
+	    data[j] = p[j];
+	  
+	  p += 2 * nsamples;
 	  
 	}
 
@@ -781,12 +834,14 @@ bool edf_record_t::read( FILE * file , int r )
       ++s;
 
     }
+
+  store.set_loaded( rec );
   
   //
   // Clean up
   //
 
-  delete [] p0;
+  if ( p0 != NULL ) delete [] p0;
   
   return true;
 
@@ -807,6 +862,16 @@ bool edf_t::read_records( int r1 , int r2 )
   if ( r2 > header.nr_all ) r2 = header.nr_all - 1;
 
   //std::cerr << "edf_t::read_records :: scanning ... r1, r2 " << r1 << "\t" << r2 << "\n";
+
+  // if memory-mapped, records are read in place on demand, so 
+  // nothing needs to be copied into memory here
+
+  if ( mapped() ) return true;
+  
+  // otherwise, only one thread loads at a time (i.e. as channel jobs
+  // may call this in parallel, sharing the file handle and the store)
+  
+  pthread_mutex_lock( &record_lock );
   
   for (int r=r1;r<=r2;r++)
     {
@@ -818,12 +883,14 @@ bool edf_t::read_records( int r1 , int r2 )
 	{
 	  if ( ! loaded( r ) ) 
 	    {
-	      edf_record_t record( this ); 
-	      record.read( file , r );
-	      records.insert( std::map<int,edf_record_t>::value_type( r , record ) );	      
+	      edf_record_t record( this , r ); 
+	      record.read( file );
 	    }
 	}
     }
+
+  pthread_mutex_unlock( &record_lock );
+
   return true;
 }
 
@@ -938,6 +1005,19 @@ bool edf_t::attach( const std::string & f ,
 		    + " but observed " + Helper::int2str( fileSize) + " bytes" );
     }
 
+  //
+  // Optionally, memory-map the file (records are then views into the
+  // mapped file, and only copied into 'records' if edited)
+  //
+
+  if ( globals::edf_mmap ) 
+    {
+      if ( map_file() )
+	logger << " memory-mapped " << fileSize << " bytes\n";
+      else
+	logger << " ** could not memory-map EDF, reading records from file instead **\n";
+    }
+
   //
   // Output some basic information
   //
@@ -958,6 +1038,62 @@ bool edf_t::attach( const std::string & f ,
 
 
 
+bool edf_t::map_file()
+{
+#ifdef WINDOWS
+  return false;
+#else
+  if ( file == NULL ) return false;
+  
+  unmap_file();
+
+  long long sz = get_filesize( file );
+  if ( sz <= 0 ) return false;
+
+  void * p = mmap( NULL , sz , PROT_READ , MAP_PRIVATE , fileno( file ) , 0 );
+  if ( p == MAP_FAILED ) return false;
+  
+  // records are typically scanned front-to-back
+  madvise( p , sz , MADV_SEQUENTIAL );
+
+  mapped_file = (byte_t*)p;
+  mapped_size = sz;
+  return true;
+#endif
+}
+
+void edf_t::unmap_file()
+{
+#ifndef WINDOWS
+  if ( mapped_file != NULL )
+    munmap( mapped_file , mapped_size );
+#endif
+  mapped_file = NULL;
+  mapped_size = 0;
+}
+
+int edf_t::record_offset( const int s ) const
+{
+  // loaded signals map, in order, onto the EDF signals in inp_signals_n;
+  // any signals beyond that were added (and so only exist in 'records')
+  
+  if ( s < 0 || s >= inp_signals_n.size() ) return -1;
+
+  int offset = 0;
+  int s1 = 0;
+  for (int s0=0; s0<header.ns_all; s0++)
+    {
+      if ( inp_signals_n.find( s0 ) != inp_signals_n.end() )
+	{
+	  if ( s1 == s ) return offset;
+	  ++s1;
+	}
+      offset += 2 * header.n_samples_all[s0];
+    }
+  return -1;
+}
+
+
 void edf_t::swap_in_aliases()
 {
 
@@ -981,9 +1117,11 @@ std::vector<double> edf_t::fixedrate_signal( uint64_t start ,
 
   std::vector<double> ret;
   
-  tp->clear();
+  // time-points and record numbers are optional (i.e. can be NULL)
+  
+  if ( tp != NULL ) tp->clear();
 
-  rec->clear();
+  if ( rec != NULL ) rec->clear();
 
   //
   // Ensure we are within bounds
@@ -1037,35 +1175,104 @@ std::vector<double> edf_t::fixedrate_signal( uint64_t start ,
   
   
   //
-  // Copy data into a single vector
+  // Copy data into a single vector: first, presize the output
   //
- 
-  double bitvalue = header.bitvalue[ signal ];
-  double offset   = header.offset[ signal ];
-
+  
+  size_t n = 0;
+  
   int r = start_record;
-
+  
   while ( r <= stop_record )
     {
+      const int start = r == start_record ? start_sample : 0 ;
+      const int stop  = r == stop_record  ? stop_sample  : n_samples_per_record - 1;
+      if ( stop >= start ) n += ( stop - start ) / downsample + 1;
+      r = timeline.next_record(r);
+      if ( r == -1 ) break;
+    }
+  
+  ret.resize( n );
+  if ( tp != NULL ) tp->resize( n );
+  if ( rec != NULL ) rec->resize( n );
+  
+  const double bitvalue = header.bitvalue[ signal ];
+  const double offset   = header.offset[ signal ];
+
+  // if memory-mapped, where in each record does this signal start?
+  
+  const int view_offset = mapped() ? record_offset( signal ) : -1;
 
-      const edf_record_t * record = &(records.find( r )->second);
+  size_t i = 0;
+  
+  r = start_record;
+
+  while ( r <= stop_record )
+    {
 
       const int start = r == start_record ? start_sample : 0 ;
       const int stop  = r == stop_record  ? stop_sample  : n_samples_per_record - 1;
+
+      const int m = stop >= start ? ( stop - start ) / downsample + 1 : 0 ;
+      
+      //
+      // Digital values: either in the sample store, or (if not loaded) 
+      // read in place from the memory-mapped file
+      //
+
+      const int16_t * d = NULL;
       
-//       std::cerr << "OUT\t"
-// 		<< record->data.size() << " "
-// 		<< signal << " " 
-// 		<< header.ns << "\n";
+      if ( store.loaded( r ) ) 
+	d = store.record( signal , r );
+      else if ( view_offset == -1 ) 
+	Helper::halt( "internal error: record not loaded in fixedrate_signal()" );
+      else if ( endian == MACHINE_LITTLE_ENDIAN ) 
+	d = (const int16_t*)( record_view( r ) + view_offset );
       
-      for (int s=start;s<=stop;s+=downsample)
+      //
+      // convert from digital to physical
+      //
+
+      if ( d != NULL ) 
 	{
-	  // convert from digital to physical on-the-fly
-	  ret.push_back( edf_record_t::dig2phys( record->data[ signal ][ s ] , bitvalue , offset ) );
-	  tp->push_back( timeline.timepoint( r , s , n_samples_per_record ) );
-	  rec->push_back( r );
+	  if ( downsample == 1 )
+	    edf_record_t::dig2phys( d + start , m , bitvalue , offset , &ret[i] );
+	  else
+	    for (int j=0;j<m;j++)
+	      ret[i+j] = edf_record_t::dig2phys( d[ start + j * downsample ] , bitvalue , offset );
+	}
+      else // mapped, but needs byte-swapping
+	{
+	  const byte_t * p = record_view( r ) + view_offset;
+	  for (int j=0;j<m;j++)
+	    {
+	      const int s = start + j * downsample;
+	      ret[i+j] = edf_record_t::dig2phys( edf_record_t::tc2dec( p[ 2*s ] , p[ 2*s+1 ] ) , bitvalue , offset );
+	    }
 	}
       
+      //
+      // time-points, from the start of each record
+      //
+
+      if ( tp != NULL ) 
+	{
+	  std::map<int,uint64_t>::const_iterator tt = timeline.rec2tp.find( r );
+	  
+	  if ( tt == timeline.rec2tp.end() ) 
+	    for (int j=0;j<m;j++) (*tp)[i+j] = 0;
+	  else
+	    for (int j=0;j<m;j++) 
+	      {
+		const uint64_t s = start + j * downsample;
+		(*tp)[i+j] = tt->second + ( s != 0 ? header.record_duration_tp * s / n_samples_per_record : 0 );
+	      }
+	}
+      
+      if ( rec != NULL ) 
+	for (int j=0;j<m;j++) (*rec)[i+j] = r;
+
+      i += m;
+
       r = timeline.next_record(r);
       if ( r == -1 ) break;
     }
@@ -1140,46 +1347,55 @@ bool edf_header_t::write( FILE * file )
 }
 
 
-bool edf_record_t::write( FILE * file )
+void edf_record_t::encode( byte_t * q )
 {
-
-  // check if this has been read?
   
   for (int s=0;s<edf->header.ns;s++)
     {
       
       const int nsamples = edf->header.n_samples[s];
 
+      const int16_t * d = data( s );
+
       //
       // Normal data channel
       //
 
       if ( edf->header.is_data_channel(s) )
 	{      
-	  for (int j=0;j<nsamples;j++)
-	    {	  
-	      char a , b;
-	      dec2tc( data[s][j] , &a, &b );	  
-	      fputc( a , file );
-	      fputc( b , file );
-	    }
+	  if ( edf_t::endian == edf_t::MACHINE_LITTLE_ENDIAN ) 
+	    memcpy( q , d , 2 * nsamples );
+	  else
+	    for (int j=0;j<nsamples;j++)
+	      dec2tc( d[j] , (char*)q + 2*j , (char*)q + 2*j + 1 );
 	}
       
       //
       // EDF Annotations channel
       //
       
-      if ( edf->header.is_annotation_channel(s) )
+      else
 	{      	  	  
+	  const int w = edf->store.width[s];
 	  for (int j=0;j< 2*nsamples;j++)
-	    {	  	      
-	      char a = j >= data[s].size() ? '\x00' : data[s][j];	      
-	      fputc( a , file );	      
-	    }
+	    q[j] = j >= w ? 0 : (byte_t)d[j];	      
 	}
+
+      q += 2 * nsamples;
     
     }
-  return true;
+
+}
+
+
+bool edf_record_t::write( FILE * file )
+{
+  int n = 0;
+  for (int s=0;s<edf->header.ns;s++) n += 2 * edf->header.n_samples[s];
+  std::vector<byte_t> buffer( n );
+  if ( buffer.size() == 0 ) return true;
+  encode( &buffer[0] );
+  return fwrite( &buffer[0] , 1 , buffer.size() , file ) == buffer.size();
 }
 
 
@@ -1194,36 +1410,188 @@ bool edf_t::write( const std::string & f )
 
   set_edf();
 
-  filename = f;
-
   FILE * outfile = NULL;
 
-  if ( ( outfile = fopen( filename.c_str() , "wb" ) ) == NULL )      
+  if ( ( outfile = fopen( f.c_str() , "wb" ) ) == NULL )      
     {
-      logger << " ** could not open " << filename << " for writing **\n";
+      logger << " ** could not open " << f << " for writing **\n";
       return false;
     }
 
   header.write( outfile );
 
+  //
+  // Records are streamed: those in the sample store are encoded from
+  // there; others have not been edited, and so are encoded directly
+  // from the source EDF (i.e. as edf_record_t::read() would have
+  // copied them) without being loaded.  The source is read in windows
+  // of consecutive records, and output flushed in blocks of records,
+  // so memory use is bounded whatever the size of the EDF
+  //
+  
+  // output offsets of each signal within a record
+  
+  std::vector<int> dst_off( header.ns , 0 );
+
+  int out_size = 0;
+  for (int s=0;s<header.ns;s++) 
+    {
+      dst_off[s] = out_size;
+      out_size += 2 * header.n_samples[s];
+    }
+  
+  const int block_bytes = 1 << 22;
+
+  const int out_n = out_size > 0 && out_size < block_bytes ? block_bytes / out_size : 1 ;
+
+  std::vector<byte_t> obuf( (size_t)out_n * out_size );
+  
+  int ocnt = 0;
+
+  // for signals from the source EDF, the offset within a source
+  // record and the number of bytes to copy (as read(), i.e. truncated
+  // to the in-memory width, if any); -1 for added signals
+  
+  std::vector<int> src_off( header.ns , -1 ) , src_len( header.ns , 0 );
+  
+  int s = 0 , src = 0;
+  for (int s0=0; s0<header.ns_all; s0++)
+    {
+      const int nfile = 2 * header.n_samples_all[s0];
+      
+      if ( s < header.ns && inp_signals_n.find( s0 ) != inp_signals_n.end() )
+	{
+	  int n = nfile < 2 * header.n_samples[s] ? nfile : 2 * header.n_samples[s];
+	  
+	  if ( store.allocated() )
+	    {
+	      const int w = header.is_annotation_channel( s ) ? store.width[s] : 2 * store.width[s];
+	      if ( w < n ) n = w;
+	    }
+	  
+	  src_off[s] = src;
+	  src_len[s] = n;
+	  ++s;
+	}
+      
+      src += nfile;
+    }
+
+  // read window for the source EDF (if not memory-mapped)
+  
+  const bool from_file = ! mapped();
+
+  const int win_n = record_size > 0 && record_size < block_bytes ? block_bytes / record_size : 1 ;
+
+  std::vector<byte_t> wbuf;
+  
+  int win_first = -1 , win_cnt = 0;
+  
   int r = timeline.first_record();
+
   while ( r != -1 ) 
     {
+      
+      byte_t * q = &obuf[ (size_t)ocnt * out_size ];
+      
+      if ( loaded( r ) ) 
+	{
+	  edf_record_t record( this , r );
+	  record.encode( q );
+	}
+      else
+	{
+
+	  // any added signals, from the store (zero otherwise)
+	  
+	  if ( store.allocated() ) 
+	    {
+	      edf_record_t record( this , r );
+	      record.encode( q );
+	    }
+	  else
+	    memset( q , 0 , out_size );
+	  
+	  // get the source record
+	  
+	  const byte_t * p = NULL;
+	  
+	  if ( ! from_file ) 
+	    p = record_view( r );
+	  else
+	    {
+	      
+	      if ( r < win_first || r >= win_first + win_cnt ) 
+		{
+		  
+		  if ( file == NULL ) 
+		    Helper::halt( "internal error in edf_t::write(), no source EDF" );
+
+		  // take the run of consecutive retained records from 'r'
+		  win_first = r;
+		  win_cnt = 1;
+		  int r1 = r;
+		  while ( win_cnt < win_n )
+		    {
+		      const int r2 = timeline.next_record( r1 );
+		      if ( r2 != r1 + 1 ) break;
+		      r1 = r2;
+		      ++win_cnt;
+		    }
+		  
+		  wbuf.resize( (size_t)win_cnt * record_size );
+		  
+		  long int offset = header_size + (long int)(record_size) * r;
+		  fseek( file , offset , SEEK_SET );
+		  size_t rdsz = fread( &wbuf[0] , 1, wbuf.size() , file );
+		  if ( rdsz != wbuf.size() ) 
+		    Helper::halt( "problem reading records from " + filename );
+		}
+	      
+	      p = &wbuf[ (size_t)( r - win_first ) * record_size ];
+	    }
+	  
+	  for (int s=0;s<header.ns;s++)
+	    if ( src_off[s] != -1 ) 
+	      memcpy( q + dst_off[s] , p + src_off[s] , src_len[s] );
+	  
+	}
 
-      // we may need to load this record, before we can write it
-      if ( ! loaded( r ) )
- 	{
- 	  edf_record_t record( this ); 
- 	  record.read( file , r );
- 	  records.insert( std::map<int,edf_record_t>::value_type( r , record ) );	      
- 	}
+      // flush a full block
+      if ( ++ocnt == out_n ) 
+	{
+	  if ( fwrite( &obuf[0] , 1 , (size_t)ocnt * out_size , outfile ) != (size_t)ocnt * out_size ) 
+	    {
+	      logger << " ** problem writing records to " << f << " **\n";
+	      fclose(outfile);
+	      return false;
+	    }
+	  ocnt = 0;
+	}
       
-      records.find(r)->second.write( outfile );
       r = timeline.next_record(r);
     }
+  
+  if ( ocnt ) 
+    if ( fwrite( &obuf[0] , 1 , (size_t)ocnt * out_size , outfile ) != (size_t)ocnt * out_size ) 
+      {
+	logger << " ** problem writing records to " << f << " **\n";
+	fclose(outfile);
+	return false;
+      }
+  
+  // nb. catches any failed header write; buffered output may also
+  // only fail on closing (e.g. disk full)
+  const bool write_error = ferror( outfile ) != 0;
+  
+  if ( fclose(outfile) != 0 || write_error ) 
+    {
+      logger << " ** problem writing " << f << " **\n";
+      return false;
+    }
 
-  fclose(outfile);
-
+  filename = f;
+  
   return true;
 }
 
@@ -1234,6 +1602,8 @@ void edf_t::drop_signal( const int s )
   if ( s < 0 || s >= header.ns ) return;  
   --header.ns;
 
+  spectra.clear();
+
   // was this signal in the original EDF file? 
   bool present_in_EDF_file = header.label_all.find( header.label[s] ) != header.label_all.end() ;
   int os = present_in_EDF_file ? header.label_all[ header.label[ s ] ] : -1 ;
@@ -1271,22 +1641,9 @@ void edf_t::drop_signal( const int s )
       header.label2header[ header.label[l] ] = l;      
   
   // records
-  int r = timeline.first_record();
-  while ( r != -1 )
-    {
-      if ( records.find(r) != records.end() ) 
-	records.find(r)->second.drop(s);
-      r = timeline.next_record(r);
-    }
-
-}
+  if ( store.allocated() ) 
+    store.drop_signal( s );
 
-void edf_record_t::drop( const int s )
-{
-  data[ s ].clear();
-  data.erase( data.begin() + s );
-//   pdata[ s ].clear();
-//   pdata.erase( pdata.begin() + s );
 }
 
 void edf_t::add_signal( const std::string & label , const int Fs , const std::vector<double> & data )
@@ -1301,6 +1658,8 @@ void edf_t::add_signal( const std::string & label , const int Fs , const std::ve
       return;
     }
 
+  spectra.clear();
+
   // sanity check -- ie. require that the data is an appropriate length
   if ( ndata != header.nr * n_samples ) 
     Helper::halt( "internal error: problem with length of input data" );  
@@ -1325,21 +1684,34 @@ void edf_t::add_signal( const std::string & label , const int Fs , const std::ve
   double bv = ( pmax - pmin ) / (double)( dmax - dmin );
   double os = ( pmax / bv ) - dmax;
 
+  // new signals only exist in memory, so all records must be loaded
+
+  int r = timeline.first_record();
+  while ( r != -1 ) 
+    {
+      ensure_loaded( r );
+      r = timeline.next_record(r);
+    }
+
+  ensure_store();
+  
+  store.add_signal( n_samples );
+
+  const int s = store.data.size() - 1;
+  
   // store (after converting to digital form)
   
   int c = 0;
-  int r = timeline.first_record();
+  r = timeline.first_record();
 
   while ( r != -1 ) 
     {
-
-      std::vector<int16_t> t(n_samples);
       
+      int16_t * t = store.record( s , r );
+
       for (int i=0;i<n_samples;i++) 
 	t[i] = edf_record_t::phys2dig( data[c++] , bv , os );
       
-      records.find(r)->second.add_data(t);
-      
       r = timeline.next_record(r);
     }
     
@@ -1392,39 +1764,33 @@ std::vector<double> edf_record_t::get_pdata( const int s )
 {
   const double & bv     = edf->header.bitvalue[s];
   const double & offset = edf->header.offset[s];
-  const int n = data[s].size();
+  const int n = edf->store.width[s];
+  const int16_t * d = data( s );
   std::vector<double> r( n );
-  for ( int i = 0 ; i < n ; i++ ) r[i] = dig2phys( data[s][i] , bv , offset );
+  for ( int i = 0 ; i < n ; i++ ) r[i] = dig2phys( d[i] , bv , offset );
   return r;
 }
 
-void edf_record_t::add_data( const std::vector<int16_t> & d )
-{
-  // store
-  data.push_back( d );
-}
-
-void edf_record_t::add_annot( const std::string & str )
+int16_t * edf_record_t::data( const int s )
 {
-  // create a new data slot
-  std::vector<int16_t> dummy; data.push_back(dummy);
-  //std::vector<double> pdummy;   pdata.push_back(pdummy);
-  // add this to the end
-  add_annot( str , data.size()-1 );
+  return edf->store.record( s , rec );
 }
 
 void edf_record_t::add_annot( const std::string & str , const int signal )
 {
   
-  if ( signal < 0 || signal >= data.size() ) 
+  if ( signal < 0 || signal >= edf->store.data.size() ) 
     Helper::halt( "internal error in add_annot()" );
+
+  const int n = edf->store.width[ signal ];
+
+  if ( str.size() > n ) 
+    Helper::halt( "problem in add_annot(), annotation too long for record" );
   
-  // convert text to int16_t encoding
-  data[ signal ].resize( str.size() );
-  for (int s=0;s<str.size();s++) 
-    {
-      data[signal][s] = (char)str[s];
-    } 
+  // convert text to int16_t encoding (zero-padded)
+  int16_t * d = data( signal );
+  for (int s=0;s<n;s++) 
+    d[s] = s < str.size() ? (char)str[s] : 0 ;
 }
 
 // now redundant
@@ -1450,6 +1816,8 @@ void edf_t::reset_record_size( const double new_record_duration )
   if ( ! header.continuous )
     Helper::halt( "can only change record size for EDF, not EDF+, currently" );
 
+  spectra.clear();
+
   // this changes the in-memory representation;
   // naturally, new data cannot easily be loaded from disk, so 
   // this command should always write a new EDF and then quit
@@ -1488,21 +1856,13 @@ void edf_t::reset_record_size( const double new_record_duration )
 
     }
   
-  // buffer for new records
-  edf_record_t new_record( this );
-
-  std::map<int,edf_record_t> new_records;
-  
-  // manually change size of the new buffer record
-  for (int s = 0 ; s < header.ns ; s++)
-    new_record.data[s].resize( new_nsamples[s] , 0 );
-    
-
   // get implied number of new records (truncate if this goes over)
   int new_nr = floor( header.nr * header.record_duration ) / (double) new_record_duration ;
 
-  for (int r=0;r<new_nr;r++) 
-    new_records.insert( std::map<int,edf_record_t>::value_type( r , new_record ) );
+  // new sample store, with all records present
+  edf_store_t new_store;
+  new_store.init( new_nr , new_nsamples );
+  for (int r=0;r<new_nr;r++) new_store.set_loaded( r );
   
   // process one signal at a time
   std::vector<int> new_rec_cnt( header.ns , 0 );
@@ -1514,13 +1874,13 @@ void edf_t::reset_record_size( const double new_record_duration )
   
       ensure_loaded( r );
 
-      edf_record_t & record = records.find(r)->second;
-
       for (int s = 0 ; s < header.ns ; s++ )
 	{
 
 	  const int n = header.n_samples[s];
 
+	  const int16_t * d = store.record( s , r );
+	  
 	  for (int i = 0 ; i < n ; i++ )
 	    {
 	      
@@ -1532,14 +1892,7 @@ void edf_t::reset_record_size( const double new_record_duration )
 	      
 	      if ( new_rec_cnt[s] < new_nr )
 		{
-		  std::map<int,edf_record_t>::iterator rr = new_records.find( new_rec_cnt[s] );
-		  if ( rr == new_records.end() ) Helper::halt( "internal error" );
-		  edf_record_t & new_record = rr->second;
-
-//  		  std::cout << "setting " << new_rec_cnt[s] << "\t" << new_smp_cnt[s] << " = " << r << " " << i << "\n";
-//  		  std::cout << " sz = " << new_record.data[ s ].size() << " " << record.data[ s ].size() << "\n";
-		  new_record.data[ s ][ new_smp_cnt[ s ] ] = record.data[ s ][ i ];
-		  
+		  new_store.record( s , new_rec_cnt[s] )[ new_smp_cnt[ s ] ] = d[ i ];
 		  ++new_smp_cnt[ s ];
 		}
 
@@ -1556,8 +1909,8 @@ void edf_t::reset_record_size( const double new_record_duration )
   // copy over
   //
   
-  records = new_records;
-  new_records.clear();
+  store.swap( new_store );
+  new_store.clear();
 
   //
   // and update EDF header
@@ -1611,7 +1964,7 @@ void edf_t::reference_and_scale( const int s , const int r , const double rescal
 
       ensure_loaded( rec );
       
-      edf_record_t & record = records.find(rec)->second;
+      edf_record_t record( this , rec );
       
       if ( hasref )
 	{
@@ -1668,7 +2021,7 @@ void edf_t::reference( const signal_list_t & signals , const signal_list_t & ref
   while ( rec != -1 )
     {
       ensure_loaded( rec );
-      edf_record_t & record = records.find(rec)->second;
+      edf_record_t record( this , rec );
       
       std::vector<std::vector<double> > refdata;
 
@@ -1722,7 +2075,7 @@ void edf_t::reference( const signal_list_t & signals , const signal_list_t & ref
 	  ensure_loaded( rec );
 	  
 	  // now we can access
-	  edf_record_t & record = records.find(rec)->second;
+	  edf_record_t record( this , rec );
 	  
 	  std::vector<double> d0 = record.get_pdata( signals(s) );
 	  
@@ -2061,103 +2414,73 @@ bool edf_t::restructure()
   //
 
   logger << " restructuring as an EDF+ : ";
+
+  // cached spectra are keyed on the old timeline
+  spectra.clear();
   
   set_edfplus();
 
   set_discontinuous();
 
   //
-  // First, check that all necessary records have actually been loaded
-  // This will not reload records, and will only load 'retained' records
-  //
-  
-  // Alternative??  if not found below, just read
-  //  read_records( 0 , header.nr_all - 1 );
-
-  //
-  // Ensure is loaded if we need it
+  // Records to keep: nb. these are not loaded here; any not already
+  // in memory are unchanged from the EDF, and so will be read (or
+  // streamed, by write()) on demand
   //
 
   std::set<int> include;
 
+  int n_retained = 0;
+
   for (int r = 0 ; r < header.nr_all; r++)
     {
       
-      bool found     = records.find(r) != records.end();
       bool retained  = timeline.retained(r);
       bool unmasked  = !timeline.masked_record(r);
       
-      if ( retained )
-	if ( unmasked ) 
-	  {
-	    if ( ! found ) read_records( r, r );	      
+      if ( retained ) 
+	{
+	  ++n_retained;
+	  if ( unmasked ) 
 	    include.insert( r );
-	  }    
+	}
     }
 
   
   //
-  // Remove records based on epoch-mask
+  // Remove records based on epoch-mask: as records are indexed in the
+  // sample store, this just means dropping them from the loaded set; 
+  // only records that were loaded (edited) are in memory, and all 
+  // others remain in the EDF (or as views of the mapped file)
   //
 
-  std::map<int,edf_record_t> copy = records;
-  records.clear();
+  for (int r = 0 ; r < store.nrecords() ; r++)
+    if ( store.loaded(r) && include.find(r) == include.end() )
+      store.unload(r);
   
-  //
-  // Copy back, but now use iterator instead
-  //
-
-  std::set<int>::const_iterator ii = include.begin();
-  while ( ii != include.end() )
-    {
-      records.insert( std::map<int,edf_record_t>::value_type( *ii , copy.find( *ii )->second ) );
-      ++ii;
-    }
-
-
-  if ( 0 ) 
-    {
-      for (int r = 0 ; r < header.nr_all; r++)
-	{
-	  
-	  bool found     = copy.find(r) != copy.end();
-	  bool retained  = timeline.retained(r);
-	  bool unmasked  = !timeline.masked_record(r);
-	  
-	  if ( retained )
-	    {
-	      if ( unmasked ) 
-		{	      
-		  if ( ! found ) Helper::halt( "internal error in restructure()");
-		  records.insert( std::map<int,edf_record_t>::value_type( r , copy.find(r)->second ) );
-		  include.insert( r );
-		}
-	    }
-	}
-    }
-
+  const int nr1 = n_retained;
+  const int nr2 = include.size();
   
-      
   // set warning flags, if not enough data left
   
-  if ( records.size() == 0 ) globals::problem = true;
+  if ( nr2 == 0 ) globals::problem = true;
     
 
   logger << "keeping " 
-	 << records.size() << " records of " 
-	 << copy.size() << ", resetting mask\n";
+	 << nr2 << " records of " 
+	 << nr1 << ", resetting mask\n";
   
-  writer.value( "NR1" , (int)copy.size() );
-  writer.value( "NR2" , (int)records.size() );
+  writer.value( "NR1" , nr1 );
+  writer.value( "NR2" , nr2 );
   
-  writer.value( "DUR1" , copy.size() * header.record_duration );
-  writer.value( "DUR2" , records.size() * header.record_duration );
+  writer.value( "DUR1" , nr1 * header.record_duration );
+  writer.value( "DUR2" , nr2 * header.record_duration );
 
   // update EDF header
   // nb. header.nr_all stays the same, reflecting the 
   // original file which has not changed
 
-  header.nr = records.size();
+  header.nr = nr2;
 
   // adjust timeline (now will be a discontinuous track)
   
@@ -2170,9 +2493,12 @@ bool edf_t::restructure()
 
 void edf_t::update_physical_minmax( const int s )
 {
+
+  // (this rescales the physical values)
+  spectra.clear();
   
   interval_t interval = timeline.wholetrace();  
-  slice_t slice( *this , s , interval );
+  slice_t slice( *this , s , interval , 1 , false );
   const std::vector<double> * d = slice.pdata();
   const int n = d->size();
 
@@ -2213,7 +2539,7 @@ void edf_t::copy_signal( const std::string & from_label , const std::string & to
   //
 
   interval_t interval = timeline.wholetrace();  
-  slice_t slice( *this , s1 , interval );
+  slice_t slice( *this , s1 , interval , 1 , false );
   const std::vector<double> * d = slice.pdata();
   
   //
@@ -2234,6 +2560,8 @@ void edf_t::update_signal( const int s , std::vector<double> * d )
   // for signal s, place back data in 'd' into EDF record structure
   // and update the physical min/max
 
+  spectra.clear();
+
   const int points_per_record = header.n_samples[s];
   const int n = d->size();
   
@@ -2270,38 +2598,32 @@ void edf_t::update_signal( const int s , std::vector<double> * d )
   header.bitvalue[s] = bv;
   header.offset[s] = os;
   
+  // edited records must be in memory (i.e. not a view of a mapped file)
+
+  int r = timeline.first_record();
+  while ( r != -1 ) 
+    {
+      ensure_loaded( r );
+      r = timeline.next_record(r);
+    }
+  
+  // check that we did not change sample rate (i.e. RESAMPLE)
+  
+  if ( store.width[s] != points_per_record ) 
+    store.resize_signal( s , points_per_record );
+  
   int cnt = 0;
   
-  int r = timeline.first_record();
+  r = timeline.first_record();
   while ( r != -1 ) 
     {
       
-      // find records
-
-      //      std::vector<double> & pdata = records.find(r)->second.pdata[ s ];
-      std::vector<int16_t>    & data  = records.find(r)->second.data[ s ];
-      
-      // check that we did not change sample rate
-      
-      if ( data.size() != points_per_record ) 
-	{
-	  //pdata.resize( points_per_record , 0 );
-	  data.resize( points_per_record , 0 );
-	}
+      int16_t * data = store.record( s , r );
 
-      
       for (int p=0;p<points_per_record;p++)
 	{
-	  
-	  //pdata[p] = (*d)[cnt]; 
-	  
-	  // also need to convert to bit-value
-	  // pdata[s][j] = header->bitvalue[s] * ( header->offset[s] + d );	  
 	  // reverse digital --> physical scaling
-	  
-	  //data[p] = (*d)[cnt] / bv - os;
 	  data[p] = edf_record_t::phys2dig( (*d)[cnt] , bv , os );
-	
 	  ++cnt;	  
 	}
 
@@ -2312,29 +2634,148 @@ void edf_t::update_signal( const int s , std::vector<double> * d )
 
 
 
-edf_record_t::edf_record_t( edf_t * e ) 
+edf_record_t::edf_record_t( edf_t * e , const int r ) 
 {    
-
   edf = e;
+  rec = r;
+}
 
-  // just for now, store both digital and physical values
-  data.resize( edf->header.ns );
-  //pdata.resize( edf->header.ns );
-  
-  for (int s = 0 ; s < edf->header.ns ; s++)
+
+int16_t * edf_store_t::alloc( const int w ) const
+{
+  const size_t n = (size_t)present.size() * w;
+  if ( n == 0 ) return NULL;
+  int16_t * p = (int16_t*)calloc( n , sizeof(int16_t) );
+  if ( p == NULL ) Helper::halt( "could not allocate memory for EDF records" );
+  return p;
+}
+
+void edf_store_t::clear()
+{
+  for (int s=0;s<data.size();s++) free( data[s] );
+  data.clear();
+  width.clear();
+  present.clear();
+  nloaded = 0;
+}
+
+void edf_store_t::swap( edf_store_t & rhs )
+{
+  data.swap( rhs.data );
+  width.swap( rhs.width );
+  present.swap( rhs.present );
+  std::swap( nloaded , rhs.nloaded );
+}
+
+void edf_store_t::init( const int nr , const std::vector<int> & w )
+{
+  clear();
+  width = w;
+  present.resize( nr , false );
+  data.resize( w.size() );
+  for (int s=0;s<w.size();s++) 
+    data[s] = alloc( w[s] );
+}
+
+void edf_store_t::add_signal( const int w )
+{
+  width.push_back( w );
+  data.push_back( alloc( w ) );
+}
+
+void edf_store_t::drop_signal( const int s )
+{
+  free( data[s] );
+  width.erase( width.begin() + s );
+  data.erase( data.begin() + s );
+}
+
+void edf_store_t::resize_signal( const int s , const int w )
+{
+  free( data[s] );
+  width[s] = w;
+  data[s] = alloc( w );
+}
+
+spectral_cache_t::spectral_cache_t()
+{
+  bytes = 0;
+  pthread_mutex_init( &mutex , NULL );
+}
+
+spectral_cache_t::~spectral_cache_t()
+{
+  pthread_mutex_destroy( &mutex );
+}
+
+bool spectral_cache_t::find( const std::string & label , 
+			     const std::vector<double> & par , 
+			     const interval_t & interval , 
+			     std::vector<double> * freq , 
+			     std::vector<double> * psd ) const
+{
+  bool found = false;
+  pthread_mutex_lock( &mutex );
+  std::map<set_key_t,set_t>::const_iterator ss = sets.find( set_key_t( label , par ) );
+  if ( ss != sets.end() )
     {
-      if ( edf->header.is_annotation_channel(s) )
+      std::map<interval_t,std::vector<double> >::const_iterator ii = ss->second.psd.find( interval );
+      if ( ii != ss->second.psd.end() )
 	{
-	  data[s].resize( 2 * edf->header.n_samples[s] , 0 );
-	  //pdata[s].resize( edf->header.n_samples[s] * fac , 0 );
+	  *freq = ss->second.freq;
+	  *psd = ii->second;
+	  found = true;
 	}
-      else
+    }
+  pthread_mutex_unlock( &mutex );
+  return found;
+}
+
+void spectral_cache_t::insert( const std::string & label , 
+			       const std::vector<double> & par , 
+			       const interval_t & interval , 
+			       const std::vector<double> & freq , 
+			       const std::vector<double> & psd )
+{
+  const size_t sz = psd.size() * sizeof(double);
+  pthread_mutex_lock( &mutex );
+  if ( bytes + sz <= (size_t)globals::spectral_cache_mb * 1024 * 1024 ) 
+    {
+      set_t & ss = sets[ set_key_t( label , par ) ];
+      if ( ss.psd.size() == 0 ) 
 	{
-	  data[s].resize( edf->header.n_samples[s] , 0 );
-	  //pdata[s].resize( edf->header.n_samples[s] , 0 );
+	  ss.freq = freq;
+	  bytes += freq.size() * sizeof(double);
+	}
+      // only if on the same frequency grid (i.e. as expected)
+      if ( ss.freq == freq && ss.psd.find( interval ) == ss.psd.end() ) 
+	{
+	  ss.psd[ interval ] = psd;
+	  bytes += sz;
 	}
     }
+  pthread_mutex_unlock( &mutex );
+}
+
+void spectral_cache_t::clear()
+{
+  pthread_mutex_lock( &mutex );
+  sets.clear();
+  bytes = 0;
+  pthread_mutex_unlock( &mutex );
+}
+
+
+void edf_t::ensure_store()
+{
+  if ( store.allocated() ) return;
   
+  // slots per record: EDF Annotations are stored byte-wise
+  std::vector<int> w( header.ns );
+  for (int s=0;s<header.ns;s++)
+    w[s] = header.is_annotation_channel(s) ? 2 * header.n_samples[s] : header.n_samples[s];
+  
+  store.init( header.nr_all , w );
 }
 
 
@@ -2409,6 +2850,12 @@ int edf_t::add_continuous_time_track()
   // time-track already set?
   if ( header.time_track() != -1 ) return header.time_track();
 
+  // nb. records need not be loaded first: the new track is appended
+  // after all signals read from the EDF, so records loaded later (by
+  // edf_record_t::read()) only fill the slots of the other signals
+
+  ensure_store();
+  
   // update header
   ++header.ns;
 
@@ -2464,6 +2911,9 @@ int edf_t::add_continuous_time_track()
   uint64_t onset_tp = 0;
   uint64_t dur_tp = header.record_duration_tp;
 
+  // add to the sample store (stored byte-wise)
+  store.add_signal( 2 * n_samples );
+
   // for each record
   int r = timeline.first_record();
   
@@ -2471,36 +2921,13 @@ int edf_t::add_continuous_time_track()
     {
 
       std::string ts = "+" + Helper::dbl2str( onset ) + "\x14\x14\x00";
-      
-      // need to make sure that the record (i.e. other signals) 
-      // are first loaded into memory...
-      
-      bool record_in_memory = loaded(r);
-      
-      if ( ! record_in_memory )
-	{
-
-	  // this will be created with ns+1 slots (i.e. 
-	  // already with space for the new timetrack, 
-	  // so we can add directly)
-	  
-	  edf_record_t record( this ); 
-	  
-	  record.read( file , r );
-
-	  records.insert( std::map<int,edf_record_t>::value_type ( r , record ) );
-
-	}
-
 	  
       //
       // Add the time-stamp as the new track (i.e. if we write as EDF+)
       //
       
-      if ( ! record_in_memory ) // record already 'updated'
-	records.find(r)->second.add_annot( ts , header.t_track );
-      else // push_back on end of record
-	records.find(r)->second.add_annot( ts );
+      edf_record_t record( this , r );
+      record.add_annot( ts , header.t_track );
       
       //
       // And mark the actual record directy (i.e. if this is used in memory)
@@ -2512,9 +2939,6 @@ int edf_t::add_continuous_time_track()
       r = timeline.next_record(r);
     }
 
-//   std::cout << "DET1 " << records.begin()->second.pdata.size() << "\t"
-// 	    << records.begin()->second.data.size() << "\n";
-
 
   return header.time_track();
 
@@ -2582,7 +3006,7 @@ void edf_t::flip( const int s )
 
   // get all data
   interval_t interval = timeline.wholetrace();
-  slice_t slice( *this , s , interval );
+  slice_t slice( *this , s , interval , 1 , false );
   const std::vector<double> * d = slice.pdata();
   std::vector<double> rescaled( d->size() );
   
@@ -2618,7 +3042,7 @@ void edf_t::rescale( const int s , const std::string & sc )
 
   // get all data
   interval_t interval = timeline.wholetrace();
-  slice_t slice( *this , s , interval );
+  slice_t slice( *this , s , interval , 1 , false );
   const std::vector<double> * d = slice.pdata();
   std::vector<double> rescaled( d->size() );
 
@@ -2689,7 +3113,7 @@ bool edf_t::basic_stats( param_t & param )
 
       interval_t interval = timeline.wholetrace();
       
-      slice_t slice( *this , signals(s) , interval );
+      slice_t slice( *this , signals(s) , interval , 1 , false );
 	  
       const std::vector<double> * d = slice.pdata();
       
@@ -2795,7 +3219,7 @@ bool edf_t::basic_stats( param_t & param )
 	  // Get data 
 	  //
 	  
-	  slice_t slice( *this , signals(s) , interval );
+	  slice_t slice( *this , signals(s) , interval , 1 , false );
 	  
 	  const std::vector<double> * d = slice.pdata();
 
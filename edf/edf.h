@@ -32,6 +32,7 @@
 #include <map>
 #include <set>
 #include <stdint.h>
+#include <pthread.h>
 
 typedef unsigned char byte_t;
 
@@ -260,6 +261,142 @@ struct edf_header_t
 
 
 
+struct edf_store_t
+{
+
+  //
+  // in-memory sample store: one contiguous, record-indexed buffer of
+  // digital values per signal, i.e. record 'r' of signal 's' occupies
+  // data[s][ r * width[s] ] ... data[s][ (r+1) * width[s] - 1 ]
+  //
+  // buffers are zero-filled by calloc(), so pages spanning records
+  // that are never loaded or edited are never committed to memory
+  //
+  
+  std::vector<int16_t*> data;
+
+  // slots per record, for each signal (n_samples, or 2 x n_samples
+  // for EDF Annotations, which hold one byte per slot)
+  
+  std::vector<int> width;
+
+  // which records have been loaded? (one byte per record, so that
+  // flags for different records can be read and set from different
+  // threads, see edf_t::read_records())
+  
+  std::vector<char> present;
+
+  int nloaded;
+  
+  edf_store_t() { nloaded = 0; } 
+
+  ~edf_store_t() { clear(); } 
+
+  void clear();
+
+  // exchange contents (the store is not copyable)
+  void swap( edf_store_t & rhs );
+  
+  // allocate space for 'nr' records (none loaded)
+  void init( const int nr , const std::vector<int> & w );
+
+  bool allocated() const { return present.size() != 0 || width.size() != 0; } 
+  
+  int size() const { return nloaded; }
+
+  int nrecords() const { return present.size(); } 
+  
+  bool loaded( const int r ) const 
+  { return r >= 0 && r < present.size() && present[r]; } 
+  
+  void set_loaded( const int r ) 
+  { if ( ! present[r] ) { present[r] = true; ++nloaded; } } 
+
+  void unload( const int r ) 
+  { if ( present[r] ) { present[r] = false; --nloaded; } } 
+  
+  int16_t * record( const int s , const int r ) 
+  { return data[s] + (size_t)r * width[s]; } 
+  
+  const int16_t * record( const int s , const int r ) const 
+  { return data[s] + (size_t)r * width[s]; } 
+
+  // append a new (zero-filled) signal
+  void add_signal( const int w );
+  
+  void drop_signal( const int s );
+
+  // change the number of slots per record for a signal (contents are lost)
+  void resize_signal( const int s , const int w );
+
+ private:
+
+  int16_t * alloc( const int w ) const;
+
+  edf_store_t( const edf_store_t & );
+  edf_store_t & operator=( const edf_store_t & );
+  
+};
+
+
+
+struct spectral_cache_t
+{
+
+  //
+  // per-epoch Welch spectra (see PWELCH), shared across commands:
+  // keyed by signal label and a vector of the parameters that
+  // determine the spectrum (e.g. sample rate, segment size, overlap,
+  // window), and then by interval; as intervals are in absolute time,
+  // re-epoching does not invalidate entries, but anything that alters
+  // signals or the timeline must call clear()
+  //
+  
+  spectral_cache_t();
+
+  ~spectral_cache_t();
+  
+  // copy the cached spectrum to 'freq' and 'psd', if present
+  bool find( const std::string & label , 
+	     const std::vector<double> & par , 
+	     const interval_t & interval , 
+	     std::vector<double> * freq , 
+	     std::vector<double> * psd ) const;
+
+  // add a spectrum (unless over the size limit, globals::spectral_cache_mb)
+  void insert( const std::string & label , 
+	       const std::vector<double> & par , 
+	       const interval_t & interval , 
+	       const std::vector<double> & freq , 
+	       const std::vector<double> & psd );
+  
+  void clear();
+  
+ private:
+
+  typedef std::pair<std::string,std::vector<double> > set_key_t;
+  
+  // all intervals for one signal/parameter set share frequencies
+  struct set_t
+  {
+    std::vector<double> freq;
+    std::map<interval_t,std::vector<double> > psd;
+  };
+
+  std::map<set_key_t,set_t> sets;
+
+  size_t bytes;
+  
+  // may be called from parallel jobs (e.g. PSD, over signals)
+  mutable pthread_mutex_t mutex;
+
+  spectral_cache_t( const spectral_cache_t & );
+  spectral_cache_t & operator=( const spectral_cache_t & );
+  
+};
+
+
+
 struct edf_record_t
 {
 
@@ -267,50 +404,37 @@ struct edf_record_t
   friend struct edf_t;
   
   //
-  // contains all samples for all signals for a single
-  // record/time-interval
+  // all samples for all signals for a single record/time-interval;
+  // this is a view of that record in the edf_t sample store
   //
 
  public:
   
-  edf_record_t( edf_t * e );
+  edf_record_t( edf_t * e , const int r );
 
   // 
   // Main I/O functions
   //
 
-  bool read( FILE * file , int r );
+  // read from the EDF into the sample store
+  bool read( FILE * file );
   
   bool write( FILE * file );
 
-  void add_data( const std::vector<int16_t> & );
+  // encode as an EDF record (2 x n_samples bytes per signal) at 'q'
+  void encode( byte_t * q );
   
   std::vector<double> get_pdata( const int signal );
   
-  // here we know which slot to add to
   void add_annot( const std::string & , int signal );
 
-  // push back on end
-  void add_annot( const std::string & );
-
-  // now redundant
-  //  void calc_data( double bitvalue , double offset  );
-
-  void drop( const int s );
+  int16_t * data( const int signal );
   
  private:
 
-
-  //
-  // Primary data store ( signal x samples per record )
-  //
-  
   edf_t * edf;
   
-  std::vector<std::vector<int16_t> >    data;
-  
-  // compute this on-the-fly
-  //  std::vector<std::vector<double> > pdata;  // physically-scaled
+  int rec;
   
  public:
 
@@ -327,6 +451,9 @@ struct edf_record_t
   // directly give bit-value and offset
   inline static double dig2phys( int16_t , double , double );
   inline static int16_t phys2dig( double , double , double );
+
+  // as above, for a block of 'n' values (SIMD where available)
+  static void dig2phys( const int16_t * , const int n , const double , const double , double * );
   
 };
 
@@ -352,7 +479,9 @@ public:
 
   edf_header_t               header;
   
-  std::map<int,edf_record_t> records;
+  edf_store_t                store;
+
+  spectral_cache_t           spectra;       // per-epoch spectra, across commands
 
   std::set<int>              inp_signals_n; // read these signals
   
@@ -381,26 +510,49 @@ public:
   // Data access
   //
 
-  int records_loaded() const { return records.size(); } 
+  int records_loaded() const { return store.size(); } 
 
   
   // has this record already been loaded?
 
-  bool loaded( const int r ) const { return records.find(r) != records.end(); } 
+  bool loaded( const int r ) const { return store.loaded(r); } 
+
+  // allocate the sample store (if not already done)
+  
+  void ensure_store();
+
+  // is the EDF memory-mapped? (if so, records that have not been 
+  // loaded/edited are read in place, as views into the mapped file)
+
+  bool mapped() const { return mapped_file != NULL; } 
+  
+  // pointer to the start of record 'r' in the mapped file
+  
+  const byte_t * record_view( const int r ) const 
+  { return mapped_file + header_size + (long int)record_size * r; } 
+
+  // byte offset of (loaded) signal 's' within an EDF record, or -1
+  // if this signal is not in the original EDF (i.e. was added)
+
+  int record_offset( const int s ) const;
 
   // load if not loaded
   void ensure_loaded( const int rec )
   {
     // we may need to load this record first, before we can edit it
+    pthread_mutex_lock( &record_lock );
     if ( ! loaded( rec ) )
       {
-	edf_record_t record( this ); 
-	record.read( file , rec );
-	records.insert( std::map<int,edf_record_t>::value_type( rec , record ) );	      
+	edf_record_t record( this , rec ); 
+	record.read( file );
       }
+    pthread_mutex_unlock( &record_lock );
   }
 
   
+  // extract a signal (physical units) for an interval; 'tp' and 'rec'
+  // (time-points and record numbers, per sample) can be NULL if not needed
+
   std::vector<double> fixedrate_signal( uint64_t start , 
 					uint64_t stop , 
 					const int signal , 
@@ -474,6 +626,24 @@ private:
   
   FILE * file;
 
+  //
+  // Memory-mapped file (NULL if not mapped)
+  //
+
+  byte_t * mapped_file;
+  
+  long long mapped_size;
+
+  //
+  // Serialises loading records into the store (if not memory-mapped),
+  // as channel jobs may slice signals in parallel
+  //
+
+  pthread_mutex_t record_lock;
+
+  bool map_file();
+
+  void unmap_file();
   
   //
   // Endianness
@@ -501,6 +671,9 @@ public:
   {
     endian = determine_endian();    
     file = NULL;
+    mapped_file = NULL;
+    mapped_size = 0;
+    pthread_mutex_init( &record_lock , NULL );
     init();
   } 
 
@@ -508,15 +681,18 @@ public:
   ~edf_t() 
   {
     init();
+    pthread_mutex_destroy( &record_lock );
   }
 
   void init()
   {
+    unmap_file();
     if ( file != NULL ) 
       fclose(file);
     file = NULL;
     header.init();
-    records.clear();    
+    store.clear();    
+    spectra.clear();
     inp_signals_n.clear();
   }
   
@@ -60,7 +60,8 @@ mslice_t::mslice_t( edf_t & edf ,
 slice_t::slice_t( edf_t & edf , 
 		  int signal ,
 		  const interval_t & interval ,
-		  int downsample )   
+		  int downsample , 
+		  bool with_timepoints )   
   : edf(edf) , signal(signal) , interval(interval) , downsample(downsample) 
 {
 
@@ -105,12 +106,76 @@ slice_t::slice_t( edf_t & edf ,
 			       interval.stop , 
 			       signal , 
 			       downsample , 
-			       &time_points , 
-			       &records );
+			       with_timepoints ? &time_points : NULL , 
+			       with_timepoints ? &records : NULL );
   
 }
  
 
+PWELCH slice_pwelch( edf_t & edf , 
+		     int signal , 
+		     const interval_t & interval , 
+		     double Fs , 
+		     double segment_sec , 
+		     double overlap_sec , 
+		     int noverlap_segments , 
+		     window_function_t W , 
+		     bool average_adj , 
+		     bool centre , 
+		     std::vector<double> * data )
+{
+  
+  // everything (bar the signal and interval) that determines the spectrum
+  
+  std::vector<double> par( 7 );
+  par[0] = Fs;
+  par[1] = segment_sec;
+  par[2] = noverlap_segments;
+  par[3] = noverlap_segments == 0 ? overlap_sec : 0 ;
+  par[4] = W;
+  par[5] = average_adj;
+  par[6] = centre;
+  
+  const std::string & label = edf.header.label[ signal ];
+
+  std::vector<double> freq, psd;
+
+  const bool cached = edf.spectra.find( label , par , interval , &freq , &psd );
+
+  if ( cached && data == NULL ) 
+    return PWELCH( freq , psd );
+
+  slice_t slice( edf , signal , interval , 1 , false );
+
+  std::vector<double> * d = slice.nonconst_pdata();
+  
+  if ( centre ) 
+    MiscMath::centre( d );
+
+  if ( data != NULL ) 
+    *data = *d;
+
+  if ( cached ) 
+    return PWELCH( freq , psd );
+  
+  if ( noverlap_segments == 0 ) 
+    {
+      const int total_points = d->size();
+      const int segment_points = segment_sec * Fs;
+      const int noverlap_points  = overlap_sec * Fs;
+      noverlap_segments = floor( ( total_points - noverlap_points) 
+				 / (double)( segment_points - noverlap_points ) );
+    }
+  
+  PWELCH pwelch( *d , Fs , segment_sec , noverlap_segments , W , average_adj );
+  
+  edf.spectra.insert( label , par , interval , pwelch.freq , pwelch.psd );
+
+  return pwelch;
+
+}
+
+
 
 
 //
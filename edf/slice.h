@@ -28,11 +28,13 @@
 #include <string>
 
 #include "stats/matrix.h"
+#include "defs/defs.h"
 
 struct signal_list_t;
 struct interval_t;
 struct edf_t;
 struct timeline_t;
+class PWELCH;
 
 
 class slice_t
@@ -41,10 +43,14 @@ class slice_t
  public:
   
   
+  // if 'with_timepoints' is false, only the data are extracted 
+  // (i.e. ptimepoints() and precords() will be empty)
+
   slice_t( edf_t & edf , 
 	   int signal , 
 	   const interval_t & interval , 
-	   int    downsample = 1 );
+	   int    downsample = 1 , 
+	   bool   with_timepoints = true );
   
   const std::vector<double> * pdata() const 
   { 
@@ -120,4 +126,27 @@ class mslice_t {
 };
 
 
+
+//
+// Welch spectrum of a signal over an interval, i.e. PWELCH on a
+// slice (mean-centred first, if 'centre'); spectra are cached in
+// edf_t::spectra, so commands using the same signal, interval and
+// parameters share them.  If 'noverlap_segments' is 0, it is derived
+// from 'overlap_sec' and the slice length (as PSD).  If 'data' is 
+// given, the slice is always extracted, and copied there
+//
+
+PWELCH slice_pwelch( edf_t & edf , 
+		     int signal , 
+		     const interval_t & interval , 
+		     double Fs , 
+		     double segment_sec , 
+		     double overlap_sec , 
+		     int noverlap_segments , 
+		     window_function_t W , 
+		     bool average_adj , 
+		     bool centre , 
+		     std::vector<double> * data = NULL );
+
+
 #endif
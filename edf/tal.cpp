@@ -39,27 +39,34 @@ tal_t edf_t::tal( const int signal , const int rec )
   std::string s( np , '\x00' ); // maximum annot. size
 
   //
-  // need to load the record?
+  // if memory-mapped (and not edited), read in place 
   //
-  
-  if ( ! loaded( rec ) ) 
+
+  if ( mapped() && ! loaded( rec ) )
     {
-      edf_record_t record( this ); 
-      record.read( file , rec );
-      records.insert( std::map<int,edf_record_t>::value_type ( rec , record ) );
+      const int offset = record_offset( signal );
+      if ( offset != -1 )
+	{
+	  const byte_t * p = record_view( rec ) + offset;
+	  for (int i=0;i<np;i++) s[i] = (char)p[i];
+	  t.decode(s);
+	  return t;
+	}
     }
 
   //
-  // Pull data
+  // need to load the record?
   //
   
-  // std::cout << "records " << ( records.find( rec ) != records.end() ) << "\n";
-  // std::cout << "s = " << records[rec].data.size() << "\n";
-  // std::cout << "signal = " <<signal << "\n";
+  ensure_loaded( rec );
 
-  const std::vector<int16_t> & raw = records.find(rec)->second.data[signal];
+  //
+  // Pull data
+  //
+  
+  const int16_t * raw = store.record( signal , rec );
 
-  const int np_used = raw.size();
+  const int np_used = store.width[signal];
   
   if ( np_used > np ) 
     Helper::halt( "problem in getting TAL" );
@@ -310,6 +310,7 @@ void cmd_t::clear_static_members()
   cmdline_cmds = "";
   stout_file = "";
   append_stout_file = false;
+  colstore_file = "";
   
   vars.clear();
   signallist.clear();
@@ -2046,6 +2047,44 @@ void cmd_t::parse_special( const std::string & tok0 , const std::string & tok1 )
       return;
     }
 
+  // limit (MB) on per-epoch spectra cached across commands (0 = none)
+  if ( Helper::iequals( tok0 , "spectral-cache" ) )
+    {
+      if ( ! Helper::str2int( tok1 , &globals::spectral_cache_mb ) )
+	Helper::halt( "expecting integer for spectral-cache=N" );
+      return;
+    }
+
+  // memory-map EDFs (read records in place)
+  if ( Helper::iequals( tok0 , "mmap" ) )
+    {
+      globals::edf_mmap = Helper::yesno( tok1 );
+      return;
+    }
+
+  // FFTW planning: measured (slower to plan, faster to run) plans, and
+  // a wisdom file read now and written back when done
+  if ( Helper::iequals( tok0 , "fftw-measure" ) )
+    {
+      globals::fftw_measure = Helper::yesno( tok1 );
+      return;
+    }
+
+  if ( Helper::iequals( tok0 , "fftw-wisdom" ) )
+    {
+      globals::fftw_wisdom = tok1;
+      FFT::load_wisdom( tok1 );
+      return;
+    }
+
+  // number of worker threads for channel-parallel commands
+  if ( Helper::iequals( tok0 , "threads" ) )
+    {
+      if ( ! Helper::str2int( tok1 , &globals::threads ) || globals::threads < 1 ) 
+	Helper::halt( "expecting threads=N, where N >= 1" );
+      return;
+    }
+
   // do not read FTR files 
   if ( Helper::iequals( tok0 , "ftr" ) )
     {
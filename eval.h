@@ -148,6 +148,7 @@ class cmd_t
   static std::string                        cmdline_cmds;
   static std::string                        stout_file;
   static bool                               append_stout_file;
+  static std::string                        colstore_file;
 
   // command-specific parameters (i.e. from command-file)
   static std::set<std::string>    signallist;
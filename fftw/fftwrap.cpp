@@ -27,9 +27,131 @@
 #include "miscmath/miscmath.h"
 
 #include "defs/defs.h"
+#include "helper/threads.h"
+
+#include <pthread.h>
+
+//
+// Shared plan and window caches: PWELCH, coherence_t, etc construct
+// an FFT object per segment, so plan creation and window evaluation
+// are done once per (size, kind) rather than per segment
+//
+
+static pthread_mutex_t fft_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static std::map<std::pair<int,int>,fftw_plan> fft_plans;
+
+struct fft_window_t {
+  std::vector<double> w;
+  double sumsq;
+};
+
+static std::map<std::pair<int,int>,fft_window_t> fft_windows;
+
+
+// nb. plans are never removed, so references into the cache stay valid
+const fftw_plan & FFT::plan( int n , plan_kind_t kind )
+{
+
+  pthread_mutex_lock( &fft_cache_lock );
+
+  std::pair<int,int> key( n , (int)kind );
+  
+  std::map<std::pair<int,int>,fftw_plan>::const_iterator ii = fft_plans.find( key );
+
+  if ( ii != fft_plans.end() ) 
+    {
+      const fftw_plan & p = ii->second;
+      pthread_mutex_unlock( &fft_cache_lock );
+      return p;
+    }
+  
+  // plans are made on scratch buffers (FFTW_MEASURE overwrites them) and
+  // later executed on each object's own (equally aligned) buffers
+  
+  fftw_complex * a = (fftw_complex*) fftw_malloc( sizeof(fftw_complex) * n );
+  fftw_complex * b = (fftw_complex*) fftw_malloc( sizeof(fftw_complex) * n );
+  if ( a == NULL || b == NULL ) Helper::halt( "FFT failed to allocate plan buffers" );
+  
+  const unsigned flags = globals::fftw_measure ? FFTW_MEASURE : FFTW_ESTIMATE;
+  
+  fftw_plan p;
+  if ( kind == PLAN_R2C ) 
+    p = fftw_plan_dft_r2c_1d( n , (double*)a , b , flags );
+  else if ( kind == PLAN_C2R ) 
+    p = fftw_plan_dft_c2r_1d( n , b , (double*)a , flags );
+  else
+    p = fftw_plan_dft_1d( n , a , b , kind == PLAN_C2C_FORWARD ? FFTW_FORWARD : FFTW_BACKWARD , flags );
+  
+  fftw_free( a );
+  fftw_free( b );
+
+  if ( p == NULL ) Helper::halt( "FFT failed to create plan" );
+
+  const fftw_plan & cached = fft_plans[ key ] = p;
+  
+  pthread_mutex_unlock( &fft_cache_lock );
+
+  return cached;
+}
+
+
+const std::vector<double> * FFT::window_coefficients( int n , window_function_t window , double * sumsq )
+{
+
+  pthread_mutex_lock( &fft_cache_lock );
+
+  std::pair<int,int> key( n , (int)window );
+
+  std::map<std::pair<int,int>,fft_window_t>::iterator ii = fft_windows.find( key );
+
+  if ( ii == fft_windows.end() ) 
+    {
+      fft_window_t & fw = fft_windows[ key ];
+      
+      if      ( window == WINDOW_TUKEY50 ) fw.w = MiscMath::tukey_window(n,0.5);
+      else if ( window == WINDOW_HANN )    fw.w = MiscMath::hann_window(n);
+      else if ( window == WINDOW_HAMMING ) fw.w = MiscMath::hamming_window(n);
+      else fw.w.resize( n , 1 ); // i.e. default of no window
+      
+      fw.sumsq = 0;
+      for (int i=0;i<n;i++) fw.sumsq += fw.w[i] * fw.w[i];
+      
+      ii = fft_windows.find( key );
+    }
+  
+  *sumsq = ii->second.sumsq;
+
+  const std::vector<double> * w = &(ii->second.w);
+
+  pthread_mutex_unlock( &fft_cache_lock );
+
+  return w;
+}
+
+
+bool FFT::load_wisdom( const std::string & filename )
+{
+  pthread_mutex_lock( &fft_cache_lock );
+  const bool okay = fftw_import_wisdom_from_filename( filename.c_str() );
+  pthread_mutex_unlock( &fft_cache_lock );
+  if ( okay ) logger << " read FFTW wisdom from " << filename << "\n";
+  return okay;
+}
+
+
+bool FFT::save_wisdom( const std::string & filename )
+{
+  pthread_mutex_lock( &fft_cache_lock );
+  const bool okay = fftw_export_wisdom_to_filename( filename.c_str() );
+  pthread_mutex_unlock( &fft_cache_lock );
+  if ( ! okay ) logger << " could not write FFTW wisdom to " << filename << "\n";
+  return okay;
+}
+
 
 FFT::FFT( int N , int Fs , fft_t type , window_function_t window )
-  : N(N) , Fs(Fs), type(type), window(window), in(NULL), out(NULL), p(NULL)
+  : N(N) , Fs(Fs), type(type), window(window), in(NULL), out(NULL), w(NULL)
 {
   
   // Allocate storage for input/output
@@ -42,9 +164,6 @@ FFT::FFT( int N , int Fs , fft_t type , window_function_t window )
   // Initialise (probably not necessary, but do anyway)
   for (int i=0;i<N;i++) { in[i][0] = in[i][1] = 0; }
   
-  // Generate plan
-  p = fftw_plan_dft_1d( N, in, out , type == FFT_FORWARD ? FFTW_FORWARD : FFTW_BACKWARD , FFTW_ESTIMATE );
-
   //
   // We want to return only the positive spectrum, so set the cut-off
   //
@@ -67,14 +186,8 @@ FFT::FFT( int N , int Fs , fft_t type , window_function_t window )
   // we take the window into account
   //
 
-  w.resize( N , 1 ); // i.e. default of no window
-  
-  normalisation_factor = 0;  
-  if      ( window == WINDOW_TUKEY50 ) w = MiscMath::tukey_window(N,0.5);
-  else if ( window == WINDOW_HANN )    w = MiscMath::hann_window(N);
-  else if ( window == WINDOW_HAMMING ) w = MiscMath::hamming_window(N);
-  
-  for (int i=0;i<N;i++) normalisation_factor += w[i] * w[i];
+  w = window_coefficients( N , window , &normalisation_factor );
+
   normalisation_factor *= Fs;  
   normalisation_factor = 1.0/normalisation_factor;
   //  std::cerr << "norm " << normalisation_factor << "\n";
@@ -90,51 +203,58 @@ bool FFT::apply( const std::vector<double> & x )
 bool FFT::apply( const double * x , const int n )
 {
   
+  if ( n > N ) Helper::halt( "error in FFT" );
+
   //
-  // Load up (windowed) input buffer
+  // Inverse transforms of real input go via the complex plan
   //
+
+  if ( type == FFT_INVERSE ) 
+    {
+      if ( window == WINDOW_NONE )
+	for (int i=0;i<n;i++) { in[i][0] = x[i];        in[i][1] = 0; } 
+      else
+	for (int i=0;i<n;i++) { in[i][0] = x[i] * (*w)[i]; in[i][1] = 0; } 
+      
+      fftw_execute_dft( plan( N , PLAN_C2C_INVERSE ) , in , out );
+      
+      calc_psd();
+
+      return true;
+    }
   
+  //
+  // Otherwise, load up (windowed) real input buffer, zero-padding up to N
+  //
+  
+  double * r = (double*)in;
+
   if ( window == WINDOW_NONE )
-    for (int i=0;i<n;i++) { in[i][0] = x[i];        in[i][1] = 0; } 
+    for (int i=0;i<n;i++) r[i] = x[i];
   else
-    for (int i=0;i<n;i++) { in[i][0] = x[i] * w[i]; in[i][1] = 0; } 
+    for (int i=0;i<n;i++) r[i] = x[i] * (*w)[i];
+  
+  for (int i=n;i<N;i++) r[i] = 0;
   
   //
-  // Execute actual FFT
+  // Execute actual (real-to-complex) FFT
   // 
   
-  fftw_execute(p);
+  fftw_execute_dft_r2c( plan( N , PLAN_R2C ) , r , out );
   
-
   //
-  // Calculate PSD
+  // r2c only gives the non-negative frequencies: fill in the rest by
+  // conjugate symmetry, so that transform() etc see the full spectrum
   //
 
-  //
-  // psdx = (1/(Fs*N)) * abs(xdft).^2;
-  // where abs() is complex sqrt(a^2+b^2)
-  //
-
-  for (int i=0;i<cutoff;i++)
+  for (int i=cutoff;i<N;i++)
     {
-      
-      double a = out[i][0];
-      double b = out[i][1];
-      
-      X[i] =  ( a*a + b*b ) * normalisation_factor;
-      mag[i] = sqrt( a*a + b*b );
- 
-      // not for DC and Nyquist, but otherwise
-      // double all entries (i.e. to preserve
-      // total power, as here we have the one-
-      // sided PSD
-      
-      if ( i > 0 && i < cutoff-1 ) X[i] *= 2;
-      
-      //      std::cout << "det " << mag[i] << "\t" << X[i] << "\t" << ( a*a + b*b ) << "\n";
-      
+      out[i][0] =   out[N-i][0];
+      out[i][1] = - out[N-i][1];
     }
-  
+
+  calc_psd();
+
   return true;
 
 }
@@ -153,8 +273,17 @@ bool FFT::apply( const std::vector<std::complex<double> > & x )
       in[i][1] = std::imag( x[i] );	
     }    
   
-  fftw_execute(p);
+  fftw_execute_dft( plan( N , type == FFT_FORWARD ? PLAN_C2C_FORWARD : PLAN_C2C_INVERSE ) , in , out );
+
+  calc_psd();
   
+  return true;
+
+}
+
+
+void FFT::calc_psd()
+{
 
   //
   // Calculate PSD
@@ -183,8 +312,6 @@ bool FFT::apply( const std::vector<std::complex<double> > & x )
       
     }
   
-  return true;
-
 }
 
 
@@ -256,7 +383,7 @@ double FFT::width( frequency_band_t band )
 }
 
 
-void PWELCH::process()
+void PWELCH::process( const std::vector<double> & data )
 {
   
   // From MATLAB parameterizatopm:
@@ -279,19 +406,13 @@ void PWELCH::process()
 //    	    << "segment_increment_points = " << segment_increment_points << "\n";
   
   //
-  // Initial FFT
+  // A single FFT object (i.e. buffers, plan and window) is reused
+  // across all segments
   //
   
-  FFT fft0( segment_size_points , Fs , FFT_FORWARD , window );
+  FFT fft( segment_size_points , Fs , FFT_FORWARD , window );
 
-  if ( average_adj ) 
-    fft0.average_adjacent();
-  
-  psd.resize( fft0.cutoff , 0 );
-  N = fft0.cutoff;
-
-  freq.resize(N);
-  for (int f=0;f<N;f++) freq[f] = fft0.frq[f];
+  psd.resize( fft.cutoff , 0 );
   
 
   //
@@ -317,9 +438,6 @@ void PWELCH::process()
       // note -- this assumes no zero-padding will be applied, 
       // and all segments passed must be of exactly size segment_size_points
      
-      
-      FFT fft( segment_size_points , Fs , FFT_FORWARD , window );
-      
       if ( p + segment_size_points > data.size() ) 
 	Helper::halt( "internal error in pwelch()" );
       
@@ -344,11 +462,6 @@ void PWELCH::process()
 	  fft.apply( &(data[p]) , segment_size_points );
 	}
       
-      if ( average_adj )
-	fft.average_adjacent();
-      
-      int cutoff = fft.cutoff;
-      
       for (int i=0;i<fft.cutoff;i++)
 	psd[i] += fft.X[i];
       
@@ -362,8 +475,24 @@ void PWELCH::process()
   for (int i=0;i<psd.size();i++)
     {
       psd[i] /= (double)segments;      
-      //std::cout << "PWELCH " << fft0.frq[i] << " --> " << psd[i] << "\n";     
+      //std::cout << "PWELCH " << fft.frq[i] << " --> " << psd[i] << "\n";     
     }
+
+  //
+  // averaging adjacent bins is linear, so can be done once, on the mean
+  //
+
+  if ( average_adj ) 
+    {
+      fft.X = psd;
+      fft.average_adjacent();
+      psd = fft.X;
+    }
+
+  N = fft.cutoff;
+
+  freq.resize(N);
+  for (int f=0;f<N;f++) freq[f] = fft.frq[f];
   
 }
 
@@ -482,6 +611,10 @@ void coherence_t::process()
 
   res.resize(N);
 
+  // reused across all segments
+  FFT fftx( segment_points , Fs , FFT_FORWARD , window );
+  FFT ffty( segment_points , Fs , FFT_FORWARD , window );
+
   // freqs.
   for (int f=0;f<N;f++) res.frq[f] = fft0.frq[f];
 
@@ -511,9 +644,6 @@ void coherence_t::process()
       if ( p + segment_points > total_points )
 	Helper::halt( "internal error in coherence()" );
       
-      FFT fftx( segment_points , Fs , FFT_FORWARD , window );
-      FFT ffty( segment_points , Fs , FFT_FORWARD , window );      
-      
       if ( detrend || zerocenter )
  	{	  
  	  std::vector<double> x1( segment_points );
@@ -534,14 +664,9 @@ void coherence_t::process()
 	  ffty.apply( &(y[p]) , segment_points );
  	}
 
-      if ( average_adj )
-	{
-	  fftx.average_adjacent();
-	  ffty.average_adjacent();
-	}
-
-    
-      int cutoff = fftx.cutoff;
+      // nb. only the (possibly halved) number of bins is taken from the
+      // averaged FFT, i.e. as fft0 above
+      int cutoff = N;
       
       // x2 is to get full spectrum  
       double normalisation_factor = 2 * fftx.normalisation_factor;
@@ -605,6 +730,278 @@ void coherence_t::process()
 
 
 
+//
+// coherence_matrix_t : segments are taken in chunks (so memory does not
+// grow with the length of the signals, if the caller supplies only the
+// data for each chunk); for each chunk, every signal is transformed
+// once (in parallel over signals) and then the cross-spectra are
+// accumulated (in parallel over pairs); sums are accumulated in segment
+// order, as in coherence_t, so results are the same
+//
+
+static const int coh_chunk_segments = 64;
+
+struct coh_spectra_job_t : public parallel_job_t
+{
+  coh_spectra_job_t( coherence_matrix_t & cm ) : cm(cm) { }   
+  coherence_matrix_t & cm;
+  void run( const int s ) { cm.spectra( s ); } 
+};
+
+struct coh_cross_job_t : public parallel_job_t
+{
+  coh_cross_job_t( coherence_matrix_t & cm ) : cm(cm) { }   
+  coherence_matrix_t & cm;
+  void run( const int k ) { cm.cross( k ); } 
+};
+
+
+coherence_matrix_t::coherence_matrix_t( int ns , 
+					int total_points , 
+					int Fs, 
+					double segment_sec ,
+					double overlap_sec , 
+					window_function_t W , 
+					bool average_adj , 
+					bool detrend , 
+					bool zerocenter )
+  : total_points(total_points) , Fs(Fs), window(W), detrend(detrend) , zerocenter(zerocenter) , 
+    average_adj(average_adj) , ns(ns) , p(0) , segments(0) , x(NULL) , x_start(0)
+{
+  
+  // segments, as for coherence_t
+
+  segment_points = segment_sec * Fs;
+
+  noverlap_points1  = overlap_sec * Fs;
+  
+  noverlap_segments = floor( ( total_points - noverlap_points1) 
+			     / (double)( segment_points - noverlap_points1 ) );
+  
+  noverlap_points2 = noverlap_segments > 1 
+    ? ceil( ( noverlap_segments*segment_points - total_points  ) / double( noverlap_segments - 1 ) )
+    : 0 ;
+  
+  segment_increment_points = segment_points - noverlap_points2;
+
+  // all pairs
+
+  for (int i=0;i<ns;i++)
+    for (int j=i+1;j<ns;j++)
+      {
+	pair1.push_back( i );
+	pair2.push_back( j );
+      }
+  
+  //
+  // Initial FFT to get frequencies
+  //
+  
+  FFT fft0( segment_points , Fs , FFT_FORWARD , window );
+
+  if ( average_adj ) fft0.average_adjacent();
+  
+  N = fft0.cutoff;
+
+  // x2 is to get full spectrum  
+  normalisation_factor = 2 * fft0.normalisation();
+
+  const int np = pair1.size();
+  
+  res.resize( np );
+  for (int k=0;k<np;k++)
+    {
+      res[k].resize( N );
+      for (int f=0;f<N;f++) res[k].frq[f] = fft0.frq[f];
+    }
+
+  spec.resize( ns );
+  auto_sum.assign( ns , std::vector<double>( N , 0 ) );
+  cross_re.assign( np , std::vector<double>( N , 0 ) );
+  cross_im.assign( np , std::vector<double>( N , 0 ) );
+
+}
+
+
+bool coherence_matrix_t::next_chunk( int * a , int * b )
+{
+
+  chunk.clear();
+
+  while ( p <= total_points - segment_points && (int)chunk.size() < coh_chunk_segments )
+    {
+      chunk.push_back( p );
+      p += segment_increment_points;
+    }
+  
+  if ( chunk.size() == 0 ) return false;
+  
+  *a = chunk[0];
+  *b = chunk[ chunk.size() - 1 ] + segment_points;
+
+  return true;
+}
+
+
+void coherence_matrix_t::accumulate( const std::vector<const std::vector<double>*> & d , const int a )
+{
+
+  if ( d.size() != ns ) 
+    Helper::halt( "coherence_matrix_t::accumulate() called with wrong number of signals" );
+
+  if ( chunk.size() == 0 ) return;
+  
+  const int b = chunk[ chunk.size() - 1 ] + segment_points;
+
+  if ( a > chunk[0] ) 
+    Helper::halt( "coherence_matrix_t::accumulate() given data that start after the chunk" );
+  
+  for (int s=0;s<ns;s++)
+    if ( (int)d[s]->size() < b - a ) 
+      Helper::halt( "coherence_matrix_t::accumulate() given too few data points for the chunk" );
+  
+  x = &d;
+  x_start = a;
+  
+  segments += chunk.size();
+
+  coh_spectra_job_t spectra_job( *this );
+  Helper::parallel_for( ns , spectra_job );
+  
+  coh_cross_job_t cross_job( *this );
+  Helper::parallel_for( pair1.size() , cross_job );
+
+  x = NULL;
+
+}
+
+
+void coherence_matrix_t::finalize()
+{
+
+  spec.clear();
+  
+  //
+  // take average over segments
+  //
+
+  const double COH_EPS = 1e-10;
+
+  const int np = pair1.size();
+  
+  for (int k=0;k<np;k++)
+    {
+      
+      coh_t & r = res[k];
+
+      const std::vector<double> & sx = auto_sum[ pair1[k] ];
+      const std::vector<double> & sy = auto_sum[ pair2[k] ];
+      
+      for (int i=0;i<N;i++)
+	{
+	  
+	  double sxx = segments ? sx[i] / (double)segments : 0 ;
+	  double syy = segments ? sy[i] / (double)segments : 0 ;
+	  std::complex<double> sxy = segments 
+	    ? std::complex<double>( cross_re[k][i] / (double)segments , cross_im[k][i] / (double)segments )
+	    : std::complex<double>( 0 , 0 );
+	  
+	  double phi = abs( sxy ) ;
+	  double phi2 = phi * phi;
+	  
+	  if ( sxx < COH_EPS || syy < COH_EPS ) 
+	    r.coh[i] = -9;
+	  else
+	    r.coh[i] = phi2 / ( sxx * syy ); 
+	  
+	  r.cross_spectrum[i] = phi2 > COH_EPS ? 5.0*log10(phi2) : -50.0 ;	  
+	  r.auto_spectrum1[i] = sxx > COH_EPS ?  10.0*log10(sxx) : -100.0 ;
+	  r.auto_spectrum2[i] = syy > COH_EPS ?  10.0*log10(syy) : -100.0 ;
+	  
+	  r.cross_norm1[i] = phi2 / (sxx*sxx) ;
+	  r.cross_norm2[i] = phi2 / (syy*syy) ;
+	}
+    }
+  
+}
+
+
+void coherence_matrix_t::spectra( const int s )
+{
+  
+  // nb. xs[0] is sample point 'x_start'
+  const std::vector<double> & xs = *(*x)[s];
+
+  FFT fftx( segment_points , Fs , FFT_FORWARD , window );
+
+  std::vector<std::complex<double> > & X = spec[s];
+
+  std::vector<double> & ss = auto_sum[s];
+  
+  const int nc = chunk.size();
+
+  X.resize( nc * N );
+
+  for (int c=0;c<nc;c++)
+    {
+      
+      const int p = chunk[c] - x_start;
+      
+      if ( detrend || zerocenter )
+ 	{	  
+ 	  std::vector<double> x1( segment_points );
+ 	  for (int j=0;j<segment_points;j++) x1[j] = xs[p+j];
+	  if  ( detrend ) MiscMath::detrend(&x1);
+	  else MiscMath::centre(&x1);
+	  fftx.apply( x1 );
+	}
+      else
+	fftx.apply( &(xs[p]) , segment_points );
+      
+      std::complex<double> * Xc = &(X[c*N]);
+
+      const fftw_complex * out = fftx.output();
+      
+      for (int i=0;i<N;i++)
+	{
+	  double a = out[i][0];
+	  double b = out[i][1];
+	  ss[i] += ( a*a + b*b ) * normalisation_factor;
+	  Xc[i] = std::complex<double>( a , b );
+	}
+    }
+
+}
+
+
+void coherence_matrix_t::cross( const int k )
+{
+  
+  const std::vector<std::complex<double> > & X = spec[ pair1[k] ];
+  const std::vector<std::complex<double> > & Y = spec[ pair2[k] ];
+  
+  std::vector<double> & re = cross_re[k];
+  std::vector<double> & im = cross_im[k];
+
+  const int nc = chunk.size();
+
+  for (int c=0;c<nc;c++)
+    {
+      const std::complex<double> * Xc = &(X[c*N]);
+      const std::complex<double> * Yc = &(Y[c*N]);
+      
+      for (int i=0;i<N;i++)
+	{
+	  std::complex<double> Xy = normalisation_factor * ( Xc[i] * conj( Yc[i] ) );
+	  re[i] += std::real( Xy );
+	  im[i] += std::imag( Xy );
+	}
+    }
+  
+}
+
+
+
 int bin_t::bin( const std::vector<double> & f , 
 		const std::vector<double> & y ) 
 {
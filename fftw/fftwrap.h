@@ -55,10 +55,35 @@ class FFT
   
   ~FFT() 
     {    
-      fftw_destroy_plan(p);
+      // nb. plans are owned by the shared plan cache
       fftw_free(in);
       fftw_free(out);
     }
+
+  //
+  // FFTW wisdom (optional; read at startup, written back on exit)
+  //
+
+  static bool load_wisdom( const std::string & filename );
+
+  static bool save_wisdom( const std::string & filename );
+
+  //
+  // Process-wide cache of FFTW plans, keyed on size, direction and
+  // real/complex input: for code that runs its own transforms (with
+  // fftw_execute_dft() etc, on fftw_malloc()'ed buffers), e.g. CWT,
+  // block FIR filtering and batched Hilbert transforms
+  //
+
+  enum plan_kind_t { PLAN_C2C_FORWARD = 0 , PLAN_C2C_INVERSE , PLAN_R2C , PLAN_C2R };
+
+  static const fftw_plan & plan( int n , plan_kind_t kind );
+
+  // raw output (first 'cutoff' values), and the normalisation factor
+  // for the window
+  const fftw_complex * output() const { return out; }
+
+  double normalisation() const { return normalisation_factor; }
   
  private:
 
@@ -68,26 +93,32 @@ class FFT
   // Sampling rate, so we can construct the appropriate Hz for the PSD
   int Fs;
   
-  // Input signal
+  // Input signal (nb. holds N doubles for real-to-complex transforms)
   fftw_complex *in;
 
   // Output signal
   fftw_complex *out;
   
-  // FFT plan from FFTW3
-  fftw_plan p;
-
   // Forward or inverse FFT?
   fft_t type;
   
-  // Optional windowing function
+  // Optional windowing function (shared, from the window cache)
   window_function_t window;
-  std::vector<double> w;
+  const std::vector<double> * w;
 
   // Normalisation factor given the window
   double normalisation_factor;
   
 
+  //
+  // Process-wide cache of window coefficients 
+  //
+
+  static const std::vector<double> * window_coefficients( int n , window_function_t window , double * sumsq );
+  
+  // Power spectrum from the first 'cutoff' outputs
+  void calc_psd();
+
   //
   // Power band helper functions
   //
@@ -194,7 +225,7 @@ class PWELCH
 	 int noverlap_segments , 
 	 window_function_t W = WINDOW_TUKEY50 , 
 	 bool average_adj = false ) 
-   : data(data) , Fs(Fs) , M(M) , noverlap_segments(noverlap_segments) , 
+   : Fs(Fs) , M(M) , noverlap_segments(noverlap_segments) , 
      window(W), average_adj(average_adj) 
   {
 
@@ -202,8 +233,16 @@ class PWELCH
     // the above specifies how many segments (of size 'M' seconds) we want in the 
     // window
 
-    process(); 
+    process( data ); 
   } 
+
+  // a previously computed spectrum (e.g. from edf_t::spectra)
+  
+ PWELCH( const std::vector<double> & freq , 
+	 const std::vector<double> & psd ) 
+   : N( freq.size() ) , psd(psd) , freq(freq) , 
+     Fs(0) , M(0) , noverlap_segments(0) , window(WINDOW_NONE) , average_adj(false)
+  { } 
   
   
   //
@@ -247,10 +286,7 @@ class PWELCH
   
  private:
     
-  void process();
-  
-  // input signal  
-  const std::vector<double> & data;
+  void process( const std::vector<double> & data );
   
   // sampling rate (points per second)
   const int Fs; 
@@ -359,5 +395,101 @@ class coherence_t {
 };
 
 
+//
+// Cross-spectral matrix: as coherence_t, but for all pairs of a set of
+// equal-length signals; each signal's segment transforms (and auto
+// spectra) are computed once and shared by every pair it is part of.
+// Segments are taken in chunks: the caller asks for the sample points
+// spanned by the next chunk, supplies just those data for each signal,
+// and calls finalize() after the last chunk
+//
+
+class coherence_matrix_t {
+
+ public:
+
+  coherence_matrix_t ( int ns , 
+		       int total_points , 
+		       int Fs, 
+		       double segment_sec ,  // segment size in seconds 
+		       double overlap_sec , // overlap in seconds
+		       window_function_t W = WINDOW_HANN , 
+		       bool average_adj = false , 
+		       bool detrend = false , 
+		       bool zerocenter = false );
+  
+  // sample points [a,b) spanned by the next chunk of segments; false if none left
+  bool next_chunk( int * a , int * b );
+
+  // accumulate the current chunk: x[s] holds signal 's' from sample point 'a' onwards
+  void accumulate( const std::vector<const std::vector<double>*> & x , const int a );
+
+  // averages over all segments, into res
+  void finalize();
+  
+  // number of pairs, and the signals in pair 'k'; pairs are ordered 
+  // (0,1), (0,2), ..., (1,2), ...
+  int npairs() const { return pair1.size(); } 
+  int first( const int k ) const { return pair1[k]; } 
+  int second( const int k ) const { return pair2[k]; } 
+  
+  // results, for each pair
+  std::vector<coh_t> res;
+
+  int total_points;
+  int noverlap_segments;
+  int segment_points;
+  int noverlap_points1, noverlap_points2;
+  int segment_increment_points;
+  
+  int Fs;
+
+ private:
+
+  window_function_t window;
+  
+  bool detrend;
+  bool zerocenter;
+
+  bool average_adj;
+
+  int N;
+
+  int ns;
+  
+  std::vector<int> pair1, pair2;
+
+  // start of the next chunk, and number of segments so far
+  int p;
+  int segments;
+
+  // segments (start points) in the current chunk, and the data for it
+  std::vector<int> chunk;
+  const std::vector<const std::vector<double>*> * x;
+  int x_start;
+  
+  // per signal: transforms of the segments in the current chunk (N
+  // per segment), and running sums of the auto-spectra
+  std::vector<std::vector<std::complex<double> > > spec;
+  std::vector<std::vector<double> > auto_sum;
+
+  // per pair: running sums of the cross-spectra
+  std::vector<std::vector<double> > cross_re, cross_im;
+
+  double normalisation_factor;
+
+ public:
+  
+  // (called in parallel from accumulate())
+
+  // transform the current chunk of segments, for signal 's'
+  void spectra( const int s );
+
+  // accumulate cross-spectra over the current chunk, for pair 'k'
+  void cross( const int k );
+  
+};
+
+
 
 #endif
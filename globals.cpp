@@ -29,11 +29,16 @@ writer_t writer;
 
 logger_t logger( "+++ luna" );;
 
+__thread writer_buffer_t * writer_t::capture = NULL;
+
+__thread std::ostringstream * logger_t::capture = NULL;
+
 std::set<std::string>              cmd_t::commands;
 std::string                        cmd_t::input = "";
 std::string                        cmd_t::cmdline_cmds = "";
 std::string                        cmd_t::stout_file = "";
 bool                               cmd_t::append_stout_file = false;
+std::string                        cmd_t::colstore_file = "";
 std::map<std::string,std::string>  cmd_t::vars;
 std::set<std::string>              cmd_t::signallist;
 std::map<std::string,std::string>  cmd_t::label_aliases;
@@ -22,6 +22,7 @@
 
 #include "helper.h"
 #include "logger.h"
+#include "threads.h"
 
 #include "defs/defs.h"
 #include "intervals/intervals.h"
@@ -108,6 +109,9 @@ bool Helper::file_extension( const std::string & f, const std::string & ext )
 
 void Helper::halt( const std::string & msg )
 {
+
+  // in a worker thread? if so, the main thread halts instead 
+  Helper::worker_halt( msg );
   
   // some other code handles the exit, e.g. if running under luna-web?
   if ( globals::bail_function != NULL ) 
@@ -55,6 +55,11 @@ class logger_t
     is_off = false;      
   }
   
+  // when set (i.e. in a worker thread), output is buffered here, and 
+  // written later by the main thread (see Helper::parallel_for())
+
+  static __thread std::ostringstream * capture;
+
   void flush() { _out_stream.flush(); } 
 
   void off() { flush(); is_off = true; } 
@@ -111,7 +116,9 @@ class logger_t
   void warning( const std::string & msg )
   {
     if ( is_off ) return ;
-    if ( globals::Rmode && globals::Rdisp )
+    if ( capture ) 
+      *capture << " ** warning: " << msg << " ** " << std::endl;
+    else if ( globals::Rmode && globals::Rdisp )
       ss << " ** warning: " << msg << " ** " << std::endl;
     else
       _out_stream << " ** warning: " << msg << " ** " << std::endl;
@@ -123,6 +130,12 @@ class logger_t
     {
       if ( is_off ) return *this;      
 
+      if ( capture ) 
+	{
+	  *capture << data;
+	  return *this;
+	}
+
       if ( ! globals::silent ) 
 	_out_stream << data;
       else if ( globals::Rmode && globals::Rdisp )
@@ -0,0 +1,184 @@
+
+//    --------------------------------------------------------------------
+//
+//    This file is part of Luna.
+//
+//    LUNA is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    Luna is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with Luna. If not, see <http://www.gnu.org/licenses/>.
+//
+//    Please see LICENSE.txt for more details.
+//
+//    --------------------------------------------------------------------
+
+
+#include "threads.h"
+
+#include "defs/defs.h"
+#include "helper/helper.h"
+#include "helper/logger.h"
+#include "db/db.h"
+
+#include <pthread.h>
+#include <sstream>
+#include <vector>
+
+extern writer_t writer;
+extern logger_t logger;
+
+struct parallel_state_t 
+{
+  parallel_job_t * job;
+  int n;
+  int next;
+  pthread_mutex_t lock;
+  std::vector<writer_buffer_t> wbuf;
+  std::vector<std::ostringstream*> lbuf;
+
+  // first (lowest) item that called Helper::halt(), or -1
+  int error_item;
+  std::string error;
+};
+
+// set in worker threads: the loop being run (so that any nested
+// parallel_for() runs serially) and the current item
+static __thread parallel_state_t * worker_state = NULL;
+static __thread int worker_item = -1;
+
+static void * parallel_worker( void * p )
+{
+  
+  parallel_state_t * state = (parallel_state_t*)p;
+
+  worker_state = state;
+
+  while ( 1 ) 
+    {
+      
+      // take the next item
+      pthread_mutex_lock( &state->lock );
+      const int i = state->next++;
+      pthread_mutex_unlock( &state->lock );
+      
+      if ( i >= state->n ) break;
+
+      worker_item = i;
+      
+      // buffer all output from this item
+      writer_t::capture = &state->wbuf[i];
+      logger_t::capture = state->lbuf[i];
+
+      state->job->run( i );
+
+      writer_t::capture = NULL;
+      logger_t::capture = NULL;
+    }
+
+  worker_state = NULL;
+  worker_item = -1;
+  
+  return NULL;
+}
+
+
+void Helper::worker_halt( const std::string & msg )
+{
+
+  if ( worker_state == NULL ) return;
+
+  parallel_state_t * state = worker_state;
+  
+  // record the error, and stop any further items being taken
+  
+  pthread_mutex_lock( &state->lock );
+  if ( state->error_item == -1 || worker_item < state->error_item ) 
+    {
+      state->error_item = worker_item;
+      state->error = msg;
+    }
+  state->next = state->n;
+  pthread_mutex_unlock( &state->lock );
+
+  writer_t::capture = NULL;
+  logger_t::capture = NULL;
+
+  worker_state = NULL;
+  worker_item = -1;
+
+  // the main thread halts, once all workers have finished
+  pthread_exit( NULL );
+}
+
+
+void Helper::parallel_for( const int n , parallel_job_t & job )
+{
+  
+  const int nt = worker_state != NULL ? 1 : globals::threads < n ? globals::threads : n ; 
+
+  //
+  // Serial case: just run in place
+  //
+
+  if ( nt <= 1 ) 
+    {
+      for (int i=0;i<n;i++) job.run(i);
+      return;
+    }
+  
+  //
+  // Otherwise, items are taken in turn by 'nt' worker threads
+  //
+
+  parallel_state_t state;
+  state.job = &job;
+  state.n = n;
+  state.next = 0;
+  state.error_item = -1;
+  pthread_mutex_init( &state.lock , NULL );
+  state.wbuf.resize( n );
+  state.lbuf.resize( n );
+  for (int i=0;i<n;i++) state.lbuf[i] = new std::ostringstream;
+
+  std::vector<pthread_t> threads( nt );
+
+  for (int t=0;t<nt;t++)
+    if ( pthread_create( &threads[t] , NULL , parallel_worker , &state ) )
+      Helper::halt( "could not create thread" );
+
+  for (int t=0;t<nt;t++)
+    pthread_join( threads[t] , NULL );
+
+  pthread_mutex_destroy( &state.lock );
+  
+  //
+  // Replay buffered output, in item order (up to any item that failed, 
+  // i.e. as the serial loop would have done, and then halt)
+  //
+
+  const int nr = state.error_item == -1 ? n : state.error_item;
+  
+  for (int i=0;i<n;i++)
+    {
+      if ( i < nr ) 
+	{
+	  logger << state.lbuf[i]->str();
+	  writer.replay( state.wbuf[i] );
+	}
+      else if ( i == nr ) 
+	logger << state.lbuf[i]->str();
+      delete state.lbuf[i];
+    }
+  
+  if ( state.error_item != -1 ) 
+    Helper::halt( state.error );
+  
+}
@@ -0,0 +1,56 @@
+
+//    --------------------------------------------------------------------
+//
+//    This file is part of Luna.
+//
+//    LUNA is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    Luna is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with Luna. If not, see <http://www.gnu.org/licenses/>.
+//
+//    Please see LICENSE.txt for more details.
+//
+//    --------------------------------------------------------------------
+
+
+#ifndef __THREADS_H__
+#define __THREADS_H__
+
+#include <string>
+
+//
+// Simple parallel loop for independent work items (e.g. channels):
+// each item's writer_t and logger output is buffered by the worker
+// thread, and then replayed in item order, so that output is
+// identical to the equivalent serial loop
+//
+
+struct parallel_job_t 
+{
+  virtual ~parallel_job_t() { } 
+
+  // process item 'i' (called from a worker thread when threads > 1)
+  virtual void run( const int i ) = 0;
+};
+
+namespace Helper 
+{
+  // run job.run(i) for i = 0 .. n-1, over up to globals::threads threads
+  // (if called from within a job, just runs serially in that thread)
+  void parallel_for( const int n , parallel_job_t & job );
+
+  // called by halt(): if in a worker thread, records the error and ends
+  // that thread, and parallel_for() then halts from the main thread;
+  // otherwise, does nothing
+  void worker_halt( const std::string & msg );
+}
+
+#endif
@@ -1289,6 +1289,27 @@ Token Eval::value() const
   return e;
 }
 
+std::set<std::string> Eval::variables() const
+{
+  std::set<std::string> v;
+  std::map<std::string,std::set<Token*> >::const_iterator i = vartb.begin();
+  while ( i != vartb.end() )
+    {
+      v.insert( i->first );
+      ++i;
+    }
+  return v;
+}
+
+bool Eval::uses( const std::string & f ) const
+{
+  for (int i=0; i<output.size(); i++)
+    for (int j=0; j<output[i].size(); j++)
+      if ( output[i][j].is_function() && output[i][j].name() == f ) 
+	return true;
+  return false;
+}
+
 bool Eval::value(int & i)
 {
   if ( e.is_int(&i) ) return true;
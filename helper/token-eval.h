@@ -91,6 +91,12 @@ struct Eval {
   // what does this return?
   Token::tok_type rtype() const;
   Token value() const;
+
+  // names of variables referenced in the (parsed) expression
+  std::set<std::string> variables() const;
+
+  // does the (parsed) expression call function 'f'? 
+  bool uses( const std::string & f ) const;
   
  private:
   
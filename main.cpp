@@ -28,6 +28,10 @@
 
 #include "main.h"
 
+#ifndef WINDOWS
+#include <sys/wait.h>
+#include <fcntl.h>
+#endif
 
 extern globals global;
 
@@ -156,6 +160,8 @@ int main(int argc , char ** argv )
 
       //   -o  output db
       //   -a  output db  { as above, except append } 
+      //   -b  output file { columnar binary, instead of a db } 
+      //   -j  N { number of worker processes over the sample-list }
       //   -s  { rest of line is script }
 
       // comma-separated strings (-->signals)
@@ -186,7 +192,24 @@ int main(int argc , char ** argv )
 	      cmd_t::stout_file = argv[ ++i ];
 	      if ( Helper::iequals( tok[0] , "-a" ) ) cmd_t::append_stout_file = true;
 	    }
-	  
+
+	  // columnar output file
+
+	  else if ( Helper::iequals( tok[0] , "-b" ) )
+	    {
+	      if ( i + 1 >= argc ) Helper::halt( "expecting file name after -b" );
+	      cmd_t::colstore_file = argv[ ++i ];
+	    }
+
+	  // number of worker processes for the sample-list
+
+	  else if ( Helper::iequals( tok[0] , "-j" ) )
+	    {
+	      if ( i + 1 >= argc ) Helper::halt( "expecting number of jobs after -j" );
+	      if ( ! Helper::str2int( argv[ ++i ] , &globals::sample_list_jobs ) || globals::sample_list_jobs < 1 )
+		Helper::halt( "expecting -j N, where N >= 1" );
+	    }
+
 	  
 	  // luna-script from command line
 	  
@@ -299,11 +322,16 @@ int main(int argc , char ** argv )
   // initialize output to a STOUT db or not?
   //
 
+  if ( cmd_t::colstore_file != "" && cmd_t::stout_file != "" ) 
+    Helper::halt( "cannot specify both -o/-a and -b" );
+
   if ( ! cmd_t::append_stout_file ) 
     Helper::deleteFile( cmd_t::stout_file );
   
   if ( cmd_t::stout_file != "" )
     writer.attach( cmd_t::stout_file );  
+  else if ( cmd_t::colstore_file != "" ) 
+    writer.attach_colstore( cmd_t::colstore_file );
   else 
     writer.nodb();
   
@@ -404,6 +432,9 @@ int main(int argc , char ** argv )
   if ( failed == 0 ) logger << " all of which passed" << "\n";
   else logger << failed << " of which failed\n";
 
+  if ( globals::fftw_wisdom != "" ) 
+    FFT::save_wisdom( globals::fftw_wisdom );
+
   exit(0);
   
 }
@@ -464,12 +495,51 @@ void process_edfs( cmd_t & cmd )
     }
   
 
+  //
+  // Split the sample-list over worker processes (luna -j N)?  Each
+  // worker takes every Nth line and writes to its own database; once
+  // all are done, the parent merges these into the primary database
+  //
+
+  const int jobs = single_edf ? 1 : globals::sample_list_jobs;
+  
+  int job = -1;
+
+  if ( jobs > 1 ) 
+    {
+      if ( writer.name() == "." ) 
+	Helper::halt( "-j requires an output database, i.e. -o" );
+
+      if ( cmd_t::colstore_file != "" ) 
+	Helper::halt( "-j cannot be used with -b" );
+      
+      std::vector<std::string> shards( jobs );
+      for (int j=0;j<jobs;j++) 
+	shards[j] = writer.name() + ".job" + Helper::int2str( j+1 );
+      
+      job = fork_sample_list_workers( shards );
+      
+      EDFLIST.close();
+
+      if ( job == -1 ) 
+	{
+	  merge_sample_list_shards( cmd.data() , shards );
+	  return;
+	}
+      
+      // worker process: re-open the sample-list, so that the file
+      // offset is not shared with the other workers
+      EDFLIST.open( cmd.data().c_str() , std::ios::in );
+    }
+
+
   //
   // Start iterating through it
   //
   
   int processed = 0;
   int actual = 0;
+  int lines = 0;
 
   while ( single_edf || ! EDFLIST.eof() )
     {
@@ -490,6 +560,18 @@ void process_edfs( cmd_t & cmd )
 	  
 	  if ( line == "" ) continue;
 
+	  ++lines;
+	  
+	  //
+	  // In a worker process, only handle every Nth line
+	  //
+
+	  if ( job != -1 && ( lines - 1 ) % jobs != job ) 
+	    {
+	      ++processed;
+	      continue;
+	    }
+
 	  //
 	  // If we are only looking at a subset of the sample list, 
 	  // might skip here	  
@@ -844,6 +926,188 @@ void process_edfs( cmd_t & cmd )
 	 << "...processed " << actual << " EDFs, done."
 	 << "\n";
 
+
+  //
+  // Worker process done: close its database and quit (skipping
+  // atexit handlers and destructors of state shared with the parent)
+  //
+
+  if ( job != -1 ) 
+    {
+      writer.close();
+      logger.off();
+      std::cout.flush();
+      _exit(0);
+    }
+
+}
+
+
+
+int fork_sample_list_workers( const std::vector<std::string> & shards )
+{
+
+  //
+  // Start one worker process per shard: returns the job number
+  // (0..N-1) in each worker, or -1 in the parent, after all workers
+  // have finished
+  //
+
+#ifdef WINDOWS
+  Helper::halt( "-j is not supported on this platform" );
+  return -1;
+#else
+
+  const int jobs = shards.size();
+
+  logger << "\n running " << jobs << " worker processes\n";
+  
+  // flush before forking, so that nothing buffered is written twice
+  logger.flush();
+  std::cout.flush();
+  
+  std::vector<pid_t> pids( jobs );
+  
+  for (int j=0;j<jobs;j++)
+    {
+
+      Helper::deleteFile( shards[j] );
+      
+      pid_t pid = fork();
+
+      if ( pid < 0 ) 
+	Helper::halt( "could not start worker process" );
+      
+      if ( pid == 0 ) 
+	{
+	  // worker: log to a file, write output to its own database
+
+	  const std::string logfile = shards[j] + ".log";
+	  int fd = open( logfile.c_str() , O_WRONLY | O_CREAT | O_TRUNC , 0644 );
+	  if ( fd != -1 ) 
+	    {
+	      dup2( fd , STDERR_FILENO );
+	      close( fd );
+	    }
+	  
+	  writer.close();
+	  writer.attach( shards[j] );
+	  
+	  return j;
+	}
+      
+      pids[j] = pid;
+    }
+
+
+  //
+  // parent: wait for all workers, then echo their logs in order
+  //
+  
+  std::vector<bool> okay( jobs );
+  
+  for (int j=0;j<jobs;j++)
+    {
+      int status = 0;
+      waitpid( pids[j] , &status , 0 );
+      okay[j] = WIFEXITED( status ) && WEXITSTATUS( status ) == 0;
+    }
+  
+  int failed = 0;
+  
+  for (int j=0;j<jobs;j++)
+    {
+      const std::string logfile = shards[j] + ".log";
+      
+      logger << "\n___________________________________________________________________\n"
+	     << "Worker " << j+1 << " of " << jobs << ( okay[j] ? "" : " (failed)" ) << "\n";
+      
+      std::ifstream LOG( logfile.c_str() , std::ios::in );
+      std::string line;
+      while ( std::getline( LOG , line ) ) 
+	logger << line << "\n";
+      LOG.close();
+      
+      Helper::deleteFile( logfile );
+
+      if ( ! okay[j] ) ++failed;
+    }
+  
+  if ( failed ) 
+    Helper::halt( Helper::int2str( failed ) + " of " + Helper::int2str( jobs ) + " worker processes failed" );
+  
+  return -1;
+  
+#endif
+}
+
+
+void merge_sample_list_shards( const std::string & sample_list , const std::vector<std::string> & shards )
+{
+  
+  //
+  // Copy each worker's output into the primary database, individual by
+  // individual in sample-list order, i.e. as if run serially
+  //
+
+  const int jobs = shards.size();
+
+  std::vector<writer_shard_t*> dbs( jobs );
+  
+  for (int j=0;j<jobs;j++)
+    {
+      if ( ! Helper::fileExists( shards[j] ) ) 
+	Helper::halt( "could not find worker database " + shards[j] );
+      dbs[j] = new writer_shard_t( shards[j] );
+    }
+  
+  // as in process_edfs(), line L was handled by worker (L-1) % N
+
+  std::set<std::pair<int,std::string> > merged;
+
+  std::ifstream EDFLIST( sample_list.c_str() , std::ios::in );
+  
+  int lines = 0;
+  int n = 0;
+
+  while ( ! EDFLIST.eof() )
+    {
+      std::string line;
+      std::getline( EDFLIST , line );
+      if ( line == "" ) continue;
+      
+      const int j = lines++ % jobs;
+
+      std::vector<std::string> tok = Helper::parse( line , "\t" );
+      if ( tok.size() == 0 ) continue;
+      
+      // each worker DB holds all data for an ID, even if listed twice
+      std::pair<int,std::string> key( j , tok[0] );
+      if ( merged.find( key ) != merged.end() ) continue;
+      merged.insert( key );
+      
+      if ( writer.merge( *dbs[j] , tok[0] ) ) ++n;
+    }
+  
+  EDFLIST.close();
+
+
+  //
+  // Clean up
+  //
+  
+  for (int j=0;j<jobs;j++)
+    {
+      delete dbs[j];
+      Helper::deleteFile( shards[j] );
+    }
+  
+  logger << "\n"
+	 << "___________________________________________________________________"
+	 << "\n"
+	 << "...merged " << n << " individual(s) from " << jobs << " worker databases into " << writer.name() << ", done."
+	 << "\n";
+  
 }
 
 
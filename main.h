@@ -29,6 +29,7 @@
 #include <set>
 #include <sstream>
 #include <iostream>
+#include <vector>
 
 class param_t;
 class cmd_t;
@@ -36,6 +37,8 @@ class cmd_t;
 void proc_dummy( const std::string & );
 void proc_eval_tester( const bool );
 void process_edfs(cmd_t&);
+int fork_sample_list_workers( const std::vector<std::string> & );
+void merge_sample_list_shards( const std::string & , const std::vector<std::string> & );
 void list_cmds();
 
 void build_param_from_cmdline( param_t * );
@@ -158,7 +158,7 @@ void pdc_t::similarity_matrix( edf_t & edf , param_t & param )
 	  
 	  if ( edf.header.is_annotation_channel( signals(s) ) ) continue;
 	  
-	  slice_t slice( edf , signals(s) , interval );
+	  slice_t slice( edf , signals(s) , interval , 1 , false );
 	  
 	  std::vector<double> * d = slice.nonconst_pdata();
 	  
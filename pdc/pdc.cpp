@@ -29,6 +29,7 @@
 #include "edf/edf.h"
 #include "edf/slice.h"
 #include "dsp/resample.h"
+#include "helper/threads.h"
 
 #include <string>
 #include <iostream>
@@ -49,6 +50,9 @@ std::vector<pdc_obs_t> pdc_t::obs;
 std::set<std::string> pdc_t::labels;
 std::map<std::string,int> pdc_t::label_count;
 std::map<std::string,int> pdc_t::channels;  
+std::vector<pdc_vp_node_t> pdc_t::vptree;
+std::vector<int> pdc_t::vpix;
+std::vector<double> pdc_t::vpdata;
 
 ///////////////////////////////////////////////////////////////////////////
 // File format notes
@@ -96,8 +100,14 @@ void pdc_t::construct_tslib( edf_t & edf , param_t & param )
 
   
   std::string outfile = param.requires( "ts-lib" ) + "-" + edf.id + ".tslib" ;
+
+  // binary TS-LIB (see pdclib.cpp) rather than text?
+  const bool binary = param.has( "binary" );
   
-  std::ofstream OUT1( outfile.c_str() , std::ios::out );
+  std::ofstream OUT1;
+  if ( ! binary ) OUT1.open( outfile.c_str() , std::ios::out );
+
+  pdc_lib_writer_t BOUT1( binary ? outfile : "" , false );
   
   //
   // Signals and sample-rate
@@ -189,6 +199,13 @@ void pdc_t::construct_tslib( edf_t & edf , param_t & param )
 	  int start = 10 * sr - 1 ;
 	  int end   = start + 10 * sr - 1 ;
 	  int np    = end - start + 1 ; 
+
+	  if ( binary )
+	    {
+	      std::vector<double> x( d->begin() + start , d->begin() + end + 1 );
+	      BOUT1.add( "e-" + Helper::int2str( epoch ) , edf.id , signals.label(s) , cat_id , "." , sr , 0 , 0 , 0 , x );
+	      continue;
+	    }
 	  
 	  // header
 	  OUT1 << "e-" << epoch << "\t" 
@@ -211,7 +228,12 @@ void pdc_t::construct_tslib( edf_t & edf , param_t & param )
   
   logger << " output " << cnt << " epochs for " << ns << " signals to TS-lib " << outfile << "\n";
 
-  OUT1.close();
+  if ( binary )
+    {
+      if ( ! BOUT1.close() ) Helper::halt( "problem writing " + outfile );
+    }
+  else
+    OUT1.close();
 
 }
 
@@ -315,29 +337,60 @@ void pdc_t::construct_pdlib( param_t & param )
   //
   
   Helper::fileExists( infile );
+
+  // either TS-LIB may be binary; a binary PD-LIB is written if 'binary' is set
   
-  std::ifstream IN( infile.c_str() , std::ios::in );
-  std::ofstream OUT( outfile.c_str() , std::ios::out );
+  pdc_lib_reader_t * BIN = pdc_lib_reader_t::is_binary( infile ) ? new pdc_lib_reader_t( infile ) : NULL ;
+
+  if ( BIN != NULL && BIN->pd ) Helper::halt( infile + " is a PD-LIB, not a TS-LIB" );
+
+  const bool binary = param.has( "binary" );
+  
+  std::ifstream IN;
+  if ( BIN == NULL ) IN.open( infile.c_str() , std::ios::in );
+
+  std::ofstream OUT;
+  if ( ! binary ) OUT.open( outfile.c_str() , std::ios::out );
+
+  pdc_lib_writer_t BOUT( binary ? outfile : "" , true );
   
   int cnt = 0; 
 
-  while ( ! IN.eof() )
+  int row = 0;
+
+  while ( 1 )
     {
       std::string ts_id, indiv_id, ch_id, cat_id, aux;
       int sr, sp;
       std::vector<double> x;
-      IN >> ts_id;
-      if ( IN.eof() ) break;
-      IN >> indiv_id >> ch_id >> cat_id >> aux;
-      IN >> sr >> sp;
 
-      for (int i=0;i<sp;i++) 
+      if ( BIN != NULL )
 	{
-	  double t;
-	  IN >> t;
-	  x.push_back(t);	  
+	  if ( row == BIN->nrows ) break;
+	  const pdc_lib_row_t & r = BIN->row( row++ );
+	  ts_id = BIN->str( r.ts_id );
+	  indiv_id = BIN->str( r.indiv_id );
+	  ch_id = BIN->str( r.ch_id );
+	  cat_id = BIN->str( r.cat_id );
+	  aux = BIN->str( r.aux );
+	  sr = r.sr;
+	  const float * v = BIN->values( r );
+	  x.assign( v , v + r.n );
+	}
+      else
+	{
+	  IN >> ts_id;
+	  if ( IN.eof() ) break;
+	  IN >> indiv_id >> ch_id >> cat_id >> aux;
+	  IN >> sr >> sp;
+	  
+	  for (int i=0;i<sp;i++) 
+	    {
+	      double t;
+	      IN >> t;
+	      x.push_back(t);	  
+	    }
 	}
-     
 
       //
       // Keep this channel?
@@ -355,6 +408,13 @@ void pdc_t::construct_pdlib( param_t & param )
       std::vector<double> pd = pdc_t::calc_pd( x , m , t , &normalize );      
 
       // uniquify the ts_id here
+      if ( binary ) 
+	{
+	  BOUT.add( ts_id + "-" + indiv_id , indiv_id , ch_id , cat_id , aux , sr , m , t , normalize , pd );
+	  ++cnt;
+	  continue;
+	}
+
       OUT << ts_id << "-" << indiv_id << "\t" 
 	  << indiv_id << "\t"
 	  << ch_id << "\t"
@@ -371,10 +431,18 @@ void pdc_t::construct_pdlib( param_t & param )
       ++cnt;
 
     }
-  
-  IN.close();
 
-  OUT.close();
+  if ( BIN != NULL ) 
+    delete BIN;
+  else
+    IN.close();
+
+  if ( binary ) 
+    {
+      if ( ! BOUT.close() ) Helper::halt( "problem writing " + outfile );
+    }
+  else
+    OUT.close();
   
   logger << " done.\n";
 }
@@ -390,6 +458,12 @@ void pdc_t::read_tslib( const std::string & tslib )
   
   if ( ! Helper::fileExists( tslib ) ) 
     Helper::halt( "could not find " + tslib );
+
+  if ( pdc_lib_reader_t::is_binary( tslib ) )
+    {
+      read_binary_lib( tslib , false );
+      return;
+    }
   
   std::ifstream IN( tslib.c_str() , std::ios::in );
   
@@ -523,6 +597,12 @@ void pdc_t::read_pdlib( const std::string & pdlib , const std::set<std::string>
   
   if ( ! Helper::fileExists( pdlib ) ) 
     Helper::halt( "could not find " + pdlib );
+
+  if ( pdc_lib_reader_t::is_binary( pdlib ) )
+    {
+      read_binary_lib( pdlib , true , incl_chs );
+      return;
+    }
   
   std::ifstream IN( pdlib.c_str() , std::ios::in );
   
@@ -746,6 +826,19 @@ void pdc_t::test()
 }
 
 
+struct pdc_row_job_t : public parallel_job_t
+{
+  pdc_row_job_t( Data::Matrix<double> & D ) : D(D) { } 
+  Data::Matrix<double> & D;
+  void run( const int i ) 
+  {
+    const int N = pdc_t::obs.size();
+    for (int j=i+1;j<N;j++)
+      D[i][j] = D[j][i] = pdc_t::distance( pdc_t::obs[i] , pdc_t::obs[j] );
+  }
+};
+
+
 Data::Matrix<double> pdc_t::all_by_all()
 {
 
@@ -760,9 +853,9 @@ Data::Matrix<double> pdc_t::all_by_all()
 //   for (int i=0;i<N;i++) 
 //     D[i].resize(N,0);
   
-  for (int i=0;i<(N-1);i++)
-    for (int j=i+1;j<N;j++)
-      D[i][j] = D[j][i] = distance( obs[i] , obs[j] );
+  // rows in parallel (each row i sets D[i][j] and D[j][i], for j > i)
+  pdc_row_job_t job( D );
+  Helper::parallel_for( N - 1 , job );
 
   return D;
 }
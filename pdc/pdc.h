@@ -31,6 +31,8 @@
 #include "helper/helper.h"
 #include "stats/matrix.h"
 
+#include <stdint.h>
+
 struct edf_t;
 
 struct param_t;
@@ -125,9 +127,118 @@ struct pd_dist_t {
 
 
 
+//
+// Binary TS-LIB and PD-LIB files (see pdclib.cpp): the same rows as
+// the text formats, but with all strings in a dictionary and all
+// values (time-series, or PD counts) as one contiguous float array
+//
+
+struct pdc_lib_row_t {
+
+  // dictionary indices
+  int32_t ts_id, indiv_id, ch_id, cat_id, aux;
+
+  // sample rate, and for a PD-LIB, m, t and the sum of counts
+  int32_t sr, m, t, sum;
+
+  // values [ offset , offset + n ) 
+  int32_t n;
+  int64_t offset;
+
+};
+
+
+struct pdc_lib_writer_t {
+
+  pdc_lib_writer_t( const std::string & filename , const bool pd );
+  
+  void add( const std::string & ts_id , 
+	    const std::string & indiv_id , 
+	    const std::string & ch_id , 
+	    const std::string & cat_id , 
+	    const std::string & aux , 
+	    int sr , int m , int t , int sum , 
+	    const std::vector<double> & x );
+  
+  // write the file
+  bool close();
+
+ private:
+
+  std::string filename;
+  bool pd;
+
+  std::map<std::string,int> dict;
+  std::vector<std::string> strings;
+  std::vector<pdc_lib_row_t> rows;
+  std::vector<float> values;
+
+  int str( const std::string & );
+
+};
+
+
+struct pdc_lib_reader_t {
+
+  // memory-maps (or if that fails, reads) the file
+  pdc_lib_reader_t( const std::string & filename );
+
+  ~pdc_lib_reader_t();
+
+  // is this a binary TS-LIB/PD-LIB?
+  static bool is_binary( const std::string & filename );
+  
+  // PD-LIB (else TS-LIB)
+  bool pd;
+
+  int nrows;
+
+  const pdc_lib_row_t & row( const int i ) const { return rows[i]; } 
+
+  std::string str( const int k ) const 
+  { return std::string( blob + string_offsets[k] , string_offsets[k+1] - string_offsets[k] ); } 
+
+  const float * values( const pdc_lib_row_t & r ) const { return vals + r.offset; } 
+
+ private:
+
+  char * data;
+  int64_t size;
+  bool mapped;
+
+  const int64_t * string_offsets;
+  const char * blob;
+  const pdc_lib_row_t * rows;
+  const float * vals;
+
+};
+
+
+//
+// Node of a vantage-point tree over the library (see pdcindex.cpp)
+//
+
+struct pdc_vp_node_t {
+  
+  // observation used as the vantage point (-1 for a leaf)
+  int vp;
+
+  // median (embedded) distance from the vantage point
+  double mu;
+
+  // child nodes: within and beyond mu
+  int inside, outside;
+
+  // for a leaf, observations vpix[begin] .. vpix[end-1]
+  int begin, end;
+
+};
+
+
 struct pdc_t { 
 
   friend struct pdc_obs_t;
+  friend struct pdc_row_job_t;
   
   pdc_t( const bool b = true ) 
   { 
@@ -193,6 +304,7 @@ struct pdc_t {
     label_count.clear();
     q=0;
     channels.clear();
+    clear_index();
   }
 
   
@@ -213,6 +325,9 @@ struct pdc_t {
   
   static void read_tslib( const std::string & );
 
+  // (binary formats, called from the above)
+  static void read_binary_lib( const std::string & , const bool pd , const std::set<std::string> * incl_chs = NULL );
+
   //
   // Wrapper to get TS-LIB from EDFs
   //
@@ -296,6 +411,25 @@ struct pdc_t {
   
   static std::set<pd_dist_t> match( const pdc_obs_t & target , const int nbest = 10 );
 
+  // as above, for many targets (in parallel)
+  static std::vector<std::set<pd_dist_t> > match( const std::vector<const pdc_obs_t*> & targets , const int nbest = 10 );
+
+
+  //
+  // Vantage-point tree index of the library, used by match(): read
+  // from 'filename' if that matches the current library, otherwise
+  // built and saved there
+  //
+
+  static void index( const std::string & filename );
+
+  static void clear_index()
+  {
+    vptree.clear();
+    vpix.clear();
+    vpdata.clear();
+  }
+
   static std::map<std::string,double> summarize( const std::set<pd_dist_t> & matches , std::string * cat , double * conf );
     
   
@@ -337,6 +471,38 @@ private:
 
   static std::set<std::string> labels;
   static std::map<std::string,int> label_count;
+
+  //
+  // vantage-point tree (empty if not indexed)
+  //
+
+  static std::vector<pdc_vp_node_t> vptree;
+  static std::vector<int> vpix;
+
+  // all PDs, in vpix order
+  static std::vector<double> vpdata;
+  
+  static int build_vp( const int begin , const int end );
+  
+  static double vp_distance( const pdc_obs_t & target , const int p , double * embedded );
+
+  static void search_vp( const int node , const pdc_obs_t & target , const int nbest , 
+			 std::vector<pd_dist_t> & heap );
+
+  static bool read_index( const std::string & filename , const uint64_t fp );
+
+  // check a loaded index against the library
+  static bool valid_index();
+
+  static bool write_index( const std::string & filename , const uint64_t fp );
+
+  static uint64_t fingerprint();
+  
+  // are all PDs probability distributions (required for the index)? 
+  static bool normalized( const pdc_obs_t & );
+
+  // Euclidean distance between (all channels') sqrt(PD) vectors 
+  static double embedded_distance( const pdc_obs_t & a, const pdc_obs_t & b );
   
   //
   // Helper functions
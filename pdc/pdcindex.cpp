@@ -0,0 +1,485 @@
+
+//    --------------------------------------------------------------------
+//
+//    This file is part of Luna.
+//
+//    LUNA is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    Luna is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with Luna. If not, see <http://www.gnu.org/licenses/>.
+//
+//    Please see LICENSE.txt for more details.
+//
+//    --------------------------------------------------------------------
+
+
+
+#include "pdc.h"
+
+#include "helper/logger.h"
+#include "helper/threads.h"
+#include "miscmath/miscmath.h"
+
+#include <cmath>
+#include <fstream>
+#include <algorithm>
+#include <limits>
+
+extern logger_t logger;
+
+
+//
+// k-nearest neighbours in the PD-LIB: distance() is the (per-channel)
+// symmetric alpha-divergence, 4( 1 - sum_i sqrt( x_i y_i ) ), which is
+// not itself a metric; but for PDs that sum to 1, it is twice the
+// squared Euclidean distance between sqrt(x) and sqrt(y).  The library
+// is therefore indexed with a vantage-point tree on the Euclidean
+// distance between (all channels') sqrt(PD) vectors, D, and searched
+// with a bound on D implied by the current k-th best distance():
+//
+//   distance() <= tau   implies   D^2 <= sqrt(q) tau / 2
+//
+// Candidates are always ranked by distance() itself, so the matches
+// are the same as an exhaustive search
+//
+
+// max. observations in a leaf
+static const int pdc_vp_leaf_size = 8;
+
+// tolerance for sum(PD) == 1 (needed for the bound above)
+static const double pdc_vp_norm_eps = 1e-12;
+
+// allowance for rounding in computed D (given the tolerance above)
+static const double pdc_vp_slack = 1e-5;
+
+static const char pdc_vp_magic[8] = { 'P','D','C','I','D','X','1','\n' };
+
+
+bool pdc_t::normalized( const pdc_obs_t & a )
+{
+  if ( a.pd.size() < q ) return false;
+  for (int k=0;k<q;k++)
+    {
+      if ( a.pd[k].size() == 0 || a.pd[k].size() != obs[0].pd[k].size() ) return false;
+      double s = 0;
+      for (int i=0;i<a.pd[k].size();i++) s += a.pd[k][i];
+      if ( fabs( s - 1 ) > pdc_vp_norm_eps ) return false;
+    }
+  return true;
+}
+
+
+double pdc_t::embedded_distance( const pdc_obs_t & a, const pdc_obs_t & b )
+{
+  double d2 = 0;
+  for (int k=0;k<q;k++)
+    d2 += symmetricAlphaDivergence( a.pd[k] , b.pd[k] );
+  d2 *= 0.5;
+  return d2 > 0 ? sqrt( d2 ) : 0 ; 
+}
+
+
+uint64_t pdc_t::fingerprint()
+{
+  // FNV-1a over q, N and all PDs
+  uint64_t h = 14695981039346656037ULL;
+  const int N = obs.size();
+  const int hdr[2] = { q , N };
+  const unsigned char * p = (const unsigned char*)hdr;
+  for (int j=0;j<sizeof(hdr);j++) { h ^= p[j]; h *= 1099511628211ULL; } 
+  for (int i=0;i<N;i++)
+    for (int k=0;k<q;k++)
+      {
+	const std::vector<double> & pd = obs[i].pd[k];
+	p = (const unsigned char*)&(pd[0]);
+	const int nb = pd.size() * sizeof(double);
+	for (int j=0;j<nb;j++) { h ^= p[j]; h *= 1099511628211ULL; } 
+      }
+  return h;
+}
+
+
+int pdc_t::build_vp( const int begin , const int end )
+{
+
+  pdc_vp_node_t node;
+  node.vp = -1;
+  node.mu = 0;
+  node.inside = node.outside = -1;
+  node.begin = begin;
+  node.end = end;
+  
+  const int idx = vptree.size();
+  vptree.push_back( node );
+  
+  if ( end - begin <= pdc_vp_leaf_size ) return idx;
+
+  // vantage point: take the middle of the range
+  std::swap( vpix[begin] , vpix[ ( begin + end ) / 2 ] );
+  const int vp = vpix[begin];
+
+  // split the rest at the median distance from it
+  const int n = end - begin - 1;
+  std::vector<std::pair<double,int> > d( n );
+  for (int i=0;i<n;i++)
+    d[i] = std::make_pair( embedded_distance( obs[vp] , obs[ vpix[begin+1+i] ] ) , vpix[begin+1+i] );
+  
+  const int med = ( n - 1 ) / 2;
+  std::nth_element( d.begin() , d.begin() + med , d.end() );
+  for (int i=0;i<n;i++) vpix[begin+1+i] = d[i].second;
+
+  // inside : D <= mu ; outside : D >= mu
+  const double mu = d[med].first;
+  const int inside = build_vp( begin + 1 , begin + 2 + med );
+  const int outside = build_vp( begin + 2 + med , end );
+  
+  vptree[idx].vp = vp;
+  vptree[idx].mu = mu;
+  vptree[idx].inside = inside;
+  vptree[idx].outside = outside;
+  
+  return idx;
+}
+
+
+void pdc_t::index( const std::string & filename )
+{
+  
+  clear_index();
+
+  const int N = obs.size();
+
+  if ( N == 0 || q == 0 ) return;
+  
+  for (int i=0;i<N;i++)
+    if ( ! normalized( obs[i] ) ) 
+      {
+	logger << " PD-LIB observation " << obs[i].id 
+	       << " does not sum to 1 (within " << pdc_vp_norm_eps 
+	       << "), so not indexing: all matches will be exhaustive\n";
+	return;
+      }
+  
+  const uint64_t fp = fingerprint();
+  
+  if ( Helper::fileExists( filename ) && read_index( filename , fp ) ) 
+    logger << " read PD-LIB index " << filename << "\n";
+  else
+    {
+      vpix.resize( N );
+      for (int i=0;i<N;i++) vpix[i] = i;
+      
+      build_vp( 0 , N );
+      
+      logger << " built PD-LIB index (" << vptree.size() << " nodes)\n";
+      
+      if ( write_index( filename , fp ) ) 
+	logger << " wrote PD-LIB index to " << filename << "\n";
+      else
+	logger << " could not write PD-LIB index to " << filename << "\n";
+    }
+
+  // copy of all PDs, in index order (i.e. so that a subtree is contiguous)
+  const int nb = obs[0].pd[0].size();
+  vpdata.resize( (size_t)N * q * nb );
+  double * y = &(vpdata[0]);
+  for (int p=0;p<N;p++)
+    for (int k=0;k<q;k++)
+      {
+	const std::vector<double> & pd = obs[ vpix[p] ].pd[k];
+	for (int i=0;i<nb;i++) *y++ = pd[i];
+      }
+  
+}
+
+
+bool pdc_t::write_index( const std::string & filename , const uint64_t fp )
+{
+  std::ofstream OUT( filename.c_str() , std::ios::out | std::ios::binary );
+  if ( ! OUT.good() ) return false;
+  
+  const int N = vpix.size();
+  const int nn = vptree.size();
+  
+  OUT.write( pdc_vp_magic , sizeof(pdc_vp_magic) );
+  OUT.write( (const char*)&fp , sizeof(fp) );
+  OUT.write( (const char*)&N , sizeof(int) );
+  OUT.write( (const char*)&nn , sizeof(int) );
+  OUT.write( (const char*)&(vpix[0]) , N * sizeof(int) );
+  OUT.write( (const char*)&(vptree[0]) , nn * sizeof(pdc_vp_node_t) );
+  
+  bool okay = OUT.good();
+  OUT.close();
+  return okay;
+}
+
+
+bool pdc_t::read_index( const std::string & filename , const uint64_t fp )
+{
+  std::ifstream IN( filename.c_str() , std::ios::in | std::ios::binary );
+
+  char magic[ sizeof(pdc_vp_magic) ];
+  uint64_t fp1 = 0;
+  int N = 0 , nn = 0;
+
+  IN.read( magic , sizeof(magic) );
+  IN.read( (char*)&fp1 , sizeof(fp1) );
+  IN.read( (char*)&N , sizeof(int) );
+  IN.read( (char*)&nn , sizeof(int) );
+
+  // a different library (or version): rebuild
+  if ( ! IN.good() 
+       || ! std::equal( magic , magic + sizeof(magic) , pdc_vp_magic ) 
+       || fp1 != fp 
+       || N != obs.size() ) 
+    {
+      logger << " PD-LIB index " << filename << " does not match this library, rebuilding\n";
+      return false;
+    }
+
+  // at most one node per observation, plus leaves
+  if ( nn < 1 || nn > 2 * N + 1 ) 
+    {
+      logger << " PD-LIB index " << filename << " is not valid, rebuilding\n";
+      return false;
+    }
+  
+  vpix.resize( N );
+  vptree.resize( nn );
+  IN.read( (char*)&(vpix[0]) , N * sizeof(int) );
+  IN.read( (char*)&(vptree[0]) , nn * sizeof(pdc_vp_node_t) );
+  
+  if ( ! IN.good() || ! valid_index() ) 
+    {
+      logger << " PD-LIB index " << filename << " is not valid, rebuilding\n";
+      clear_index();
+      return false;
+    }
+  
+  return true;
+}
+
+
+bool pdc_t::valid_index()
+{
+
+  // i.e. as build_vp() would have made it: vpix is a permutation of
+  // the observations, the root spans all of them, and each node's
+  // children come after it and split its range after the vantage point
+
+  const int N = obs.size();
+  const int nn = vptree.size();
+  
+  if ( vpix.size() != N || nn < 1 ) return false;
+  
+  std::vector<bool> seen( N , false );
+  for (int p=0;p<N;p++)
+    {
+      const int i = vpix[p];
+      if ( i < 0 || i >= N || seen[i] ) return false;
+      seen[i] = true;
+    }
+  
+  if ( vptree[0].begin != 0 || vptree[0].end != N ) return false;
+  
+  for (int n=0;n<nn;n++)
+    {
+      const pdc_vp_node_t & node = vptree[n];
+      
+      if ( node.begin < 0 || node.end > N || node.begin > node.end ) return false;
+      
+      if ( node.vp == -1 ) 
+	{
+	  if ( node.inside != -1 || node.outside != -1 ) return false;
+	  continue;
+	}
+      
+      if ( node.begin == node.end || node.vp != vpix[ node.begin ] ) return false;
+      
+      if ( node.inside <= n || node.inside >= nn 
+	   || node.outside <= n || node.outside >= nn ) return false;
+      
+      const pdc_vp_node_t & in = vptree[ node.inside ];
+      const pdc_vp_node_t & out = vptree[ node.outside ];
+      
+      if ( in.begin != node.begin + 1 || in.end != out.begin || out.end != node.end ) return false;
+
+      if ( ! ( node.mu >= 0 ) ) return false;
+    }
+  
+  return true;
+}
+
+
+//
+// bounded top-k (max-heap on pd_dist_t, i.e. the worst match on top)
+//
+
+static void pdc_consider( std::vector<pd_dist_t> & heap , const int nbest , const pd_dist_t & d )
+{
+  if ( heap.size() < nbest )
+    {
+      heap.push_back( d );
+      std::push_heap( heap.begin() , heap.end() );
+    }
+  else if ( d < heap.front() )
+    {
+      std::pop_heap( heap.begin() , heap.end() );
+      heap.back() = d;
+      std::push_heap( heap.begin() , heap.end() );
+    }
+}
+
+
+//
+// distance() between the target and the library observation at position
+// 'p' of the index (computed in the same way, from the index's copy of
+// the PDs); optionally, also the embedded distance
+//
+
+double pdc_t::vp_distance( const pdc_obs_t & target , const int p , double * embedded )
+{
+  const int nb = target.pd[0].size();
+  const double * y = &(vpdata[ (size_t)p * q * nb ]);
+  
+  double d = 0 , e = 0;
+
+  for (int k=0;k<q;k++)
+    {
+      const double * x = &(target.pd[k][0]);
+      double a = 0;
+      for (int i=0;i<nb;i++)
+	a += sqrt( x[i] * y[i] );
+      a = 4 * ( 1 - a );
+      y += nb;
+
+      if ( q == 1 ) d = a;
+      else d += MiscMath::sqr( a );
+      e += a;
+    }
+
+  if ( embedded ) 
+    {
+      e *= 0.5;
+      *embedded = e > 0 ? sqrt( e ) : 0 ;
+    }
+
+  return q == 1 ? d : sqrt( d );
+}
+
+
+void pdc_t::search_vp( const int n , const pdc_obs_t & target , const int nbest , 
+		       std::vector<pd_dist_t> & heap )
+{
+
+  const pdc_vp_node_t & node = vptree[n];
+  
+  if ( node.vp == -1 )
+    {
+      for (int p=node.begin;p<node.end;p++)
+	pdc_consider( heap , nbest , pd_dist_t( vp_distance( target , p , NULL ) , vpix[p] ) );
+      return;
+    }
+
+  // nb. the vantage point is at position 'begin'
+  double delta = 0;
+  pdc_consider( heap , nbest , pd_dist_t( vp_distance( target , node.begin , &delta ) , node.vp ) );
+
+  // nearer side first
+  const bool in_first = delta <= node.mu;
+  
+  for (int side = 0 ; side < 2 ; side++ )
+    {
+      
+      // search radius (in D), given the current k-th best
+      double r = std::numeric_limits<double>::max();
+      if ( heap.size() == nbest ) 
+	{
+	  const double tau = heap.front().d > 0 ? heap.front().d : 0 ; 
+	  r = sqrt( sqrt( (double)q ) * tau / 2.0 ) + 3 * pdc_vp_slack;
+	}
+      
+      if ( ( side == 0 ) == in_first )
+	{
+	  if ( node.inside != -1 && delta - r <= node.mu ) 
+	    search_vp( node.inside , target , nbest , heap );
+	}
+      else
+	{
+	  if ( node.outside != -1 && delta + r >= node.mu ) 
+	    search_vp( node.outside , target , nbest , heap );
+	}
+    }
+  
+}
+
+
+std::set<pd_dist_t> pdc_t::match( const pdc_obs_t & target , const int nbest )
+{
+
+  const int N = obs.size();
+  
+  // as before, nbest < 1 implies all 
+  const int k = nbest < 1 || nbest > N ? N : nbest ;
+  
+  std::vector<pd_dist_t> heap;
+  heap.reserve( k + 1 );
+
+  if ( k > 0 )
+    {
+      if ( vptree.size() != 0 && normalized( target ) )
+	search_vp( 0 , target , k , heap );
+      else
+	for (int i = 0 ; i < N ; i++ ) 
+	  pdc_consider( heap , k , pd_dist_t( distance( target , obs[i] ) , i ) );
+    }
+  
+  return std::set<pd_dist_t>( heap.begin() , heap.end() );
+}
+
+
+struct pdc_match_job_t : public parallel_job_t 
+{
+
+  pdc_match_job_t( const std::vector<const pdc_obs_t*> & targets , const int nbest , 
+		   std::vector<std::set<pd_dist_t> > & matches )
+  : targets(targets) , nbest(nbest) , matches(matches) { } 
+
+  const std::vector<const pdc_obs_t*> & targets;
+  const int nbest;
+  std::vector<std::set<pd_dist_t> > & matches;
+  
+  void run( const int i ) 
+  {
+    matches[i] = pdc_t::match( *targets[i] , nbest );
+  }
+};
+
+
+std::vector<std::set<pd_dist_t> > pdc_t::match( const std::vector<const pdc_obs_t*> & targets , const int nbest )
+{
+  // targets must also sum to 1 to use the index
+  if ( vptree.size() != 0 ) 
+    {
+      int nu = 0;
+      for (int i=0;i<targets.size();i++)
+	if ( ! normalized( *targets[i] ) ) ++nu;
+      if ( nu ) 
+	logger << " " << nu << " of " << targets.size() 
+	       << " targets do not sum to 1 (within " << pdc_vp_norm_eps 
+	       << "), so are matched exhaustively\n";
+    }
+
+  std::vector<std::set<pd_dist_t> > matches( targets.size() );
+  pdc_match_job_t job( targets , nbest , matches );
+  Helper::parallel_for( targets.size() , job );
+  return matches;
+}
@@ -0,0 +1,364 @@
+
+//    --------------------------------------------------------------------
+//
+//    This file is part of Luna.
+//
+//    LUNA is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    Luna is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with Luna. If not, see <http://www.gnu.org/licenses/>.
+//
+//    Please see LICENSE.txt for more details.
+//
+//    --------------------------------------------------------------------
+
+
+
+#include "pdc.h"
+
+#include "helper/logger.h"
+
+#include <cstdio>
+#include <cstring>
+
+#ifndef WINDOWS
+#include <sys/mman.h>
+#endif
+
+extern logger_t logger;
+
+//
+// Binary TS-LIB / PD-LIB format (all numbers in native byte order)
+//
+//   char     magic[8]       "LUNAPDC1"
+//   int32    type           0 TS-LIB, 1 PD-LIB
+//   int32    nrows
+//   int32    nstrings
+//   int32    (unused)
+//   int64    nvalues
+//   int64    string_offsets[ nstrings + 1 ]   (into the blob)
+//   char     blob[]         padded to a multiple of 8 bytes
+//   row_t    rows[ nrows ]  (pdc_lib_row_t)
+//   float    values[ nvalues ]
+//
+// i.e. all arrays are 8-byte aligned, and can be used in place from a
+// memory-mapped file.  PD-LIB values are counts (as in the text format)
+// to be divided by 'sum'; as floats, these are exact only up to 2^24;
+// TS-LIB values are the time-series.  Files are validated on opening
+// (sizes, string offsets and every row's indices and value range)
+//
+
+static const char pdc_lib_magic[8] = { 'L','U','N','A','P','D','C','1' };
+
+
+pdc_lib_writer_t::pdc_lib_writer_t( const std::string & filename , const bool pd )
+  : filename(filename) , pd(pd) 
+{
+}
+
+
+int pdc_lib_writer_t::str( const std::string & s )
+{
+  std::map<std::string,int>::const_iterator ii = dict.find( s );
+  if ( ii != dict.end() ) return ii->second;
+  const int k = strings.size();
+  dict[ s ] = k;
+  strings.push_back( s );
+  return k;
+}
+
+
+void pdc_lib_writer_t::add( const std::string & ts_id , 
+			    const std::string & indiv_id , 
+			    const std::string & ch_id , 
+			    const std::string & cat_id , 
+			    const std::string & aux , 
+			    int sr , int m , int t , int sum , 
+			    const std::vector<double> & x )
+{
+  pdc_lib_row_t r;
+  r.ts_id = str( ts_id );
+  r.indiv_id = str( indiv_id );
+  r.ch_id = str( ch_id );
+  r.cat_id = str( cat_id );
+  r.aux = str( aux );
+  r.sr = sr;
+  r.m = m;
+  r.t = t;
+  r.sum = sum;
+  r.n = x.size();
+  r.offset = values.size();
+  rows.push_back( r );
+  for (int i=0;i<x.size();i++) values.push_back( x[i] );
+}
+
+
+bool pdc_lib_writer_t::close()
+{
+  
+  FILE * file = fopen( filename.c_str() , "wb" );
+  if ( file == NULL ) return false;
+
+  const int32_t hdr[4] = { pd ? 1 : 0 , (int32_t)rows.size() , (int32_t)strings.size() , 0 };
+  const int64_t nvalues = values.size();
+  
+  std::vector<int64_t> offsets( strings.size() + 1 , 0 );
+  for (int k=0;k<strings.size();k++)
+    offsets[k+1] = offsets[k] + strings[k].size();
+  
+  fwrite( pdc_lib_magic , 1 , sizeof(pdc_lib_magic) , file );
+  fwrite( hdr , sizeof(int32_t) , 4 , file );
+  fwrite( &nvalues , sizeof(int64_t) , 1 , file );
+  fwrite( &(offsets[0]) , sizeof(int64_t) , offsets.size() , file );
+
+  for (int k=0;k<strings.size();k++)
+    fwrite( strings[k].data() , 1 , strings[k].size() , file );
+
+  const char pad[8] = { 0,0,0,0,0,0,0,0 };
+  fwrite( pad , 1 , ( 8 - offsets.back() % 8 ) % 8 , file );
+  
+  if ( rows.size() ) 
+    fwrite( &(rows[0]) , sizeof(pdc_lib_row_t) , rows.size() , file );
+
+  if ( values.size() ) 
+    fwrite( &(values[0]) , sizeof(float) , values.size() , file );
+  
+  bool okay = ! ferror( file );
+  
+  fclose( file );
+
+  return okay;
+}
+
+
+bool pdc_lib_reader_t::is_binary( const std::string & filename )
+{
+  FILE * file = fopen( filename.c_str() , "rb" );
+  if ( file == NULL ) return false;
+  char magic[8];
+  bool okay = fread( magic , 1 , 8 , file ) == 8 && memcmp( magic , pdc_lib_magic , 8 ) == 0 ;
+  fclose( file );
+  return okay;
+}
+
+
+pdc_lib_reader_t::pdc_lib_reader_t( const std::string & filename )
+  : data(NULL) , size(0) , mapped(false)
+{
+
+  FILE * file = fopen( filename.c_str() , "rb" );
+
+  if ( file == NULL ) Helper::halt( "could not open " + filename );
+
+  fseek( file , 0 , SEEK_END );
+  size = ftell( file );
+  fseek( file , 0 , SEEK_SET );
+  
+#ifndef WINDOWS
+  void * p = mmap( NULL , size , PROT_READ , MAP_SHARED , fileno( file ) , 0 );
+  if ( p != MAP_FAILED ) 
+    {
+      data = (char*)p;
+      mapped = true;
+    }
+#endif
+
+  if ( ! mapped ) 
+    {
+      data = new char[ size ];
+      if ( fread( data , 1 , size , file ) != size ) 
+	Helper::halt( "problem reading " + filename );
+    }
+
+  fclose( file );
+
+  //
+  // header
+  //
+
+  const int64_t hdr_size = sizeof(pdc_lib_magic) + 4 * sizeof(int32_t) + sizeof(int64_t);
+
+  if ( size < hdr_size || memcmp( data , pdc_lib_magic , 8 ) != 0 ) 
+    Helper::halt( filename + " is not a binary TS-LIB/PD-LIB" );
+  
+  const int32_t * hdr = (const int32_t*)( data + 8 );
+  pd = hdr[0] == 1;
+  nrows = hdr[1];
+  const int nstrings = hdr[2];
+  const int64_t nvalues = *(const int64_t*)( data + 24 );
+
+  const std::string corrupt = "corrupt binary TS-LIB/PD-LIB " + filename;
+  
+  if ( nrows < 0 || nstrings < 0 || nvalues < 0 || hdr_size + ( nstrings + 1 ) * (int64_t)sizeof(int64_t) > size ) 
+    Helper::halt( corrupt );
+
+  string_offsets = (const int64_t*)( data + hdr_size );
+
+  // string offsets must start at 0, not decrease, and lie within the
+  // file (so the blob size is also checked before it is used below)
+  
+  const int64_t blob_start = hdr_size + ( nstrings + 1 ) * (int64_t)sizeof(int64_t);
+  
+  if ( string_offsets[0] != 0 ) 
+    Helper::halt( corrupt );
+  
+  for (int k=0;k<nstrings;k++)
+    if ( string_offsets[k+1] < string_offsets[k] || string_offsets[k+1] > size - blob_start ) 
+      Helper::halt( corrupt );
+  
+  blob = data + blob_start;
+  
+  const int64_t blob_size = string_offsets[ nstrings ];
+  const int64_t rows_start = blob_start + blob_size + ( 8 - blob_size % 8 ) % 8;
+
+  // sizes of the remaining sections, in 64-bit arithmetic, before any 
+  // pointers are formed
+  
+  if ( rows_start + (int64_t)nrows * (int64_t)sizeof(pdc_lib_row_t) + nvalues * (int64_t)sizeof(float) != size ) 
+    Helper::halt( corrupt );
+
+  rows = (const pdc_lib_row_t*)( data + rows_start );
+  vals = (const float*)( rows + nrows );
+
+  //
+  // check every row: dictionary indices, and values within the file
+  //
+
+  for (int i=0;i<nrows;i++)
+    {
+      const pdc_lib_row_t & r = rows[i];
+      
+      if ( r.ts_id < 0 || r.ts_id >= nstrings 
+	   || r.indiv_id < 0 || r.indiv_id >= nstrings 
+	   || r.ch_id < 0 || r.ch_id >= nstrings 
+	   || r.cat_id < 0 || r.cat_id >= nstrings 
+	   || r.aux < 0 || r.aux >= nstrings ) 
+	Helper::halt( corrupt + ", bad dictionary index in row " + Helper::int2str( i+1 ) );
+
+      if ( r.n < 0 || r.offset < 0 || r.offset > nvalues - r.n ) 
+	Helper::halt( corrupt + ", bad values in row " + Helper::int2str( i+1 ) );
+    }
+  
+}
+
+
+pdc_lib_reader_t::~pdc_lib_reader_t()
+{
+#ifndef WINDOWS
+  if ( mapped ) 
+    {
+      munmap( data , size );
+      return;
+    }
+#endif
+  delete [] data;
+}
+
+
+//
+// Read a binary TS-LIB or PD-LIB: as read_tslib() and read_pdlib(),
+// consecutive rows with the same ts-id make one observation
+//
+
+void pdc_t::read_binary_lib( const std::string & filename , const bool pd , const std::set<std::string> * incl_chs )
+{
+
+  pdc_lib_reader_t lib( filename );
+
+  if ( lib.pd != pd ) 
+    Helper::halt( filename + " is a binary " + ( lib.pd ? "PD-LIB" : "TS-LIB" ) + ", not a " + ( pd ? "PD-LIB" : "TS-LIB" ) );
+
+  logger << " reading binary " << ( pd ? "pd-lib " : "ts-lib " ) << filename << "\n";
+  
+  std::map<std::string,int> label_count;
+  
+  // dictionary index -> channel slot (-1 if not a channel, or excluded)
+  std::map<int,int> chslot;
+  
+  pdc_obs_t ob(q);
+  
+  int previous_ts_id = -1;
+
+  int cnt = 0;
+
+  for (int i=0;i<lib.nrows;i++)
+    {
+      
+      const pdc_lib_row_t & r = lib.row(i);
+      
+      std::map<int,int>::const_iterator cc = chslot.find( r.ch_id );
+      if ( cc == chslot.end() ) 
+	{
+	  const std::string ch_id = lib.str( r.ch_id );
+	  const bool incl = incl_chs == NULL || incl_chs->find( ch_id ) != incl_chs->end();
+	  cc = chslot.insert( std::make_pair( r.ch_id , incl ? channel( ch_id ) : -2 ) ).first;
+	}
+      
+      // are we including this channel? 
+      if ( cc->second == -2 ) continue;
+      
+      ++cnt;
+
+      // a new observation? save the old one
+      if ( r.ts_id != previous_ts_id )
+	{
+	  if ( previous_ts_id != -1 ) 
+	    {
+	      label_count[ ob.label ]++;
+	      add( ob );
+	    }
+	  
+	  ob.init(q);
+	  ob.id = lib.str( r.ts_id );
+	  ob.label = lib.str( r.cat_id );
+	  previous_ts_id = r.ts_id;
+	}
+
+      const int c = cc->second;
+      
+      if ( c < 0 ) continue;
+
+      const float * x = lib.values( r );
+      
+      ob.ch[c] = true;
+      
+      if ( pd ) 
+	{
+	  const int nm = num_pd( r.m );
+	  if ( nm == -1 || nm != r.n ) Helper::halt( "internal problem in pdc" );
+	  
+	  // counts, so normalize by sum upon reading
+	  std::vector<double> & p = ob.pd[c];
+	  p.resize( nm );
+	  for (int j=0;j<nm;j++) 
+	    p[j] = x[j] / (double)r.sum;
+	}
+      else
+	ob.ts[c].assign( x , x + r.n );
+    }
+  
+  if ( previous_ts_id != -1 ) 
+    {
+      label_count[ ob.label ]++;
+      add( ob );
+    }
+
+  logger << " scanned " << cnt << ( pd ? " lines" : " segments" ) << " and read " << obs.size() << " observations\n";
+  std::map<std::string,int>::const_iterator ii = label_count.begin();
+  while ( ii != label_count.end() ) 
+    {
+      logger << "  " << ii->first << "\t" << ii->second << "\n";
+      ++ii;
+    }
+  
+  channel_check();
+  
+}
@@ -120,6 +120,10 @@ void pdc_t::simple_sleep_scorer( edf_t & edf , param_t & param )
       
       if ( obs.size() == 0 ) 
 	Helper::halt( "no valid PDLIB specified" );
+
+      // index for nearest-neighbour matching (kept next to the PD-LIB)
+      if ( param.has( "index" ) ? Helper::yesno( param.value( "index" ) ) : true )
+	index( pdlib + ".idx" );
     }
   
 
@@ -445,16 +449,23 @@ void pdc_t::simple_sleep_scorer( edf_t & edf , param_t & param )
   //
   
   std::vector<std::string> stages;
+
+  // all matches, in parallel: each epoch has three 10-second intervals
+  std::vector<const pdc_obs_t*> all_targets;
+  for (int e=0; e<targets.size(); e++)
+    for (int j=0; j<3; j++)
+      all_targets.push_back( &targets[e][j] );
+
+  std::vector<std::set<pd_dist_t> > all_matches = match( all_targets , nmatch );
   
   for (int e=0; e<targets.size(); e++)
     {
 
       writer.epoch( edf.timeline.display_epoch( e ) );
 
-      // each epoch has three 10-second intervals
-      std::set<pd_dist_t> matches1 = match( targets[e][0] , nmatch );
-      std::set<pd_dist_t> matches2 = match( targets[e][1] , nmatch );
-      std::set<pd_dist_t> matches3 = match( targets[e][2] , nmatch );
+      const std::set<pd_dist_t> & matches1 = all_matches[ 3 * e ];
+      const std::set<pd_dist_t> & matches2 = all_matches[ 3 * e + 1 ];
+      const std::set<pd_dist_t> & matches3 = all_matches[ 3 * e + 2 ];
       
       std::string match1, match2, match3;
       double conf1, conf2, conf3;
@@ -596,34 +607,6 @@ void pdc_t::write_xml( const std::string & filename , const std::vector<std::str
 }
 
 
-std::set<pd_dist_t> pdc_t::match( const pdc_obs_t & target , const int nbest )
-{
-
-  const int N = obs.size();
-  
-  std::set<pd_dist_t> dist, final;
-  
-  for (int i = 0 ; i < N ; i++ ) 
-    {
-      //      std::cout << "MM " << distance( target , obs[i] ) << " for " << i << " " << obs[i].label << "\n";
-      dist.insert( pd_dist_t( distance( target , obs[i] ) , i ) );
-    }
-
-  
-  int cnt = 0 ; 
-  std::set<pd_dist_t>::const_iterator ii = dist.begin();
-  while ( ii != dist.end() )
-    {
-      //std::cout << "FF " << cnt+1 << " " << ii->ix << " " << obs[ ii->ix ].label << " " << ii->d << "\n";
-      final.insert( *ii );
-      ++cnt;
-      if ( cnt == nbest ) break;
-      ++ii;
-    }
-  
-  return final;
-}
-
 std::map<std::string,double> pdc_t::summarize( const std::set<pd_dist_t> & matches , std::string * cat , double * conf )
 {
 
@@ -27,6 +27,7 @@
 #include "annot/annot.h"
 #include "helper/helper.h"
 #include "helper/logger.h"
+#include "helper/threads.h"
 #include "db/db.h"
 #include "fftw/fftwrap.h"
 #include "dsp/mse.h"
@@ -36,6 +37,43 @@
 extern writer_t writer;
 extern logger_t logger;
 
+//
+// PSD, per signal
+//
+
+struct psd_job_t : public parallel_job_t 
+{
+
+  psd_job_t( edf_t & edf , const signal_list_t & signals , const std::vector<int> & epoch_list , 
+	     const std::vector<double> & Fs , const std::vector<frequency_band_t> & bands )
+  : edf(edf) , signals(signals) , epoch_list(epoch_list) , Fs(Fs) , bands(bands) { } 
+  
+  edf_t & edf;
+  const signal_list_t & signals;
+  const std::vector<int> & epoch_list;
+  const std::vector<double> & Fs;
+  const std::vector<frequency_band_t> & bands;
+  
+  bool show_spectrum;
+  bool dB;
+  bool mean_centre_epoch;
+  double bin_width;
+  bool show_epoch;
+  bool calc_dynamics;
+  bool show_epoch_spectrum;
+  double max_power;
+  bool calc_mse;
+  double fft_segment_size;
+  double fft_segment_overlap;
+  bool average_adj;
+  window_function_t window_function;
+  bool epoch_level_output;
+  
+  void run( const int s );
+
+};
+
+
 annot_t * spectral_power( edf_t & edf , 
 			  const std::string & signal_label , 
 			  param_t & param )
@@ -166,399 +204,461 @@ annot_t * spectral_power( edf_t & edf ,
   
   
   //
-  // Get each signal
+  // List of (unmasked) epochs
   //
   
-  for (int s = 0 ; s < ns; s++ )
+  std::vector<int> epoch_list;
+  
+  while ( 1 ) 
     {
-      
+      int epoch = edf.timeline.next_epoch();
+      if ( epoch == -1 ) break;
+      epoch_list.push_back( epoch );
+    }
 
-      //
-      // only consider data tracks
-      //
-      
-      if ( edf.header.is_annotation_channel( signals(s) ) ) 
-	continue;
-      
 
-      //
-      // Stratify output by channel
-      //
-      
-      writer.level( signals.label(s) , globals::signal_strat );
-      
-      
-      //
-      // get high, low and total power.
-      //
-      
-      int total_epochs = 0;  
-      
-      // store frequencies from epoch-level analysis
-      std::vector<double> freqs;
+  //
+  // Get each signal (in parallel, if threads > 1)
+  //
 
-      std::vector<double> epochs;
+  psd_job_t job( edf , signals , epoch_list , Fs , bands );
+
+  job.show_spectrum = show_spectrum;
+  job.dB = dB;
+  job.mean_centre_epoch = mean_centre_epoch;
+  job.bin_width = bin_width;
+  job.show_epoch = show_epoch;
+  job.calc_dynamics = calc_dynamics;
+  job.show_epoch_spectrum = show_epoch_spectrum;
+  job.max_power = max_power;
+  job.calc_mse = calc_mse;
+  job.fft_segment_size = fft_segment_size;
+  job.fft_segment_overlap = fft_segment_overlap;
+  job.average_adj = average_adj;
+  job.window_function = window_function;
+  job.epoch_level_output = epoch_level_output;
+  
+  Helper::parallel_for( ns , job );
 
-      // band and F results
-      std::map<frequency_band_t,std::vector<double> > track_band;
-      std::map<int,std::vector<double> > track_freq;
+  writer.unlevel( globals::signal_strat );	   
       
+  
+  // ignore return annot_t * 
+  return NULL;
 
+}
 
-      
-      //
-      // Set first epoch
-      //
-      
-      edf.timeline.first_epoch();
 
 
-      //
-      // for each each epoch 
-      //
-      
-      while ( 1 ) 
-	{
-	  
-	  int epoch = edf.timeline.next_epoch();      
-	  
-	  if ( epoch == -1 ) break;
-	  
+void psd_job_t::run( const int s )
+{
 
-	  ++total_epochs;
+  
 
-	  
-	  interval_t interval = edf.timeline.epoch( epoch );
-	  
-	  // stratify output by epoch?
-	  if ( epoch_level_output )
-	    writer.epoch( edf.timeline.display_epoch( epoch ) );
-	  	  
-	   //
-	   // Get data
-	   //
-
-	   slice_t slice( edf , signals(s) , interval );
-	   
-	   std::vector<double> * d = slice.nonconst_pdata();
+  //
+  // only consider data tracks
+  //
+  
+  if ( edf.header.is_annotation_channel( signals(s) ) ) 
+    return;
+  
 
-	   //
-	   // mean centre epoch?
-	   //
+  //
+  // Stratify output by channel
+  //
+  
+  writer.level( signals.label(s) , globals::signal_strat );
+  
+  
+  //
+  // get high, low and total power.
+  //
+  
+  int total_epochs = 0;  
+  
+  // store frequencies from epoch-level analysis
+  std::vector<double> freqs;
 
-	   if ( mean_centre_epoch ) 
-	     MiscMath::centre( d );
-	   
-	   //
-	   // pwelch() to obtain full PSD
-	   //
-	   
-	   const double overlap_sec = fft_segment_overlap;
-	   const double segment_sec  = fft_segment_size;
-	   
-	   const int total_points = d->size();
-	   const int segment_points = segment_sec * Fs[s];
-	   const int noverlap_points  = overlap_sec * Fs[s];
-	   
-	   // implied number of segments
-	   int noverlap_segments = floor( ( total_points - noverlap_points) 
-					  / (double)( segment_points - noverlap_points ) );
-	   
-	   
-// 	   logger << "total_points = " << total_points << "\n";
-// 	   logger << "nooverlap_segments = " << noverlap_segments << "\n";
-// 	   logger << "noverlap_points = " << noverlap_points << "\n";
-// 	   logger << "segment_points = " << segment_points << "\n";
-	   
-// 	   std::cout << "about to fly...\n";
-// 	   std::cout << "Fs = " << Fs[s] << "\n";
-
-	   PWELCH pwelch( *d , 
-			  Fs[s] , 
-			  segment_sec , 
-			  noverlap_segments , 
-			  window_function , 
-			  average_adj );
-	   
-	   //	   std::cout << "done\n";
-
-
-	   double this_slowwave   = pwelch.psdsum( SLOW )  ;      /// globals::band_width( SLOW );
-	   double this_delta      = pwelch.psdsum( DELTA ) ;      /// globals::band_width( DELTA );
-	   double this_theta      = pwelch.psdsum( THETA ) ;      /// globals::band_width( THETA );
-	   double this_alpha      = pwelch.psdsum( ALPHA ) ;      /// globals::band_width( ALPHA );
-	   double this_sigma      = pwelch.psdsum( SIGMA ) ;      /// globals::band_width( SIGMA );
-	   double this_low_sigma  = pwelch.psdsum( LOW_SIGMA ) ;  /// globals::band_width( LOW_SIGMA );
-	   double this_high_sigma = pwelch.psdsum( HIGH_SIGMA ) ; /// globals::band_width( HIGH_SIGMA );
-	   double this_beta       = pwelch.psdsum( BETA )  ;      /// globals::band_width( BETA );
-	   double this_gamma      = pwelch.psdsum( GAMMA ) ;      /// globals::band_width( GAMMA );]
-	   double this_total      = pwelch.psdsum( TOTAL ) ;      /// globals::band_width( TOTAL );
-	   
-	   //
-	   // track epoch-level band-power statistics
-	   //
-	   
-	   track_band[ SLOW  ].push_back( this_slowwave );
-	   track_band[ DELTA ].push_back( this_delta );
-	   track_band[ THETA ].push_back( this_theta );
-	   track_band[ ALPHA ].push_back( this_alpha );
-	   track_band[ SIGMA ].push_back( this_sigma );
-	   track_band[ BETA  ].push_back( this_beta );
-	   track_band[ GAMMA ].push_back( this_gamma );
-	   track_band[ LOW_SIGMA ].push_back( this_low_sigma );
-	   track_band[ HIGH_SIGMA ].push_back( this_high_sigma );
-	   track_band[ TOTAL ].push_back( this_total );
+  std::vector<double> epochs;
+
+  // band and F results
+  std::map<frequency_band_t,std::vector<double> > track_band;
+  std::map<int,std::vector<double> > track_freq;
+  
+  // writer handles for epoch-level output
+  const var_handle_t psd_h = writer.var_handle( "PSD" );
+  const var_handle_t relpsd_h = writer.var_handle( "RELPSD" );
+
+  std::map<frequency_band_t,level_handle_t> band_h;
+  if ( show_epoch ) 
+    {
+      const frequency_band_t b[] = { SLOW, DELTA, THETA, ALPHA, SIGMA, LOW_SIGMA, HIGH_SIGMA, BETA, GAMMA, TOTAL };
+      for (int i=0; i<10; i++) band_h[ b[i] ] = writer.level_handle( globals::band( b[i] ) , globals::band_strat );
+    }
+
+  // bin mid-points, and their handles, for the epoch-level spectrum
+  std::vector<double> freq_mid;
+  std::vector<level_handle_t> freq_h;
+  
+
+
+  
+  //
+  // for each each epoch 
+  //
+  
+  for (int ei=0; ei<epoch_list.size(); ei++)
+    {
+      
+      const int epoch = epoch_list[ei];
+      
+
+      ++total_epochs;
+
+      
+      interval_t interval = edf.timeline.epoch( epoch );
+      
+      // stratify output by epoch?
+      if ( epoch_level_output )
+	writer.epoch( edf.timeline.display_epoch( epoch ) );
+	      
+       //
+       // pwelch() to obtain full PSD, on the (optionally mean-centred)
+       // epoch; this reuses any spectrum already computed (e.g. by a
+       // prior PSD) for this signal, epoch and parameters
+       //
+       
+       PWELCH pwelch = slice_pwelch( edf , 
+				     signals(s) , 
+				     interval , 
+				     Fs[s] , 
+				     fft_segment_size , 
+				     fft_segment_overlap , 
+				     0 , 
+				     window_function , 
+				     average_adj , 
+				     mean_centre_epoch );
+       
+       //	   std::cout << "done\n";
+
+
+       double this_slowwave   = pwelch.psdsum( SLOW )  ;      /// globals::band_width( SLOW );
+       double this_delta      = pwelch.psdsum( DELTA ) ;      /// globals::band_width( DELTA );
+       double this_theta      = pwelch.psdsum( THETA ) ;      /// globals::band_width( THETA );
+       double this_alpha      = pwelch.psdsum( ALPHA ) ;      /// globals::band_width( ALPHA );
+       double this_sigma      = pwelch.psdsum( SIGMA ) ;      /// globals::band_width( SIGMA );
+       double this_low_sigma  = pwelch.psdsum( LOW_SIGMA ) ;  /// globals::band_width( LOW_SIGMA );
+       double this_high_sigma = pwelch.psdsum( HIGH_SIGMA ) ; /// globals::band_width( HIGH_SIGMA );
+       double this_beta       = pwelch.psdsum( BETA )  ;      /// globals::band_width( BETA );
+       double this_gamma      = pwelch.psdsum( GAMMA ) ;      /// globals::band_width( GAMMA );]
+       double this_total      = pwelch.psdsum( TOTAL ) ;      /// globals::band_width( TOTAL );
+       
+       //
+       // track epoch-level band-power statistics
+       //
+       
+       track_band[ SLOW  ].push_back( this_slowwave );
+       track_band[ DELTA ].push_back( this_delta );
+       track_band[ THETA ].push_back( this_theta );
+       track_band[ ALPHA ].push_back( this_alpha );
+       track_band[ SIGMA ].push_back( this_sigma );
+       track_band[ BETA  ].push_back( this_beta );
+       track_band[ GAMMA ].push_back( this_gamma );
+       track_band[ LOW_SIGMA ].push_back( this_low_sigma );
+       track_band[ HIGH_SIGMA ].push_back( this_high_sigma );
+       track_band[ TOTAL ].push_back( this_total );
+       
+       //
+       // track epoch numbers (for dynam_t)
+       //
+       
+       epochs.push_back( epoch );
+
+       //
+       // Epoch-level output
+       //
+
+       if ( show_epoch )
+	 {
 	   
-	   //
-	   // track epoch numbers (for dynam_t)
-	   //
+	   double this_total =  this_slowwave
+	     + this_delta
+	     + this_theta
+	     + this_alpha
+	     + this_sigma  
+	     + this_beta
+	     + this_gamma;
+
+	   writer.level( band_h[ SLOW ] );
+	   writer.value( psd_h , dB ? 10*log10( this_slowwave ) : this_slowwave  );
+	   writer.value( relpsd_h , this_slowwave / this_total );
 	   
-	   epochs.push_back( epoch );
+	   writer.level( band_h[ DELTA ] );
+	   writer.value( psd_h , dB ? 10*log10( this_delta ) : this_delta );
+	   writer.value( relpsd_h , this_delta / this_total );
 
-	   //
-	   // Epoch-level output
-	   //
+	   writer.level( band_h[ THETA ] );
+	   writer.value( psd_h , dB ? 10*log10( this_theta ) : this_theta  );
+	   writer.value( relpsd_h , this_theta / this_total );
 
-	   if ( show_epoch )
-	     {
-	       
-	       double this_total =  this_slowwave
-		 + this_delta
-		 + this_theta
-		 + this_alpha
-		 + this_sigma  
-		 + this_beta
-		 + this_gamma;
-
-	       writer.level( globals::band( SLOW ) , globals::band_strat );
-	       writer.value( "PSD" , dB ? 10*log10( this_slowwave ) : this_slowwave  );
-	       writer.value( "RELPSD" , this_slowwave / this_total );
-	       
-	       writer.level( globals::band( DELTA ) , globals::band_strat );
-	       writer.value( "PSD" , dB ? 10*log10( this_delta ) : this_delta );
-	       writer.value( "RELPSD" , this_delta / this_total );
+	   writer.level( band_h[ ALPHA ] );
+	   writer.value( psd_h , dB ? 10*log10( this_alpha ) : this_alpha );
+	   writer.value( relpsd_h , this_alpha / this_total );
 
-	       writer.level( globals::band( THETA ) , globals::band_strat );
-	       writer.value( "PSD" , dB ? 10*log10( this_theta ) : this_theta  );
-	       writer.value( "RELPSD" , this_theta / this_total );
+	   writer.level( band_h[ SIGMA ] );
+	   writer.value( psd_h , dB ? 10*log10( this_sigma ) : this_sigma );
+	   writer.value( relpsd_h , this_sigma / this_total );
 
-	       writer.level( globals::band( ALPHA ) , globals::band_strat );
-	       writer.value( "PSD" , dB ? 10*log10( this_alpha ) : this_alpha );
-	       writer.value( "RELPSD" , this_alpha / this_total );
+	   writer.level( band_h[ LOW_SIGMA ] );
+	   writer.value( psd_h , dB ? 10*log10( this_low_sigma ) : this_low_sigma  );
+	   writer.value( relpsd_h , this_low_sigma / this_total );
 
-	       writer.level( globals::band( SIGMA ) , globals::band_strat );
-	       writer.value( "PSD" , dB ? 10*log10( this_sigma ) : this_sigma );
-	       writer.value( "RELPSD" , this_sigma / this_total );
+	   writer.level( band_h[ HIGH_SIGMA ] );
+	   writer.value( psd_h , dB ? 10*log10( this_high_sigma ) : this_high_sigma );
+	   writer.value( relpsd_h , this_high_sigma / this_total );
 
-	       writer.level( globals::band( LOW_SIGMA ) , globals::band_strat );
-	       writer.value( "PSD" , dB ? 10*log10( this_low_sigma ) : this_low_sigma  );
-	       writer.value( "RELPSD" , this_low_sigma / this_total );
+	   writer.level( band_h[ BETA ] );
+	   writer.value( psd_h , dB ? 10*log10( this_beta ) : this_beta  );
+	   writer.value( relpsd_h , this_beta / this_total );
 
-	       writer.level( globals::band( HIGH_SIGMA ) , globals::band_strat );
-	       writer.value( "PSD" , dB ? 10*log10( this_high_sigma ) : this_high_sigma );
-	       writer.value( "RELPSD" , this_high_sigma / this_total );
+	   writer.level( band_h[ GAMMA ] );
+	   writer.value( psd_h , dB ? 10*log10( this_gamma ) : this_gamma );
+	   writer.value( relpsd_h , this_gamma / this_total );
 
-	       writer.level( globals::band( BETA ) , globals::band_strat );
-	       writer.value( "PSD" , dB ? 10*log10( this_beta ) : this_beta  );
-	       writer.value( "RELPSD" , this_beta / this_total );
-
-	       writer.level( globals::band( GAMMA ) , globals::band_strat );
-	       writer.value( "PSD" , dB ? 10*log10( this_gamma ) : this_gamma );
-	       writer.value( "RELPSD" , this_gamma / this_total );
+	   writer.level( band_h[ TOTAL ] );
+	   writer.value( psd_h , dB ? 10*log10( this_total ) : this_total );
+	   
+	   writer.unlevel( globals::band_strat );
+	   
+	 }
+       
+       
+       //
+       // track over entire spectrum (track on first encounter)
+       //
+       
+       if( freqs.size() == 0 ) 
+	 {
+	   freqs = pwelch.freq;
+	 }
+	 
 
-	       writer.level( globals::band( TOTAL ) , globals::band_strat );
-	       writer.value( "PSD" , dB ? 10*log10( this_total ) : this_total );
-	       
-	       writer.unlevel( globals::band_strat );
-	       
-	     }
 	   
+       // std::cout << "freqs.size() = " << freqs[s].size() << "\n";
+       // std::cout << "pwelch.size() = " << pwelch.psd.size() << "\n";
+       
+       if ( freqs.size() == pwelch.psd.size() )
+	 {
 	   
-	   //
-	   // track over entire spectrum (track on first encounter)
-	   //
+	   // accumulate for entire night means
+	   if ( show_spectrum )
+	     for (int f=0;f<pwelch.psd.size();f++)
+	       track_freq[ f ].push_back( pwelch.psd[f] );
 	   
-	   if( freqs.size() == 0 ) 
-	     {
-	       freqs = pwelch.freq;
-	     }
-	     
-
-	       
-	   // std::cout << "freqs.size() = " << freqs[s].size() << "\n";
-	   // std::cout << "pwelch.size() = " << pwelch.psd.size() << "\n";
+	   // epoch-level output?
 	   
-	   if ( freqs.size() == pwelch.psd.size() )
-	     {
+	   if ( show_epoch_spectrum )
+	     {		 
 	       
-	       // accumulate for entire night means
-	       if ( show_spectrum )
-		 for (int f=0;f<pwelch.psd.size();f++)
-		   track_freq[ f ].push_back( pwelch.psd[f] );
+	       // using bin_t 	      
+	       bin_t bin( bin_width , max_power , Fs[s] );
 	       
-	       // epoch-level output?
+	       bin.bin( freqs , pwelch.psd );
 	       
-	       if ( show_epoch_spectrum )
-		 {		 
-		   
-		   // using bin_t 	      
-		   bin_t bin( bin_width , max_power , Fs[s] );
-		   
-		   bin.bin( freqs , pwelch.psd );
-		   
-		   for ( int i = 0 ; i < bin.bfa.size() ; i++ ) 		{
-		     
-		     //writer.level( Helper::dbl2str( bin.bfa[i] ) + "-" + Helper::dbl2str( bin.bfb[i] ) ,  globals::freq_strat  );
-		     writer.level( ( bin.bfa[i] + bin.bfb[i] ) / 2.0 , globals::freq_strat );
-		     writer.value( "PSD" , dB? 10*log10( bin.bspec[i] ) : bin.bspec[i] );
-		   }
-		   writer.unlevel( globals::freq_strat );
-		 }
+	       // (re)make handles for these bins, typically on the first epoch only
+	       std::vector<double> mid( bin.bfa.size() );
+	       for ( int i = 0 ; i < bin.bfa.size() ; i++ ) 
+		 mid[i] = ( bin.bfa[i] + bin.bfb[i] ) / 2.0 ;
 	       
+	       if ( mid != freq_mid ) 
+		 {
+		   freq_mid = mid;
+		   freq_h.resize( mid.size() );
+		   for ( int i = 0 ; i < mid.size() ; i++ ) 
+		     freq_h[i] = writer.level_handle( mid[i] , globals::freq_strat );
+		 }
+
+	       for ( int i = 0 ; i < bin.bfa.size() ; i++ ) 		{
+		 
+		 //writer.level( Helper::dbl2str( bin.bfa[i] ) + "-" + Helper::dbl2str( bin.bfb[i] ) ,  globals::freq_strat  );
+		 writer.level( freq_h[i] );
+		 writer.value( psd_h , dB? 10*log10( bin.bspec[i] ) : bin.bspec[i] );
+	       }
+	       writer.unlevel( globals::freq_strat );
 	     }
-	   else
-	     logger << " *** warning:: skipped a segment: different NFFT/internal problem ... \n";
-	   
 	   
+	 }
+       else
+	 logger << " *** warning:: skipped a segment: different NFFT/internal problem ... \n";
+       
+       
+  
+       //
+       // end of epoch-level strata
+       //
+
+       if ( epoch_level_output )
+	 writer.unepoch();
+       
+       
+       //
+       // next epoch
+       //
+
+    } 
+  
+  
+  //
+  // Output
+  //
+  
+  const int n = freqs.size();      
+  
+  writer.var( "NE" , "Number of epochs" );
+  
+  writer.value( "NE" , total_epochs );
+  
+  if ( show_spectrum )
+    {
       
-	   //
-	   // end of epoch-level strata
-	   //
+      if ( total_epochs > 0 ) 
+	{	  
+	  
+	  // get mean power across epochs
+	  
+	  if ( track_freq.size() != freqs.size() ) 
+	    Helper::halt( "internal error psd_t" );
+	  
+	  std::vector<double> means;
+	  for (int f=0;f<n;f++) 
+	    means.push_back( MiscMath::mean( track_freq[f] ) );
+	  
+	  bin_t bin( bin_width , max_power , Fs[s] );
 
-	   if ( epoch_level_output )
-	     writer.unepoch();
-	   
-	   
-	   //
-	   // next epoch
-	   //
+	  bin.bin( freqs , means );
 
-	} 
+	  for ( int i = 0 ; i < bin.bfa.size() ; i++ ) 
+	    {
+	      writer.level( ( bin.bfa[i] + bin.bfb[i] ) / 2.0 , globals::freq_strat );
+	      writer.value( "PSD" , dB ? 10*log10( bin.bspec[i] ) : bin.bspec[i] );
+	    }
+	   writer.unlevel( globals::freq_strat );
+
+	}
       
+    }
+
+  
+  bool okay = total_epochs > 0 ;
+
+  //
+  // mean total power
+  //
+
+  double mean_total_power = MiscMath::mean( track_band[ TOTAL ] );
+
+  //
+  // by band 
+  //
+  
+  std::vector<frequency_band_t>::const_iterator bi = bands.begin();
+  while ( bi != bands.end() )
+    {	   
+
+      if ( okay ) 
+	{
+	  double p = MiscMath::mean( track_band[ *bi ] );
+
+	  writer.level( globals::band( *bi ) , globals::band_strat );
+	  writer.value( "PSD" , dB ? 10*log10(p) : p  );
+	  writer.value( "RELPSD" , p / mean_total_power );
+	}
       
-      //
-      // Output
-      //
+ 	  ++bi;
+    }
+  
+  writer.unlevel( globals::band_strat );
+
+
+  
+  //
+  // Dynamics?
+  //
+  
+
+  if ( calc_dynamics )
+    {
       
-      const int n = freqs.size();      
+      // do we have any _CYCLE epoch-annotations ?
       
-      writer.var( "NE" , "Number of epochs" );
+      bool has_cycles = edf.timeline.epoch_annotation( "_NREMC_1" );
       
-      writer.value( "NE" , total_epochs );
+      std::vector<std::string> cycle;
       
-      if ( show_spectrum )
+      if ( has_cycles )
 	{
 	  
-	  if ( total_epochs > 0 ) 
-	    {	  
+	  for (int e=0;e<epochs.size(); e++)
+	    {
 	      
-	      // get mean power across epochs
+	      std::string c = "."; // null
 	      
-	      if ( track_freq.size() != freqs.size() ) 
-		Helper::halt( "internal error psd_t" );
+	      // nb. uses current epoch encoding
+	      // take up to 10 cycles
+	      if      ( edf.timeline.epoch_annotation( "_NREMC_1" , epochs[e] ) ) c = "C1";
+	      else if ( edf.timeline.epoch_annotation( "_NREMC_2" , epochs[e] ) ) c = "C2";
+	      else if ( edf.timeline.epoch_annotation( "_NREMC_3" , epochs[e] ) ) c = "C3";
+	      else if ( edf.timeline.epoch_annotation( "_NREMC_4" , epochs[e] ) ) c = "C4";
+	      else if ( edf.timeline.epoch_annotation( "_NREMC_5" , epochs[e] ) ) c = "C5";
+	      else if ( edf.timeline.epoch_annotation( "_NREMC_6" , epochs[e] ) ) c = "C6";
+	      else if ( edf.timeline.epoch_annotation( "_NREMC_7" , epochs[e] ) ) c = "C7";
+	      else if ( edf.timeline.epoch_annotation( "_NREMC_8" , epochs[e] ) ) c = "C8";
+	      else if ( edf.timeline.epoch_annotation( "_NREMC_9" , epochs[e] ) ) c = "C9";
+	      else if ( edf.timeline.epoch_annotation( "_NREMC_10" , epochs[e] ) ) c = "C10";
 	      
-	      std::vector<double> means;
-	      for (int f=0;f<n;f++) 
-		means.push_back( MiscMath::mean( track_freq[f] ) );
+	      cycle.push_back( c );
 	      
-	      bin_t bin( bin_width , max_power , Fs[s] );
-
-	      bin.bin( freqs , means );
-
-	      for ( int i = 0 ; i < bin.bfa.size() ; i++ ) 
-		{
-		  writer.level( ( bin.bfa[i] + bin.bfb[i] ) / 2.0 , globals::freq_strat );
-		  writer.value( "PSD" , dB ? 10*log10( bin.bspec[i] ) : bin.bspec[i] );
-		}
-	       writer.unlevel( globals::freq_strat );
-
 	    }
-	  
 	}
-
       
-      bool okay = total_epochs > 0 ;
 
       //
-      // mean total power
+      // band power 
       //
 
-      double mean_total_power = MiscMath::mean( track_band[ TOTAL ] );
-
-      //
-      // by band 
-      //
+      std::map<frequency_band_t,std::vector<double> >::const_iterator ii = track_band.begin();
       
-      std::vector<frequency_band_t>::const_iterator bi = bands.begin();
-      while ( bi != bands.end() )
-	{	   
-
-	  if ( okay ) 
-	    {
-	      double p = MiscMath::mean( track_band[ *bi ] );
-
-	      writer.level( globals::band( *bi ) , globals::band_strat );
-	      writer.value( "PSD" , dB ? 10*log10(p) : p  );
-	      writer.value( "RELPSD" , p / mean_total_power );
-	    }
+      while ( ii != track_band.end() )
+	{	      
+	  writer.level( globals::band( ii->first ) , globals::band_strat );
 	  
- 	  ++bi;
+	  if ( has_cycles )
+	    dynam_report_with_log( ii->second , epochs , &cycle );
+	  else
+	    dynam_report_with_log( ii->second , epochs );
+	  
+	  ++ii;
 	}
       
-      writer.unlevel( globals::band_strat );
+      writer.unlevel( globals::band_strat ); 
 
 
-      
       //
-      // Dynamics?
+      // full spectra?
       //
       
-
-      if ( calc_dynamics )
+      if ( show_spectrum )
 	{
+
 	  
-	  // do we have any _CYCLE epoch-annotations ?
-	  
-	  bool has_cycles = edf.timeline.epoch_annotation( "_NREMC_1" );
-	  
-	  std::vector<std::string> cycle;
+	  std::map<int,std::vector<double> >::const_iterator ii = track_freq.begin();
 	  
-	  if ( has_cycles )
+	  while ( ii != track_freq.end() )
 	    {
 	      
-	      for (int e=0;e<epochs.size(); e++)
-		{
-		  
-		  std::string c = "."; // null
-		  
-		  // nb. uses current epoch encoding
-		  // take up to 10 cycles
-		  if      ( edf.timeline.epoch_annotation( "_NREMC_1" , epochs[e] ) ) c = "C1";
-		  else if ( edf.timeline.epoch_annotation( "_NREMC_2" , epochs[e] ) ) c = "C2";
-		  else if ( edf.timeline.epoch_annotation( "_NREMC_3" , epochs[e] ) ) c = "C3";
-		  else if ( edf.timeline.epoch_annotation( "_NREMC_4" , epochs[e] ) ) c = "C4";
-		  else if ( edf.timeline.epoch_annotation( "_NREMC_5" , epochs[e] ) ) c = "C5";
-		  else if ( edf.timeline.epoch_annotation( "_NREMC_6" , epochs[e] ) ) c = "C6";
-		  else if ( edf.timeline.epoch_annotation( "_NREMC_7" , epochs[e] ) ) c = "C7";
-		  else if ( edf.timeline.epoch_annotation( "_NREMC_8" , epochs[e] ) ) c = "C8";
-		  else if ( edf.timeline.epoch_annotation( "_NREMC_9" , epochs[e] ) ) c = "C9";
-		  else if ( edf.timeline.epoch_annotation( "_NREMC_10" , epochs[e] ) ) c = "C10";
-		  
-		  cycle.push_back( c );
-		  
-		}
-	    }
-	  
-
-	  //
-	  // band power 
-	  //
-
-	  std::map<frequency_band_t,std::vector<double> >::const_iterator ii = track_band.begin();
-	  
-	  while ( ii != track_band.end() )
-	    {	      
-	      writer.level( globals::band( ii->first ) , globals::band_strat );
+	      if ( freqs[ ii->first ] > max_power )  { ++ii; continue; } 
+	      
+	      writer.level( freqs[ ii->first ] , globals::freq_strat );
 	      
 	      if ( has_cycles )
 		dynam_report_with_log( ii->second , epochs , &cycle );
@@ -566,100 +666,53 @@ annot_t * spectral_power( edf_t & edf ,
 		dynam_report_with_log( ii->second , epochs );
 	      
 	      ++ii;
-	    }
-	  
-	  writer.unlevel( globals::band_strat ); 
-
-
-	  //
-	  // full spectra?
-	  //
-	  
-	  if ( show_spectrum )
-	    {
-
-	      
-	      std::map<int,std::vector<double> >::const_iterator ii = track_freq.begin();
-	      
-	      while ( ii != track_freq.end() )
-		{
-		  
-		  if ( freqs[ ii->first ] > max_power )  { ++ii; continue; } 
-		  
-		  writer.level( freqs[ ii->first ] , globals::freq_strat );
-		  
-		  if ( has_cycles )
-		    dynam_report_with_log( ii->second , epochs , &cycle );
-		  else
-		    dynam_report_with_log( ii->second , epochs );
-		  
-		  ++ii;
-		  
-		}
-	      
-	      writer.unlevel( globals::freq_strat );
 	      
 	    }
 	  
+	  writer.unlevel( globals::freq_strat );
+	  
 	}
       
+    }
+  
+  
+
+  if ( calc_mse )
+    {
       
+      int mse_lwr_scale = 1;
+      int mse_upr_scale = 10;
+      int mse_inc_scale = 2;
+      int mse_m = 2;
+      double mse_r = 0.15;
 
-      if ( calc_mse )
-	{
-	  
-	  int mse_lwr_scale = 1;
-	  int mse_upr_scale = 10;
-	  int mse_inc_scale = 2;
-	  int mse_m = 2;
-	  double mse_r = 0.15;
+      mse_t mse( mse_lwr_scale , mse_upr_scale , mse_inc_scale ,
+		 mse_m , mse_r );
 
-	  mse_t mse( mse_lwr_scale , mse_upr_scale , mse_inc_scale ,
-		     mse_m , mse_r );
+      
+      std::map<frequency_band_t,std::vector<double> >::const_iterator ii = track_band.begin();
 
+      while ( ii != track_band.end() )
+	{
 	  
-	  std::map<frequency_band_t,std::vector<double> >::const_iterator ii = track_band.begin();
-
-	  while ( ii != track_band.end() )
+	  writer.level( globals::band( ii->first ) , globals::band_strat );
+	  
+	  std::map<int,double> mses = mse.calc( ii->second );
+	  
+	  writer.var( "MSE" , "Multiscale entropy" );
+	  
+	  std::map<int,double>::const_iterator jj = mses.begin();
+	  while ( jj != mses.end() )
 	    {
-	      
-	      writer.level( globals::band( ii->first ) , globals::band_strat );
-	      
-	      std::map<int,double> mses = mse.calc( ii->second );
-	      
-	      writer.var( "MSE" , "Multiscale entropy" );
-	      
-	      std::map<int,double>::const_iterator jj = mses.begin();
-	      while ( jj != mses.end() )
-		{
-		  writer.level( jj->first , "SCALE" );
-		  writer.value( "MSE" , jj->second );
-		  ++jj;
-		}
-	      writer.unlevel( "SCALE" );
-	      ++ii;
+	      writer.level( jj->first , "SCALE" );
+	      writer.value( "MSE" , jj->second );
+	      ++jj;
 	    }
-	  writer.unlevel( globals::band_strat );
+	  writer.unlevel( "SCALE" );
+	  ++ii;
 	}
-     
-
-
-
-
-
-      
-      //
-      // next signal
-      //
-    } 
-
-
-  writer.unlevel( globals::signal_strat );	   
-      
-  
-  // ignore return annot_t * 
-  return NULL;
+      writer.unlevel( globals::band_strat );
+    }
 
 }
 
-
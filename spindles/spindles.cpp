@@ -44,12 +44,101 @@
 
 #include "helper/logger.h"
 #include "helper/helper.h"
+#include "helper/threads.h"
 
 // output
 extern writer_t writer;
 extern logger_t logger;
 
 
+//
+// SPINDLES: per-signal data, CWT and baseline spectrum
+//
+
+struct spindle_cwt_job_t : public parallel_job_t
+{
+  
+  spindle_cwt_job_t( edf_t & edf , const signal_list_t & signals , const interval_t & interval , 
+		     const std::vector<double> & Fs , const std::vector<double> & frq , const int num_cycles )
+  : edf(edf) , signals(signals) , interval(interval) , Fs(Fs) , frq(frq) , num_cycles(num_cycles) , s0(0) 
+  {
+    slices.resize( signals.size() , NULL );
+    cwts.resize( signals.size() , NULL );
+    baseline_fft.resize( signals.size() );
+  }
+
+  ~spindle_cwt_job_t() { clear(); } 
+
+  edf_t & edf;
+  const signal_list_t & signals;
+  const interval_t & interval;
+  const std::vector<double> & Fs;
+  const std::vector<double> & frq;
+  const int num_cycles;
+
+  // first signal of the current block
+  int s0;
+
+  // results, indexed by signal
+  std::vector<slice_t*> slices;
+  std::vector<CWT*> cwts;
+  std::vector<std::map<freq_range_t,double> > baseline_fft;
+  
+  void run( const int i )
+  {
+    
+    const int s = s0 + i;
+
+    if ( edf.header.is_annotation_channel( signals(s) ) ) return;
+    
+    //
+    // Pull all data
+    //
+
+    slices[s] = new slice_t( edf , signals(s) , interval );
+
+    const std::vector<double> * d = slices[s]->pdata();
+    
+    //
+    // Run CWT 
+    //
+
+    cwts[s] = new CWT;
+    
+    CWT & cwt = *cwts[s];
+
+    cwt.set_sampling_rate( Fs[s] );
+      
+    for (int fi=0;fi<frq.size();fi++)
+      cwt.add_wavelet( frq[fi] , num_cycles );  // f( Fc , number of cycles ) 
+      
+    cwt.load( d );
+    
+    cwt.run();
+
+    //
+    // Run baseline FFT on the entire signal 
+    //
+    
+    do_fft( d , Fs[s] , &baseline_fft[s] );
+    
+  }
+
+  void clear()
+  {
+    for (int s=0;s<slices.size();s++)
+      {
+	if ( slices[s] != NULL ) delete slices[s];
+	if ( cwts[s] != NULL ) delete cwts[s];
+	slices[s] = NULL;
+	cwts[s] = NULL;
+	baseline_fft[s].clear();
+      }
+  }
+  
+};
+
+
 annot_t * spindle_wavelet( edf_t & edf , param_t & param )
 {
 
@@ -311,10 +400,25 @@ annot_t * spindle_wavelet( edf_t & edf , param_t & param )
   //
   
   interval_t interval = edf.timeline.wholetrace(); 
+
+  // signal data, CWT and baseline spectrum are computed ahead, for a 
+  // block of 'threads' signals at a time (in parallel, if threads > 1)
+  
+  spindle_cwt_job_t cwt_job( edf , signals , interval , Fs , frq , num_cycles );
+
+  int block_end = 0;
   
   for (int s = 0 ; s < ns ; s++ ) 
     {
       
+      if ( s == block_end ) 
+	{
+	  cwt_job.clear();
+	  cwt_job.s0 = s;
+	  block_end = s + globals::threads < ns ? s + globals::threads : ns ;
+	  Helper::parallel_for( block_end - s , cwt_job );
+	}
+      
       //
       // Only consider raw signal channels
       //
@@ -332,11 +436,9 @@ annot_t * spindle_wavelet( edf_t & edf , param_t & param )
       // Pull all data
       //
       
-      slice_t slice( edf , signals(s) , interval );
+      const std::vector<double> * d = cwt_job.slices[s]->pdata();
       
-      const std::vector<double> * d = slice.pdata();
-      
-      const std::vector<uint64_t> * tp = slice.ptimepoints();
+      const std::vector<uint64_t> * tp = cwt_job.slices[s]->ptimepoints();
       
       const int np0 = d->size();
 
@@ -347,26 +449,12 @@ annot_t * spindle_wavelet( edf_t & edf , param_t & param )
       double t_minutes = d->size() * dt_minutes; // total trace time in minutes
 
       //
-      // Run CWT 
+      // CWT and baseline FFT on the entire signal (see spindle_cwt_job_t)
       //
 
-      CWT cwt;
+      CWT & cwt = *cwt_job.cwts[s];
       
-      cwt.set_sampling_rate( Fs[s] );
-      
-      for (int fi=0;fi<frq.size();fi++)
-	cwt.add_wavelet( frq[fi] , num_cycles );  // f( Fc , number of cycles ) 
-      
-      cwt.load( d );
-
-      cwt.run();
-
-      //
-      // Run baseline FFT on the entire signal 
-      //
-      
-      std::map<freq_range_t,double> baseline_fft;
-      do_fft( d , Fs[s] , &baseline_fft );
+      std::map<freq_range_t,double> & baseline_fft = cwt_job.baseline_fft[s];
       
       
 
@@ -988,7 +1076,6 @@ annot_t * spindle_wavelet( edf_t & edf , param_t & param )
 	  // Optionally, transform of spindle frequencies (+/- 2 Hz ) to get IF
 	  //
 	  
-	  hilbert_t * p_chirp_hilbert = NULL ;
 	  std::vector<double> * p_chirp_if = NULL;
 	  std::vector<int> * p_chirp_bin = NULL;
 
@@ -1008,10 +1095,13 @@ annot_t * spindle_wavelet( edf_t & edf , param_t & param )
 	      double ripple = 0.01;
 	      double tw = 4; 
   
-	      p_chirp_hilbert = new hilbert_t( *d , Fs[s] , frq[fi] - ht_chirp_frq  , frq[fi] + ht_chirp_frq , ripple , tw );
+	      // only the IF is needed here (nb. n-1 points)
+	      
+	      hilbert_bank_t chirp_hilbert( d->size() , Fs[s] , frq[fi] - ht_chirp_frq  , frq[fi] + ht_chirp_frq , ripple , tw );
 	      
-	      p_chirp_if = new std::vector<double>;
-	      *p_chirp_if = p_chirp_hilbert->instantaneous_frequency( Fs[s] );
+	      p_chirp_if = new std::vector<double>( d->size() > 1 ? d->size() - 1 : 0 );
+	      if ( d->size() > 1 ) 
+		chirp_hilbert.apply( &(*d)[0] , NULL , NULL , NULL , &(*p_chirp_if)[0] );
 	      
 	      p_chirp_bin = new std::vector<int>;
 	      p_chirp_bin->resize( d->size() , -1 );
@@ -1705,11 +1795,9 @@ annot_t * spindle_wavelet( edf_t & edf , param_t & param )
 
 	  if ( ht_chirp ) 
 	    {
-	      delete p_chirp_hilbert;
 	      delete p_chirp_if;
 	      delete p_chirp_bin;
 	      
-	      p_chirp_hilbert = NULL;
 	      p_chirp_if = NULL;
 	      p_chirp_bin = NULL;
 	      
@@ -122,7 +122,7 @@ void zratio_t::calc( edf_t & edf , const std::string & signal_label )
 	  
 	  interval_t interval = edf.timeline.epoch( epoch );
 	  
-	  slice_t slice( edf , signals(s) , interval );
+	  slice_t slice( edf , signals(s) , interval , 1 , false );
 	  
 	  const std::vector<double> * d = slice.pdata();
 	  
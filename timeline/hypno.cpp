@@ -1455,6 +1455,7 @@ void hypnogram_t::fudge( double es, int ne )
 {
   timeline->epoch_length_tp = es * globals::tp_1sec;
   timeline->epochs.resize( ne );
+  timeline->clear_epoch_events();
 }
 
 
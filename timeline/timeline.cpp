@@ -34,6 +34,8 @@
 #include "helper/logger.h"
 #include "helper/token-eval.h"
 
+#include <algorithm>
+
 extern writer_t writer;
 
 extern logger_t logger;
@@ -458,6 +460,8 @@ int timeline_t::calc_epochs()
   
   
   epochs.clear();
+
+  clear_epoch_events();
   
   mask.clear();
   
@@ -880,6 +884,92 @@ void timeline_t::apply_empty_epoch_mask( const std::string & label , bool includ
 
 }
 
+//
+// Epoch <--> annotation-instance incidence, by a single sweep: epochs
+// in order of start, and instances in (start-major) map order; each
+// instance becomes active once it starts before the end of an epoch,
+// and is retired once it ends before the start of one (and so also
+// before all later epochs)
+//
+
+const std::vector<std::vector<annot_map_t::const_iterator> > & timeline_t::epoch_events( annot_t * a )
+{
+
+  if ( a == NULL ) 
+    Helper::halt( "internal error: null annotation in epoch_events()" );
+
+  std::map<const annot_t*,epoch_incidence_t>::iterator ii = incidence.find( a );
+  
+  if ( ii != incidence.end() && ii->second.stamp == a->stamp ) 
+    return ii->second.events;
+  
+  epoch_incidence_t & inc = incidence[ a ];
+
+  inc.stamp = a->stamp;
+  
+  const int ne = epochs.size();
+
+  inc.events.assign( ne , std::vector<annot_map_t::const_iterator>() );
+  
+  std::vector<std::pair<interval_t,int> > order( ne );
+  for (int e=0;e<ne;e++) order[e] = std::make_pair( epochs[e] , e );
+  std::sort( order.begin() , order.end() );
+  
+  std::vector<annot_map_t::const_iterator> active;
+
+  annot_map_t::const_iterator jj = a->interval_events.begin();
+
+  for (int k=0;k<ne;k++)
+    {
+      
+      const interval_t & window = order[k].first;
+
+      std::vector<annot_map_t::const_iterator> & events = inc.events[ order[k].second ];
+
+      // (a window ending at 0 wraps in overlaps(): see annot_t::extract())
+
+      if ( window.stop == 0 ) 
+	{
+	  annot_map_t r = a->extract( window );
+	  annot_map_t::const_iterator rr = r.begin();
+	  while ( rr != r.end() ) 
+	    {
+	      events.push_back( a->interval_events.find( rr->first ) );
+	      ++rr;
+	    }
+	  continue;
+	}
+
+      // overlap is defined as A to B-1 for interval_t(A,B), as in overlaps()
+
+      while ( jj != a->interval_events.end() && jj->first.interval.start <= window.stop - 1 )
+	{
+	  active.push_back( jj );
+	  ++jj;
+	}
+      
+      int n = 0;
+
+      for (int i=0;i<active.size();i++)
+	{
+	  const interval_t & interval = active[i]->first.interval;
+	  
+	  if ( interval.stop - 1 < window.start ) continue;
+	  
+	  active[ n++ ] = active[i];
+	  
+	  // (nb. an earlier-starting epoch may end later)
+	  if ( interval.start <= window.stop - 1 ) events.push_back( active[i] );
+	}
+      
+      active.resize( n );
+      
+    }
+
+  return inc.events;
+}
+
+
 void timeline_t::apply_epoch_mask( annot_t * a , std::set<std::string> * values , bool include )
 {
   
@@ -906,29 +996,28 @@ void timeline_t::apply_epoch_mask( annot_t * a , std::set<std::string> * values
   int cnt_unchanged = 0;
   int cnt_now_unmasked = 0;
   int cnt_basic_match = 0;  // basic count of matches, whether changes mask or not
+
+  // overlapping annotations for all epochs 
+  const std::vector<std::vector<annot_map_t::const_iterator> > & all_events = epoch_events( a );
   
   for (int e=0;e<ne;e++)
     {
 
-      interval_t interval = epoch( e );
-      
-      annot_map_t events = a->extract( interval );
+      const std::vector<annot_map_t::const_iterator> & events = all_events[e];
       
       bool matches = false;
       
       if ( value_mask ) 
 	{
 	  // do any of the instance IDs match any of the values?
-	  annot_map_t::const_iterator ii = events.begin();
-	  while ( ii != events.end() )
+	  for (int i=0;i<events.size();i++)
 	    {		  
-	      const instance_idx_t & instance_idx = ii->first;	      
+	      const instance_idx_t & instance_idx = events[i]->first;	      
 	      if ( values->find( instance_idx.id ) != values->end() )
 		{
 		  matches = true;
 		  break;
 		}
-	      ++ii;
 	    }
 	}
       else 
@@ -1526,19 +1615,14 @@ void timeline_t::annotate_epochs( const std::string & label ,
       if ( e0 == -1 ) 
 	Helper::halt( "internal error in annotate_epochs()" );
 
-      interval_t interval = epoch( e );
-      
-      annot_map_t events = annot->extract( interval );
+      const std::vector<annot_map_t::const_iterator> & events = epoch_events( annot )[ e ];
       
       // search for a matching value (at least one)
       
-      annot_map_t::const_iterator ii = events.begin();
-
-      while ( ii != events.end() )
+      for (int i=0;i<events.size();i++)
 	{	
 	  
-	  const instance_idx_t & instance_idx = ii->first;
-	  const instance_t * instance = ii->second;
+	  const instance_idx_t & instance_idx = events[i]->first;
 
 	  if ( values.find( instance_idx.id ) != values.end() )
 	    {	      
@@ -1547,8 +1631,6 @@ void timeline_t::annotate_epochs( const std::string & label ,
 	      break;
 	    }	      
 	  
-	  ++ii;
-	  
 	}
       
     } // next epoch
@@ -2006,8 +2088,6 @@ void timeline_t::list_all_annotations( const param_t & param )
 	  
 	  writer.epoch( display_epoch( e ) );
 
-	  interval_t interval = epoch( e );
-	  
 	  // get each annotations
 	  for (int a=0;a<names.size();a++)
 	    {
@@ -2015,16 +2095,13 @@ void timeline_t::list_all_annotations( const param_t & param )
 	      annot_t * annot = annotations.find( names[a] );
 	      
 	      // get overlapping annotations for this epoch
-	      annot_map_t events = annot->extract( interval );
+	      const std::vector<annot_map_t::const_iterator> & events = epoch_events( annot )[ e ];
 
 	      // list
-	      annot_map_t::const_iterator ii = events.begin();
-	      while ( ii != events.end() )
+	      for (int i=0;i<events.size();i++)
 		{	  
 		  
-		  const instance_idx_t & instance_idx = ii->first;
-
-		  const instance_t * instance = ii->second;
+		  const instance_idx_t & instance_idx = events[i]->first;
 
 		  const interval_t & interval = instance_idx.interval;
 		  
@@ -2049,8 +2126,6 @@ void timeline_t::list_all_annotations( const param_t & param )
 		  writer.value( "EPOCH_MASK" , masked( e ) );
 		  writer.value( "ANNOT_MASK" , is_masked );
 		  
-		  
-		  ++ii;
 		}      
 
 	      writer.unlevel( "INTERVAL" );
@@ -2265,11 +2340,58 @@ void timeline_t::apply_eval_mask( const std::string & str , int mask_mode , cons
   
 
   //
-  // Get all existing annotations (overkill...)
+  // Compile the expression once: as no assignments are allowed, each
+  // evaluation depends only on the bound annotation inputs
   //
+
+  const bool no_assignments = true;
   
-  std::vector<std::string> names = annotations.names();
+  Eval tok( expression , no_assignments );
 
+  const bool parsed = tok.valid();
+
+  
+  //
+  // Only annotations that supply a referenced variable are needed,
+  // i.e. 'annot', 'annot_sec' or 'annot.meta' (see Eval::bind())
+  //
+  
+  const std::set<std::string> vars = tok.variables();
+
+  std::vector<std::string> all_names = annotations.names();
+
+  std::vector<std::string> names;
+
+  for (int a=0;a<all_names.size();a++)
+    {
+      const std::string & n = all_names[a];
+      bool used = false;
+      std::set<std::string>::const_iterator vv = vars.begin();
+      while ( vv != vars.end() )
+	{
+	  if ( *vv == n || *vv == n + "_sec" || vv->compare( 0 , n.size() + 1 , n + "." ) == 0 ) 
+	    { used = true; break; }
+	  ++vv;
+	}
+      if ( used ) names.push_back( n );
+    }
+
+  std::vector<annot_t*> annots( names.size() );
+  for (int a=0;a<names.size();a++)
+    annots[a] = annotations.find( names[a] );
+  
+  
+  //
+  // Epochs overlapping the same set of annotation instances give the
+  // same result, so cache results by that set (unless the expression
+  // draws random numbers, or in verbose mode, which traces each
+  // evaluation)
+  //
+
+  const bool memoize = ! ( verbose || tok.uses( "rnd" ) || tok.uses( "rand" ) );
+
+  std::map<std::vector<const void*>,std::pair<bool,bool> > memo;
+  
 
   //
   // Keep track of changes
@@ -2299,6 +2421,10 @@ void timeline_t::apply_eval_mask( const std::string & str , int mask_mode , cons
   first_epoch();
   
   int acc_total = 0 , acc_retval = 0 , acc_valid = 0; 
+
+  // a dummy instance for the output variables (not saved)
+  
+  instance_t dummy;
   
   while ( 1 ) 
     {
@@ -2306,49 +2432,59 @@ void timeline_t::apply_eval_mask( const std::string & str , int mask_mode , cons
       int e = next_epoch_ignoring_mask() ;
 
       if ( e == -1 ) break;
+
+      // overlapping annotations for this epoch, and their identities
       
-      interval_t interval = epoch( e );
-	  
-      std::map<std::string,annot_map_t> inputs;
+      std::vector<const void*> key;
       
-      // get each annotations
-      for (int a=0;a<names.size();a++)
+      for (int a=0;a<annots.size();a++)
 	{
-	  
-	  annot_t * annot = annotations.find( names[a] );
-	  
-	  // get overlapping annotations for this epoch
-	  annot_map_t events = annot->extract( interval );
-	  
-	  // store
-	  inputs[ names[a] ] = events;
+	  const std::vector<annot_map_t::const_iterator> & events = epoch_events( annots[a] )[ e ];
+	  for (int i=0;i<events.size();i++) 
+	    key.push_back( &(*events[i]) );
+	  key.push_back( NULL );
 	}
 
-      //
-      // create a dummy new instance for the output variables (not saved)
-      //
-      
-      instance_t dummy;
-      
-      //
-      // evaluate the expression, but note, this is set to not 
-      // allow any assignments.... this makes it cleaner and easier 
-      // to spot bad//undefined variables as errors.
-      //
-
-      const bool no_assignments = true;
-      
-      Eval tok( expression , no_assignments );
+      bool is_valid = false;
 
-      tok.bind( inputs , &dummy );
+      bool matches = false;
 
-      bool is_valid = tok.evaluate( verbose );
-      
-      bool matches;
+      std::map<std::vector<const void*>,std::pair<bool,bool> >::const_iterator mm = memoize ? memo.find( key ) : memo.end();
       
-      if ( ! tok.value( matches ) ) is_valid = false;
-
+      if ( mm != memo.end() ) 
+	{
+	  is_valid = mm->second.first;
+	  matches = mm->second.second;
+	}
+      else if ( parsed ) 
+	{
+	  
+	  std::map<std::string,annot_map_t> inputs;
+	  
+	  for (int a=0;a<annots.size();a++)
+	    {	  
+	      const std::vector<annot_map_t::const_iterator> & events = epoch_events( annots[a] )[ e ];
+	      annot_map_t & input = inputs[ names[a] ];
+	      for (int i=0;i<events.size();i++) 
+		input.insert( input.end() , *events[i] );
+	    }
+	  
+	  //
+	  // evaluate the expression, but note, this is set to not 
+	  // allow any assignments.... this makes it cleaner and easier 
+	  // to spot bad//undefined variables as errors.
+	  //
+	  
+	  tok.bind( inputs , &dummy );
+	  
+	  is_valid = tok.evaluate( verbose );
+	  
+	  if ( ! tok.value( matches ) ) is_valid = false;
 
+	  if ( memoize ) 
+	    memo[ key ] = std::make_pair( is_valid , matches );
+	  
+	}
 
       //
       // Flip?
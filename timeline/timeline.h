@@ -146,6 +146,14 @@ struct timeline_t
   
   void list_all_annotations( const param_t & param );
 
+  // for each (current, 0..ne-1) epoch, the overlapping instances of
+  // annotation 'a' (in map order); built once per epoch definition
+  // and kept until the epochs (EPOCH, RESTRUCTURE) or 'a' change
+
+  const std::vector<std::vector<annot_map_t::const_iterator> > & epoch_events( annot_t * a );
+  
+  void clear_epoch_events() { incidence.clear(); }
+
 
   //
   // Hypnogram
@@ -177,6 +185,7 @@ struct timeline_t
     epoch_length_tp = 0L;
     epoch_inc_tp = 0L;
     epochs.clear();
+    clear_epoch_events();
     
     // Masks
     clear_epoch_mask();
@@ -586,6 +595,16 @@ struct timeline_t
   
   // boolean epoch-based annotations
   std::map<std::string,std::map<int,bool> > eannots;
+
+  // epoch <--> annotation-instance incidence (see epoch_events())
+
+  struct epoch_incidence_t
+  {
+    uint64_t stamp;
+    std::vector<std::vector<annot_map_t::const_iterator> > events;
+  };
+  
+  std::map<const annot_t*,epoch_incidence_t> incidence;
   
 };
 
@@ -30,6 +30,7 @@
 #include <cstring>
 
 #include "luna.h"
+#include "db/colstore.h"
 
 // #include "defs/defs.h"
 // #include "helper/helper.h"
@@ -172,6 +173,21 @@ std::set<int> match_strata_ids;
 bool run_summary;
 bool run_dictionary;
 
+//
+// Attach a database, or a columnar file (luna -b): for the latter,
+// only values of the requested variables and individuals are read
+//
+
+colstore_filter_t colstore_filter;
+
+bool attach( const std::string & filename , bool values = true )
+{
+  const bool IS_READONLY = true;
+  if ( colstore_reader_t::is_colstore( filename ) ) 
+    return writer.load_colstore( filename , values ? &colstore_filter : NULL );
+  return writer.attach( filename , IS_READONLY );
+}
+
 struct request_t 
 {
   request_t( const std::string & r )
@@ -423,8 +439,6 @@ int main(int argc , char ** argv )
   if ( databases.size()>1 && args_cvar.size() > 0 ) 
     Helper::halt(" cannot specify -c with multiple attached databases currently") ;
 
-  const bool IS_READONLY = true;
-
 
   //
   // Check variables
@@ -447,7 +461,7 @@ int main(int argc , char ** argv )
       if ( ! Helper::fileExists( databases[d] ) ) 
 	Helper::halt( "could not find stout file " + databases[d] );
       
-      if ( ! writer.attach( databases[d] , IS_READONLY ) )
+      if ( ! attach( databases[d] , false ) )
 	Helper::halt( "could not attach stout-file " + databases[d] );      
       
       // get all variables
@@ -468,6 +482,10 @@ int main(int argc , char ** argv )
 	{
 	  if ( all_vars.find( *vv ) == all_vars.end() ) 
 	    Helper::halt("could not find variable " + vv->str() + " in any databases" );
+
+	  // (and only these need be read from columnar files)
+	  if ( vv->var != "" ) colstore_filter.vars.insert( vv->var );
+	  if ( vv->cmd != "" ) colstore_filter.cmds.insert( vv->cmd );
 	  ++vv;
 	}
     }
@@ -516,7 +534,9 @@ int main(int argc , char ** argv )
       // Attach and read all information except value-store
       //
       
-      writer.attach( databases[d] , IS_READONLY );
+      colstore_filter.indivs = args_ind;
+
+      attach( databases[d] );
 
       // set index, i.e. for reading mode
       writer.index();